@@ -0,0 +1,45 @@
+# Benchmark all the sample files, varying one option at a time
+# from the defaults, with any given options added to every run.
+# reads input from samples/*.png
+# creates output in out/*.png
+# appends a line of JSON per run to bench.jsonl, or $REPORT
+#
+# Compare reports from two builds on the same machine to measure
+# a change; the kernel microbenchmarks are run separately with:
+#   cargo test --release -- --ignored --nocapture --test-threads=1 bench_
+
+REPORT=${REPORT:-bench.jsonl}
+REPEAT=${REPEAT:-3}
+
+cargo build --quiet --release --features=cli || exit 1
+mkdir -p out
+
+run() {
+  for x in samples/*.png
+  do
+    target/release/mtpng --repeat "$REPEAT" --report "$REPORT" "$@" "$x" "out/$(basename "$x")" > /dev/null || exit 1
+  done
+}
+
+run "$@"
+for filter in none sub up average paeth
+do
+  run --filter "$filter" "$@"
+done
+for level in 1 9
+do
+  run --level "$level" "$@"
+done
+for strategy in default filtered huffman rle fixed
+do
+  run --strategy "$strategy" "$@"
+done
+for chunk in 32768 131072 1048576 auto
+do
+  run --chunk-size "$chunk" "$@"
+done
+for threads in 1 2 4 8
+do
+  run --threads "$threads" "$@"
+done
+echo "Results in $REPORT"
@@ -82,6 +82,17 @@ typedef enum mtpng_strategy_t {
     MTPNG_STRATEGY_FIXED = 4
 } mtpng_strategy;
 
+//
+// Deflate implementations for mtpng_encoder_options_set_backend().
+//
+// MTPNG_BACKEND_ZLIB is the default, and is always available.
+// Others must be enabled when building the library.
+//
+typedef enum mtpng_backend_t {
+    MTPNG_BACKEND_ZLIB = 0,
+    MTPNG_BACKEND_MINIZ = 1
+} mtpng_backend;
+
 //
 // Compression levels for mtpng_encoder_options_set_compression_level().
 //
@@ -102,6 +113,53 @@ typedef enum mtpng_color_t {
     MTPNG_COLOR_TRUECOLOR_ALPHA = 6
 } mtpng_color;
 
+//
+// Interlace methods for mtpng_header_set_interlace_method().
+//
+typedef enum mtpng_interlace_method_t {
+    MTPNG_INTERLACE_NONE = 0,
+    MTPNG_INTERLACE_ADAM7 = 1
+} mtpng_interlace_method;
+
+//
+// Input pixel layouts for mtpng_header_set_source_format().
+//
+typedef enum mtpng_source_format_t {
+    MTPNG_SOURCE_FORMAT_PACKED = 0,
+    MTPNG_SOURCE_FORMAT_BGRA = 1,
+    MTPNG_SOURCE_FORMAT_BGRX = 2,
+    MTPNG_SOURCE_FORMAT_PREMULTIPLIED_RGBA = 3,
+    MTPNG_SOURCE_FORMAT_PREMULTIPLIED_BGRA = 4,
+    MTPNG_SOURCE_FORMAT_NATIVE_ENDIAN_16 = 5
+} mtpng_source_format;
+
+//
+// APNG frame disposal operations for mtpng_frame_control_set_dispose_op().
+//
+typedef enum mtpng_dispose_op_t {
+    MTPNG_DISPOSE_OP_NONE = 0,
+    MTPNG_DISPOSE_OP_BACKGROUND = 1,
+    MTPNG_DISPOSE_OP_PREVIOUS = 2
+} mtpng_dispose_op;
+
+//
+// APNG frame blending operations for mtpng_frame_control_set_blend_op().
+//
+typedef enum mtpng_blend_op_t {
+    MTPNG_BLEND_OP_SOURCE = 0,
+    MTPNG_BLEND_OP_OVER = 1
+} mtpng_blend_op;
+
+//
+// Which processors a thread pool from mtpng_threadpool_new_cores()
+// puts its workers on.
+//
+typedef enum mtpng_cores_t {
+    MTPNG_CORES_ALL = 0,      // every logical processor
+    MTPNG_CORES_PHYSICAL = 1, // one per physical core
+    MTPNG_CORES_BIG = 2       // one per core of the fastest kind
+} mtpng_cores;
+
 #pragma mark Structs
 
 //
@@ -112,6 +170,39 @@ typedef enum mtpng_color_t {
 //
 typedef struct mtpng_threadpool_struct mtpng_threadpool;
 
+//
+// Represents a pool of reusable memory buffers, which may be
+// shared between multiple encoders at once or over time.
+//
+// The contents are private; you will only ever use pointers.
+//
+typedef struct mtpng_bufferpool_struct mtpng_bufferpool;
+
+//
+// Represents a scheduler dividing a thread pool's time between
+// multiple encoders running at once.
+//
+// The contents are private; you will only ever use pointers.
+//
+typedef struct mtpng_scheduler_struct mtpng_scheduler;
+
+//
+// Represents the compressed chunks of the last image encoded with it,
+// for reuse where the next image is unchanged.
+//
+// The contents are private; you will only ever use pointers.
+//
+typedef struct mtpng_chunk_cache_struct mtpng_chunk_cache;
+
+//
+// Represents a queue of output from an encoder created with
+// mtpng_encoder_new_polled(), to be copied out in whole chunks
+// with mtpng_output_poll() instead of written to callbacks.
+//
+// The contents are private; you will only ever use pointers.
+//
+typedef struct mtpng_output_struct mtpng_output;
+
 //
 // Represents configuration options for the PNG encoder.
 //
@@ -127,6 +218,14 @@ typedef struct mtpng_encoder_options_struct mtpng_encoder_options;
 //
 typedef struct mtpng_header_struct mtpng_header;
 
+//
+// Represents an APNG animation frame's metadata, belonging
+// in its fcTL frame control chunk.
+//
+// The contents are private; you will only ever use pointers.
+//
+typedef struct mtpng_frame_control_struct mtpng_frame_control;
+
 //
 // Represents a PNG encoder instance, which can encode a single
 // image and then must be released. Multiple encoders may share
@@ -136,9 +235,66 @@ typedef struct mtpng_header_struct mtpng_header;
 //
 typedef struct mtpng_encoder_struct mtpng_encoder;
 
+//
+// Represents configuration options for the PNG decoder.
+//
+// The contents are private; you will only ever use pointers.
+//
+typedef struct mtpng_decoder_options_struct mtpng_decoder_options;
+
+//
+// Represents a PNG decoder instance, which can decode a single
+// image and then must be released. Decoders and encoders may
+// share a single thread pool.
+//
+// The contents are private; you will only ever use pointers.
+//
+typedef struct mtpng_decoder_struct mtpng_decoder;
+
+//
+// Timings and counts for an encode, from mtpng_encoder_get_stats().
+// Times are wall-clock, in microseconds.
+//
+typedef struct mtpng_stats_t {
+    uint64_t elapsed_us;     // since the header was written
+    uint64_t filter_us;      // total in filter jobs
+    uint64_t deflate_us;     // total in deflate jobs
+    uint64_t output_us;      // writing compressed data out
+    uint64_t blocked_us;     // caller waiting on the worker threads
+    uint64_t idle_us;        // pool threads not running this encoder's jobs
+    uint64_t bytes_in;       // pixel data taken in
+    uint64_t bytes_filtered; // filtered rows passed to deflate
+    uint64_t bytes_out;      // compressed image data written
+    uint64_t filter_counts[5]; // rows per filter type, indexed by mtpng_filter
+    uint64_t chunks;         // chunks compressed
+} mtpng_stats;
+
+//
+// A caller-owned buffer for mtpng_output_poll() to copy into.
+//
+typedef struct mtpng_iovec_t {
+    uint8_t* p_bytes;        // start of the buffer
+    size_t len;              // its capacity in, bytes copied out
+} mtpng_iovec;
+
+//
+// One of the images for mtpng_encode_batch(). Rows start every
+// stride bytes, as for mtpng_encoder_write_image(). The palette and
+// transparency are written before the image data if not NULL.
+//
+typedef struct mtpng_batch_image_t {
+    mtpng_header* p_header;
+    const uint8_t* p_bytes;
+    size_t len;
+    size_t stride;
+    const uint8_t* p_palette;
+    size_t palette_len;
+    const uint8_t* p_transparency;
+    size_t transparency_len;
+} mtpng_batch_image;
+
 #pragma mark Function types
 
-#if 0
 //
 // Read callback type for mtpng_decoder_new().
 //
@@ -146,13 +302,12 @@ typedef struct mtpng_encoder_struct mtpng_encoder;
 // a data buffer to copy into. If data is not yet available, you
 // should block until it is.
 //
-// Return the number of bytes copied, or less on end of file or
-// failure.
+// Return the number of bytes copied, which may be less than len,
+// or 0 on end of file or failure.
 //
 typedef size_t (*mtpng_read_func)(void* user_data,
                                   uint8_t* p_bytes,
                                   size_t len);
-#endif
 
 //
 // Write callback type for mtpng_encoder_new().
@@ -185,6 +340,32 @@ typedef size_t (*mtpng_write_func)(void* user_data,
 //
 typedef bool (*mtpng_flush_func)(void* user_data);
 
+//
+// Completion callback type for mtpng_encoder_finish_async().
+//
+// Called once all output has been written, or encoding has failed,
+// with the result mtpng_encoder_finish() would have returned.
+//
+// This is usually called on one of the encoder's worker threads.
+//
+typedef void (*mtpng_done_func)(void* user_data,
+                                mtpng_result result);
+
+//
+// Completion callback type for mtpng_encode_batch().
+//
+// Called once for each image in the batch, in order, with its index
+// and result. On success, p_bytes and len hold the whole PNG file,
+// which is only valid until the callback returns; copy it out.
+//
+// This is called on the thread that called mtpng_encode_batch().
+//
+typedef void (*mtpng_batch_func)(void* user_data,
+                                 size_t index,
+                                 mtpng_result result,
+                                 const uint8_t* p_bytes,
+                                 size_t len);
+
 #pragma mark ThreadPool
 
 //
@@ -209,6 +390,29 @@ extern mtpng_result
 mtpng_threadpool_new(mtpng_threadpool** pp_pool,
                      size_t threads);
 
+//
+// Creates a new thread pool with a worker for each of the given
+// cores: every logical processor, one per physical core leaving out
+// extra hyperthreads, or only the big cores of a big.LITTLE design.
+// Workers are pinned to their processors, with neighbouring ones on
+// the same NUMA node, using only those the process may run on. A
+// threads count other than MTPNG_THREADS_DEFAULT spreads that many
+// workers over the cores in turn instead.
+//
+// The topology is read from Linux's sysfs. Elsewhere, this is the same
+// as mtpng_threadpool_new().
+//
+// On input, *pp_pool must be NULL.
+// On output, *pp_pool will be a pointer to a thread pool instance
+// if successful, or remain unchanged in case of error.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_threadpool_new_cores(mtpng_threadpool** pp_pool,
+                           size_t threads,
+                           mtpng_cores cores);
+
 //
 // Releases the pool's memory and clears the pointer.
 //
@@ -224,6 +428,169 @@ mtpng_threadpool_new(mtpng_threadpool** pp_pool,
 extern mtpng_result
 mtpng_threadpool_release(mtpng_threadpool** pp_pool);
 
+#pragma mark BufferPool
+
+//
+// Creates a new buffer pool, which recycles the large buffers
+// used for pixel, filtered, and compressed data between encoders
+// instead of freeing them. At most max_bytes of idle buffers are
+// kept; pass 0 to keep any number.
+//
+// On input, *pp_pool must be NULL.
+// On output, *pp_pool will be a pointer to a buffer pool instance
+// if successful, or remain unchanged in case of error.
+//
+// If you do not create a buffer pool, each encoder recycles
+// buffers only within itself.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_bufferpool_new(mtpng_bufferpool** pp_pool,
+                     size_t max_bytes);
+
+//
+// Releases the pool and clears the pointer.
+//
+// On input, *pp_pool must be a valid instance pointer.
+// On output, *pp_pool will be NULL on success or remain unchanged
+// in case of failure.
+//
+// Encoders already created with the pool keep its memory alive
+// until they are released, but any options set to use the pool
+// must not be used to create more encoders afterwards.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_bufferpool_release(mtpng_bufferpool** pp_pool);
+
+#pragma mark Scheduler
+
+//
+// Creates a new scheduler. Encoders set up to use it queue their
+// jobs on it instead of directly on the thread pool, and take turns
+// running at most max_jobs of them at once between them.
+//
+// Pass 0 for max_jobs to use the number of threads in the global
+// thread pool plus two.
+//
+// On input, *pp_scheduler must be NULL.
+// On output, *pp_scheduler will be a pointer to a scheduler instance
+// if successful, or remain unchanged in case of error.
+//
+// Encoders sharing a scheduler should use the same thread pool.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_scheduler_new(mtpng_scheduler** pp_scheduler,
+                    size_t max_jobs);
+
+//
+// Releases the scheduler and clears the pointer.
+//
+// On input, *pp_scheduler must be a valid instance pointer.
+// On output, *pp_scheduler will be NULL on success or remain unchanged
+// in case of failure.
+//
+// Encoders already created with the scheduler keep using it until
+// they are released, but any options set to use the scheduler
+// must not be used to create more encoders afterwards.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_scheduler_release(mtpng_scheduler** pp_scheduler);
+
+#pragma mark ChunkCache
+
+//
+// Creates a new, empty chunk cache. Encoders set up to use it keep
+// each image's compressed chunks in it, and reuse those of the last
+// image wherever its rows are unchanged, so re-encoding an image with
+// a small change costs a fraction of a full encode.
+//
+// On input, *pp_cache must be NULL.
+// On output, *pp_cache will be a pointer to a chunk cache instance
+// if successful, or remain unchanged in case of error.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_chunk_cache_new(mtpng_chunk_cache** pp_cache);
+
+//
+// Releases the cache and clears the pointer.
+//
+// On input, *pp_cache must be a valid instance pointer.
+// On output, *pp_cache will be NULL on success or remain unchanged
+// in case of failure.
+//
+// Any options set to use the cache must not be used to create
+// more encoders afterwards.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_chunk_cache_release(mtpng_chunk_cache** pp_cache);
+
+#pragma mark Output
+
+//
+// Creates a new, empty output queue, for an encoder created with
+// mtpng_encoder_new_polled() to write into instead of calling back
+// for every few bytes.
+//
+// On input, *pp_output must be NULL.
+// On output, *pp_output will be a pointer to an output instance
+// if successful, or remain unchanged in case of error.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_output_new(mtpng_output** pp_output);
+
+//
+// Releases the output queue and clears the pointer, discarding
+// anything not yet polled. An encoder still using it keeps it
+// alive until the encoder is finished or released.
+//
+// On input, *pp_output must be a valid instance pointer.
+// On output, *pp_output will be NULL on success or remain unchanged
+// in case of failure.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_output_release(mtpng_output** pp_output);
+
+//
+// Copies queued output into the caller's buffers, as many whole
+// PNG chunks as fit, the file signature counting as one. Buffers
+// are filled in order, moving to the next when the next chunk
+// doesn't fit in what's left; a chunk too large for a whole buffer
+// is split over as many as it needs, and continued on the next
+// call if they run out.
+//
+// On input, *p_count is the number of buffers at p_iov, and each
+// buffer's len its capacity. On output, *p_count is the number of
+// buffers filled, and each of those buffers' len the number of
+// bytes copied into it. Nothing else is changed.
+//
+// Output is queued by every encoder call that writes any, and by
+// the worker threads after mtpng_encoder_finish_async(), until
+// polled. Once mtpng_encoder_finish() returns, or the completion
+// callback is called, poll until *p_count comes back 0 for the end
+// of the file. Safe to call from any thread.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_output_poll(mtpng_output* p_output,
+                  mtpng_iovec* p_iov,
+                  size_t* p_count);
+
 #pragma mark Encoder options
 
 //
@@ -268,6 +635,55 @@ extern mtpng_result
 mtpng_encoder_options_set_thread_pool(mtpng_encoder_options* p_options,
                                       mtpng_threadpool* p_pool);
 
+//
+// Set the buffer pool instance to recycle memory through.
+//
+// The pool must stay alive until all encoders using these
+// options have been created.
+//
+// Check the return values for errors.
+//
+extern mtpng_result
+mtpng_encoder_options_set_buffer_pool(mtpng_encoder_options* p_options,
+                                      mtpng_bufferpool* p_pool);
+
+//
+// Set the chunk cache instance to keep and reuse compressed chunks in.
+// Nothing is reused if the header, chunk size, or compression settings
+// differ from the last image's; ignored for animated images and with
+// a flush interval.
+//
+// The cache must stay alive until all encoders using these
+// options have been created.
+//
+// Check the return values for errors.
+//
+extern mtpng_result
+mtpng_encoder_options_set_chunk_cache(mtpng_encoder_options* p_options,
+                                      mtpng_chunk_cache* p_cache);
+
+//
+// Set the scheduler instance to queue jobs on.
+//
+// The scheduler must stay alive until all encoders using these
+// options have been created.
+//
+// Check the return values for errors.
+//
+extern mtpng_result
+mtpng_encoder_options_set_scheduler(mtpng_encoder_options* p_options,
+                                    mtpng_scheduler* p_scheduler);
+
+//
+// Set the encoder's share of its scheduler's running jobs, relative
+// to other encoders with work waiting. Must be at least 1, the default.
+//
+// Check the return values for errors.
+//
+extern mtpng_result
+mtpng_encoder_options_set_priority(mtpng_encoder_options* p_options,
+                                   uint32_t priority);
+
 
 //
 // Override the default PNG filter mode selection.
@@ -291,6 +707,16 @@ extern mtpng_result
 mtpng_encoder_options_set_strategy(mtpng_encoder_options* p_options,
                                    mtpng_strategy strategy_mode);
 
+//
+// Select the deflate implementation, one of the MTPNG_BACKEND_*
+// constants. Returns an error if the backend was not built in.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_encoder_options_set_backend(mtpng_encoder_options* p_options,
+                                  mtpng_backend backend);
+
 //
 // Override the default PNG compression level.
 //
@@ -317,90 +743,386 @@ mtpng_encoder_options_set_compression_level(mtpng_encoder_options* p_options,
 // chunk_size must be at least 32768 bytes, required for
 // maintaining compression across chunks.
 //
+// Pass 0 to pick a chunk size for each image from its size, the
+// number of threads, and the compression level; small images may
+// then use chunks under 32768 bytes to keep all threads busy.
+//
 // Check the return value for errors.
 //
 extern mtpng_result
 mtpng_encoder_options_set_chunk_size(mtpng_encoder_options* p_options,
                                      size_t chunk_size);
 
-#pragma mark Header
-
 //
-// Creates a new PNG header with default settings. Fill out the details
-// and pass in to mtpng_encoder_write_header(). May be reused on multiple
-// encoders.
+// Set a soft limit in bytes on uncompressed image data held in
+// flight by the encoder's worker threads. When over the limit,
+// mtpng_encoder_write_image_rows() will block until enough data
+// has been compressed and written out. At least one chunk's worth
+// is always allowed.
 //
-// Free with mtpng_header_release().
+// Compressed data is not counted; without streaming mode, it's
+// held in memory until the end of the image.
 //
-// On input, *pp_header must be NULL.
-// On output, *pp_header will be a pointer to an options instance
-// if successful, or remain unchanged in case of error.
+// 0 means no limit, the default.
 //
 // Check the return value for errors.
 //
 extern mtpng_result
-mtpng_header_new(mtpng_header** pp_header);
+mtpng_encoder_options_set_memory_limit(mtpng_encoder_options* p_options,
+                                       size_t memory_limit);
 
 //
-// Releases the header's memory and clears the pointer.
-//
-// On input, *pp_header must be a valid instance pointer.
-// On output, *pp_header will be NULL on success or remain unchanged
-// in case of failure.
+// Enable or disable collecting timings, byte counts, and filter
+// choices for mtpng_encoder_get_stats(). Off by default.
 //
 // Check the return value for errors.
 //
 extern mtpng_result
-mtpng_header_release(mtpng_header** pp_header);
+mtpng_encoder_options_set_stats(mtpng_encoder_options* p_options,
+                                bool stats);
 
 //
-// Set the image size in pixels. The given width and height
-// values must not be 0, but are not otherwise limited.
-//
-// Caller is responsible for ensuring that at least one row
-// of image data copied a few times fits in memory, or you're
-// gonna have a bad time.
+// Enable or disable writing an index of the compressed chunks after
+// the image data, so mtpng_decoder_read_rows() can decode part of
+// the image without the rest. Costs a little compression. Off by
+// default.
 //
 // Check the return value for errors.
 //
 extern mtpng_result
-mtpng_header_set_size(mtpng_header* p_header,
-                      uint32_t width,
-                      uint32_t height);
+mtpng_encoder_options_set_write_index(mtpng_encoder_options* p_options,
+                                      bool write_index);
 
 //
-// Set the color type and depth for the image.
+// Enable or disable encoding 8-bit truecolor input, with or without
+// alpha, as indexed color. The header is set up for the truecolor
+// input, and the palette and transparency chunks are generated from
+// the image, so don't write them, nor bKGD, hIST or sBIT chunks.
+// Images with up to 256 colors are kept exact; others are reduced
+// to 256. Off by default.
 //
-// Any valid combination of color type and depth is accepted;
-// see https://www.w3.org/TR/PNG/#table111 for the specs.
+// Check the return value for errors.
 //
-// If you do not call this function, mtpng will assume you want
-// truecolor with alpha at 8-bit depth.
+extern mtpng_result
+mtpng_encoder_options_set_quantize(mtpng_encoder_options* p_options,
+                                   bool quantize);
+
+//
+// Enable or disable dithering when quantizing to a reduced palette.
+// Off by default.
 //
 // Check the return value for errors.
 //
 extern mtpng_result
-mtpng_header_set_color(mtpng_header* p_header,
-                       mtpng_color color_type,
-                       uint8_t depth);
-
-#pragma mark Encoder
+mtpng_encoder_options_set_dither(mtpng_encoder_options* p_options,
+                                 bool dither);
 
 //
-// Create a new PNG encoder instance.
-// Copies the options data.
+// Enable or disable encoding the image in a smaller color type or
+// bit depth, if one holds it exactly: dropping opaque alpha, grey
+// as greyscale, 16 bits as 8, or 256 colors or fewer as indexed.
+// The header is then written along with the image data. Writing a
+// palette, transparency, or animation control turns it off again.
+// Ignored when quantizing. Off by default.
 //
-// On input, *pp_encoder must be NULL.
-// On output, *pp_encoder will be an instance pointer on success,
-// or remain unchanged in case of failure.
+// Check the return value for errors.
 //
-// The write_func and flush_func callbacks are required, and must
-// not be NULL.
+extern mtpng_result
+mtpng_encoder_options_set_reduce(mtpng_encoder_options* p_options,
+                                 bool reduce);
+
 //
-// user_data is passed to the callback functions, and may be any
-// value such as a private object pointer or NULL.
+// Enable or disable searching for the smallest output, at several
+// times the CPU: each chunk is filtered with every filter and then
+// compressed with the default, filtered, and RLE strategies, keeping
+// the smallest of each. A fixed filter or strategy mode isn't
+// searched. The flush interval is ignored. Off by default.
 //
-// p_options may be NULL, in which case default options will
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_encoder_options_set_search(mtpng_encoder_options* p_options,
+                                 bool search);
+
+//
+// Enable or disable deflating each chunk on the worker that filtered
+// it, where the chunk before it is already filtered, so its data stays
+// in that core's cache. Best with a pool from
+// mtpng_threadpool_new_cores(). The output is the same. Off by default.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_encoder_options_set_chunk_affinity(mtpng_encoder_options* p_options,
+                                         bool chunk_affinity);
+
+//
+// Enable or disable streaming mode, which writes out a separate
+// IDAT chunk as each data chunk is compressed instead of holding
+// all compressed data until the end. Lowers latency to output and
+// memory use, at a cost of a few bytes per chunk.
+//
+// Off by default.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_encoder_options_set_streaming(mtpng_encoder_options* p_options,
+                                    bool streaming);
+
+//
+// In streaming mode, also flush the compressed stream every
+// flush_interval bytes of image data or so, rounded to whole rows,
+// writing each piece as its own IDAT chunk and calling the flush
+// callback as soon as it is ready.
+//
+// 0 means whole chunks only, the default. Ignored when not streaming.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_encoder_options_set_flush_interval(mtpng_encoder_options* p_options,
+                                         size_t flush_interval);
+
+#pragma mark Header
+
+//
+// Creates a new PNG header with default settings. Fill out the details
+// and pass in to mtpng_encoder_write_header(). May be reused on multiple
+// encoders.
+//
+// Free with mtpng_header_release().
+//
+// On input, *pp_header must be NULL.
+// On output, *pp_header will be a pointer to an options instance
+// if successful, or remain unchanged in case of error.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_header_new(mtpng_header** pp_header);
+
+//
+// Releases the header's memory and clears the pointer.
+//
+// On input, *pp_header must be a valid instance pointer.
+// On output, *pp_header will be NULL on success or remain unchanged
+// in case of failure.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_header_release(mtpng_header** pp_header);
+
+//
+// Set the image size in pixels. The given width and height
+// values must not be 0, but are not otherwise limited.
+//
+// Caller is responsible for ensuring that at least one row
+// of image data copied a few times fits in memory, or you're
+// gonna have a bad time.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_header_set_size(mtpng_header* p_header,
+                      uint32_t width,
+                      uint32_t height);
+
+//
+// Set the color type and depth for the image.
+//
+// Any valid combination of color type and depth is accepted;
+// see https://www.w3.org/TR/PNG/#table111 for the specs.
+//
+// If you do not call this function, mtpng will assume you want
+// truecolor with alpha at 8-bit depth.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_header_set_color(mtpng_header* p_header,
+                       mtpng_color color_type,
+                       uint8_t depth);
+
+//
+// Set the interlace method for the image. With Adam7, the image
+// data is sent in seven passes of increasing detail; each pass is
+// filtered and compressed in chunks in parallel like a whole image.
+// Interlaced images cannot be animated or use a chunk cache.
+//
+// Image data is still provided as ordinary rows, but with
+// mtpng_encoder_write_image_rows() nothing is compressed until
+// the last row has come in.
+//
+// If you do not call this function, the image is not interlaced.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_header_set_interlace_method(mtpng_header* p_header,
+                                  mtpng_interlace_method interlace_method);
+
+//
+// Set the layout of the image data you'll pass in, if it isn't
+// already packed as for the color type and depth. Rows are then
+// converted on the worker threads as they're filtered, instead of
+// in a separate pass beforehand.
+//
+// BGRA and the premultiplied formats require truecolor with alpha
+// at 8-bit depth; BGRX, with its ignored fourth byte, requires
+// truecolor at 8-bit depth; native-endian requires 16-bit depth.
+// This is checked by mtpng_encoder_write_header().
+//
+// Row lengths given to the encoder are those of the source format,
+// 4 bytes per pixel for BGRX.
+//
+// If you do not call this function, data must be pre-packed.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_header_set_source_format(mtpng_header* p_header,
+                               mtpng_source_format source_format);
+
+//
+// Get the image size in pixels, eg from mtpng_decoder_read_header().
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_header_get_size(mtpng_header* p_header,
+                      uint32_t* p_width,
+                      uint32_t* p_height);
+
+//
+// Get the color type and bit depth.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_header_get_color(mtpng_header* p_header,
+                       mtpng_color* p_color_type,
+                       uint8_t* p_depth);
+
+//
+// Get the interlace method.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_header_get_interlace_method(mtpng_header* p_header,
+                                  mtpng_interlace_method* p_interlace_method);
+
+//
+// Get the length in bytes of each row in the source format:
+// what the encoder takes, or what mtpng_decoder_read_image()
+// gives back.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_header_get_stride(mtpng_header* p_header,
+                        size_t* p_stride);
+
+#pragma mark Frame control
+
+//
+// Creates a new APNG frame control with default settings: 1x1 pixels
+// at the top left, shown for 1/100 second. Fill out the details and
+// pass in to mtpng_encoder_write_frame_control(). May be reused.
+//
+// Free with mtpng_frame_control_release().
+//
+// On input, *pp_frame must be NULL.
+// On output, *pp_frame will be a pointer to a frame control instance
+// if successful, or remain unchanged in case of error.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_frame_control_new(mtpng_frame_control** pp_frame);
+
+//
+// Releases the frame control's memory and clears the pointer.
+//
+// On input, *pp_frame must be a valid instance pointer.
+// On output, *pp_frame will be NULL on success or remain unchanged
+// in case of failure.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_frame_control_release(mtpng_frame_control** pp_frame);
+
+//
+// Set the frame size in pixels, which must not be 0.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_frame_control_set_size(mtpng_frame_control* p_frame,
+                             uint32_t width,
+                             uint32_t height);
+
+//
+// Set the position of the frame's top left corner on the canvas.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_frame_control_set_offset(mtpng_frame_control* p_frame,
+                               uint32_t x_offset,
+                               uint32_t y_offset);
+
+//
+// Set how long the frame is shown, as delay_num / delay_den seconds.
+// A denominator of 0 is treated as 100.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_frame_control_set_delay(mtpng_frame_control* p_frame,
+                              uint16_t delay_num,
+                              uint16_t delay_den);
+
+//
+// Set what happens to the frame's region before the next frame.
+// Defaults to MTPNG_DISPOSE_OP_NONE.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_frame_control_set_dispose_op(mtpng_frame_control* p_frame,
+                                   mtpng_dispose_op dispose_op);
+
+//
+// Set how the frame combines with the canvas.
+// Defaults to MTPNG_BLEND_OP_SOURCE.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_frame_control_set_blend_op(mtpng_frame_control* p_frame,
+                                 mtpng_blend_op blend_op);
+
+#pragma mark Encoder
+
+//
+// Create a new PNG encoder instance.
+// Copies the options data.
+//
+// On input, *pp_encoder must be NULL.
+// On output, *pp_encoder will be an instance pointer on success,
+// or remain unchanged in case of failure.
+//
+// The write_func and flush_func callbacks are required, and must
+// not be NULL.
+//
+// user_data is passed to the callback functions, and may be any
+// value such as a private object pointer or NULL.
+//
+// p_options may be NULL, in which case default options will
 // be used including a global threadpool.
 //
 // Check the return values for errors.
@@ -412,6 +1134,25 @@ mtpng_encoder_new(mtpng_encoder** pp_encoder,
                   void* const user_data,
                   mtpng_encoder_options* p_options);
 
+//
+// Create a new PNG encoder instance that queues its output in
+// p_output for mtpng_output_poll(), rather than calling back.
+// Otherwise the same as mtpng_encoder_new().
+//
+// On input, *pp_encoder must be NULL.
+// On output, *pp_encoder will be an instance pointer on success,
+// or remain unchanged in case of failure.
+//
+// p_options may be NULL, in which case default options will
+// be used including a global threadpool.
+//
+// Check the return values for errors.
+//
+extern mtpng_result
+mtpng_encoder_new_polled(mtpng_encoder** pp_encoder,
+                         mtpng_output* p_output,
+                         mtpng_encoder_options* p_options);
+
 //
 // Releases the encoder's memory and clears the pointer.
 //
@@ -427,6 +1168,9 @@ mtpng_encoder_new(mtpng_encoder** pp_encoder,
 // If using a threadpool, must be called before releasing the
 // threadpool!
 //
+// Waits for any work blocks still running, so image data passed
+// to mtpng_encoder_write_image() may be freed after this returns.
+//
 // If the encoder is still in use, this may explode.
 //
 // Check the return value for errors.
@@ -511,6 +1255,106 @@ mtpng_encoder_write_image_rows(mtpng_encoder* p_encoder,
                                const uint8_t* p_bytes,
                                size_t len);
 
+//
+// Load the complete image into the encoder at once, to be
+// filtered and compressed without copying the data.
+//
+// Must be called after mtpng_encoder_write_header() and before
+// mtpng_encoder_finish(), and cannot be combined with
+// mtpng_encoder_write_image_rows() on the same encoder.
+//
+// Image data must be pre-packed in the correct bit depth and
+// channel order. Rows start every 'stride' bytes, which must be
+// at least the packed row length; any padding after each row is
+// ignored. The last row need not be padded out.
+//
+// The encoder reads directly from p_bytes on its worker threads,
+// so the buffer must stay valid and unmodified until
+// mtpng_encoder_finish() or mtpng_encoder_release() returns.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_encoder_write_image(mtpng_encoder* p_encoder,
+                          const uint8_t* p_bytes,
+                          size_t len,
+                          size_t stride);
+
+//
+// Mark the file as an animated PNG with num_frames frames, played
+// num_plays times over, or forever if 0.
+//
+// Must be called after mtpng_encoder_write_header() and before any
+// image data. Each frame then starts with a call to
+// mtpng_encoder_write_frame_control(), followed by its image data.
+// If image data comes before the first frame control, it is only
+// the default image shown by decoders without APNG support.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_encoder_write_animation_control(mtpng_encoder* p_encoder,
+                                      uint32_t num_frames,
+                                      uint32_t num_plays);
+
+//
+// Start the next animation frame. Its image data, sized to the
+// frame, follows with mtpng_encoder_write_image_rows() or
+// mtpng_encoder_write_image().
+//
+// The previous frame's image data must be complete. The first
+// frame, if it is also the default image, must cover the canvas.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_encoder_write_frame_control(mtpng_encoder* p_encoder,
+                                  mtpng_frame_control* p_frame);
+
+//
+// Write the next animation frame from a packed image of the whole
+// canvas, encoding only the rectangle that differs from the last
+// frame written this way. The size and offset of p_frame are
+// replaced with that rectangle; its other settings are kept.
+//
+// The frame before should use MTPNG_DISPOSE_OP_NONE, and this one
+// MTPNG_BLEND_OP_SOURCE if it has transparency. Requires a bit
+// depth of at least 8.
+//
+// As with mtpng_encoder_write_image(), the buffer must stay valid
+// and unmodified until mtpng_encoder_finish() or
+// mtpng_encoder_release() returns.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_encoder_write_frame_diff(mtpng_encoder* p_encoder,
+                               mtpng_frame_control* p_frame,
+                               const uint8_t* p_bytes,
+                               size_t len);
+
+//
+// Wait for the image data provided so far to be compressed
+// and written out, and flush output.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_encoder_flush(mtpng_encoder* p_encoder);
+
+//
+// Fill *p_stats with timings and counts for the encode so far.
+// Requires stats enabled with mtpng_encoder_options_set_stats().
+//
+// Call after mtpng_encoder_flush() to cover the whole image, as
+// mtpng_encoder_finish() releases the encoder.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_encoder_get_stats(mtpng_encoder* p_encoder,
+                        mtpng_stats* p_stats);
+
 //
 // Wait for any outstanding work blocks, flush output,
 // release the encoder instance and clear the pointer.
@@ -533,6 +1377,222 @@ mtpng_encoder_write_image_rows(mtpng_encoder* p_encoder,
 extern mtpng_result
 mtpng_encoder_finish(mtpng_encoder** pp_encoder);
 
+//
+// Same as mtpng_encoder_finish(), but returns immediately and
+// calls done_func with the result once encoding is complete.
+//
+// On input, *pp_encoder must be a valid instance pointer.
+// On output, *pp_encoder will be NULL; the instance is released
+// after done_func is called, and must not be used again.
+//
+// Output is written from the worker threads in the meantime, so
+// the write and flush callbacks passed to mtpng_encoder_new()
+// must be safe to call from another thread. Any buffer passed to
+// mtpng_encoder_write_image() must stay valid until done_func
+// has been called, as must the threadpool, if any.
+//
+// done_func may be called before this returns.
+//
+// Check the return value for errors; if this fails, done_func
+// is not called.
+//
+extern mtpng_result
+mtpng_encoder_finish_async(mtpng_encoder** pp_encoder,
+                           mtpng_done_func done_func,
+                           void* const user_data);
+
+#pragma mark Batch
+
+//
+// Encode count images with the same options, running several at
+// once on the thread pool, and pass each one's PNG data to done_func
+// as it's finished. Even images too small to be split into chunks
+// are compressed on the pool, so a batch of small images keeps every
+// thread busy. Returns once the whole batch is done.
+//
+// The image data is read directly on the worker threads, and must
+// stay valid until this returns.
+//
+// p_options may be NULL, in which case default options will
+// be used including a global threadpool.
+//
+// Check the return value for errors; if any image failed, this
+// returns an error after done_func has been called for all of them.
+//
+extern mtpng_result
+mtpng_encode_batch(const mtpng_batch_image* p_images,
+                   size_t count,
+                   mtpng_encoder_options* p_options,
+                   mtpng_batch_func done_func,
+                   void* const user_data);
+
+#pragma mark Decoder options
+
+//
+// Create a new set of decoder options.
+//
+// On input, *pp_options must be NULL.
+// On output, *pp_options will be a pointer to a new instance
+// on success, or remain NULL on failure.
+//
+// Free with mtpng_decoder_options_release().
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_decoder_options_new(mtpng_decoder_options** pp_options);
+
+//
+// Release the decoder options.
+//
+// On input, *pp_options must be a valid instance pointer.
+// On output, *pp_options will be NULL on success.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_decoder_options_release(mtpng_decoder_options** pp_options);
+
+//
+// Use a thread pool of your own instead of the global default.
+// The pool must outlive the decoder.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_decoder_options_set_thread_pool(mtpng_decoder_options* p_options,
+                                      mtpng_threadpool* p_pool);
+
+//
+// Have mtpng_decoder_read_image() give rows in the given layout
+// instead of packed as stored in the file, converted on the worker
+// threads. The same restrictions on color type and depth apply as
+// with mtpng_header_set_source_format(), checked when the header
+// is read.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_decoder_options_set_output_format(mtpng_decoder_options* p_options,
+                                        mtpng_source_format output_format);
+
+//
+// Set a limit in bytes on the image data held while decoding: the
+// compressed stream, its inflated rows, and the decoded image.
+// mtpng_decoder_read_header() rejects images that would need more,
+// as well as any whose size can't be represented.
+//
+// 0 means no limit, the default.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_decoder_options_set_memory_limit(mtpng_decoder_options* p_options,
+                                       size_t memory_limit);
+
+#pragma mark Decoder
+
+//
+// Create a new PNG decoder instance, reading from the given callback.
+//
+// p_options may be NULL for the defaults, and may be released
+// once the decoder is created.
+//
+// On input, *pp_decoder must be NULL.
+// On output, *pp_decoder will be a pointer to a new instance
+// on success, or remain NULL on failure.
+//
+// Free with mtpng_decoder_release().
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_decoder_new(mtpng_decoder** pp_decoder,
+                  mtpng_read_func read_func,
+                  void* const user_data,
+                  mtpng_decoder_options* p_options);
+
+//
+// Release the decoder instance and clear the pointer.
+//
+// On input, *pp_decoder must be a valid instance pointer.
+// On output, *pp_decoder will be NULL on success.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_decoder_release(mtpng_decoder** pp_decoder);
+
+//
+// Read the file signature and chunks up to the image data,
+// filling out p_header, which must be created beforehand with
+// mtpng_header_new(). Its source format is the decoder's output
+// format, so mtpng_header_get_stride() gives the row length for
+// mtpng_decoder_read_image().
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_decoder_read_header(mtpng_decoder* p_decoder,
+                          mtpng_header* p_header);
+
+//
+// Get the palette read with the header, as 3-byte RGB entries.
+// Sets *p_len to 0 if there's none. The data belongs to the decoder
+// and is valid until it's released.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_decoder_get_palette(mtpng_decoder* p_decoder,
+                          const uint8_t** pp_bytes,
+                          size_t* p_len);
+
+//
+// Get the tRNS transparency data read with the header, if any,
+// just as for mtpng_decoder_get_palette().
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_decoder_get_transparency(mtpng_decoder* p_decoder,
+                               const uint8_t** pp_bytes,
+                               size_t* p_len);
+
+//
+// Decode the image into the given buffer, which must hold at
+// least height rows of mtpng_header_get_stride() bytes, reading
+// on to the end of the file.
+//
+// Files written by mtpng are inflated in parallel across the
+// thread pool; others inflate on the calling thread while rows
+// are unfiltered and converted on the workers.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_decoder_read_image(mtpng_decoder* p_decoder,
+                         uint8_t* p_bytes,
+                         size_t len);
+
+//
+// Decode rows start_row up to end_row into the given buffer, which
+// must hold that many rows of mtpng_header_get_stride() bytes, in
+// place of mtpng_decoder_read_image().
+//
+// With an index from mtpng_encoder_options_set_write_index(), only
+// the compressed chunks those rows need are decoded. Other files,
+// and interlaced images, are decoded in full.
+//
+// Check the return value for errors.
+//
+extern mtpng_result
+mtpng_decoder_read_rows(mtpng_decoder* p_decoder,
+                        uint32_t start_row,
+                        uint32_t end_row,
+                        uint8_t* p_bytes,
+                        size_t len);
+
 #pragma mark footer
 
 #ifdef __cplusplus
@@ -23,20 +23,20 @@
 // THE SOFTWARE.
 //
 
-use std::convert::TryFrom;
-use std::fs::File;
+use std::fs;
+use std::fs::{File, OpenOptions};
 use std::io;
-use std::io::{Error, ErrorKind};
+use std::io::{BufReader, Error, ErrorKind, Write};
+use std::path::Path;
+use std::sync::Arc;
+use std::time::Duration;
 
 // CLI options
 extern crate clap;
 use clap::{Arg, App, ArgMatches};
 
-// For reading an existing file
-extern crate png;
-
 extern crate rayon;
-use rayon::{ThreadPool, ThreadPoolBuilder};
+use rayon::ThreadPool;
 
 // For timing!
 extern crate time;
@@ -44,10 +44,13 @@ use time::precise_time_s;
 
 // Hey that's us!
 extern crate mtpng;
-use mtpng::{ColorType, CompressionLevel, Header};
+use mtpng::{CompressionLevel, Cores, Header, InterlaceMethod};
 use mtpng::Mode::{Adaptive, Fixed};
-use mtpng::encoder::{Encoder, Options};
+use mtpng::decoder::Decoder;
+use mtpng::decoder::Options as DecoderOptions;
+use mtpng::encoder::{encode_batch, BatchImage, Encoder, Options, Stats};
 use mtpng::Strategy;
+use mtpng::Backend;
 use mtpng::Filter;
 
 pub fn err(payload: &str) -> Error
@@ -55,50 +58,36 @@ pub fn err(payload: &str) -> Error
     Error::new(ErrorKind::Other, payload)
 }
 
-fn read_png(filename: &str)
+fn read_png(pool: &ThreadPool, filename: &str)
     -> io::Result<(Header, Vec<u8>, Option<Vec<u8>>, Option<Vec<u8>>)>
 {
-    use png::Decoder;
-    use png::HasParameters;
-    use png::Transformations;
-
-    let mut decoder = Decoder::new(File::open(filename)?);
-    decoder.set(Transformations::IDENTITY);
-
-    let (info, mut reader) = decoder.read_info()?;
+    let mut options = DecoderOptions::new();
+    options.set_thread_pool(pool)?;
 
-    let mut header = Header::new();
-    header.set_size(info.width, info.height)?;
-    header.set_color(ColorType::try_from(info.color_type as u8)?,
-                     info.bit_depth as u8)?;
+    let mut decoder = Decoder::new(BufReader::new(File::open(filename)?), &options);
+    let mut header = decoder.read_header()?;
+    let data = decoder.read_image()?;
 
-    let palette = reader.info().palette.clone();
-    let transparency = reader.info().trns.clone();
+    // The data comes back deinterlaced, so re-encode it that way
+    // unless asked otherwise.
+    header.set_interlace_method(InterlaceMethod::Standard)?;
 
-    let mut data = vec![0u8; info.buffer_size()];
-    reader.next_frame(&mut data)?;
+    let palette = decoder.palette().map(|data| data.to_vec());
+    let transparency = decoder.transparency().map(|data| data.to_vec());
 
     Ok((header, data, palette, transparency))
 }
 
-fn write_png(pool: &ThreadPool,
-             args: &ArgMatches,
-             filename: &str,
-             header: &Header,
-             data: &[u8],
-             palette: &Option<Vec<u8>>,
-             transparency: &Option<Vec<u8>>)
-   -> io::Result<()>
-{
-    let writer = File::create(filename)?;
+fn encoder_options<'a>(pool: &'a ThreadPool, args: &ArgMatches) -> io::Result<Options<'a>> {
     let mut options = Options::new();
 
     // Encoding options
     options.set_thread_pool(pool)?;
 
     match args.value_of("chunk-size") {
-        None    => {},
-        Some(s) => {
+        None         => {},
+        Some("auto") => options.set_chunk_size_mode(Adaptive)?,
+        Some(s)      => {
             let n = s.parse::<usize>().map_err(|_e| err("Invalid chunk size"))?;
             options.set_chunk_size(n)?;
         },
@@ -134,6 +123,13 @@ fn write_png(pool: &ThreadPool,
         _                => return Err(err("Invalid compression strategy mode"))?,
     }
 
+    match args.value_of("backend") {
+        None          => {},
+        Some("zlib")  => options.set_backend(Backend::Zlib)?,
+        Some("miniz") => options.set_backend(Backend::Miniz)?,
+        _             => return Err(err("Unsupported deflate backend (try zlib or miniz)")),
+    }
+
     match args.value_of("streaming") {
         None        => {},
         Some("yes") => options.set_streaming(true)?,
@@ -141,6 +137,85 @@ fn write_png(pool: &ThreadPool,
         _           => return Err(err("Invalid streaming mode, try yes or no."))
     }
 
+    match args.value_of("index") {
+        None        => {},
+        Some("yes") => options.set_write_index(true)?,
+        Some("no")  => options.set_write_index(false)?,
+        _           => return Err(err("Invalid index mode, try yes or no."))
+    }
+
+    match args.value_of("quantize") {
+        None           => {},
+        Some("yes")    => options.set_quantize(true)?,
+        Some("dither") => {
+            options.set_quantize(true)?;
+            options.set_dither(true)?;
+        },
+        Some("no")     => options.set_quantize(false)?,
+        _              => return Err(err("Invalid quantize mode, try yes, dither, or no."))
+    }
+
+    match args.value_of("reduce") {
+        None        => {},
+        Some("yes") => options.set_reduce(true)?,
+        Some("no")  => options.set_reduce(false)?,
+        _           => return Err(err("Invalid reduce mode, try yes or no."))
+    }
+
+    match args.value_of("search") {
+        None        => {},
+        Some("yes") => options.set_search(true)?,
+        Some("no")  => options.set_search(false)?,
+        _           => return Err(err("Invalid search mode, try yes or no."))
+    }
+
+    match args.value_of("chunk-affinity") {
+        None        => {},
+        Some("yes") => options.set_chunk_affinity(true)?,
+        Some("no")  => options.set_chunk_affinity(false)?,
+        _           => return Err(err("Invalid chunk affinity, try yes or no."))
+    }
+
+    match args.value_of("flush-interval") {
+        None    => {},
+        Some(s) => {
+            let n = s.parse::<usize>().map_err(|_e| err("Invalid flush interval"))?;
+            options.set_flush_interval(n)?;
+        },
+    }
+
+    Ok(options)
+}
+
+fn output_header(args: &ArgMatches, header: &Header) -> io::Result<Header> {
+    let mut header = *header;
+    match args.value_of("interlace") {
+        None        => {},
+        Some("yes") => header.set_interlace_method(InterlaceMethod::Adam7)?,
+        Some("no")  => header.set_interlace_method(InterlaceMethod::Standard)?,
+        _           => return Err(err("Invalid interlace mode, try yes or no.")),
+    }
+    Ok(header)
+}
+
+fn write_png(pool: &ThreadPool,
+             args: &ArgMatches,
+             filename: &str,
+             header: &Header,
+             data: &[u8],
+             palette: &Option<Vec<u8>>,
+             transparency: &Option<Vec<u8>>)
+   -> io::Result<()>
+{
+    let writer = File::create(filename)?;
+    let mut options = encoder_options(pool, args)?;
+    let header = output_header(args, header)?;
+
+    let trace = args.value_of("trace");
+    if trace.is_some() || args.is_present("stats") {
+        options.set_stats(true)?;
+    }
+
     let mut encoder = Encoder::new(writer, &options);
 
     // Image data
@@ -154,11 +229,165 @@ fn write_png(pool: &ThreadPool,
         None => {},
     }
     encoder.write_image_rows(&data)?;
+    encoder.flush()?;
+    if let Some(stats) = encoder.stats() {
+        if args.is_present("stats") {
+            print_stats(&stats);
+        }
+        if let Some(trace) = trace {
+            write_trace(trace, &stats)?;
+        }
+    }
     encoder.finish()?;
 
     Ok(())
 }
 
+fn print_stats(stats: &Stats) {
+    let ms = |d: Duration| d.as_secs() as f64 * 1000.0 + d.subsec_nanos() as f64 / 1e6;
+    eprintln!("elapsed {:.1} ms: filter {:.1} ms, deflate {:.1} ms, idle {:.1} ms over {} threads",
+              ms(stats.elapsed()), ms(stats.filter_time()), ms(stats.deflate_time()),
+              ms(stats.idle_time()), stats.threads());
+    eprintln!("caller blocked {:.1} ms, writing output {:.1} ms",
+              ms(stats.blocked_time()), ms(stats.output_time()));
+    eprintln!("bytes in {}, filtered {}, out {} in {} chunks",
+              stats.bytes_in(), stats.bytes_filtered(), stats.bytes_out(), stats.chunks().len());
+    let counts = stats.filter_counts();
+    eprintln!("filters: none {}, sub {}, up {}, average {}, paeth {}",
+              counts[0], counts[1], counts[2], counts[3], counts[4]);
+}
+
+//
+// Write the chunks' jobs out as Chrome trace events, which can be
+// loaded into chrome://tracing or Perfetto to see how the threads
+// were kept busy. Jobs run on the calling thread go on thread 0,
+// and those on pool threads after it.
+//
+fn write_trace(trace: &str, stats: &Stats) -> io::Result<()> {
+    let micros = |d: Duration| d.as_secs() as f64 * 1e6 + d.subsec_nanos() as f64 / 1e3;
+    let tid = |thread: Option<usize>| thread.map(|t| t + 1).unwrap_or(0);
+    let mut events = Vec::new();
+    for chunk in stats.chunks() {
+        events.push(format!("{{\"name\":\"filter {}\",\"cat\":\"filter\",\"ph\":\"X\",\
+                             \"ts\":{:.1},\"dur\":{:.1},\"pid\":1,\"tid\":{}}}",
+                            chunk.index(), micros(chunk.filter_start()),
+                            micros(chunk.filter_time()), tid(chunk.filter_thread())));
+        events.push(format!("{{\"name\":\"deflate {}\",\"cat\":\"deflate\",\"ph\":\"X\",\
+                             \"ts\":{:.1},\"dur\":{:.1},\"pid\":1,\"tid\":{}}}",
+                            chunk.index(), micros(chunk.deflate_start()),
+                            micros(chunk.deflate_time()), tid(chunk.deflate_thread())));
+    }
+    let mut file = File::create(trace)?;
+    write!(file, "{{\"traceEvents\":[\n{}\n]}}\n", events.join(",\n"))
+}
+
+//
+// Append a line of JSON describing a run to the report file,
+// for collecting benchmark results; see bench-samples.sh.
+//
+fn write_report(report: &str,
+                args: &ArgMatches,
+                header: &Header,
+                threads: usize,
+                seconds: f64,
+                outfile: &str)
+   -> io::Result<()>
+{
+    let option = |name: &str| json_string(args.value_of(name).unwrap_or("default"));
+    let line = format!("{{\"input\":{},\"width\":{},\"height\":{},\"threads\":{},\
+                        \"chunk_size\":{},\"filter\":{},\"level\":{},\
+                        \"strategy\":{},\"backend\":{},\"streaming\":{},\
+                        \"ms\":{:.1},\"bytes\":{}}}\n",
+                       json_string(args.value_of("input").unwrap()),
+                       header.width(),
+                       header.height(),
+                       threads,
+                       option("chunk-size"),
+                       option("filter"),
+                       option("level"),
+                       option("strategy"),
+                       option("backend"),
+                       option("streaming"),
+                       seconds * 1000.0,
+                       fs::metadata(outfile)?.len());
+    let mut file = OpenOptions::new().create(true).append(true).open(report)?;
+    file.write_all(line.as_bytes())
+}
+
+//
+// Quote a string for JSON output, escaping anything that would
+// end it early or isn't allowed in it as is.
+//
+fn json_string(value: &str) -> String {
+    let mut out = String::with_capacity(value.len() + 2);
+    out.push('"');
+    for c in value.chars() {
+        match c {
+            '"' => out.push_str("\\\""),
+            '\\' => out.push_str("\\\\"),
+            '\n' => out.push_str("\\n"),
+            '\r' => out.push_str("\\r"),
+            '\t' => out.push_str("\\t"),
+            c if (c as u32) < 0x20 => out.push_str(&format!("\\u{:04x}", c as u32)),
+            c => out.push(c),
+        }
+    }
+    out.push('"');
+    out
+}
+
+//
+// Encode every PNG in indir to outdir together with encode_batch(),
+// reporting the throughput of each run.
+//
+fn encode_dir(pool: &ThreadPool,
+              args: &ArgMatches,
+              indir: &str,
+              outdir: &str,
+              reps: usize)
+   -> io::Result<()>
+{
+    let mut names = Vec::new();
+    for entry in fs::read_dir(indir)? {
+        let name = entry?.file_name();
+        if Path::new(&name).extension().map_or(false, |ext| ext == "png") {
+            names.push(name);
+        }
+    }
+    names.sort();
+
+    let mut batch = Vec::with_capacity(names.len());
+    for name in &names {
+        let path = Path::new(indir).join(name);
+        let (header, data, palette, transparency) = read_png(pool, &path.to_string_lossy())?;
+        batch.push(BatchImage {
+            header: output_header(args, &header)?,
+            image: Arc::new(data),
+            row_stride: header.stride(),
+            palette,
+            transparency,
+        });
+    }
+    let options = encoder_options(pool, args)?;
+
+    for _i in 0 .. reps {
+        let start_time = precise_time_s();
+        let mut result = Ok(());
+        encode_batch(&batch, &options, |index, output| {
+            if result.is_ok() {
+                result = output.and_then(|data| fs::write(Path::new(outdir).join(&names[index]), data));
+            }
+        });
+        result?;
+        let delta = precise_time_s() - start_time;
+
+        println!("Done {} images in {} ms, {:.1} images/sec",
+                 batch.len(), (delta * 1000.0).round(), batch.len() as f64 / delta);
+    }
+
+    Ok(())
+}
+
 fn doit(args: ArgMatches) -> io::Result<()> {
     let threads = match args.value_of("threads") {
         None    => 0, // Means default
@@ -167,9 +396,15 @@ fn doit(args: ArgMatches) -> io::Result<()> {
         },
     };
 
-    let pool = ThreadPoolBuilder::new().num_threads(threads)
-                                       .build()
-                                       .map_err(|e| err(&e.to_string()))?;
+    let cores = match args.value_of("cores") {
+        None             => Cores::All,
+        Some("all")      => Cores::All,
+        Some("physical") => Cores::Physical,
+        Some("big")      => Cores::Big,
+        _                => return Err(err("Invalid cores, try all, physical, or big.")),
+    };
+
+    let pool = mtpng::thread_pool(threads, cores)?;
     eprintln!("Using {} threads", pool.current_num_threads());
 
     let reps = match args.value_of("repeat") {
@@ -184,7 +419,10 @@ fn doit(args: ArgMatches) -> io::Result<()> {
     let outfile = args.value_of("output").unwrap();
 
     println!("{} -> {}", infile, outfile);
-    let (header, data, palette, transparency) = read_png(&infile)?;
+    if args.is_present("batch") {
+        return encode_dir(&pool, &args, infile, outfile, reps);
+    }
+    let (header, data, palette, transparency) = read_png(&pool, &infile)?;
 
     for _i in 0 .. reps {
         let start_time = precise_time_s();
@@ -192,6 +430,10 @@ fn doit(args: ArgMatches) -> io::Result<()> {
         let delta = precise_time_s() - start_time;
 
         println!("Done in {} ms", (delta * 1000.0).round());
+
+        if let Some(report) = args.value_of("report") {
+            write_report(report, &args, &header, pool.current_num_threads(), delta, outfile)?;
+        }
     }
 
     Ok(())
@@ -205,7 +447,7 @@ pub fn main() {
         .arg(Arg::with_name("chunk-size")
             .long("chunk-size")
             .value_name("bytes")
-            .help("Divide image into chunks of at least this given size.")
+            .help("Divide image into chunks of at least this given size, or auto.")
             .takes_value(true))
         .arg(Arg::with_name("filter")
             .long("filter")
@@ -219,24 +461,77 @@ pub fn main() {
             .long("strategy")
             .value_name("strategy")
             .help("Deflate strategy: one of filtered, huffman, rle, or fixed."))
+        .arg(Arg::with_name("backend")
+            .long("backend")
+            .value_name("backend")
+            .help("Deflate implementation: zlib (default), or miniz if built with it."))
         .arg(Arg::with_name("streaming")
             .long("streaming")
             .value_name("streaming")
             .help("Use streaming output mode; trades off file size for lower latency and memory usage"))
+        .arg(Arg::with_name("index")
+            .long("index")
+            .value_name("index")
+            .help("Write an index of the compressed chunks, for mtpng's decoder to decode rows from without the whole image"))
+        .arg(Arg::with_name("quantize")
+            .long("quantize")
+            .value_name("quantize")
+            .help("Convert 8-bit truecolor input to indexed color: yes, dither, or no (default)."))
+        .arg(Arg::with_name("reduce")
+            .long("reduce")
+            .value_name("reduce")
+            .help("Use a smaller color type or depth where it holds the image exactly, yes or no (default)."))
+        .arg(Arg::with_name("search")
+            .long("search")
+            .value_name("search")
+            .help("Try every filter and strategy on each chunk and keep the smallest, yes or no (default)."))
+        .arg(Arg::with_name("flush-interval")
+            .long("flush-interval")
+            .value_name("bytes")
+            .help("In streaming mode, also write out compressed data every this many bytes of image data.")
+            .takes_value(true))
+        .arg(Arg::with_name("interlace")
+            .long("interlace")
+            .value_name("interlace")
+            .help("Use Adam7 interlacing, yes or no; makes files larger but loads progressively."))
         .arg(Arg::with_name("threads")
             .long("threads")
             .value_name("threads")
             .help("Override default number of threads."))
+        .arg(Arg::with_name("cores")
+            .long("cores")
+            .value_name("cores")
+            .help("Put a thread on every logical processor (all, the default), each physical core, or only big cores."))
+        .arg(Arg::with_name("chunk-affinity")
+            .long("chunk-affinity")
+            .value_name("chunk-affinity")
+            .help("Deflate each chunk on the thread that filtered it where possible, yes or no (default)."))
         .arg(Arg::with_name("repeat")
             .long("repeat")
             .value_name("n")
             .help("Run conversion n times, as load benchmarking helper."))
+        .arg(Arg::with_name("batch")
+            .long("batch")
+            .help("Encode every PNG in the input directory to the output directory at once, and report images per second."))
+        .arg(Arg::with_name("report")
+            .long("report")
+            .value_name("file")
+            .help("Append a line of JSON with the options, time, and size of each run to file.")
+            .takes_value(true))
+        .arg(Arg::with_name("stats")
+            .long("stats")
+            .help("Print where the encode's time went, and what it filtered and compressed."))
+        .arg(Arg::with_name("trace")
+            .long("trace")
+            .value_name("file")
+            .help("Write the filter and deflate jobs of each run to file as Chrome trace JSON.")
+            .takes_value(true))
         .arg(Arg::with_name("input")
-            .help("Input filename, must be another PNG.")
+            .help("Input filename, must be another PNG, or directory of them with --batch.")
             .required(true)
             .index(1))
         .arg(Arg::with_name("output")
-            .help("Output filename.")
+            .help("Output filename, or directory with --batch.")
             .required(true)
             .index(2))
         .get_matches();
@@ -26,13 +26,19 @@
 use rayon::ThreadPool;
 use rayon::ThreadPoolBuilder;
 
+use std::cmp;
 use std::convert::TryFrom;
 
 use std::io;
+use std::io::{IoSlice, Read};
 use std::io::Write;
 
 use std::ptr;
 
+use std::sync::{Arc, Mutex};
+
+use std::time::Duration;
+
 use std::ffi::CStr;
 use std::os::raw::c_char;
 
@@ -40,17 +46,34 @@ use libc::{c_void, c_int, size_t};
 
 use super::ColorType;
 use super::Strategy;
+use super::Backend;
 use super::CompressionLevel;
 use super::Mode::{Adaptive, Fixed};
 use super::Header;
+use super::InterlaceMethod;
+use super::SourceFormat;
+use super::FrameControl;
+use super::DisposeOp;
+use super::BlendOp;
+use super::Cores;
+use super::BufferPool;
+use super::Scheduler;
+use super::thread_pool;
 
+use super::encoder::BatchImage;
 use super::encoder::Encoder;
 use super::encoder::Options;
+use super::encoder::ChunkCache;
+use super::encoder::encode_batch;
+
+use super::decoder;
+use super::decoder::Decoder;
 
 use super::filter::Filter;
 
 use super::utils::invalid_input;
 use super::utils::other;
+use super::utils::read_be32;
 
 #[repr(C)]
 pub enum CResult {
@@ -58,6 +81,55 @@ pub enum CResult {
     Err = 1,
 }
 
+//
+// Summary of Stats for mtpng_encoder_get_stats(),
+// with times in microseconds.
+//
+#[repr(C)]
+pub struct CStats {
+    elapsed_us: u64,
+    filter_us: u64,
+    deflate_us: u64,
+    output_us: u64,
+    blocked_us: u64,
+    idle_us: u64,
+    bytes_in: u64,
+    bytes_filtered: u64,
+    bytes_out: u64,
+    filter_counts: [u64; 5],
+    chunks: u64,
+}
+
+//
+// Caller-owned buffer for mtpng_output_poll(), given with its
+// capacity and returned with the length filled.
+//
+#[repr(C)]
+pub struct CIoVec {
+    p_bytes: *mut u8,
+    len: size_t,
+}
+
+//
+// One of the images for mtpng_encode_batch(); the palette
+// and transparency may be null for none.
+//
+#[repr(C)]
+pub struct CBatchImage {
+    p_header: PHeader,
+    p_bytes: *const u8,
+    len: size_t,
+    stride: size_t,
+    p_palette: *const u8,
+    palette_len: size_t,
+    p_transparency: *const u8,
+    transparency_len: size_t,
+}
+
+fn micros(duration: Duration) -> u64 {
+    duration.as_micros() as u64
+}
+
 impl From<Result<(),io::Error>> for CResult {
     fn from(result: Result<(),io::Error>) -> CResult {
         match result {
@@ -67,10 +139,8 @@ impl From<Result<(),io::Error>> for CResult {
     }
 }
 
-/*
 pub type CReadFunc = unsafe extern "C"
     fn(*const c_void, *mut u8, size_t) -> size_t;
-*/
 
 pub type CWriteFunc = unsafe extern "C"
     fn(*const c_void, *const u8, size_t) -> size_t;
@@ -78,10 +148,16 @@ pub type CWriteFunc = unsafe extern "C"
 pub type CFlushFunc = unsafe extern "C"
     fn(*const c_void) -> bool;
 
-/*
+pub type CDoneFunc = unsafe extern "C"
+    fn(*const c_void, CResult);
+
+pub type CBatchFunc = unsafe extern "C"
+    fn(*const c_void, size_t, CResult, *const u8, size_t);
 
 //
 // Adapter for Read trait to use C callback.
+// The callback returns the number of bytes read,
+// which may be short of the buffer, and 0 at the end.
 //
 pub struct CReader {
     read_func: CReadFunc,
@@ -104,25 +180,28 @@ impl Read for CReader {
     fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
         let ret = unsafe {
             (self.read_func)(self.user_data,
-                             &mut buf[0],
+                             buf.as_mut_ptr(),
                              buf.len())
         };
-        if ret == buf.len() {
+        if ret <= buf.len() {
             Ok(ret)
         } else {
             Err(other("mtpng read callback returned failure"))
         }
     }
 }
-*/
 
 //
-// Adapter for Write trait to use C callbacks.
+// Adapter for Write trait to use C callbacks, or to queue
+// the output for the caller to poll for.
 //
-pub struct CWriter {
-    write_func: CWriteFunc,
-    flush_func: CFlushFunc,
-    user_data: *mut c_void,
+pub enum CWriter {
+    Callbacks {
+        write_func: CWriteFunc,
+        flush_func: CFlushFunc,
+        user_data: *mut c_void,
+    },
+    Polled(Arc<Mutex<OutputQueue>>),
 }
 
 impl CWriter {
@@ -131,7 +210,7 @@ impl CWriter {
            user_data: *mut c_void)
     -> CWriter
     {
-        CWriter {
+        CWriter::Callbacks {
             write_func: write_func,
             flush_func: flush_func,
             user_data: user_data,
@@ -139,28 +218,209 @@ impl CWriter {
     }
 }
 
+// The caller promises the callbacks are safe to use from the
+// worker threads if they use mtpng_encoder_finish_async().
+unsafe impl Send for CWriter {}
+
+//
+// Completion callback for mtpng_encoder_finish_async().
+//
+struct CDone {
+    done_func: CDoneFunc,
+    user_data: *mut c_void,
+}
+
+unsafe impl Send for CDone {}
+
+impl CDone {
+    fn call(self, result: CResult) {
+        unsafe {
+            (self.done_func)(self.user_data, result);
+        }
+    }
+}
+
 impl Write for CWriter {
     fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
-        let ret = unsafe {
-            (self.write_func)(self.user_data,
-                                   &buf[0],
-                                   buf.len())
-        };
-        if ret == buf.len() {
-            Ok(ret)
-        } else {
-            Err(other("mtpng write callback returned failure"))
+        match *self {
+            CWriter::Callbacks { write_func, user_data, .. } => {
+                let ret = unsafe {
+                    (write_func)(user_data,
+                                 &buf[0],
+                                 buf.len())
+                };
+                if ret == buf.len() {
+                    Ok(ret)
+                } else {
+                    Err(other("mtpng write callback returned failure"))
+                }
+            },
+            CWriter::Polled(ref queue) => {
+                queue.lock().unwrap().data.extend_from_slice(buf);
+                Ok(buf.len())
+            },
+        }
+    }
+
+    fn write_vectored(&mut self, bufs: &[IoSlice]) -> io::Result<usize> {
+        match *self {
+            CWriter::Callbacks { .. } => {
+                match bufs.iter().find(|buf| !buf.is_empty()) {
+                    Some(buf) => self.write(buf),
+                    None => Ok(0),
+                }
+            },
+            CWriter::Polled(ref queue) => {
+                // A whole chunk's data at once, under one lock.
+                let mut queue = queue.lock().unwrap();
+                let mut len = 0;
+                for buf in bufs {
+                    queue.data.extend_from_slice(buf);
+                    len += buf.len();
+                }
+                Ok(len)
+            },
         }
     }
 
     fn flush(&mut self) -> io::Result<()> {
-        let ret = unsafe {
-            (self.flush_func)(self.user_data)
+        match *self {
+            CWriter::Callbacks { flush_func, user_data, .. } => {
+                let ret = unsafe {
+                    (flush_func)(user_data)
+                };
+                if ret {
+                    Ok(())
+                } else {
+                    Err(other("mtpng flush callback returned failure"))
+                }
+            },
+            CWriter::Polled(_) => Ok(()),
+        }
+    }
+}
+
+//
+// Output written by a polled encoder, waiting to be copied out
+// by mtpng_output_poll(). Copies whole chunks at a time, with
+// the signature counting as one, tracking the PNG structure to
+// find where each ends.
+//
+pub struct OutputQueue {
+    data: Vec<u8>,
+    start: usize,
+    // Bytes left to copy out of a chunk split over buffers.
+    partial: usize,
+    signed: bool,
+}
+
+impl OutputQueue {
+    fn new() -> OutputQueue {
+        OutputQueue {
+            data: Vec::new(),
+            start: 0,
+            partial: 0,
+            signed: false,
+        }
+    }
+
+    //
+    // Length of the next whole chunk, once it's all been written.
+    // The worker threads may be partway through writing one
+    // when finishing asynchronously.
+    //
+    fn next_len(&self) -> Option<usize> {
+        let pending = &self.data[self.start ..];
+        let len = if !self.signed {
+            8
+        } else if pending.len() >= 4 {
+            12 + read_be32(&pending[.. 4]) as usize
+        } else {
+            return None;
         };
-        if ret {
-            Ok(())
+        if pending.len() >= len {
+            Some(len)
         } else {
-            Err(other("mtpng flush callback returned failure"))
+            None
+        }
+    }
+
+    //
+    // Copy as many whole chunks into the buffers as fit, starting
+    // the next buffer rather than splitting a chunk that would fit
+    // in an empty one. Returns the number of buffers filled, each
+    // with its length set to the bytes copied into it.
+    //
+    fn poll(&mut self, bufs: &mut [CIoVec]) -> usize {
+        let mut index = 0;
+        let mut used = 0;
+        while index < bufs.len() {
+            let room = bufs[index].len - used;
+            if self.partial == 0 {
+                match self.next_len() {
+                    Some(len) if used > 0 && len > room => {
+                        bufs[index].len = used;
+                        index += 1;
+                        used = 0;
+                        continue;
+                    },
+                    Some(len) => {
+                        self.partial = len;
+                        self.signed = true;
+                    },
+                    None => break,
+                }
+            }
+
+            let len = cmp::min(self.partial, room);
+            unsafe {
+                ptr::copy_nonoverlapping(self.data[self.start ..].as_ptr(),
+                                         bufs[index].p_bytes.add(used),
+                                         len);
+            }
+            self.start += len;
+            self.partial -= len;
+            used += len;
+            if used == bufs[index].len {
+                index += 1;
+                used = 0;
+            }
+        }
+        if used > 0 {
+            bufs[index].len = used;
+            index += 1;
+        }
+
+        // Move what's left down once most of it's been taken.
+        if self.start == self.data.len() {
+            self.data.clear();
+            self.start = 0;
+        } else if self.start > self.data.len() / 2 {
+            self.data.drain(.. self.start);
+            self.start = 0;
+        }
+        index
+    }
+}
+
+//
+// Image data passed in from C for mtpng_encoder_write_image().
+// The caller guarantees it stays alive and unchanged until the
+// encoder is finished or released, which both wait for any jobs
+// still reading from it.
+//
+struct CImage {
+    p_bytes: *const u8,
+    len: usize,
+}
+
+unsafe impl Send for CImage {}
+unsafe impl Sync for CImage {}
+
+impl AsRef<[u8]> for CImage {
+    fn as_ref(&self) -> &[u8] {
+        unsafe {
+            ::std::slice::from_raw_parts(self.p_bytes, self.len)
         }
     }
 }
@@ -169,9 +429,16 @@ impl Write for CWriter {
 type CEncoder = Encoder<'static, CWriter>;
 
 pub type PThreadPool = *mut ThreadPool;
+pub type PBufferPool = *mut BufferPool;
+pub type PScheduler = *mut Scheduler;
+pub type PChunkCache = *mut ChunkCache;
+pub type POutput = *mut Arc<Mutex<OutputQueue>>;
 pub type PEncoderOptions = *mut Options<'static>;
 pub type PEncoder = *mut CEncoder;
 pub type PHeader = *mut Header;
+pub type PDecoderOptions = *mut decoder::Options<'static>;
+pub type PDecoder = *mut Decoder<'static, CReader>;
+pub type PFrameControl = *mut FrameControl;
 
 
 #[no_mangle]
@@ -194,6 +461,29 @@ fn mtpng_threadpool_new(pp_pool: *mut PThreadPool, threads: size_t)
     }())
 }
 
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_threadpool_new_cores(pp_pool: *mut PThreadPool,
+                              threads: size_t,
+                              cores: c_int)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if pp_pool.is_null() {
+            return Err(invalid_input("pp_pool must not be null"));
+        }
+        if !(*pp_pool).is_null() {
+            return Err(invalid_input("*pp_pool must be null"))
+        }
+        if cores < 0 || cores > u8::max_value() as c_int {
+            return Err(invalid_input("Invalid cores mode"));
+        }
+        let pool = thread_pool(threads, Cores::try_from(cores as u8)?)?;
+        *pp_pool = Box::into_raw(Box::new(pool));
+        Ok(())
+    }())
+}
+
 #[no_mangle]
 pub unsafe extern "C"
 fn mtpng_threadpool_release(pp_pool: *mut PThreadPool)
@@ -212,359 +502,1172 @@ fn mtpng_threadpool_release(pp_pool: *mut PThreadPool)
     }())
 }
 
-
 #[no_mangle]
 pub unsafe extern "C"
-fn mtpng_encoder_options_new(pp_options: *mut PEncoderOptions)
+fn mtpng_scheduler_new(pp_scheduler: *mut PScheduler, max_jobs: size_t)
 -> CResult
 {
     CResult::from(|| -> io::Result<()> {
-        if pp_options.is_null() {
-            return Err(invalid_input("pp_options must not be null"));
+        if pp_scheduler.is_null() {
+            return Err(invalid_input("pp_scheduler must not be null"));
         }
-        if !(*pp_options).is_null() {
-            return Err(invalid_input("*pp_options must be null"))
+        if !(*pp_scheduler).is_null() {
+            return Err(invalid_input("*pp_scheduler must be null"))
         }
-        *pp_options = Box::into_raw(Box::new(Options::new()));
+        let scheduler = if max_jobs == 0 {
+            Scheduler::new()
+        } else {
+            Scheduler::with_limit(max_jobs)
+        };
+        *pp_scheduler = Box::into_raw(Box::new(scheduler));
         Ok(())
     }())
 }
 
 #[no_mangle]
 pub unsafe extern "C"
-fn mtpng_encoder_options_release(pp_options: *mut PEncoderOptions)
+fn mtpng_scheduler_release(pp_scheduler: *mut PScheduler)
 -> CResult
 {
     CResult::from(|| -> io::Result<()> {
-        if pp_options.is_null() {
-            return Err(invalid_input("pp_header must not be null"));
+        if pp_scheduler.is_null() {
+            return Err(invalid_input("pp_scheduler must not be null"));
         }
-        if (*pp_options).is_null() {
-            return Err(invalid_input("*pp_header must not be null"));
+        if (*pp_scheduler).is_null() {
+            return Err(invalid_input("*pp_scheduler must not be null"));
         }
-        drop(Box::from_raw(*pp_options));
-        *pp_options = ptr::null_mut();
+        drop(Box::from_raw(*pp_scheduler));
+        *pp_scheduler = ptr::null_mut();
         Ok(())
     }())
 }
 
-
 #[no_mangle]
 pub unsafe extern "C"
-fn mtpng_encoder_options_set_thread_pool(p_options: PEncoderOptions,
-                                         p_pool: PThreadPool)
+fn mtpng_bufferpool_new(pp_pool: *mut PBufferPool, max_bytes: size_t)
 -> CResult
 {
     CResult::from(|| -> io::Result<()> {
-        if p_options.is_null() {
-            return Err(invalid_input("p_options must not be null"));
+        if pp_pool.is_null() {
+            return Err(invalid_input("pp_pool must not be null"));
         }
-        (*p_options).set_thread_pool(&*p_pool)
+        if !(*pp_pool).is_null() {
+            return Err(invalid_input("*pp_pool must be null"))
+        }
+        let pool = BufferPool::with_limit(max_bytes);
+        *pp_pool = Box::into_raw(Box::new(pool));
+        Ok(())
     }())
 }
 
-
 #[no_mangle]
 pub unsafe extern "C"
-fn mtpng_encoder_options_set_filter(p_options: PEncoderOptions,
-                                    filter_mode: c_int)
+fn mtpng_bufferpool_release(pp_pool: *mut PBufferPool)
 -> CResult
 {
     CResult::from(|| -> io::Result<()> {
-        if p_options.is_null() {
-            return Err(invalid_input("p_options must not be null"));
+        if pp_pool.is_null() {
+            return Err(invalid_input("pp_pool must not be null"));
         }
-        if filter_mode > u8::max_value() as c_int {
-            return Err(invalid_input("Invalid filter mode"));
+        if (*pp_pool).is_null() {
+            return Err(invalid_input("*pp_pool must not be null"));
         }
-        let mode = if filter_mode < 0 {
-            Adaptive
-        } else {
-            Fixed(Filter::try_from(filter_mode as u8)?)
-        };
-        (*p_options).set_filter_mode(mode)
+        drop(Box::from_raw(*pp_pool));
+        *pp_pool = ptr::null_mut();
+        Ok(())
     }())
 }
 
 #[no_mangle]
 pub unsafe extern "C"
-fn mtpng_encoder_options_set_strategy(p_options: PEncoderOptions,
-                                      strategy_mode: c_int)
+fn mtpng_chunk_cache_new(pp_cache: *mut PChunkCache)
 -> CResult
 {
     CResult::from(|| -> io::Result<()> {
-        if p_options.is_null() {
-            return Err(invalid_input("p_options must not be null"));
+        if pp_cache.is_null() {
+            return Err(invalid_input("pp_cache must not be null"));
         }
-        if strategy_mode > u8::max_value() as c_int {
-            return Err(invalid_input("Invalid strategy mode"));
+        if !(*pp_cache).is_null() {
+            return Err(invalid_input("*pp_cache must be null"))
         }
-        let mode = if strategy_mode < 0 {
-            Adaptive
-        } else {
-            Fixed(Strategy::try_from(strategy_mode as u8)?)
-        };
-        (*p_options).set_strategy_mode(mode)
+        *pp_cache = Box::into_raw(Box::new(ChunkCache::new()));
+        Ok(())
     }())
 }
 
 #[no_mangle]
 pub unsafe extern "C"
-fn mtpng_encoder_options_set_compression_level(p_options: PEncoderOptions,
-                                               compression_level: c_int)
+fn mtpng_chunk_cache_release(pp_cache: *mut PChunkCache)
 -> CResult
 {
     CResult::from(|| -> io::Result<()> {
-        if p_options.is_null() {
-            return Err(invalid_input("p_options must not be null"));
+        if pp_cache.is_null() {
+            return Err(invalid_input("pp_cache must not be null"));
         }
-        if compression_level < 0 || compression_level > 9 {
-            return Err(invalid_input("Invalid compression level"));
+        if (*pp_cache).is_null() {
+            return Err(invalid_input("*pp_cache must not be null"));
         }
-        let level = CompressionLevel::try_from(compression_level as u8)?;
-        (*p_options).set_compression_level(level)
+        drop(Box::from_raw(*pp_cache));
+        *pp_cache = ptr::null_mut();
+        Ok(())
     }())
 }
 
 #[no_mangle]
 pub unsafe extern "C"
-fn mtpng_encoder_options_set_chunk_size(p_options: PEncoderOptions,
-                                        chunk_size: size_t)
+fn mtpng_output_new(pp_output: *mut POutput)
 -> CResult
 {
     CResult::from(|| -> io::Result<()> {
-        if p_options.is_null() {
-            return Err(invalid_input("p_encoder must not be null"));
+        if pp_output.is_null() {
+            return Err(invalid_input("pp_output must not be null"));
         }
-        (*p_options).set_chunk_size(chunk_size)
+        if !(*pp_output).is_null() {
+            return Err(invalid_input("*pp_output must be null"))
+        }
+        *pp_output = Box::into_raw(Box::new(Arc::new(Mutex::new(OutputQueue::new()))));
+        Ok(())
     }())
 }
 
-
 #[no_mangle]
 pub unsafe extern "C"
-fn mtpng_header_new(pp_header: *mut PHeader)
+fn mtpng_output_release(pp_output: *mut POutput)
 -> CResult
 {
     CResult::from(|| -> io::Result<()> {
-        if pp_header.is_null() {
-            return Err(invalid_input("pp_header must not be null"));
+        if pp_output.is_null() {
+            return Err(invalid_input("pp_output must not be null"));
         }
-        if !(*pp_header).is_null() {
-            return Err(invalid_input("*pp_header must be null"))
+        if (*pp_output).is_null() {
+            return Err(invalid_input("*pp_output must not be null"));
         }
-        *pp_header = Box::into_raw(Box::new(Header::new()));
+        drop(Box::from_raw(*pp_output));
+        *pp_output = ptr::null_mut();
         Ok(())
     }())
 }
 
 #[no_mangle]
 pub unsafe extern "C"
-fn mtpng_header_release(pp_header: *mut PHeader)
+fn mtpng_output_poll(p_output: POutput,
+                     p_iov: *mut CIoVec,
+                     p_count: *mut size_t)
 -> CResult
 {
     CResult::from(|| -> io::Result<()> {
-        if pp_header.is_null() {
-            return Err(invalid_input("pp_header must not be null"));
+        if p_output.is_null() {
+            return Err(invalid_input("p_output must not be null"));
         }
-        if (*pp_header).is_null() {
-            return Err(invalid_input("*pp_header must not be null"));
+        if p_count.is_null() {
+            return Err(invalid_input("p_count must not be null"));
         }
-        drop(Box::from_raw(*pp_header));
-        *pp_header = ptr::null_mut();
+        if p_iov.is_null() && *p_count > 0 {
+            return Err(invalid_input("p_iov must not be null"));
+        }
+        let bufs = if *p_count > 0 {
+            ::std::slice::from_raw_parts_mut(p_iov, *p_count)
+        } else {
+            &mut []
+        };
+        if bufs.iter().any(|buf| buf.p_bytes.is_null() && buf.len > 0) {
+            return Err(invalid_input("Buffers must not be null"));
+        }
+        *p_count = (*p_output).lock().unwrap().poll(bufs);
         Ok(())
     }())
 }
 
+
 #[no_mangle]
 pub unsafe extern "C"
-fn mtpng_header_set_size(p_header: PHeader,
-                         width: u32,
-                         height: u32)
+fn mtpng_encoder_options_new(pp_options: *mut PEncoderOptions)
 -> CResult
 {
     CResult::from(|| -> io::Result<()> {
-        if p_header.is_null() {
-            return Err(invalid_input("p_encoder must not be null"));
+        if pp_options.is_null() {
+            return Err(invalid_input("pp_options must not be null"));
         }
-        (*p_header).set_size(width, height)
+        if !(*pp_options).is_null() {
+            return Err(invalid_input("*pp_options must be null"))
+        }
+        *pp_options = Box::into_raw(Box::new(Options::new()));
+        Ok(())
     }())
 }
 
 #[no_mangle]
 pub unsafe extern "C"
-fn mtpng_header_set_color(p_header: PHeader,
-                                   color_type: c_int,
-                                   depth: u8)
+fn mtpng_encoder_options_release(pp_options: *mut PEncoderOptions)
 -> CResult
 {
     CResult::from(|| -> io::Result<()> {
-        if p_header.is_null() {
-            return Err(invalid_input("p_header must not be null"));
+        if pp_options.is_null() {
+            return Err(invalid_input("pp_header must not be null"));
         }
-        if color_type < 0 || color_type > u8::max_value() as c_int {
-            return Err(invalid_input("Invalid color type"));
+        if (*pp_options).is_null() {
+            return Err(invalid_input("*pp_header must not be null"));
         }
-        let color = ColorType::try_from(color_type as u8)?;
-        (*p_header).set_color(color, depth)
+        drop(Box::from_raw(*pp_options));
+        *pp_options = ptr::null_mut();
+        Ok(())
     }())
 }
 
 
-
 #[no_mangle]
 pub unsafe extern "C"
-fn mtpng_encoder_new(pp_encoder: *mut PEncoder,
-                     write_func: Option<CWriteFunc>,
-                     flush_func: Option<CFlushFunc>,
-                     user_data: *mut c_void,
-                     p_options: PEncoderOptions)
+fn mtpng_encoder_options_set_thread_pool(p_options: PEncoderOptions,
+                                         p_pool: PThreadPool)
 -> CResult
 {
     CResult::from(|| -> io::Result<()> {
-        if pp_encoder.is_null() {
-            return Err(invalid_input("pp_encoder must not be null"));
-        }
-        if !(*pp_encoder).is_null() {
-            return Err(invalid_input("*pp_encoder must be null"));
+        if p_options.is_null() {
+            return Err(invalid_input("p_options must not be null"));
         }
-        let writer = match (write_func, flush_func) {
-            (Some(wf), Some(ff)) => CWriter::new(wf, ff, user_data),
-            _ => return Err(invalid_input("write_func and flush_func must not be null"))
-        };
-        let default = Options::<'static>::new();
-        let options = if p_options.is_null() {
-            &default
-        } else {
-            &*p_options
-        };
-        let encoder = Encoder::new(writer, options);
-        *pp_encoder = Box::into_raw(Box::new(encoder));
-        Ok(())
+        (*p_options).set_thread_pool(&*p_pool)
     }())
 }
 
 #[no_mangle]
 pub unsafe extern "C"
-fn mtpng_encoder_release(pp_encoder: *mut PEncoder)
+fn mtpng_encoder_options_set_buffer_pool(p_options: PEncoderOptions,
+                                         p_pool: PBufferPool)
 -> CResult
 {
     CResult::from(|| -> io::Result<()> {
-        if pp_encoder.is_null() {
-            return Err(invalid_input("pp_encoder must not be null"))
+        if p_options.is_null() {
+            return Err(invalid_input("p_options must not be null"));
         }
-        if (*pp_encoder).is_null() {
-            return Err(invalid_input("*pp_encoder must not be null"))
+        if p_pool.is_null() {
+            return Err(invalid_input("p_pool must not be null"));
         }
-        drop(Box::from_raw(*pp_encoder));
-        *pp_encoder = ptr::null_mut();
-        Ok(())
+        (*p_options).set_buffer_pool(&*p_pool)
     }())
 }
 
-
 #[no_mangle]
 pub unsafe extern "C"
-fn mtpng_encoder_write_header(p_encoder: PEncoder,
-                              p_header: PHeader)
+fn mtpng_encoder_options_set_chunk_cache(p_options: PEncoderOptions,
+                                         p_cache: PChunkCache)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_options.is_null() {
+            return Err(invalid_input("p_options must not be null"));
+        }
+        if p_cache.is_null() {
+            return Err(invalid_input("p_cache must not be null"));
+        }
+        (*p_options).set_chunk_cache(&*p_cache)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_options_set_scheduler(p_options: PEncoderOptions,
+                                       p_scheduler: PScheduler)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_options.is_null() {
+            return Err(invalid_input("p_options must not be null"));
+        }
+        if p_scheduler.is_null() {
+            return Err(invalid_input("p_scheduler must not be null"));
+        }
+        (*p_options).set_scheduler(&*p_scheduler)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_options_set_priority(p_options: PEncoderOptions,
+                                      priority: u32)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_options.is_null() {
+            return Err(invalid_input("p_options must not be null"));
+        }
+        (*p_options).set_priority(priority)
+    }())
+}
+
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_options_set_filter(p_options: PEncoderOptions,
+                                    filter_mode: c_int)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_options.is_null() {
+            return Err(invalid_input("p_options must not be null"));
+        }
+        if filter_mode > u8::max_value() as c_int {
+            return Err(invalid_input("Invalid filter mode"));
+        }
+        let mode = if filter_mode < 0 {
+            Adaptive
+        } else {
+            Fixed(Filter::try_from(filter_mode as u8)?)
+        };
+        (*p_options).set_filter_mode(mode)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_options_set_strategy(p_options: PEncoderOptions,
+                                      strategy_mode: c_int)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_options.is_null() {
+            return Err(invalid_input("p_options must not be null"));
+        }
+        if strategy_mode > u8::max_value() as c_int {
+            return Err(invalid_input("Invalid strategy mode"));
+        }
+        let mode = if strategy_mode < 0 {
+            Adaptive
+        } else {
+            Fixed(Strategy::try_from(strategy_mode as u8)?)
+        };
+        (*p_options).set_strategy_mode(mode)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_options_set_backend(p_options: PEncoderOptions,
+                                     backend: c_int)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_options.is_null() {
+            return Err(invalid_input("p_options must not be null"));
+        }
+        if backend < 0 || backend > u8::max_value() as c_int {
+            return Err(invalid_input("Invalid backend"));
+        }
+        (*p_options).set_backend(Backend::try_from(backend as u8)?)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_options_set_compression_level(p_options: PEncoderOptions,
+                                               compression_level: c_int)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_options.is_null() {
+            return Err(invalid_input("p_options must not be null"));
+        }
+        if compression_level < 0 || compression_level > 9 {
+            return Err(invalid_input("Invalid compression level"));
+        }
+        let level = CompressionLevel::try_from(compression_level as u8)?;
+        (*p_options).set_compression_level(level)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_options_set_chunk_size(p_options: PEncoderOptions,
+                                        chunk_size: size_t)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_options.is_null() {
+            return Err(invalid_input("p_encoder must not be null"));
+        }
+        let mode = if chunk_size == 0 {
+            Adaptive
+        } else {
+            Fixed(chunk_size)
+        };
+        (*p_options).set_chunk_size_mode(mode)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_options_set_memory_limit(p_options: PEncoderOptions,
+                                          memory_limit: size_t)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_options.is_null() {
+            return Err(invalid_input("p_options must not be null"));
+        }
+        (*p_options).set_memory_limit(memory_limit)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_options_set_stats(p_options: PEncoderOptions,
+                                   stats: bool)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_options.is_null() {
+            return Err(invalid_input("p_options must not be null"));
+        }
+        (*p_options).set_stats(stats)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_options_set_write_index(p_options: PEncoderOptions,
+                                         write_index: bool)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_options.is_null() {
+            return Err(invalid_input("p_options must not be null"));
+        }
+        (*p_options).set_write_index(write_index)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_options_set_quantize(p_options: PEncoderOptions,
+                                      quantize: bool)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_options.is_null() {
+            return Err(invalid_input("p_options must not be null"));
+        }
+        (*p_options).set_quantize(quantize)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_options_set_dither(p_options: PEncoderOptions,
+                                    dither: bool)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_options.is_null() {
+            return Err(invalid_input("p_options must not be null"));
+        }
+        (*p_options).set_dither(dither)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_options_set_reduce(p_options: PEncoderOptions,
+                                    reduce: bool)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_options.is_null() {
+            return Err(invalid_input("p_options must not be null"));
+        }
+        (*p_options).set_reduce(reduce)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_options_set_search(p_options: PEncoderOptions,
+                                    search: bool)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_options.is_null() {
+            return Err(invalid_input("p_options must not be null"));
+        }
+        (*p_options).set_search(search)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_options_set_chunk_affinity(p_options: PEncoderOptions,
+                                            chunk_affinity: bool)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_options.is_null() {
+            return Err(invalid_input("p_options must not be null"));
+        }
+        (*p_options).set_chunk_affinity(chunk_affinity)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_options_set_streaming(p_options: PEncoderOptions,
+                                       streaming: bool)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_options.is_null() {
+            return Err(invalid_input("p_options must not be null"));
+        }
+        (*p_options).set_streaming(streaming)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_options_set_flush_interval(p_options: PEncoderOptions,
+                                            flush_interval: size_t)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_options.is_null() {
+            return Err(invalid_input("p_options must not be null"));
+        }
+        (*p_options).set_flush_interval(flush_interval)
+    }())
+}
+
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_header_new(pp_header: *mut PHeader)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if pp_header.is_null() {
+            return Err(invalid_input("pp_header must not be null"));
+        }
+        if !(*pp_header).is_null() {
+            return Err(invalid_input("*pp_header must be null"))
+        }
+        *pp_header = Box::into_raw(Box::new(Header::new()));
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_header_release(pp_header: *mut PHeader)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if pp_header.is_null() {
+            return Err(invalid_input("pp_header must not be null"));
+        }
+        if (*pp_header).is_null() {
+            return Err(invalid_input("*pp_header must not be null"));
+        }
+        drop(Box::from_raw(*pp_header));
+        *pp_header = ptr::null_mut();
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_header_set_size(p_header: PHeader,
+                         width: u32,
+                         height: u32)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_header.is_null() {
+            return Err(invalid_input("p_encoder must not be null"));
+        }
+        (*p_header).set_size(width, height)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_header_set_color(p_header: PHeader,
+                                   color_type: c_int,
+                                   depth: u8)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_header.is_null() {
+            return Err(invalid_input("p_header must not be null"));
+        }
+        if color_type < 0 || color_type > u8::max_value() as c_int {
+            return Err(invalid_input("Invalid color type"));
+        }
+        let color = ColorType::try_from(color_type as u8)?;
+        (*p_header).set_color(color, depth)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_header_set_interlace_method(p_header: PHeader,
+                                     interlace_method: c_int)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_header.is_null() {
+            return Err(invalid_input("p_header must not be null"));
+        }
+        if interlace_method < 0 || interlace_method > u8::max_value() as c_int {
+            return Err(invalid_input("Invalid interlace method"));
+        }
+        let method = InterlaceMethod::try_from(interlace_method as u8)?;
+        (*p_header).set_interlace_method(method)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_header_set_source_format(p_header: PHeader,
+                                  source_format: c_int)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_header.is_null() {
+            return Err(invalid_input("p_header must not be null"));
+        }
+        if source_format < 0 || source_format > u8::max_value() as c_int {
+            return Err(invalid_input("Invalid source format"));
+        }
+        let format = SourceFormat::try_from(source_format as u8)?;
+        (*p_header).set_source_format(format)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_header_get_size(p_header: PHeader,
+                         p_width: *mut u32,
+                         p_height: *mut u32)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_header.is_null() {
+            return Err(invalid_input("p_header must not be null"));
+        }
+        if p_width.is_null() || p_height.is_null() {
+            return Err(invalid_input("p_width and p_height must not be null"));
+        }
+        *p_width = (*p_header).width();
+        *p_height = (*p_header).height();
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_header_get_color(p_header: PHeader,
+                          p_color_type: *mut c_int,
+                          p_depth: *mut u8)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_header.is_null() {
+            return Err(invalid_input("p_header must not be null"));
+        }
+        if p_color_type.is_null() || p_depth.is_null() {
+            return Err(invalid_input("p_color_type and p_depth must not be null"));
+        }
+        *p_color_type = (*p_header).color_type() as c_int;
+        *p_depth = (*p_header).depth();
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_header_get_interlace_method(p_header: PHeader,
+                                     p_interlace_method: *mut c_int)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_header.is_null() {
+            return Err(invalid_input("p_header must not be null"));
+        }
+        if p_interlace_method.is_null() {
+            return Err(invalid_input("p_interlace_method must not be null"));
+        }
+        *p_interlace_method = (*p_header).interlace_method() as c_int;
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_header_get_stride(p_header: PHeader,
+                           p_stride: *mut size_t)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_header.is_null() {
+            return Err(invalid_input("p_header must not be null"));
+        }
+        if p_stride.is_null() {
+            return Err(invalid_input("p_stride must not be null"));
+        }
+        *p_stride = (*p_header).source_stride();
+        Ok(())
+    }())
+}
+
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_frame_control_new(pp_frame: *mut PFrameControl)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if pp_frame.is_null() {
+            return Err(invalid_input("pp_frame must not be null"));
+        }
+        if !(*pp_frame).is_null() {
+            return Err(invalid_input("*pp_frame must be null"))
+        }
+        *pp_frame = Box::into_raw(Box::new(FrameControl::new()));
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_frame_control_release(pp_frame: *mut PFrameControl)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if pp_frame.is_null() {
+            return Err(invalid_input("pp_frame must not be null"));
+        }
+        if (*pp_frame).is_null() {
+            return Err(invalid_input("*pp_frame must not be null"));
+        }
+        drop(Box::from_raw(*pp_frame));
+        *pp_frame = ptr::null_mut();
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_frame_control_set_size(p_frame: PFrameControl,
+                                width: u32,
+                                height: u32)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_frame.is_null() {
+            return Err(invalid_input("p_frame must not be null"));
+        }
+        (*p_frame).set_size(width, height)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_frame_control_set_offset(p_frame: PFrameControl,
+                                  x_offset: u32,
+                                  y_offset: u32)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_frame.is_null() {
+            return Err(invalid_input("p_frame must not be null"));
+        }
+        (*p_frame).set_offset(x_offset, y_offset)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_frame_control_set_delay(p_frame: PFrameControl,
+                                 delay_num: u16,
+                                 delay_den: u16)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_frame.is_null() {
+            return Err(invalid_input("p_frame must not be null"));
+        }
+        (*p_frame).set_delay(delay_num, delay_den)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_frame_control_set_dispose_op(p_frame: PFrameControl,
+                                      dispose_op: c_int)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_frame.is_null() {
+            return Err(invalid_input("p_frame must not be null"));
+        }
+        if dispose_op < 0 || dispose_op > u8::max_value() as c_int {
+            return Err(invalid_input("Invalid dispose op"));
+        }
+        (*p_frame).set_dispose_op(DisposeOp::try_from(dispose_op as u8)?)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_frame_control_set_blend_op(p_frame: PFrameControl,
+                                    blend_op: c_int)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_frame.is_null() {
+            return Err(invalid_input("p_frame must not be null"));
+        }
+        if blend_op < 0 || blend_op > u8::max_value() as c_int {
+            return Err(invalid_input("Invalid blend op"));
+        }
+        (*p_frame).set_blend_op(BlendOp::try_from(blend_op as u8)?)
+    }())
+}
+
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_new(pp_encoder: *mut PEncoder,
+                     write_func: Option<CWriteFunc>,
+                     flush_func: Option<CFlushFunc>,
+                     user_data: *mut c_void,
+                     p_options: PEncoderOptions)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if pp_encoder.is_null() {
+            return Err(invalid_input("pp_encoder must not be null"));
+        }
+        if !(*pp_encoder).is_null() {
+            return Err(invalid_input("*pp_encoder must be null"));
+        }
+        let writer = match (write_func, flush_func) {
+            (Some(wf), Some(ff)) => CWriter::new(wf, ff, user_data),
+            _ => return Err(invalid_input("write_func and flush_func must not be null"))
+        };
+        let default = Options::<'static>::new();
+        let options = if p_options.is_null() {
+            &default
+        } else {
+            &*p_options
+        };
+        let encoder = Encoder::new(writer, options);
+        *pp_encoder = Box::into_raw(Box::new(encoder));
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_new_polled(pp_encoder: *mut PEncoder,
+                            p_output: POutput,
+                            p_options: PEncoderOptions)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if pp_encoder.is_null() {
+            return Err(invalid_input("pp_encoder must not be null"));
+        }
+        if !(*pp_encoder).is_null() {
+            return Err(invalid_input("*pp_encoder must be null"));
+        }
+        if p_output.is_null() {
+            return Err(invalid_input("p_output must not be null"));
+        }
+        let writer = CWriter::Polled(Arc::clone(&*p_output));
+        let default = Options::<'static>::new();
+        let options = if p_options.is_null() {
+            &default
+        } else {
+            &*p_options
+        };
+        let encoder = Encoder::new(writer, options);
+        *pp_encoder = Box::into_raw(Box::new(encoder));
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_release(pp_encoder: *mut PEncoder)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if pp_encoder.is_null() {
+            return Err(invalid_input("pp_encoder must not be null"))
+        }
+        if (*pp_encoder).is_null() {
+            return Err(invalid_input("*pp_encoder must not be null"))
+        }
+        (**pp_encoder).wait_for_jobs();
+        drop(Box::from_raw(*pp_encoder));
+        *pp_encoder = ptr::null_mut();
+        Ok(())
+    }())
+}
+
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_write_header(p_encoder: PEncoder,
+                              p_header: PHeader)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_encoder.is_null() {
+            return Err(invalid_input("p_encoder must not be null"));
+        }
+        if p_header.is_null() {
+            return Err(invalid_input("p_header must not be null"));
+        }
+        (*p_encoder).write_header(&*p_header)?;
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_write_palette(p_encoder: PEncoder,
+                               p_bytes: *const u8,
+                               len: size_t)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_encoder.is_null() {
+            return Err(invalid_input("p_encoder must not be null"));
+        }
+        if p_bytes.is_null() {
+            return Err(invalid_input("p_bytes must not be null"));
+        }
+        let slice = ::std::slice::from_raw_parts(p_bytes, len);
+        (*p_encoder).write_palette(slice)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_write_transparency(p_encoder: PEncoder,
+                                    p_bytes: *const u8,
+                                    len: size_t)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_encoder.is_null() {
+            return Err(invalid_input("p_encoder must not be null"));
+        }
+        if p_bytes.is_null() {
+            return Err(invalid_input("p_bytes must not be null"));
+        }
+        let slice = ::std::slice::from_raw_parts(p_bytes, len);
+        (*p_encoder).write_transparency(slice)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_write_chunk(p_encoder: PEncoder,
+                             p_tag: *const c_char,
+                             p_bytes: *const u8,
+                             len: size_t)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_encoder.is_null() {
+            return Err(invalid_input("p_encoder must not be null"));
+        }
+        if p_tag.is_null() {
+            return Err(invalid_input("p_tag must not be null"));
+        }
+        if p_bytes.is_null() {
+            return Err(invalid_input("p_bytes must not be null"));
+        }
+        let tag = CStr::from_ptr(p_tag).to_bytes();
+        let slice = ::std::slice::from_raw_parts(p_bytes, len);
+        (*p_encoder).write_chunk(tag, slice)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_write_image_rows(p_encoder: PEncoder,
+                                  p_bytes: *const u8,
+                                  len: size_t)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_encoder.is_null() {
+            return Err(invalid_input("p_encoder must not be null"));
+        }
+        if p_bytes.is_null() {
+            return Err(invalid_input("p_bytes must not be null"));
+        }
+        let slice = ::std::slice::from_raw_parts(p_bytes, len);
+        (*p_encoder).write_image_rows(slice)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_write_image(p_encoder: PEncoder,
+                             p_bytes: *const u8,
+                             len: size_t,
+                             stride: size_t)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_encoder.is_null() {
+            return Err(invalid_input("p_encoder must not be null"));
+        }
+        if p_bytes.is_null() {
+            return Err(invalid_input("p_bytes must not be null"));
+        }
+        let image = Arc::new(CImage {
+            p_bytes,
+            len,
+        });
+        (*p_encoder).write_image_strided(image, stride)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_write_animation_control(p_encoder: PEncoder,
+                                         num_frames: u32,
+                                         num_plays: u32)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_encoder.is_null() {
+            return Err(invalid_input("p_encoder must not be null"));
+        }
+        (*p_encoder).write_animation_control(num_frames, num_plays)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encoder_write_frame_control(p_encoder: PEncoder,
+                                     p_frame: PFrameControl)
 -> CResult
 {
     CResult::from(|| -> io::Result<()> {
         if p_encoder.is_null() {
             return Err(invalid_input("p_encoder must not be null"));
         }
-        if p_header.is_null() {
-            return Err(invalid_input("p_header must not be null"));
+        if p_frame.is_null() {
+            return Err(invalid_input("p_frame must not be null"));
         }
-        (*p_encoder).write_header(&*p_header)?;
-        Ok(())
+        (*p_encoder).write_frame_control(&*p_frame)
     }())
 }
 
 #[no_mangle]
 pub unsafe extern "C"
-fn mtpng_encoder_write_palette(p_encoder: PEncoder,
-                               p_bytes: *const u8,
-                               len: size_t)
+fn mtpng_encoder_write_frame_diff(p_encoder: PEncoder,
+                                  p_frame: PFrameControl,
+                                  p_bytes: *const u8,
+                                  len: size_t)
 -> CResult
 {
     CResult::from(|| -> io::Result<()> {
         if p_encoder.is_null() {
             return Err(invalid_input("p_encoder must not be null"));
         }
+        if p_frame.is_null() {
+            return Err(invalid_input("p_frame must not be null"));
+        }
         if p_bytes.is_null() {
             return Err(invalid_input("p_bytes must not be null"));
         }
-        let slice = ::std::slice::from_raw_parts(p_bytes, len);
-        (*p_encoder).write_palette(slice)
+        let image = Arc::new(CImage {
+            p_bytes,
+            len,
+        });
+        (*p_encoder).write_frame_diff(&*p_frame, image)
     }())
 }
 
 #[no_mangle]
 pub unsafe extern "C"
-fn mtpng_encoder_write_transparency(p_encoder: PEncoder,
-                                    p_bytes: *const u8,
-                                    len: size_t)
+fn mtpng_encoder_finish(pp_encoder: *mut PEncoder)
 -> CResult
 {
     CResult::from(|| -> io::Result<()> {
-        if p_encoder.is_null() {
-            return Err(invalid_input("p_encoder must not be null"));
+        if pp_encoder.is_null() {
+            return Err(invalid_input("pp_encoder must not be null"));
         }
-        if p_bytes.is_null() {
-            return Err(invalid_input("p_bytes must not be null"));
+        if (*pp_encoder).is_null() {
+            return Err(invalid_input("*pp_encoder must not be null"));
         }
-        let slice = ::std::slice::from_raw_parts(p_bytes, len);
-        (*p_encoder).write_transparency(slice)
+
+        // Take ownership back from C...
+        let b_encoder = Box::from_raw(*pp_encoder);
+        *pp_encoder = ptr::null_mut();
+
+        // And finish it out.
+        b_encoder.finish()?;
+        Ok(())
     }())
 }
 
 #[no_mangle]
 pub unsafe extern "C"
-fn mtpng_encoder_write_chunk(p_encoder: PEncoder,
-                             p_tag: *const c_char,
-                             p_bytes: *const u8,
-                             len: size_t)
+fn mtpng_encoder_flush(p_encoder: PEncoder)
 -> CResult
 {
     CResult::from(|| -> io::Result<()> {
         if p_encoder.is_null() {
             return Err(invalid_input("p_encoder must not be null"));
         }
-        if p_tag.is_null() {
-            return Err(invalid_input("p_tag must not be null"));
-        }
-        if p_bytes.is_null() {
-            return Err(invalid_input("p_bytes must not be null"));
-        }
-        let tag = CStr::from_ptr(p_tag).to_bytes();
-        let slice = ::std::slice::from_raw_parts(p_bytes, len);
-        (*p_encoder).write_chunk(tag, slice)
+        (*p_encoder).flush()
     }())
 }
 
 #[no_mangle]
 pub unsafe extern "C"
-fn mtpng_encoder_write_image_rows(p_encoder: PEncoder,
-                                  p_bytes: *const u8,
-                                  len: size_t)
+fn mtpng_encoder_get_stats(p_encoder: PEncoder,
+                           p_stats: *mut CStats)
 -> CResult
 {
     CResult::from(|| -> io::Result<()> {
         if p_encoder.is_null() {
             return Err(invalid_input("p_encoder must not be null"));
         }
-        if p_bytes.is_null() {
-            return Err(invalid_input("p_bytes must not be null"));
+        if p_stats.is_null() {
+            return Err(invalid_input("p_stats must not be null"));
         }
-        let slice = ::std::slice::from_raw_parts(p_bytes, len);
-        (*p_encoder).write_image_rows(slice)
+        let stats = match (*p_encoder).stats() {
+            Some(stats) => stats,
+            None => return Err(invalid_input("Stats not enabled in options")),
+        };
+        *p_stats = CStats {
+            elapsed_us: micros(stats.elapsed()),
+            filter_us: micros(stats.filter_time()),
+            deflate_us: micros(stats.deflate_time()),
+            output_us: micros(stats.output_time()),
+            blocked_us: micros(stats.blocked_time()),
+            idle_us: micros(stats.idle_time()),
+            bytes_in: stats.bytes_in(),
+            bytes_filtered: stats.bytes_filtered(),
+            bytes_out: stats.bytes_out(),
+            filter_counts: stats.filter_counts(),
+            chunks: stats.chunks().len() as u64,
+        };
+        Ok(())
     }())
 }
 
 #[no_mangle]
 pub unsafe extern "C"
-fn mtpng_encoder_finish(pp_encoder: *mut PEncoder)
+fn mtpng_encoder_finish_async(pp_encoder: *mut PEncoder,
+                              done_func: Option<CDoneFunc>,
+                              user_data: *mut c_void)
 -> CResult
 {
     CResult::from(|| -> io::Result<()> {
@@ -574,13 +1677,380 @@ fn mtpng_encoder_finish(pp_encoder: *mut PEncoder)
         if (*pp_encoder).is_null() {
             return Err(invalid_input("*pp_encoder must not be null"));
         }
+        let done = match done_func {
+            Some(df) => CDone {
+                done_func: df,
+                user_data: user_data,
+            },
+            None => return Err(invalid_input("done_func must not be null")),
+        };
 
         // Take ownership back from C...
         let b_encoder = Box::from_raw(*pp_encoder);
         *pp_encoder = ptr::null_mut();
 
-        // And finish it out.
-        b_encoder.finish()?;
+        // And let the thread pool finish it out.
+        b_encoder.finish_async(move |result| {
+            done.call(CResult::from(result.map(|_| ())));
+        });
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_encode_batch(p_images: *const CBatchImage,
+                      count: size_t,
+                      p_options: PEncoderOptions,
+                      done_func: Option<CBatchFunc>,
+                      user_data: *mut c_void)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_images.is_null() && count > 0 {
+            return Err(invalid_input("p_images must not be null"));
+        }
+        let done = match done_func {
+            Some(df) => df,
+            None => return Err(invalid_input("done_func must not be null")),
+        };
+        let images = if count > 0 {
+            ::std::slice::from_raw_parts(p_images, count)
+        } else {
+            &[]
+        };
+        let copy = |p_bytes: *const u8, len: size_t| {
+            if p_bytes.is_null() {
+                None
+            } else {
+                Some(::std::slice::from_raw_parts(p_bytes, len).to_vec())
+            }
+        };
+        let mut batch = Vec::with_capacity(images.len());
+        for image in images {
+            if image.p_header.is_null() || image.p_bytes.is_null() {
+                return Err(invalid_input("p_header and p_bytes must not be null"));
+            }
+            batch.push(BatchImage {
+                header: *image.p_header,
+                image: Arc::new(CImage {
+                    p_bytes: image.p_bytes,
+                    len: image.len,
+                }),
+                row_stride: image.stride,
+                palette: copy(image.p_palette, image.palette_len),
+                transparency: copy(image.p_transparency, image.transparency_len),
+            });
+        }
+
+        let default = Options::<'static>::new();
+        let options = if p_options.is_null() {
+            &default
+        } else {
+            &*p_options
+        };
+        let mut failed = false;
+        encode_batch(&batch, options, |index, result| {
+            match result {
+                Ok(data) => done(user_data, index, CResult::Ok, data.as_ptr(), data.len()),
+                Err(_) => {
+                    failed = true;
+                    done(user_data, index, CResult::Err, ptr::null(), 0);
+                },
+            }
+        });
+        if failed {
+            Err(other("Failed to encode an image in the batch"))
+        } else {
+            Ok(())
+        }
+    }())
+}
+
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_decoder_options_new(pp_options: *mut PDecoderOptions)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if pp_options.is_null() {
+            return Err(invalid_input("pp_options must not be null"));
+        }
+        if !(*pp_options).is_null() {
+            return Err(invalid_input("*pp_options must be null"))
+        }
+        *pp_options = Box::into_raw(Box::new(decoder::Options::new()));
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_decoder_options_release(pp_options: *mut PDecoderOptions)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if pp_options.is_null() {
+            return Err(invalid_input("pp_options must not be null"));
+        }
+        if (*pp_options).is_null() {
+            return Err(invalid_input("*pp_options must not be null"));
+        }
+        drop(Box::from_raw(*pp_options));
+        *pp_options = ptr::null_mut();
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_decoder_options_set_thread_pool(p_options: PDecoderOptions,
+                                         p_pool: PThreadPool)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_options.is_null() {
+            return Err(invalid_input("p_options must not be null"));
+        }
+        if p_pool.is_null() {
+            return Err(invalid_input("p_pool must not be null"));
+        }
+        (*p_options).set_thread_pool(&*p_pool)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_decoder_options_set_output_format(p_options: PDecoderOptions,
+                                           output_format: c_int)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_options.is_null() {
+            return Err(invalid_input("p_options must not be null"));
+        }
+        if output_format < 0 || output_format > u8::max_value() as c_int {
+            return Err(invalid_input("Invalid output format"));
+        }
+        let format = SourceFormat::try_from(output_format as u8)?;
+        (*p_options).set_output_format(format)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_decoder_options_set_memory_limit(p_options: PDecoderOptions,
+                                          memory_limit: size_t)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_options.is_null() {
+            return Err(invalid_input("p_options must not be null"));
+        }
+        (*p_options).set_memory_limit(memory_limit)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_decoder_new(pp_decoder: *mut PDecoder,
+                     read_func: Option<CReadFunc>,
+                     user_data: *mut c_void,
+                     p_options: PDecoderOptions)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if pp_decoder.is_null() {
+            return Err(invalid_input("pp_decoder must not be null"));
+        }
+        if !(*pp_decoder).is_null() {
+            return Err(invalid_input("*pp_decoder must be null"));
+        }
+        let reader = match read_func {
+            Some(rf) => CReader::new(rf, user_data),
+            None => return Err(invalid_input("read_func must not be null")),
+        };
+        let default = decoder::Options::<'static>::new();
+        let options = if p_options.is_null() {
+            &default
+        } else {
+            &*p_options
+        };
+        let decoder = Decoder::new(reader, options);
+        *pp_decoder = Box::into_raw(Box::new(decoder));
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_decoder_release(pp_decoder: *mut PDecoder)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if pp_decoder.is_null() {
+            return Err(invalid_input("pp_decoder must not be null"))
+        }
+        if (*pp_decoder).is_null() {
+            return Err(invalid_input("*pp_decoder must not be null"))
+        }
+        drop(Box::from_raw(*pp_decoder));
+        *pp_decoder = ptr::null_mut();
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_decoder_read_header(p_decoder: PDecoder,
+                             p_header: PHeader)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_decoder.is_null() {
+            return Err(invalid_input("p_decoder must not be null"));
+        }
+        if p_header.is_null() {
+            return Err(invalid_input("p_header must not be null"));
+        }
+        *p_header = (*p_decoder).read_header()?;
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_decoder_get_palette(p_decoder: PDecoder,
+                             pp_bytes: *mut *const u8,
+                             p_len: *mut size_t)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_decoder.is_null() {
+            return Err(invalid_input("p_decoder must not be null"));
+        }
+        if pp_bytes.is_null() || p_len.is_null() {
+            return Err(invalid_input("pp_bytes and p_len must not be null"));
+        }
+        let palette = (*p_decoder).palette().unwrap_or(&[]);
+        *pp_bytes = palette.as_ptr();
+        *p_len = palette.len();
+        Ok(())
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_decoder_get_transparency(p_decoder: PDecoder,
+                                  pp_bytes: *mut *const u8,
+                                  p_len: *mut size_t)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_decoder.is_null() {
+            return Err(invalid_input("p_decoder must not be null"));
+        }
+        if pp_bytes.is_null() || p_len.is_null() {
+            return Err(invalid_input("pp_bytes and p_len must not be null"));
+        }
+        let transparency = (*p_decoder).transparency().unwrap_or(&[]);
+        *pp_bytes = transparency.as_ptr();
+        *p_len = transparency.len();
         Ok(())
     }())
 }
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_decoder_read_image(p_decoder: PDecoder,
+                            p_bytes: *mut u8,
+                            len: size_t)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_decoder.is_null() {
+            return Err(invalid_input("p_decoder must not be null"));
+        }
+        if p_bytes.is_null() {
+            return Err(invalid_input("p_bytes must not be null"));
+        }
+        let buf = ::std::slice::from_raw_parts_mut(p_bytes, len);
+        (*p_decoder).read_image_into(buf)
+    }())
+}
+
+#[no_mangle]
+pub unsafe extern "C"
+fn mtpng_decoder_read_rows(p_decoder: PDecoder,
+                           start_row: u32,
+                           end_row: u32,
+                           p_bytes: *mut u8,
+                           len: size_t)
+-> CResult
+{
+    CResult::from(|| -> io::Result<()> {
+        if p_decoder.is_null() {
+            return Err(invalid_input("p_decoder must not be null"));
+        }
+        if p_bytes.is_null() {
+            return Err(invalid_input("p_bytes must not be null"));
+        }
+        let buf = ::std::slice::from_raw_parts_mut(p_bytes, len);
+        (*p_decoder).read_rows_into(start_row, end_row, buf)
+    }())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{CIoVec, OutputQueue};
+
+    #[test]
+    fn poll_whole_chunks() {
+        let mut queue = OutputQueue::new();
+        queue.data.extend_from_slice(&[137, 80, 78, 71, 13, 10, 26, 10]);
+        for &len in &[13usize, 30, 0] {
+            queue.data.extend_from_slice(&[0, 0, 0, len as u8]);
+            queue.data.extend(vec![len as u8; len + 8]);
+        }
+        // Half of the next chunk's length, still being written.
+        queue.data.extend_from_slice(&[0, 0]);
+        let mut expected = queue.data.clone();
+
+        let mut storage = vec![vec![0u8; 40]; 4];
+        let mut poll = |queue: &mut OutputQueue| -> Vec<u8> {
+            let mut bufs: Vec<CIoVec> = storage.iter_mut().map(|buf| {
+                CIoVec {
+                    p_bytes: buf.as_mut_ptr(),
+                    len: buf.len(),
+                }
+            }).collect();
+            let count = queue.poll(&mut bufs);
+            let lens: Vec<usize> = bufs[.. count].iter().map(|buf| buf.len).collect();
+            let mut output = Vec::new();
+            for (buf, &len) in storage.iter().zip(&lens) {
+                output.extend_from_slice(&buf[.. len]);
+            }
+            output.extend(lens.iter().map(|&len| len as u8));
+            output
+        };
+
+        // The signature and first chunk fit together. The second
+        // doesn't fit after them, or in one buffer, so is split over
+        // two, with the empty third chunk after it.
+        let output = poll(&mut queue);
+        let (data, lens) = output.split_at(output.len() - 3);
+        assert_eq!(lens, &[33, 40, 14]);
+        assert_eq!(data, &expected[.. 87]);
+
+        // Nothing whole is left until the last chunk is written.
+        assert_eq!(poll(&mut queue), Vec::<u8>::new());
+        queue.data.extend_from_slice(&[0, 1, b'I', b'E', b'N', b'D', 9, 1, 2, 3, 4]);
+        expected.extend_from_slice(&[0, 1, b'I', b'E', b'N', b'D', 9, 1, 2, 3, 4]);
+        let output = poll(&mut queue);
+        let (data, lens) = output.split_at(output.len() - 1);
+        assert_eq!(lens, &[13]);
+        assert_eq!(data, &expected[87 ..]);
+        assert_eq!(queue.data.len(), 0);
+    }
+}
@@ -0,0 +1,177 @@
+//
+// mtpng - a multithreaded parallel PNG encoder in Rust
+// convert.rs - input pixel format conversion
+//
+// Copyright (c) 2018 Brion Vibber
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+use super::SourceFormat;
+
+//
+// Convert one row of input in the given source format to the packed
+// PNG layout. Called from the filter jobs, a row at a time, so the
+// loops are kept simple enough for the compiler to vectorize.
+//
+pub fn convert_row(format: SourceFormat, src: &[u8], dest: &mut [u8]) {
+    match format {
+        SourceFormat::Packed => dest.copy_from_slice(&src[.. dest.len()]),
+        SourceFormat::Bgra => {
+            for (out, pixel) in dest.chunks_mut(4).zip(src.chunks(4)) {
+                out[0] = pixel[2];
+                out[1] = pixel[1];
+                out[2] = pixel[0];
+                out[3] = pixel[3];
+            }
+        },
+        SourceFormat::Bgrx => {
+            for (out, pixel) in dest.chunks_mut(3).zip(src.chunks(4)) {
+                out[0] = pixel[2];
+                out[1] = pixel[1];
+                out[2] = pixel[0];
+            }
+        },
+        SourceFormat::PremultipliedRgba => {
+            for (out, pixel) in dest.chunks_mut(4).zip(src.chunks(4)) {
+                unpremultiply(out, pixel[0], pixel[1], pixel[2], pixel[3]);
+            }
+        },
+        SourceFormat::PremultipliedBgra => {
+            for (out, pixel) in dest.chunks_mut(4).zip(src.chunks(4)) {
+                unpremultiply(out, pixel[2], pixel[1], pixel[0], pixel[3]);
+            }
+        },
+        SourceFormat::NativeEndian16 => {
+            if cfg!(target_endian = "little") {
+                for (out, sample) in dest.chunks_mut(2).zip(src.chunks(2)) {
+                    out[0] = sample[1];
+                    out[1] = sample[0];
+                }
+            } else {
+                dest.copy_from_slice(&src[.. dest.len()]);
+            }
+        },
+    }
+}
+
+//
+// The reverse, for decoding: convert one packed PNG row into the
+// given layout.
+//
+pub fn convert_row_to(format: SourceFormat, src: &[u8], dest: &mut [u8]) {
+    match format {
+        SourceFormat::Packed => dest.copy_from_slice(&src[.. dest.len()]),
+        SourceFormat::Bgra => {
+            for (out, pixel) in dest.chunks_mut(4).zip(src.chunks(4)) {
+                out[0] = pixel[2];
+                out[1] = pixel[1];
+                out[2] = pixel[0];
+                out[3] = pixel[3];
+            }
+        },
+        SourceFormat::Bgrx => {
+            for (out, pixel) in dest.chunks_mut(4).zip(src.chunks(3)) {
+                out[0] = pixel[2];
+                out[1] = pixel[1];
+                out[2] = pixel[0];
+                out[3] = 255;
+            }
+        },
+        SourceFormat::PremultipliedRgba => {
+            for (out, pixel) in dest.chunks_mut(4).zip(src.chunks(4)) {
+                premultiply(out, pixel[0], pixel[1], pixel[2], pixel[3]);
+            }
+        },
+        SourceFormat::PremultipliedBgra => {
+            for (out, pixel) in dest.chunks_mut(4).zip(src.chunks(4)) {
+                premultiply(out, pixel[2], pixel[1], pixel[0], pixel[3]);
+            }
+        },
+        SourceFormat::NativeEndian16 => convert_row(format, src, dest),
+    }
+}
+
+#[inline(always)]
+fn premultiply(out: &mut [u8], r: u8, g: u8, b: u8, a: u8) {
+    let scale = |c: u8| -> u8 {
+        ((c as u32 * a as u32 + 127) / 255) as u8
+    };
+    out[0] = scale(r);
+    out[1] = scale(g);
+    out[2] = scale(b);
+    out[3] = a;
+}
+
+//
+// Divide the colors back out by alpha, rounding to nearest. Fully
+// transparent pixels come out as transparent black.
+//
+#[inline(always)]
+fn unpremultiply(out: &mut [u8], r: u8, g: u8, b: u8, a: u8) {
+    let scale = |c: u8| -> u8 {
+        match a {
+            0 => 0,
+            255 => c,
+            _ => {
+                let a = a as u32;
+                let c = (c as u32 * 255 + a / 2) / a;
+                if c > 255 { 255 } else { c as u8 }
+            }
+        }
+    };
+    out[0] = scale(r);
+    out[1] = scale(g);
+    out[2] = scale(b);
+    out[3] = a;
+}
+
+#[cfg(test)]
+mod tests {
+    use super::super::SourceFormat;
+    use super::{convert_row, convert_row_to};
+
+    #[test]
+    fn conversions_work() {
+        let convert = |format, src: &[u8], len| {
+            let mut dest = vec![0u8; len];
+            convert_row(format, src, &mut dest);
+            dest
+        };
+        let bgra = [1, 2, 3, 4, 5, 6, 7, 8];
+        assert_eq!(convert(SourceFormat::Bgra, &bgra, 8), vec![3, 2, 1, 4, 7, 6, 5, 8]);
+        assert_eq!(convert(SourceFormat::Bgrx, &bgra, 6), vec![3, 2, 1, 7, 6, 5]);
+
+        let premultiplied = [64, 128, 0, 128, 9, 9, 9, 0, 10, 20, 30, 255];
+        assert_eq!(convert(SourceFormat::PremultipliedRgba, &premultiplied, 12),
+                   vec![128, 255, 0, 128, 0, 0, 0, 0, 10, 20, 30, 255]);
+        assert_eq!(convert(SourceFormat::PremultipliedBgra, &premultiplied, 12),
+                   vec![0, 255, 128, 128, 0, 0, 0, 0, 30, 20, 10, 255]);
+
+        let samples = 0x1234u16.to_ne_bytes();
+        assert_eq!(convert(SourceFormat::NativeEndian16, &samples, 2), vec![0x12, 0x34]);
+
+        let rgba = [3, 2, 1, 4, 128, 255, 0, 128];
+        let mut out = [0u8; 8];
+        convert_row_to(SourceFormat::Bgrx, &rgba[.. 6], &mut out);
+        assert_eq!(out, [1, 2, 3, 255, 255, 128, 4, 255]);
+        convert_row_to(SourceFormat::PremultipliedRgba, &rgba, &mut out);
+        assert_eq!(out, [0, 0, 0, 4, 64, 128, 0, 128]);
+    }
+}
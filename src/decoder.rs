@@ -0,0 +1,1289 @@
+//
+// mtpng - a multithreaded parallel PNG encoder in Rust
+// decoder.rs - pipelined PNG decoder
+//
+// Copyright (c) 2018 Brion Vibber
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+use rayon::ThreadPool;
+
+use std::cmp;
+use std::collections::VecDeque;
+use std::io;
+use std::io::Read;
+use std::mem;
+use std::ops::Range;
+use std::panic;
+use std::panic::AssertUnwindSafe;
+use std::sync::{Arc, Mutex};
+use std::sync::mpsc;
+use std::sync::mpsc::{Sender, Receiver};
+
+use super::ColorType;
+use super::Header;
+use super::InterlaceMethod;
+use super::SourceFormat;
+
+use super::convert;
+use super::deflate;
+use super::deflate::Inflate;
+use super::filter;
+use super::index;
+use super::index::Index;
+use super::inflate;
+use super::interlace;
+use super::reader;
+use super::reader::Reader;
+
+use super::utils::*;
+
+//
+// Filtered rows are handed off to be unfiltered in blocks of about
+// this many bytes, so the workers can start while the rest is still
+// being inflated.
+//
+const BLOCK_SIZE: usize = 128 * 1024;
+
+//
+// Shortest run of compressed data worth inflating on its own when
+// splitting up a stream at its flush points.
+//
+const MIN_SEGMENT: usize = 32 * 1024;
+
+/// Options for a Decoder.
+#[derive(Copy, Clone)]
+pub struct Options<'a> {
+    thread_pool: Option<&'a ThreadPool>,
+    output_format: SourceFormat,
+    memory_limit: usize,
+}
+
+impl<'a> Options<'a> {
+    /// Create a new Options struct using default options:
+    /// * thread_pool: global default
+    /// * output_format: Packed
+    /// * memory_limit: none
+    pub fn new() -> Options<'a> {
+        Options {
+            thread_pool: None,
+            output_format: SourceFormat::Packed,
+            memory_limit: 0,
+        }
+    }
+
+    /// Use a custom Rayon ThreadPool instance instead of the global pool.
+    pub fn set_thread_pool(&mut self, thread_pool: &'a ThreadPool) -> IoResult {
+        self.thread_pool = Some(thread_pool);
+        Ok(())
+    }
+
+    /// Convert the pixels to the given layout instead of returning them
+    /// packed as stored in the file. As with encoding, the layout must
+    /// suit the image's color type and depth, or read_header() fails.
+    pub fn set_output_format(&mut self, output_format: SourceFormat) -> IoResult {
+        self.output_format = output_format;
+        Ok(())
+    }
+
+    /// Set a limit in bytes on the image data held while decoding: the
+    /// compressed stream, its inflated rows, and the decoded image. An
+    /// image whose header says it needs more is rejected by
+    /// read_header(), before anything is allocated for it.
+    ///
+    /// 0 means no limit, the default. Sizes that can't be represented
+    /// are always rejected.
+    pub fn set_memory_limit(&mut self, memory_limit: usize) -> IoResult {
+        self.memory_limit = memory_limit;
+        Ok(())
+    }
+}
+
+impl<'a> Default for Options<'a> {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+/// Parallel PNG decoder state.
+/// Takes an Options struct and a Read struct to take input from.
+///
+/// Only the default image of an animated PNG is decoded, and
+/// ancillary chunks other than the transparency are skipped.
+pub struct Decoder<'a, R: Read> {
+    reader: Reader<R>,
+    options: Options<'a>,
+
+    header: Option<Header>,
+    palette: Option<Vec<u8>>,
+    transparency: Option<Vec<u8>>,
+
+    // The first image data chunk, read while looking for
+    // the end of the chunks before it.
+    first_data: Option<Vec<u8>>,
+    read_image: bool,
+
+    // From the chunk after the image data, if written by mtpng
+    // with an index.
+    index: Option<Index>,
+}
+
+impl<'a, R: Read> Decoder<'a, R> {
+    /// Creates a new Decoder instance with the given Read input and options.
+    pub fn new(read: R, options: &Options<'a>) -> Decoder<'a, R> {
+        Decoder {
+            reader: Reader::new(read),
+            options: *options,
+
+            header: None,
+            palette: None,
+            transparency: None,
+
+            first_data: None,
+            read_image: false,
+
+            index: None,
+        }
+    }
+
+    /// Read the PNG signature and the chunks up to the image data,
+    /// returning the header. Its source format is the output format
+    /// from the options, and its source_stride() the length of each
+    /// row that read_image() will return.
+    pub fn read_header(&mut self) -> io::Result<Header> {
+        if self.header.is_some() {
+            return Err(invalid_input("Cannot read header a second time."));
+        }
+        self.reader.read_signature()?;
+        let (tag, data) = self.reader.read_chunk()?;
+        if &tag != b"IHDR" {
+            return Err(invalid_data("Missing IHDR chunk"));
+        }
+        let mut header = reader::parse_header(&data)?;
+
+        loop {
+            let (tag, data) = self.reader.read_chunk()?;
+            match &tag {
+                b"IDAT" => {
+                    self.first_data = Some(data);
+                    break;
+                },
+                b"PLTE" => self.palette = Some(data),
+                b"tRNS" => self.transparency = Some(data),
+                b"IEND" => return Err(invalid_data("Missing image data")),
+                _ if reader::is_critical(&tag) => return Err(invalid_data("Unknown critical chunk")),
+                _ => {},
+            }
+        }
+        if let (ColorType::IndexedColor, None) = (header.color_type, &self.palette) {
+            return Err(invalid_data("Missing palette"));
+        }
+
+        header.set_source_format(self.options.output_format)?;
+        header.check_source_format()?;
+        match image_memory(&header) {
+            None => return Err(invalid_data("Image too large")),
+            Some(len) if self.over_memory_limit(len) => {
+                return Err(invalid_data("Image exceeds memory limit"));
+            },
+            Some(_) => {},
+        }
+        self.header = Some(header);
+        Ok(header)
+    }
+
+    /// The PLTE chunk's palette entries, if any.
+    pub fn palette(&self) -> Option<&[u8]> {
+        self.palette.as_ref().map(|data| &data[..])
+    }
+
+    /// The tRNS chunk's transparency data, if any.
+    pub fn transparency(&self) -> Option<&[u8]> {
+        self.transparency.as_ref().map(|data| &data[..])
+    }
+
+    /// Decode the image data into a new buffer, with rows
+    /// header.source_stride() bytes apart.
+    pub fn read_image(&mut self) -> io::Result<Vec<u8>> {
+        let len = match self.header {
+            Some(header) => header.height as usize * header.source_stride(),
+            None => 0,
+        };
+        let mut data = vec![0u8; len];
+        self.read_image_into(&mut data)?;
+        Ok(data)
+    }
+
+    /// Decode the image data into the given buffer, which must hold at
+    /// least height rows of header.source_stride() bytes. Reads on to
+    /// the end of the file.
+    ///
+    /// Inflate runs on the calling thread, handing rows off to be
+    /// unfiltered one block after another on a worker thread, with any
+    /// conversion to the output format spread over the others. Files
+    /// written by mtpng, whose compressed chunks end on byte boundaries,
+    /// are inflated a chunk per worker thread instead.
+    pub fn read_image_into(&mut self, buf: &mut [u8]) -> IoResult {
+        let header = self.start_image()?;
+        if buf.len() < header.height as usize * header.source_stride() {
+            return Err(invalid_input("Buffer too small for image"));
+        }
+        let stream = Arc::new(self.read_stream()?);
+        self.decode(&header, stream, buf)
+    }
+
+    /// Decode rows start_row up to end_row into a new buffer, with rows
+    /// header.source_stride() bytes apart.
+    pub fn read_rows(&mut self, start_row: u32, end_row: u32) -> io::Result<Vec<u8>> {
+        let len = match self.header {
+            Some(header) => end_row.saturating_sub(start_row) as usize * header.source_stride(),
+            None => 0,
+        };
+        let mut data = vec![0u8; len];
+        self.read_rows_into(start_row, end_row, &mut data)?;
+        Ok(data)
+    }
+
+    /// Decode rows start_row up to end_row into the given buffer, which
+    /// must hold that many rows of header.source_stride() bytes. Reads
+    /// on to the end of the file, in place of read_image().
+    ///
+    /// Files written by mtpng with an index, from
+    /// encoder::Options::set_write_index(), only have the chunks
+    /// holding those rows decoded, and as many before as their
+    /// compressed data refers back to. Others, and interlaced images,
+    /// are decoded in full.
+    pub fn read_rows_into(&mut self, start_row: u32, end_row: u32, buf: &mut [u8]) -> IoResult {
+        let header = self.start_image()?;
+        if start_row >= end_row || end_row > header.height {
+            return Err(invalid_input("Invalid row range"));
+        }
+        let stride = header.source_stride();
+        let len = (end_row - start_row) as usize * stride;
+        if buf.len() < len {
+            return Err(invalid_input("Buffer too small for rows"));
+        }
+        let stream = Arc::new(self.read_stream()?);
+        let rows = start_row as usize .. end_row as usize;
+
+        let passes = image_passes(&header);
+        if let (InterlaceMethod::Standard, Some(plan)) = (header.interlace_method, self.index_plan(&passes, stream.len())) {
+            if let Some(data) = self.decode_rows(&header, &stream, &plan, rows.clone()) {
+                let packed = header.stride();
+                for (src, dest) in data.chunks(packed).zip(buf.chunks_mut(stride)) {
+                    convert::convert_row_to(header.source_format, src, dest);
+                }
+                return Ok(());
+            }
+        }
+
+        let mut image = vec![0u8; header.height as usize * stride];
+        self.decode(&header, stream, &mut image)?;
+        buf[.. len].copy_from_slice(&image[rows.start * stride .. rows.end * stride]);
+        Ok(())
+    }
+
+    /// Return the Read input for further use.
+    /// Consumes the decoder instance.
+    pub fn finish(self) -> R {
+        self.reader.finish()
+    }
+
+    fn start_image(&mut self) -> io::Result<Header> {
+        let header = match self.header {
+            Some(header) => header,
+            None => return Err(invalid_input("Must read header before image data.")),
+        };
+        if self.read_image {
+            return Err(invalid_input("Cannot read image data a second time."));
+        }
+        self.read_image = true;
+        Ok(header)
+    }
+
+    //
+    // Collect the compressed image data from its chunks, reading
+    // through to the end of the file.
+    //
+    fn read_stream(&mut self) -> io::Result<Vec<u8>> {
+        let mut stream = self.first_data.take().unwrap();
+        let mut in_data = true;
+        loop {
+            let (tag, data) = self.reader.read_chunk()?;
+            match &tag {
+                b"IDAT" if in_data => {
+                    if self.over_memory_limit(stream.len() + data.len()) {
+                        return Err(invalid_data("Image data exceeds memory limit"));
+                    }
+                    stream.extend_from_slice(&data)
+                },
+                b"IDAT" => return Err(invalid_data("Image data chunks must be consecutive")),
+                b"IEND" => return Ok(stream),
+                _ if reader::is_critical(&tag) => return Err(invalid_data("Unexpected critical chunk")),
+                _ => {
+                    // A broken index is only a missed shortcut.
+                    if &tag == index::TAG {
+                        self.index = Index::parse(&data).ok();
+                    }
+                    in_data = false;
+                },
+            }
+        }
+    }
+
+    fn decode(&self, header: &Header, stream: Arc<Vec<u8>>, buf: &mut [u8]) -> IoResult {
+        let passes = image_passes(header);
+        let filtered_len = passes.iter()
+                                 .map(|&(_, ref pass)| pass.height as usize * (pass.stride() + 1))
+                                 .sum();
+        let plan = self.index_plan(&passes, stream.len());
+
+        let mut sink = RowSink::new(*header, passes, self.options.thread_pool);
+        match self.parallel_inflate(Arc::clone(&stream), filtered_len, plan) {
+            Some(filtered) => sink.write(&filtered)?,
+            None => {
+                let mut inflater = Inflate::new()?;
+                if !inflater.write(&stream, |data| sink.write(data))? {
+                    return Err(invalid_data("Truncated image data"));
+                }
+            }
+        }
+        sink.finish(buf, self.options.thread_pool)
+    }
+
+    fn over_memory_limit(&self, len: usize) -> bool {
+        self.options.memory_limit > 0 && len > self.options.memory_limit
+    }
+
+    fn threads(&self) -> usize {
+        match self.options.thread_pool {
+            Some(pool) => pool.current_num_threads(),
+            None => ::rayon::current_num_threads(),
+        }
+    }
+
+    //
+    // The compressed chunks listed in the index, if there is one and it
+    // adds up: they must cover each pass's rows in turn, in the order
+    // they come in the stream.
+    //
+    fn index_plan(&self, passes: &[(usize, Header)], stream_len: usize) -> Option<Vec<IndexedChunk>> {
+        let index = self.index.as_ref()?;
+        if index.flags & index::STANDALONE_ROWS == 0 {
+            return None;
+        }
+        let mut chunks = Vec::<IndexedChunk>::with_capacity(index.entries.len());
+        let mut pass = 0;
+        let mut row = 0;
+        for entry in &index.entries {
+            if row == passes.get(pass)?.1.height as usize {
+                pass += 1;
+                row = 0;
+            }
+            let &(number, ref sub) = passes.get(pass)?;
+            let end_row = entry.end_row as usize;
+            if entry.pass as usize != number || entry.start_row as usize != row ||
+                end_row <= row || end_row > sub.height as usize {
+                return None;
+            }
+
+            // The first one's offset includes the zlib header.
+            let start = match chunks.last() {
+                None if entry.offset == 0 => 2,
+                Some(last) if entry.offset > last.start as u64 && entry.offset < stream_len as u64 => entry.offset as usize,
+                _ => return None,
+            };
+            chunks.push(IndexedChunk {
+                start,
+                len: (end_row - row) * (sub.stride() + 1),
+                adler32: entry.adler32,
+                start_row: row,
+                end_row,
+            });
+            row = end_row;
+        }
+        if pass + 1 != passes.len() || row != passes[pass].1.height as usize {
+            return None;
+        }
+        Some(chunks)
+    }
+
+    //
+    // Try inflating the stream's segments in parallel: at the chunks
+    // from the index if there is one, or else split where it was sync
+    // flushed. Returns None if there's nothing to split or it didn't
+    // check out, eg because the flush marker bytes turned up by
+    // coincidence, in which case it's inflated as a single stream.
+    //
+    fn parallel_inflate(&self, stream: Arc<Vec<u8>>, filtered_len: usize, plan: Option<Vec<IndexedChunk>>)
+        -> Option<Vec<u8>>
+    {
+        if self.threads() < 2 || !is_zlib_header(&stream) {
+            return None;
+        }
+        let starts = match plan {
+            Some(ref chunks) => chunks.iter().map(|chunk| chunk.start).collect(),
+            None => segment_starts(&stream),
+        };
+        if starts.len() < 2 {
+            return None;
+        }
+
+        // No segment inflates to more than the whole image, or its
+        // chunk's share of it with an index.
+        let ranges = starts.iter().enumerate().map(|(i, &start)| {
+            let end = starts.get(i + 1).cloned().unwrap_or(stream.len());
+            let limit = plan.as_ref().map(|chunks| chunks[i].len).unwrap_or(filtered_len);
+            (start, end, i > 0, limit)
+        }).collect();
+        let mut jobs = SegmentJobs::new(&stream, ranges, self.options.thread_pool);
+        for _ in 0 .. self.threads() {
+            jobs.spawn_next();
+        }
+
+        // Resolve each segment's window once the ones before it are in.
+        let mut segments: Vec<Option<inflate::Segment>> = starts.iter().map(|_| None).collect();
+        let mut output = Vec::<u8>::with_capacity(filtered_len);
+        let mut next = 0;
+        let mut trailer = None;
+        while next < starts.len() {
+            let (i, result) = jobs.recv()?;
+            segments[i] = Some(result.ok()?);
+            while next < starts.len() {
+                let segment = match segments[next].take() {
+                    Some(segment) => segment,
+                    None => break,
+                };
+                if segment.is_final != (next == starts.len() - 1) {
+                    return None;
+                }
+                if segment.is_final {
+                    trailer = Some(starts[next] + segment.end);
+                }
+                let chunk_start = output.len();
+                inflate::resolve(&segment.data, &mut output).ok()?;
+                if output.len() > filtered_len {
+                    return None;
+                }
+                if let Some(ref chunks) = plan {
+                    let chunk = &chunks[next];
+                    if output.len() - chunk_start != chunk.len ||
+                        deflate::adler32(deflate::adler32_initial(), &output[chunk_start ..]) != chunk.adler32 {
+                        return None;
+                    }
+                }
+                next += 1;
+
+                // Keep the segments waiting to be resolved down to
+                // about one per thread.
+                jobs.spawn_next();
+            }
+        }
+
+        let trailer = trailer?;
+        if output.len() != filtered_len || trailer + 4 > stream.len() {
+            return None;
+        }
+        let adler32 = deflate::adler32(deflate::adler32_initial(), &output);
+        if adler32 != read_be32(&stream[trailer .. trailer + 4]) {
+            return None;
+        }
+        Some(output)
+    }
+
+    //
+    // Decode just the given rows of a non-interlaced image, from the
+    // chunks in the index holding them, returning them packed.
+    //
+    // Their compressed data may copy from the 32 KiB of filtered data
+    // before them, so inflate the chunks before as well, one at a time
+    // until that's all filled in. The first row of each chunk doesn't
+    // depend on the row above, so unfiltering starts there.
+    //
+    // Returns None if it didn't check out, so the whole image can be
+    // decoded to report the error properly.
+    //
+    fn decode_rows(&self, header: &Header, stream: &Arc<Vec<u8>>, chunks: &[IndexedChunk], rows: Range<usize>)
+        -> Option<Vec<u8>>
+    {
+        let first = chunks.iter().position(|chunk| chunk.end_row > rows.start)?;
+        let last = chunks.iter().rposition(|chunk| chunk.start_row < rows.end)?;
+        let range = |i: usize| {
+            let end = chunks.get(i + 1).map(|chunk| chunk.start).unwrap_or(stream.len());
+            (chunks[i].start, end, i > 0, chunks[i].len)
+        };
+
+        let mut jobs = SegmentJobs::new(stream, (first ..= last).map(&range).collect(),
+                                        self.options.thread_pool);
+        for _ in 0 .. self.threads() {
+            jobs.spawn_next();
+        }
+        let mut segments: Vec<Option<inflate::Segment>> = (first ..= last).map(|_| None).collect();
+        for _ in first ..= last {
+            let (i, result) = jobs.recv()?;
+            segments[i] = Some(result.ok()?);
+            jobs.spawn_next();
+        }
+        let mut segments: VecDeque<inflate::Segment> = segments.into_iter().collect::<Option<_>>()?;
+
+        // Fill in what can be from the chunks so far, and go back
+        // another if any of the ones needed is still missing bytes.
+        let mut start = first;
+        let symbols = loop {
+            let mut symbols = Vec::<u16>::new();
+            let mut needed = 0;
+            for (i, segment) in segments.iter().enumerate() {
+                if start + i == first {
+                    needed = symbols.len();
+                }
+                inflate::resolve_partial(&segment.data, &mut symbols);
+            }
+            if symbols[needed ..].iter().all(|&symbol| symbol != inflate::UNKNOWN) {
+                symbols.drain(.. needed);
+                break symbols;
+            }
+            if start == 0 {
+                return None;
+            }
+            start -= 1;
+            let (begin, end, has_window, limit) = range(start);
+            segments.push_front(inflate::inflate_segment(&stream[begin .. end], has_window, limit).ok()?);
+        };
+
+        let filtered: Vec<u8> = symbols.iter().map(|&symbol| symbol as u8).collect();
+        let mut offset = 0;
+        for chunk in &chunks[first ..= last] {
+            let data = filtered.get(offset .. offset + chunk.len)?;
+            if deflate::adler32(deflate::adler32_initial(), data) != chunk.adler32 {
+                return None;
+            }
+            offset += chunk.len;
+        }
+        if offset != filtered.len() {
+            return None;
+        }
+
+        // Unfilter from the start of the first chunk, keeping the rows asked for.
+        let stride = header.stride();
+        let bpp = header.bytes_per_pixel();
+        let first_row = chunks[first].start_row;
+        if first_row > 0 && filtered[0] > 1 {
+            return None;
+        }
+        let mut prev = vec![0u8; stride];
+        let mut row = vec![0u8; stride];
+        let mut data = Vec::with_capacity(rows.len() * stride);
+        for (y, src) in (first_row ..).zip(filtered.chunks(stride + 1)) {
+            if y >= rows.end {
+                break;
+            }
+            filter::unfilter(src[0], bpp, &prev, &src[1 ..], &mut row).ok()?;
+            if y >= rows.start {
+                data.extend_from_slice(&row);
+            }
+            mem::swap(&mut prev, &mut row);
+        }
+        Some(data)
+    }
+}
+
+//
+// Ranges of the stream to inflate on the thread pool, all but the
+// first without their window, each limited to the filtered bytes
+// expected of it. They're started in order as the caller asks, so
+// it can keep how many are in flight or waiting on it in check.
+//
+struct SegmentJobs<'a> {
+    stream: Arc<Vec<u8>>,
+    ranges: Vec<(usize, usize, bool, usize)>,
+    spawned: usize,
+    pool: Option<&'a ThreadPool>,
+    tx: Sender<(usize, io::Result<inflate::Segment>)>,
+    rx: Receiver<(usize, io::Result<inflate::Segment>)>,
+}
+
+impl<'a> SegmentJobs<'a> {
+    fn new(stream: &Arc<Vec<u8>>, ranges: Vec<(usize, usize, bool, usize)>,
+           pool: Option<&'a ThreadPool>) -> SegmentJobs<'a>
+    {
+        let (tx, rx) = mpsc::channel();
+        SegmentJobs {
+            stream: Arc::clone(stream),
+            ranges,
+            spawned: 0,
+            pool,
+            tx,
+            rx,
+        }
+    }
+
+    fn spawn_next(&mut self) {
+        let i = self.spawned;
+        let (start, end, has_window, limit) = match self.ranges.get(i) {
+            Some(&range) => range,
+            None => return,
+        };
+        self.spawned += 1;
+        let stream = Arc::clone(&self.stream);
+        let tx = self.tx.clone();
+        spawn(self.pool, move || {
+            // The channel is kept open for the next job, so a panic
+            // has to be sent back to be noticed.
+            let result = panic::catch_unwind(AssertUnwindSafe(|| {
+                inflate::inflate_segment(&stream[start .. end], has_window, limit)
+            })).unwrap_or_else(|_| Err(other("Inflate job failed")));
+            let _ = tx.send((i, result));
+        });
+    }
+
+    fn recv(&self) -> Option<(usize, io::Result<inflate::Segment>)> {
+        self.rx.recv().ok()
+    }
+}
+
+//
+// A compressed chunk from the index: where it starts in the stream,
+// and how much filtered data it holds, of which rows of its pass.
+//
+struct IndexedChunk {
+    start: usize,
+    len: usize,
+    adler32: u32,
+    start_row: usize,
+    end_row: usize,
+}
+
+//
+// Deflate data with a 2-byte zlib header and no preset dictionary.
+// https://tools.ietf.org/html/rfc1950
+//
+fn is_zlib_header(stream: &[u8]) -> bool {
+    stream.len() > 2 &&
+        stream[0] & 0x0f == 8 &&
+        stream[0] >> 4 <= 7 &&
+        ((stream[0] as u32) << 8 | stream[1] as u32) % 31 == 0 &&
+        stream[1] & 0x20 == 0
+}
+
+//
+// Bytes of inflated rows and decoded image held to decode an image,
+// or None if that's more than fits in a usize, as it can be with a
+// corrupt or hostile header.
+//
+fn image_memory(header: &Header) -> Option<usize> {
+    let width = header.width as usize;
+    let bits_per_pixel = header.color_type.channels() * header.depth as usize;
+    bits_per_pixel.checked_mul(width)?;
+    if let SourceFormat::Bgrx = header.source_format {
+        width.checked_mul(4)?;
+    }
+
+    // Once the row lengths are known to fit, so do the passes'.
+    let filtered = image_passes(header).iter().try_fold(0usize, |sum, &(_, ref pass)| {
+        (pass.stride() + 1).checked_mul(pass.height as usize)
+                           .and_then(|len| sum.checked_add(len))
+    })?;
+    let image = header.source_stride().checked_mul(header.height as usize)?;
+
+    // Interlaced images are put back together packed before converting.
+    let packed = match (header.interlace_method, header.source_format) {
+        (InterlaceMethod::Adam7, SourceFormat::Packed) => 0,
+        (InterlaceMethod::Adam7, _) => header.stride().checked_mul(header.height as usize)?,
+        _ => 0,
+    };
+    image.checked_add(filtered)?.checked_add(packed)
+}
+
+//
+// Offsets to inflate separately from: just after the zlib header, and
+// after each empty stored block left by a sync flush at least a segment
+// on. Each block starts on a byte boundary after one of those.
+//
+fn segment_starts(stream: &[u8]) -> Vec<usize> {
+    let mut starts = vec![2];
+    let mut i = 2 + MIN_SEGMENT;
+    while i + 4 < stream.len() {
+        if stream[i .. i + 4] == [0, 0, 0xff, 0xff] {
+            starts.push(i + 4);
+            i += 4 + MIN_SEGMENT;
+        } else {
+            i += 1;
+        }
+    }
+    starts
+}
+
+//
+// The sub-images rows come in, with their Adam7 pass numbers: the
+// whole image, or each non-empty interlaced pass in turn. Rows come
+// out of them packed.
+//
+fn image_passes(header: &Header) -> Vec<(usize, Header)> {
+    match header.interlace_method {
+        InterlaceMethod::Standard => {
+            let mut packed = *header;
+            packed.source_format = SourceFormat::Packed;
+            vec![(0, packed)]
+        },
+        InterlaceMethod::Adam7 => (0 .. 7).filter_map(|pass| {
+            interlace::pass_header(header, pass).map(|sub| (pass, sub))
+        }).collect(),
+    }
+}
+
+//
+// A run of filtered rows from one pass, to be unfiltered.
+//
+struct RowBlock {
+    pass: usize,
+    first_row: usize,
+    data: Vec<u8>,
+}
+
+//
+// Rows unfiltered, and converted if need be, from the workers.
+//
+enum Message {
+    Rows(usize, usize, Vec<u8>),
+    Error(io::Error),
+}
+
+//
+// State shared with the worker threads.
+//
+struct Pipeline {
+    header: Header,
+    passes: Vec<(usize, Header)>,
+
+    queue: Mutex<UnfilterQueue>,
+}
+
+struct UnfilterQueue {
+    blocks: VecDeque<RowBlock>,
+
+    // Whether a job is working through the blocks.
+    running: bool,
+
+    // Last row unfiltered, which the next block's first row is
+    // unfiltered against unless it starts a pass.
+    prev: Vec<u8>,
+}
+
+impl Pipeline {
+    //
+    // Queue up a block, starting a job to unfilter it unless one is
+    // already working through them. Each job takes its own sender, so
+    // the channel only closes once they've all finished or failed.
+    //
+    fn push(shared: &Arc<Pipeline>, block: RowBlock, tx: &Sender<Message>, pool: Option<&ThreadPool>) {
+        let start = {
+            let mut queue = shared.queue.lock().unwrap();
+            queue.blocks.push_back(block);
+            !mem::replace(&mut queue.running, true)
+        };
+        if start {
+            let shared = Arc::clone(shared);
+            let tx = tx.clone();
+            spawn(pool, move || shared.run_unfilter(tx));
+        }
+    }
+
+    //
+    // Unfilter blocks in order until none are left waiting. Each one's
+    // conversion goes to another job, so this can get on with the next.
+    //
+    fn run_unfilter(&self, tx: Sender<Message>) {
+        loop {
+            let (block, mut prev) = {
+                let mut queue = self.queue.lock().unwrap();
+                match queue.blocks.pop_front() {
+                    Some(block) => {
+                        let prev = mem::replace(&mut queue.prev, Vec::new());
+                        (block, prev)
+                    },
+                    None => {
+                        queue.running = false;
+                        return;
+                    }
+                }
+            };
+            let result = self.unfilter(&block, &mut prev);
+            self.queue.lock().unwrap().prev = prev;
+            match result {
+                Ok(rows) => self.convert(block.pass, block.first_row, rows, &tx),
+                Err(e) => {
+                    let _ = tx.send(Message::Error(e));
+                }
+            }
+        }
+    }
+
+    fn unfilter(&self, block: &RowBlock, prev: &mut Vec<u8>) -> io::Result<Vec<u8>> {
+        let header = &self.passes[block.pass].1;
+        let stride = header.stride();
+        let bpp = header.bytes_per_pixel();
+        if block.first_row == 0 {
+            prev.clear();
+            prev.resize(stride, 0);
+        }
+
+        let rows = block.data.len() / (stride + 1);
+        let mut out = vec![0u8; rows * stride];
+        for (i, src) in block.data.chunks(stride + 1).enumerate() {
+            let (done, rest) = out.split_at_mut(i * stride);
+            let above = if i == 0 {
+                &prev[..]
+            } else {
+                &done[(i - 1) * stride ..]
+            };
+            filter::unfilter(src[0], bpp, above, &src[1 ..], &mut rest[.. stride])?;
+        }
+        prev.clear();
+        prev.extend_from_slice(&out[(rows - 1) * stride ..]);
+        Ok(out)
+    }
+
+    //
+    // Interlaced passes go back as they are, to be put together once
+    // they're all in; other rows are converted on another worker.
+    //
+    fn convert(&self, pass: usize, first_row: usize, rows: Vec<u8>, tx: &Sender<Message>) {
+        let format = self.header.source_format;
+        match (self.header.interlace_method, format) {
+            (InterlaceMethod::Adam7, _) | (_, SourceFormat::Packed) => {
+                let _ = tx.send(Message::Rows(pass, first_row, rows));
+            },
+            _ => {
+                let header = self.header;
+                let tx = tx.clone();
+                ::rayon::spawn(move || {
+                    let data = convert_rows(&header, &rows);
+                    let _ = tx.send(Message::Rows(pass, first_row, data));
+                });
+            }
+        }
+    }
+}
+
+//
+// Convert packed rows to the header's source format.
+//
+fn convert_rows(header: &Header, rows: &[u8]) -> Vec<u8> {
+    let stride = header.stride();
+    let out_stride = header.source_stride();
+    let mut data = vec![0u8; rows.len() / stride * out_stride];
+    for (src, dest) in rows.chunks(stride).zip(data.chunks_mut(out_stride)) {
+        convert::convert_row_to(header.source_format, src, dest);
+    }
+    data
+}
+
+//
+// Takes the inflated stream on the calling thread and cuts it up into
+// blocks of rows for the workers.
+//
+struct RowSink<'a> {
+    shared: Arc<Pipeline>,
+    pool: Option<&'a ThreadPool>,
+    tx: Sender<Message>,
+    rx: Receiver<Message>,
+
+    // Where the block being filled starts, and how long it will be.
+    pass: usize,
+    row: usize,
+    block: Vec<u8>,
+    block_len: usize,
+}
+
+impl<'a> RowSink<'a> {
+    fn new(header: Header, passes: Vec<(usize, Header)>, pool: Option<&'a ThreadPool>) -> RowSink<'a> {
+        let (tx, rx) = mpsc::channel();
+        let mut sink = RowSink {
+            shared: Arc::new(Pipeline {
+                header,
+                passes,
+                queue: Mutex::new(UnfilterQueue {
+                    blocks: VecDeque::new(),
+                    running: false,
+                    prev: Vec::new(),
+                }),
+            }),
+            pool,
+            tx,
+            rx,
+            pass: 0,
+            row: 0,
+            block: Vec::new(),
+            block_len: 0,
+        };
+        sink.start_block();
+        sink
+    }
+
+    fn start_block(&mut self) {
+        let passes = &self.shared.passes;
+        if self.pass < passes.len() {
+            let header = &passes[self.pass].1;
+            let row_len = header.stride() + 1;
+            let rows = cmp::max(1, BLOCK_SIZE / row_len);
+            let rows = cmp::min(rows, header.height as usize - self.row);
+            self.block_len = rows * row_len;
+            self.block = Vec::with_capacity(self.block_len);
+        }
+    }
+
+    fn write(&mut self, mut data: &[u8]) -> IoResult {
+        while !data.is_empty() {
+            if self.pass == self.shared.passes.len() {
+                return Err(invalid_data("Too much image data"));
+            }
+            let len = cmp::min(data.len(), self.block_len - self.block.len());
+            self.block.extend_from_slice(&data[.. len]);
+            data = &data[len ..];
+            if self.block.len() == self.block_len {
+                self.send_block();
+            }
+        }
+        Ok(())
+    }
+
+    fn send_block(&mut self) {
+        let height = self.shared.passes[self.pass].1.height as usize;
+        let row_len = self.shared.passes[self.pass].1.stride() + 1;
+        let block = RowBlock {
+            pass: self.pass,
+            first_row: self.row,
+            data: mem::replace(&mut self.block, Vec::new()),
+        };
+        self.row += block.data.len() / row_len;
+        Pipeline::push(&self.shared, block, &self.tx, self.pool);
+
+        if self.row == height {
+            self.pass += 1;
+            self.row = 0;
+        }
+        self.start_block();
+    }
+
+    //
+    // Wait for the workers and put the rows in place.
+    //
+    fn finish(self, buf: &mut [u8], pool: Option<&ThreadPool>) -> IoResult {
+        let passes = &self.shared.passes;
+        if self.pass < passes.len() {
+            return Err(invalid_data("Missing image data"));
+        }
+
+        // Leave only the jobs' senders, so one that panics can't leave
+        // this waiting on rows that will never come.
+        drop(self.tx);
+        let header = self.shared.header;
+        let interlaced = header.interlace_method == InterlaceMethod::Adam7;
+        let mut pass_data: Vec<Vec<u8>> = passes.iter().map(|&(_, ref pass)| {
+            if interlaced {
+                vec![0u8; pass.height as usize * pass.stride()]
+            } else {
+                Vec::new()
+            }
+        }).collect();
+
+        let mut rows_left: usize = passes.iter().map(|&(_, ref pass)| pass.height as usize).sum();
+        while rows_left > 0 {
+            match self.rx.recv() {
+                Ok(Message::Rows(pass, first_row, data)) => {
+                    let stride = if interlaced {
+                        passes[pass].1.stride()
+                    } else {
+                        header.source_stride()
+                    };
+                    let dest = if interlaced {
+                        &mut pass_data[pass][..]
+                    } else {
+                        &mut buf[..]
+                    };
+                    dest[first_row * stride .. first_row * stride + data.len()].copy_from_slice(&data);
+                    rows_left -= data.len() / stride;
+                },
+                Ok(Message::Error(e)) => return Err(e),
+                Err(_) => return Err(other("Worker thread failed")),
+            }
+        }
+
+        if interlaced {
+            deinterlace(&header, passes, &pass_data, buf, pool);
+        }
+        Ok(())
+    }
+}
+
+//
+// Put the passes of an interlaced image back together into buf,
+// converting it in blocks across the workers if need be.
+//
+fn deinterlace(header: &Header,
+               passes: &[(usize, Header)],
+               pass_data: &[Vec<u8>],
+               buf: &mut [u8],
+               pool: Option<&ThreadPool>)
+{
+    let stride = header.stride();
+    let height = header.height as usize;
+    let mut image = match header.source_format {
+        SourceFormat::Packed => Vec::new(),
+        _ => vec![0u8; height * stride],
+    };
+    {
+        let dest = match header.source_format {
+            SourceFormat::Packed => &mut buf[.. height * stride],
+            _ => &mut image[..],
+        };
+        for byte in dest.iter_mut() {
+            *byte = 0;
+        }
+        for (&(pass, ref sub), data) in passes.iter().zip(pass_data) {
+            for (row, src) in data.chunks(sub.stride()).enumerate() {
+                let y = interlace::source_row(pass, row);
+                interlace::insert_row(header, pass, src, &mut dest[y * stride .. (y + 1) * stride]);
+            }
+        }
+    }
+    if let SourceFormat::Packed = header.source_format {
+        return;
+    }
+
+    let image = Arc::new(image);
+    let rows = cmp::max(1, BLOCK_SIZE / stride);
+    let (tx, rx) = mpsc::channel();
+    let blocks = (height + rows - 1) / rows;
+    for block in 0 .. blocks {
+        let image = Arc::clone(&image);
+        let header = *header;
+        let tx = tx.clone();
+        spawn(pool, move || {
+            let start = block * rows * stride;
+            let end = cmp::min(start + rows * stride, image.len());
+            let _ = tx.send((block, convert_rows(&header, &image[start .. end])));
+        });
+    }
+    let out_stride = header.source_stride();
+    for _ in 0 .. blocks {
+        let (block, data) = rx.recv().unwrap();
+        let start = block * rows * out_stride;
+        buf[start .. start + data.len()].copy_from_slice(&data);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::io;
+    use std::io::Cursor;
+    use std::sync::Arc;
+
+    use rayon::ThreadPoolBuilder;
+
+    use super::super::deflate;
+    use super::super::deflate::Flush;
+    use super::super::encoder;
+    use super::super::writer::Writer;
+    use super::super::ColorType;
+    use super::super::Header;
+    use super::super::InterlaceMethod;
+    use super::super::SourceFormat;
+    use super::{Decoder, Options};
+
+    fn encode(header: &Header, data: &[u8], options: &encoder::Options) -> io::Result<Vec<u8>> {
+        let mut encoder = encoder::Encoder::new(Vec::<u8>::new(), options);
+        encoder.write_header(header)?;
+        if let ColorType::IndexedColor = header.color_type() {
+            encoder.write_palette(&[0u8; 768])?;
+        }
+        encoder.write_image(Arc::new(data.to_vec()))?;
+        encoder.finish()
+    }
+
+    fn decode(png: &[u8], format: SourceFormat) -> io::Result<(Header, Vec<u8>)> {
+        let mut options = Options::new();
+        options.set_output_format(format)?;
+        let mut decoder = Decoder::new(Cursor::new(png), &options);
+        let header = decoder.read_header()?;
+        let data = decoder.read_image()?;
+        Ok((header, data))
+    }
+
+    #[test]
+    fn round_trip() {
+        let mut seed = 1234u32;
+        let mut rand = || {
+            seed = seed.wrapping_mul(1103515245).wrapping_add(12345);
+            (seed >> 20) as u8 & 0x0f
+        };
+        let cases = [
+            (ColorType::Truecolor, 8, InterlaceMethod::Standard, true),
+            (ColorType::Truecolor, 8, InterlaceMethod::Standard, false),
+            (ColorType::TruecolorAlpha, 16, InterlaceMethod::Standard, true),
+            (ColorType::Greyscale, 1, InterlaceMethod::Standard, true),
+            (ColorType::IndexedColor, 4, InterlaceMethod::Adam7, true),
+            (ColorType::GreyscaleAlpha, 8, InterlaceMethod::Adam7, false),
+        ];
+        for &(color_type, depth, interlace, streaming) in &cases {
+            let mut header = Header::new();
+            header.set_size(613, 401).unwrap();
+            header.set_color(color_type, depth).unwrap();
+            header.set_interlace_method(interlace).unwrap();
+
+            // Noisy enough to compress to several segments.
+            let mut data: Vec<u8> = (0 .. header.stride() * 401).map(|i| (i % 7) as u8 * 16 + rand()).collect();
+
+            // Padding bits past the last pixel don't survive interlacing.
+            let bits = 613 * color_type.channels() * depth as usize % 8;
+            if bits > 0 {
+                for row in data.chunks_mut(header.stride()) {
+                    *row.last_mut().unwrap() &= !(0xffu8 >> bits);
+                }
+            }
+            let mut options = encoder::Options::new();
+            options.set_chunk_size(65536).unwrap();
+            options.set_streaming(streaming).unwrap();
+            let png = encode(&header, &data, &options).unwrap();
+
+            let (decoded_header, decoded) = decode(&png, SourceFormat::Packed).unwrap();
+            assert_eq!(decoded_header.interlace_method(), interlace);
+            assert!(decoded == data, "expected same pixels for {:?}", (depth, interlace, streaming));
+        }
+    }
+
+    #[test]
+    fn output_formats() {
+        let mut header = Header::new();
+        header.set_size(300, 200).unwrap();
+        header.set_color(ColorType::TruecolorAlpha, 8).unwrap();
+        let data: Vec<u8> = (0 .. 300 * 4 * 200).map(|i| (i % 253) as u8).collect();
+        let png = encode(&header, &data, &encoder::Options::new()).unwrap();
+
+        let (bgra_header, bgra) = decode(&png, SourceFormat::Bgra).unwrap();
+        assert_eq!(bgra_header.source_format(), SourceFormat::Bgra);
+        for (out, pixel) in bgra.chunks(4).zip(data.chunks(4)) {
+            assert_eq!(out, &[pixel[2], pixel[1], pixel[0], pixel[3]][..]);
+        }
+        assert!(decode(&png, SourceFormat::Bgrx).is_err(), "expected alpha mismatch");
+
+        let mut truncated = png.clone();
+        truncated.truncate(png.len() / 2);
+        assert!(decode(&truncated, SourceFormat::Packed).is_err());
+    }
+
+    #[test]
+    fn indexed_rows() {
+        let mut header = Header::new();
+        header.set_size(500, 300).unwrap();
+        header.set_color(ColorType::Truecolor, 8).unwrap();
+        let data: Vec<u8> = (0 .. 500 * 3 * 300u32).map(|i| (i * 7 / 5 % 251 ^ i / 1500) as u8).collect();
+        let mut options = encoder::Options::new();
+        options.set_chunk_size(40000).unwrap();
+        options.set_write_index(true).unwrap();
+        let mut png = encode(&header, &data, &options).unwrap();
+
+        let (_, decoded) = decode(&png, SourceFormat::Packed).unwrap();
+        assert!(decoded == data, "expected same pixels");
+
+        let read_rows = |png: &[u8], start: u32, end: u32| -> io::Result<Vec<u8>> {
+            let mut decoder = Decoder::new(Cursor::new(png), &Options::new());
+            decoder.read_header()?;
+            decoder.read_rows(start, end)
+        };
+        for &(start, end) in &[(0, 1), (77, 150), (299, 300), (0, 300)] {
+            let rows = read_rows(&png, start, end).unwrap();
+            assert!(rows == &data[start as usize * 1500 .. end as usize * 1500], "expected rows {}-{}", start, end);
+        }
+
+        // Break the compressed data near the end, fixing up the CRC; the
+        // top rows still decode without it.
+        let idat = (8 ..).find(|&i| &png[i .. i + 4] == b"IDAT").unwrap() - 4;
+        let len = (png[idat] as usize) << 24 | (png[idat + 1] as usize) << 16 |
+                  (png[idat + 2] as usize) << 8 | png[idat + 3] as usize;
+        png[idat + 8 + len - 100] ^= 0x55;
+        let crc = deflate::crc32(deflate::crc32_initial(), &png[idat + 4 .. idat + 8 + len]);
+        png[idat + 8 + len .. idat + 12 + len].copy_from_slice(&[(crc >> 24) as u8, (crc >> 16) as u8, (crc >> 8) as u8, crc as u8]);
+        assert!(read_rows(&png, 0, 300).is_err());
+        assert!(read_rows(&png, 10, 40).unwrap() == &data[10 * 1500 .. 40 * 1500]);
+    }
+
+    #[test]
+    fn oversized_segments() {
+        // A 1x1 image whose data inflates to megabytes, split by sync
+        // flushes far enough apart to be inflated in parallel.
+        let mut seed = 99u32;
+        let noise: Vec<u8> = (0 .. 40000).map(|_| {
+            seed = seed.wrapping_mul(1103515245).wrapping_add(12345);
+            (seed >> 24) as u8
+        }).collect();
+        let zeros = vec![0u8; 4 << 20];
+        let mut deflater = deflate::Deflate::new(deflate::Options::new(), Vec::<u8>::new());
+        for i in 0 .. 4 {
+            deflater.write(&noise, Flush::SyncFlush).unwrap();
+            let flush = if i == 3 { Flush::Finish } else { Flush::SyncFlush };
+            deflater.write(&zeros, flush).unwrap();
+        }
+        let stream = deflater.finish().unwrap();
+
+        let mut header = Header::new();
+        header.set_size(1, 1).unwrap();
+        header.set_color(ColorType::Greyscale, 8).unwrap();
+        let mut writer = Writer::new(Vec::<u8>::new());
+        writer.write_signature().unwrap();
+        writer.write_header(header).unwrap();
+        writer.write_chunk(b"IDAT", &stream).unwrap();
+        writer.write_chunk(b"IEND", &[]).unwrap();
+        let png = writer.finish().unwrap();
+
+        let pool = ThreadPoolBuilder::new().num_threads(4).build().unwrap();
+        let mut options = Options::new();
+        options.set_thread_pool(&pool).unwrap();
+        let mut decoder = Decoder::new(Cursor::new(png), &options);
+        decoder.read_header().unwrap();
+        let err = decoder.read_image().unwrap_err();
+        assert_eq!(err.kind(), io::ErrorKind::InvalidData);
+    }
+
+    #[test]
+    fn memory_limit() {
+        let mut header = Header::new();
+        header.set_size(200, 100).unwrap();
+        header.set_color(ColorType::TruecolorAlpha, 16).unwrap();
+        let data = vec![7u8; 200 * 8 * 100];
+        let mut png = encode(&header, &data, &encoder::Options::new()).unwrap();
+
+        let read_header = |png: &[u8], limit: usize| -> io::Result<()> {
+            let mut options = Options::new();
+            options.set_memory_limit(limit)?;
+            Decoder::new(Cursor::new(png), &options).read_header().map(|_| ())
+        };
+        assert!(read_header(&png, 400000).is_ok());
+        let err = read_header(&png, 100000).unwrap_err();
+        assert_eq!(err.kind(), io::ErrorKind::InvalidData);
+
+        // A header too big to size at all is rejected even without a limit.
+        png[16 .. 24].copy_from_slice(&[0x7f, 0xff, 0xff, 0xff, 0x7f, 0xff, 0xff, 0xff]);
+        let crc = deflate::crc32(deflate::crc32_initial(), &png[12 .. 29]);
+        png[29 .. 33].copy_from_slice(&[(crc >> 24) as u8, (crc >> 16) as u8, (crc >> 8) as u8, crc as u8]);
+        let err = read_header(&png, 0).unwrap_err();
+        assert_eq!(err.kind(), io::ErrorKind::InvalidData);
+    }
+}
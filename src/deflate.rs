@@ -26,6 +26,8 @@
 use std::io;
 use std::io::Write;
 
+use std::cell::RefCell;
+
 use std::mem;
 
 use std::ptr;
@@ -56,6 +58,90 @@ pub fn adler32_combine(sum_a: u32, sum_b: u32, len_b: usize) -> u32 {
     }
 }
 
+/// Deflate compression library to use.
+#[repr(u8)]
+#[derive(Copy, Clone, PartialEq)]
+pub enum Backend {
+    /// zlib via libz-sys, the default; built with the "zlib-ng" feature
+    /// this is zlib-ng's faster compatible implementation.
+    Zlib = 0,
+    /// Pure-Rust miniz_oxide, available with the "miniz_oxide" feature.
+    Miniz = 1,
+}
+
+impl Backend {
+    /// Check if this backend was compiled into the library.
+    pub fn is_available(self) -> bool {
+        match self {
+            Backend::Zlib => true,
+            Backend::Miniz => cfg!(feature = "miniz_oxide"),
+        }
+    }
+}
+
+impl TryFrom<u8> for Backend {
+    type Error = io::Error;
+
+    fn try_from(val: u8) -> Result<Self, Self::Error> {
+        match val {
+            0 => Ok(Backend::Zlib),
+            1 => Ok(Backend::Miniz),
+            _ => Err(invalid_input("Invalid backend constant")),
+        }
+    }
+}
+
+//
+// Common interface of the backends for compressing one chunk
+// of the image data stream into a byte buffer.
+//
+pub trait Compress {
+    // Prime the window with the end of the previous chunk's input.
+    fn set_dictionary(&mut self, dict: &[u8]) -> IoResult;
+
+    // Upper bound on compressed size of len bytes of input.
+    fn bound(&mut self, len: usize) -> io::Result<usize>;
+
+    // The buffer being written into, eg to swap in a pre-sized one.
+    fn output(&mut self) -> &mut Vec<u8>;
+
+    fn write(&mut self, data: &[u8], flush: Flush) -> IoResult;
+
+    fn finish(self: Box<Self>) -> io::Result<Vec<u8>>;
+}
+
+pub fn compressor(backend: Backend, options: Options) -> io::Result<Box<dyn Compress>> {
+    match backend {
+        Backend::Zlib => Ok(Box::new(Deflate::new(options, Vec::new()))),
+        #[cfg(feature = "miniz_oxide")]
+        Backend::Miniz => Ok(Box::new(miniz::MinizDeflate::new(&options))),
+        #[cfg(not(feature = "miniz_oxide"))]
+        Backend::Miniz => Err(invalid_input("miniz_oxide backend not compiled in")),
+    }
+}
+
+//
+// zlib's CRC-32 is used for PNG chunk checksums as well; recent zlib
+// and zlib-ng select hardware-accelerated versions where available.
+//
+pub fn crc32(sum: u32, bytes: &[u8]) -> u32 {
+    unsafe {
+        ::libz_sys::crc32(c_ulong::from(sum), bytes.as_ptr(), bytes.len() as c_uint) as u32
+    }
+}
+
+pub fn crc32_initial() -> u32 {
+    unsafe {
+        ::libz_sys::crc32(0, ptr::null(), 0) as u32
+    }
+}
+
+pub fn crc32_combine(sum_a: u32, sum_b: u32, len_b: usize) -> u32 {
+    unsafe {
+        ::libz_sys::crc32_combine(c_ulong::from(sum_a), c_ulong::from(sum_b), len_b as c_long) as u32
+    }
+}
+
 pub struct Options {
     level: c_int,
     method: c_int,
@@ -131,12 +217,86 @@ pub enum Flush {
     Finish = Z_FINISH as isize,
 }
 
+//
+// An initialized zlib deflate stream, ended when dropped.
+//
+struct Stream {
+    raw: Box<z_stream>,
+    level: c_int,
+    window_bits: c_int,
+    mem_level: c_int,
+    strategy: c_int,
+}
+
+impl Drop for Stream {
+    fn drop(&mut self) {
+        unsafe {
+            deflateEnd(&mut *self.raw);
+        }
+    }
+}
+
+//
+// Finished streams are kept around for reuse by later chunks on the
+// same thread, saving the allocation and clearing of zlib's window
+// and hash tables every time. There are only ever a couple of distinct
+// configurations in use by an encoder (zlib header or raw), so keep
+// the cache per thread small.
+//
+const MAX_CACHED_STREAMS: usize = 4;
+
+thread_local! {
+    static STREAM_CACHE: RefCell<Vec<Stream>> = RefCell::new(Vec::new());
+}
+
+fn take_cached_stream(options: &Options) -> Option<Stream> {
+    STREAM_CACHE.try_with(|cache| {
+        let mut cache = cache.borrow_mut();
+        // Window size and memory use are fixed at init time; level
+        // and strategy can be changed with deflateParams, but one that
+        // already matches saves the call.
+        let fits = |stream: &Stream| {
+            stream.window_bits == options.window_bits &&
+            stream.mem_level == options.mem_level
+        };
+        let found = cache.iter().position(|stream| {
+            fits(stream) &&
+            stream.level == options.level &&
+            stream.strategy == options.strategy
+        }).or_else(|| cache.iter().position(|stream| fits(stream)));
+        found.map(|i| cache.swap_remove(i))
+    }).unwrap_or(None)
+}
+
+fn cache_stream(mut stream: Stream) {
+    let ret = unsafe {
+        deflateReset(&mut *stream.raw)
+    };
+    // The buffers it last pointed at belong to the finished chunk.
+    clear_buffers(&mut stream.raw);
+    if ret == Z_OK {
+        // If the thread is shutting down the stream just gets dropped.
+        let _ = STREAM_CACHE.try_with(move |cache| {
+            let mut cache = cache.borrow_mut();
+            if cache.len() < MAX_CACHED_STREAMS {
+                cache.push(stream);
+            }
+        });
+    }
+}
+
+fn clear_buffers(raw: &mut z_stream) {
+    raw.next_in = ptr::null_mut();
+    raw.avail_in = 0;
+    raw.next_out = ptr::null_mut();
+    raw.avail_out = 0;
+}
+
 pub struct Deflate<W: Write> {
     output: W,
     options: Options,
-    initialized: bool,
     finished: bool,
-    stream: Box<z_stream>,
+    stream: Option<Stream>,
 }
 
 impl<W: Write> Deflate<W> {
@@ -144,49 +304,85 @@ impl<W: Write> Deflate<W> {
         Deflate {
             output: w,
             options,
-            initialized: false,
             finished: false,
-            stream: Box::new(unsafe {
-                // Note: this will fail in future versions of Rust
-                // because the alloc function pointers in the zstream
-                // struct are not properly wrapped in an Option so
-                // cannot be null. Currently it throws a warning.
-                mem::MaybeUninit::zeroed().assume_init()
-            }),
+            stream: None,
         }
     }
 
-    pub fn init(&mut self) -> IoResult {
-        if self.initialized {
-            Ok(())
-        } else {
+    fn reuse_stream(&mut self) -> Option<Stream> {
+        let mut stream = take_cached_stream(&self.options)?;
+        if stream.level != self.options.level || stream.strategy != self.options.strategy {
+            // deflateParams may flush with deflate(), so make sure it
+            // has no stale buffers to read from or write to.
+            clear_buffers(&mut stream.raw);
             let ret = unsafe {
-                deflateInit2_(&mut *self.stream,
+                deflateParams(&mut *stream.raw,
                               self.options.level,
-                              self.options.method,
-                              self.options.window_bits,
-                              self.options.mem_level,
-                              self.options.strategy,
-                              zlibVersion(),
-                              mem::size_of::<z_stream>() as c_int)
+                              self.options.strategy)
             };
-            match ret {
-                Z_OK => {
-                    self.initialized = true;
-                    Ok(())
-                },
-                Z_MEM_ERROR => Err(other("Out of memory")),
-                Z_STREAM_ERROR => Err(invalid_input("Invalid parameter")),
-                Z_VERSION_ERROR => Err(invalid_input("Incompatible version of zlib")),
-                _ => Err(other("Unexpected error")),
+            if ret != Z_OK {
+                // Z_BUF_ERROR means it had pending data and didn't take
+                // the new parameters; drop it and start fresh either way.
+                return None;
             }
+            stream.level = self.options.level;
+            stream.strategy = self.options.strategy;
         }
+        Some(stream)
     }
 
-    pub fn set_dictionary(&mut self, dict: &[u8]) -> IoResult {
+    pub fn init(&mut self) -> IoResult {
+        if self.stream.is_some() {
+            return Ok(());
+        }
+        if let Some(stream) = self.reuse_stream() {
+            self.stream = Some(stream);
+            return Ok(());
+        }
+
+        let mut raw: Box<z_stream> = Box::new(unsafe {
+            // Note: this will fail in future versions of Rust
+            // because the alloc function pointers in the zstream
+            // struct are not properly wrapped in an Option so
+            // cannot be null. Currently it throws a warning.
+            mem::MaybeUninit::zeroed().assume_init()
+        });
+        let ret = unsafe {
+            deflateInit2_(&mut *raw,
+                          self.options.level,
+                          self.options.method,
+                          self.options.window_bits,
+                          self.options.mem_level,
+                          self.options.strategy,
+                          zlibVersion(),
+                          mem::size_of::<z_stream>() as c_int)
+        };
+        match ret {
+            Z_OK => {
+                self.stream = Some(Stream {
+                    raw,
+                    level: self.options.level,
+                    window_bits: self.options.window_bits,
+                    mem_level: self.options.mem_level,
+                    strategy: self.options.strategy,
+                });
+                Ok(())
+            },
+            Z_MEM_ERROR => Err(other("Out of memory")),
+            Z_STREAM_ERROR => Err(invalid_input("Invalid parameter")),
+            Z_VERSION_ERROR => Err(invalid_input("Incompatible version of zlib")),
+            _ => Err(other("Unexpected error")),
+        }
+    }
+
+    fn raw_stream(&mut self) -> io::Result<&mut z_stream> {
         self.init()?;
+        Ok(&mut *self.stream.as_mut().unwrap().raw)
+    }
+
+    pub fn set_dictionary(&mut self, dict: &[u8]) -> IoResult {
         let ret = unsafe {
-            deflateSetDictionary(&mut *self.stream,
+            deflateSetDictionary(self.raw_stream()?,
                                  &dict[0],
                                  dict.len() as c_uint)
         };
@@ -200,7 +396,7 @@ impl<W: Write> Deflate<W> {
     fn deflate(&mut self, data: &[u8], flush: Flush) -> IoResult {
         self.init()?;
         let mut buffer = [0u8; 128 * 1024];
-        let stream = &mut *self.stream;
+        let stream = &mut *self.stream.as_mut().unwrap().raw;
         stream.next_in = &data[0] as *const u8 as *mut u8;
         stream.avail_in = data.len() as c_uint;
         loop {
@@ -241,27 +437,219 @@ impl<W: Write> Deflate<W> {
         }
     }
 
+    //
+    // Upper bound on the compressed size of len bytes of input
+    // with the current options, when finished in one call.
+    // Each SyncFlush may add a few more bytes on top of this.
+    //
+    pub fn bound(&mut self, len: usize) -> io::Result<usize> {
+        let bound = unsafe {
+            deflateBound(self.raw_stream()?, len as c_ulong)
+        };
+        Ok(bound as usize)
+    }
+
+    //
+    // Access the output writer, eg to swap in a pre-sized buffer.
+    //
+    pub fn get_mut(&mut self) -> &mut W {
+        &mut self.output
+    }
+
     pub fn write(&mut self, data: &[u8], flush: Flush) -> IoResult {
         self.init()?;
         self.deflate(data, flush)
     }
 
     //
-    // Deallocate the zlib state and return the writer.
+    // Release the zlib state for reuse and return the writer.
     //
     pub fn finish(mut self) -> io::Result<W> {
-        if self.initialized {
+        if let Some(stream) = self.stream.take() {
+            cache_stream(stream);
+        }
+        Ok(self.output)
+    }
+}
+
+impl Compress for Deflate<Vec<u8>> {
+    fn set_dictionary(&mut self, dict: &[u8]) -> IoResult {
+        Deflate::set_dictionary(self, dict)
+    }
+
+    fn bound(&mut self, len: usize) -> io::Result<usize> {
+        Deflate::bound(self, len)
+    }
+
+    fn output(&mut self) -> &mut Vec<u8> {
+        self.get_mut()
+    }
+
+    fn write(&mut self, data: &[u8], flush: Flush) -> IoResult {
+        Deflate::write(self, data, flush)
+    }
+
+    fn finish(self: Box<Self>) -> io::Result<Vec<u8>> {
+        Deflate::finish(*self)
+    }
+}
+
+//
+// A zlib inflate stream, for decoding image data as one stream.
+//
+pub struct Inflate {
+    raw: Box<z_stream>,
+}
+
+impl Inflate {
+    pub fn new() -> io::Result<Inflate> {
+        let mut raw: Box<z_stream> = Box::new(unsafe {
+            // Same caveat as for Deflate::init().
+            mem::MaybeUninit::zeroed().assume_init()
+        });
+        let ret = unsafe {
+            inflateInit2_(&mut *raw,
+                          15,
+                          zlibVersion(),
+                          mem::size_of::<z_stream>() as c_int)
+        };
+        match ret {
+            Z_OK => Ok(Inflate {
+                raw,
+            }),
+            Z_MEM_ERROR => Err(other("Out of memory")),
+            Z_VERSION_ERROR => Err(invalid_input("Incompatible version of zlib")),
+            _ => Err(other("Unexpected error")),
+        }
+    }
+
+    //
+    // Decompress the next piece of input, handing the output to emit
+    // as it comes. Returns true once the end of the stream is reached,
+    // after checking its checksum; anything following is ignored.
+    //
+    pub fn write<F>(&mut self, data: &[u8], mut emit: F) -> io::Result<bool>
+        where F: FnMut(&[u8]) -> IoResult
+    {
+        let mut buffer = [0u8; 128 * 1024];
+        let stream = &mut *self.raw;
+        stream.next_in = data.as_ptr() as *mut u8;
+        stream.avail_in = data.len() as c_uint;
+        loop {
+            stream.next_out = &mut buffer[0] as *mut u8;
+            stream.avail_out = buffer.len() as c_uint;
             let ret = unsafe {
-                deflateEnd(&mut *self.stream)
+                inflate(stream, Z_NO_FLUSH)
             };
             match ret {
-                // Z_DATA_ERROR means we freed before finishing the stream.
-                // For our use case we do this deliberately, it's ok!
-                Z_OK | Z_DATA_ERROR => Ok(self.output),
-                Z_STREAM_ERROR => Err(invalid_input("Inconsistent stream state")),
-                _ => Err(other("Unexpected error")),
+                Z_OK | Z_STREAM_END | Z_BUF_ERROR => {
+                    let end = buffer.len() - stream.avail_out as usize;
+                    emit(&buffer[0 .. end])?;
+                    if ret == Z_STREAM_END {
+                        return Ok(true);
+                    }
+                    if stream.avail_out > 0 {
+                        // Used up all the input.
+                        return Ok(false);
+                    }
+                },
+                Z_NEED_DICT => return Err(invalid_data("Preset dictionaries not supported")),
+                Z_DATA_ERROR => return Err(invalid_data("Corrupt compressed data")),
+                Z_MEM_ERROR => return Err(other("Out of memory")),
+                _ => return Err(other("Unexpected error")),
             }
-        } else {
+        }
+    }
+}
+
+impl Drop for Inflate {
+    fn drop(&mut self) {
+        unsafe {
+            inflateEnd(&mut *self.raw);
+        }
+    }
+}
+
+#[cfg(feature = "miniz_oxide")]
+mod miniz {
+    use std::io;
+
+    use ::miniz_oxide::deflate::core::CompressorOxide;
+    use ::miniz_oxide::deflate::core::{TDEFLFlush, TDEFLStatus};
+    use ::miniz_oxide::deflate::core::{compress_to_output, create_comp_flags_from_zip_params};
+
+    use super::{Compress, Flush, Options};
+
+    use super::super::utils::*;
+
+    pub struct MinizDeflate {
+        // Large enough to keep off the stack.
+        compressor: Box<CompressorOxide>,
+        output: Vec<u8>,
+    }
+
+    impl MinizDeflate {
+        pub fn new(options: &Options) -> MinizDeflate {
+            // Unlike zlib, miniz doesn't map -1 to the default level.
+            let level = if options.level < 0 {
+                6
+            } else {
+                options.level
+            };
+            let flags = create_comp_flags_from_zip_params(level,
+                                                          options.window_bits,
+                                                          options.strategy);
+            MinizDeflate {
+                compressor: Box::new(CompressorOxide::new(flags)),
+                output: Vec::new(),
+            }
+        }
+
+        fn compress(&mut self, data: &[u8], flush: TDEFLFlush) -> IoResult {
+            let output = &mut self.output;
+            let (status, consumed) = compress_to_output(&mut self.compressor, data, flush, |bytes| {
+                output.extend_from_slice(bytes);
+                true
+            });
+            match status {
+                TDEFLStatus::Okay | TDEFLStatus::Done if consumed == data.len() => Ok(()),
+                _ => Err(other("Compression failed")),
+            }
+        }
+    }
+
+    impl Compress for MinizDeflate {
+        //
+        // miniz has no preset dictionary support, so compress the
+        // dictionary bytes themselves and throw away the output.
+        // The sync flush leaves the output byte-aligned between blocks,
+        // and the decoder already has those bytes from the previous
+        // chunk, so back-references into them stay valid.
+        //
+        fn set_dictionary(&mut self, dict: &[u8]) -> IoResult {
+            let start = self.output.len();
+            self.compress(dict, TDEFLFlush::Sync)?;
+            self.output.truncate(start);
+            Ok(())
+        }
+
+        fn bound(&mut self, len: usize) -> io::Result<usize> {
+            // Same as zlib's compressBound().
+            Ok(len + (len >> 12) + (len >> 14) + (len >> 25) + 13)
+        }
+
+        fn output(&mut self) -> &mut Vec<u8> {
+            &mut self.output
+        }
+
+        fn write(&mut self, data: &[u8], flush: Flush) -> IoResult {
+            self.compress(data, match flush {
+                Flush::SyncFlush => TDEFLFlush::Sync,
+                Flush::Finish => TDEFLFlush::Finish,
+            })
+        }
+
+        fn finish(self: Box<Self>) -> io::Result<Vec<u8>> {
             Ok(self.output)
         }
     }
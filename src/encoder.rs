@@ -25,53 +25,108 @@
 
 use rayon::ThreadPool;
 
-use std::collections::HashMap;
+use std::cmp;
+use std::collections::VecDeque;
 
 use std::io;
 use std::io::Write;
 
-use std::sync::Arc;
+use std::mem;
+use std::ptr;
+
+use std::sync::{Arc, Mutex};
+use std::sync::atomic::{AtomicPtr, AtomicUsize, Ordering};
 use std::sync::mpsc;
 use std::sync::mpsc::{Sender, Receiver};
 
+use std::time::{Duration, Instant};
+
 use super::ColorType;
 use super::CompressionLevel;
+use super::FrameControl;
 use super::Strategy;
 use super::Header;
+use super::InterlaceMethod;
 use super::Mode;
 use super::Mode::{Adaptive, Fixed};
+use super::SourceFormat;
 
+use super::convert;
 use super::filter::AdaptiveFilter;
 use super::filter::Filter;
+use super::index;
+use super::index::Index;
+use super::interlace;
+use super::pool::BufferPool;
+use super::quantize;
+use super::reduce;
+use super::scheduler;
+use super::scheduler::Scheduler;
 use super::writer::Writer;
 
 use super::deflate;
-use super::deflate::Deflate;
+use super::deflate::Backend;
 use super::deflate::Flush;
 
 use super::utils::*;
 
+// Chunks laid out by the image's color type, which can't be carried
+// over when it's reduced or quantized to another.
+const COLOR_CHUNKS: [&[u8]; 3] = [b"bKGD", b"hIST", b"sBIT"];
+
+// Chunks the spec requires before PLTE; others held back while the
+// palette is made up follow it.
+const BEFORE_PALETTE_CHUNKS: [&[u8]; 5] = [b"cHRM", b"gAMA", b"iCCP", b"sBIT", b"sRGB"];
+
 
 /// Options setup struct for the PNG encoder.
 /// May be modified and reused.
 #[derive(Copy, Clone)]
 pub struct Options<'a> {
-    chunk_size: usize,
+    chunk_size: Mode<usize>,
     compression_level: CompressionLevel,
     strategy_mode: Mode<Strategy>,
     filter_mode: Mode<Filter>,
     streaming: bool,
+    flush_interval: usize,
+    memory_limit: usize,
+    backend: Backend,
     thread_pool: Option<&'a ThreadPool>,
+    buffer_pool: Option<&'a BufferPool>,
+    scheduler: Option<&'a Scheduler>,
+    priority: u32,
+    chunk_cache: Option<&'a ChunkCache>,
+    stats: bool,
+    write_index: bool,
+    quantize: bool,
+    dither: bool,
+    reduce: bool,
+    search: bool,
+    chunk_affinity: bool,
 }
 
 impl<'a> Options<'a> {
     /// Create a new Options struct using default options:
-    /// * chunk_size: 256 KiB
+    /// * chunk_size: Fixed(256 KiB)
     /// * compression_level: Default
     /// * strategy_mode: Adaptive
     /// * filter_mode: Adaptive
     /// * streaming: off
+    /// * flush_interval: none
+    /// * memory_limit: none
+    /// * backend: Zlib
     /// * thread_pool: global default
+    /// * buffer_pool: private to each encoder
+    /// * scheduler: none
+    /// * priority: 1
+    /// * chunk_cache: none
+    /// * stats: off
+    /// * write_index: off
+    /// * quantize: off
+    /// * dither: off
+    /// * reduce: off
+    /// * search: off
+    /// * chunk_affinity: off
     ///
     /// The compression, strategy, and filtering use the same
     /// defaults as libpng.
@@ -81,7 +136,7 @@ impl<'a> Options<'a> {
             // A chunk size of 256 KiB gives compression results very similar
             // to a single stream when otherwise using defaults.
             //
-            chunk_size: 256 * 1024,
+            chunk_size: Fixed(256 * 1024),
 
             //
             // Same defaults as libpng.
@@ -100,10 +155,75 @@ impl<'a> Options<'a> {
             //
             streaming: false,
 
+            //
+            // Emit each chunk's compressed data in one piece.
+            //
+            flush_interval: 0,
+
+            //
+            // Only the number of queued jobs is limited by default,
+            // so memory use grows with chunk size and thread count.
+            //
+            memory_limit: 0,
+
+            //
+            // zlib is always available.
+            //
+            backend: Backend::Zlib,
+
             //
             // Use the global thread pool.
             //
             thread_pool: None,
+
+            //
+            // Recycle buffers only within each encoder.
+            //
+            buffer_pool: None,
+
+            //
+            // Queue jobs directly on the thread pool.
+            //
+            scheduler: None,
+            priority: 1,
+
+            //
+            // Compress every image from scratch.
+            //
+            chunk_cache: None,
+
+            //
+            // Timing the jobs is cheap, but keeping a record per
+            // chunk isn't free on huge images.
+            //
+            stats: false,
+
+            //
+            // Most decoders couldn't make use of it.
+            //
+            write_index: false,
+
+            //
+            // Only reduce colors when asked, and then keep flat areas flat.
+            //
+            quantize: false,
+            dither: false,
+
+            //
+            // Encode the color type and depth the caller asked for.
+            //
+            reduce: false,
+
+            //
+            // One pass, with the filter and strategy modes above.
+            //
+            search: false,
+
+            //
+            // Any free thread may deflate a chunk, which spreads the
+            // work soonest when threads outnumber chunks in flight.
+            //
+            chunk_affinity: false,
         }
     }
 
@@ -113,17 +233,74 @@ impl<'a> Options<'a> {
         Ok(())
     }
 
+    /// Share a BufferPool instance between encoders instead of using a
+    /// private pool per encoder. Useful when encoding many images.
+    pub fn set_buffer_pool(&mut self, buffer_pool: &'a BufferPool) -> IoResult {
+        self.buffer_pool = Some(buffer_pool);
+        Ok(())
+    }
+
+    /// Share a Scheduler instance between encoders, so their jobs take
+    /// turns on the thread pool instead of queueing up in order.
+    pub fn set_scheduler(&mut self, scheduler: &'a Scheduler) -> IoResult {
+        self.scheduler = Some(scheduler);
+        Ok(())
+    }
+
+    /// Set the share of a Scheduler's running jobs this encoder gets
+    /// while others also have work waiting; an encoder with priority 3
+    /// starts three jobs for every one from an encoder with priority 1.
+    ///
+    /// Must be at least 1, the default. Has no effect without a scheduler.
+    pub fn set_priority(&mut self, priority: u32) -> IoResult {
+        if priority < 1 {
+            Err(invalid_input("Priority must be at least 1"))
+        } else {
+            self.priority = priority;
+            Ok(())
+        }
+    }
+
+    /// Keep each image's compressed chunks in a ChunkCache, and reuse
+    /// those of the last image encoded with it wherever its rows are
+    /// unchanged, such as for a series of screenshots. Only chunks near
+    /// changed rows are filtered and compressed again, so a small change
+    /// costs a fraction of a full encode. The output is the same as
+    /// without the cache.
+    ///
+    /// Unchanged rows are spotted by comparing each chunk's rows with the
+    /// last image's as they come in, so the cache keeps those rows too.
+    /// Nothing is reused if the header,
+    /// chunk size, or compression settings differ from the last image's.
+    /// The cache is ignored for animations and with a flush interval.
+    pub fn set_chunk_cache(&mut self, chunk_cache: &'a ChunkCache) -> IoResult {
+        self.chunk_cache = Some(chunk_cache);
+        Ok(())
+    }
+
     /// Set the size in bytes of chunks used for distributing data to threads.
     /// The actual chunk size used will be a multiple of row lengths approximating
     /// the requested size.
     ///
     /// Chunk size must be at least 32 KiB.
     pub fn set_chunk_size(&mut self, chunk_size: usize) -> IoResult {
-        if chunk_size < 32768 {
-            Err(invalid_input("chunk size must be at least 32768"))
-        } else {
-            self.chunk_size = chunk_size;
-            Ok(())
+        self.set_chunk_size_mode(Fixed(chunk_size))
+    }
+
+    /// Set the chunk size, or pick one for each image. Adaptive chooses
+    /// from the image's size, the number of threads, and the compression
+    /// level: small images may be split into chunks finer than the usual
+    /// 32 KiB minimum so every thread gets work, while large ones use
+    /// bigger chunks to lose less compression at their boundaries.
+    ///
+    /// Fixed chunk sizes must be at least 32 KiB.
+    pub fn set_chunk_size_mode(&mut self, chunk_size: Mode<usize>) -> IoResult {
+        match chunk_size {
+            Fixed(n) if n < 32768 => Err(invalid_input("chunk size must be at least 32768")),
+            _ => {
+                self.chunk_size = chunk_size;
+                Ok(())
+            }
         }
     }
 
@@ -164,6 +341,144 @@ impl<'a> Options<'a> {
         self.streaming = streaming;
         Ok(())
     }
+
+    /// In streaming mode, also flush the compressed stream after about
+    /// this many bytes of each chunk's image data, rounded to whole
+    /// rows, and send each piece to output as its own "IDAT" chunk
+    /// followed by a flush of the Write sink as soon as it's ready.
+    ///
+    /// This cuts latency to the first bytes from a whole chunk down to
+    /// a few rows, at the cost of a few more bytes per piece.
+    ///
+    /// 0 means whole chunks only, the default. Ignored when not streaming.
+    pub fn set_flush_interval(&mut self, flush_interval: usize) -> IoResult {
+        self.flush_interval = flush_interval;
+        Ok(())
+    }
+
+    /// Set a soft limit in bytes on the memory held by image data in
+    /// flight through the encoder's worker pipeline: copied input pixels
+    /// and filtered rows. Once over the limit, write_image_rows() blocks
+    /// until enough chunks have been compressed and output, and
+    /// try_write_image_rows() returns a WouldBlock error.
+    ///
+    /// A chunk's worth of data is always allowed through, even if larger
+    /// than the limit. Compressed output is not counted, as without
+    /// streaming mode it must all be held until the end of the image;
+    /// enable streaming to keep that from growing too.
+    ///
+    /// 0 means no limit, the default.
+    pub fn set_memory_limit(&mut self, memory_limit: usize) -> IoResult {
+        self.memory_limit = memory_limit;
+        Ok(())
+    }
+
+    /// Enable or disable collecting timings, byte counts, and filter
+    /// choices during the encode, for Encoder::stats().
+    pub fn set_stats(&mut self, stats: bool) -> IoResult {
+        self.stats = stats;
+        Ok(())
+    }
+
+    /// Enable or disable writing an index of the compressed chunks in a
+    /// private "mtIX" chunk after the image data, so mtpng::decoder can
+    /// inflate them in parallel without guesswork, and decode a range
+    /// of rows with read_rows() without the rest of the image.
+    ///
+    /// To make that work, the first row of each chunk is filtered without
+    /// reference to the row above, which costs a little compression.
+    pub fn set_write_index(&mut self, write_index: bool) -> IoResult {
+        self.write_index = write_index;
+        Ok(())
+    }
+
+    /// Enable or disable encoding 8-bit truecolor input, with or without
+    /// alpha, as indexed color with a palette of up to 256 colors built
+    /// from the image. The header is given as for the truecolor input,
+    /// and the "PLTE" and "tRNS" chunks are written along with the image
+    /// data, so the caller must not write them. Other chunks written
+    /// before then are held back to go around the palette, except bKGD,
+    /// hIST and sBIT, which are laid out by color type and rejected.
+    ///
+    /// Images with no more than 256 colors are encoded exactly. Others are
+    /// reduced with a median cut, refined over the image's histogram.
+    /// Either way the whole image must be collected first, so
+    /// write_image_rows() copies it all before anything is encoded.
+    pub fn set_quantize(&mut self, quantize: bool) -> IoResult {
+        self.quantize = quantize;
+        Ok(())
+    }
+
+    /// When quantizing to a reduced palette, enable or disable dithering,
+    /// which trades flat areas for smoother gradients. The error is
+    /// diffused within blocks of rows, so they can be mapped in parallel.
+    pub fn set_dither(&mut self, dither: bool) -> IoResult {
+        self.dither = dither;
+        Ok(())
+    }
+
+    /// Enable or disable checking the image for a smaller color type or
+    /// bit depth that holds it exactly, and encoding it that way: without
+    /// an alpha channel if it's all opaque, as greyscale if it's grey,
+    /// at 8 bits if 16-bit samples repeat their high bytes, or as indexed
+    /// color if it has 256 colors or fewer, at fewer bits where they fit.
+    ///
+    /// The image is scanned and converted in parallel blocks before being
+    /// encoded, so write_image_rows() copies it all first, and the header
+    /// is written along with the image data. Chunks written in between
+    /// follow the header as usual. Writing a palette, transparency, or
+    /// animation control gives up on reducing, as they depend on the color
+    /// type; so does anything below 8 bits per sample, or indexed color.
+    /// An iCCP chunk written in between keeps color images in color and
+    /// grey ones in grey, as the profile only fits one or the other.
+    ///
+    /// Ignored when quantizing.
+    pub fn set_reduce(&mut self, reduce: bool) -> IoResult {
+        self.reduce = reduce;
+        Ok(())
+    }
+
+    /// Enable or disable searching for the smallest output, spending
+    /// several times the CPU on each chunk: the rows are filtered with
+    /// each of the filters and the adaptive filter in parallel, keeping
+    /// whichever compresses smallest, and then compressed with each of
+    /// the default, filtered, and RLE strategies, keeping the smallest.
+    ///
+    /// A fixed filter or strategy mode is used as is rather than searched.
+    /// The flush interval is ignored, as pieces of a chunk can't be sent
+    /// before the other strategies have finished.
+    pub fn set_search(&mut self, search: bool) -> IoResult {
+        self.search = search;
+        Ok(())
+    }
+
+    /// Enable or disable deflating each chunk on the worker thread that
+    /// filtered it, straight after, where the previous chunk's filtering
+    /// is already done, rather than in a job of its own for any thread
+    /// to pick up. That's most of the time, and keeps the filtered data
+    /// in that core's cache instead of moving it to another, which pays
+    /// off most across sockets; combine with a pool from thread_pool()
+    /// to keep workers on their cores.
+    ///
+    /// The output is the same either way.
+    pub fn set_chunk_affinity(&mut self, chunk_affinity: bool) -> IoResult {
+        self.chunk_affinity = chunk_affinity;
+        Ok(())
+    }
+
+    /// Set the deflate implementation to compress with. Zlib is the
+    /// default; others must be enabled with cargo features, or this
+    /// will return an error.
+    ///
+    /// All backends produce valid output that may differ in size.
+    pub fn set_backend(&mut self, backend: Backend) -> IoResult {
+        if backend.is_available() {
+            self.backend = backend;
+            Ok(())
+        } else {
+            Err(invalid_input("Deflate backend not compiled in"))
+        }
+    }
 }
 
 impl<'a> Default for Options<'a> {
@@ -172,6 +487,274 @@ impl<'a> Default for Options<'a> {
     }
 }
 
+/// Compressed chunks of the last image encoded with this cache,
+/// for reuse by the next one; see Options::set_chunk_cache().
+///
+/// An encoder takes the contents when it writes its header and puts
+/// its own back once all of its output is written, so only one encoder
+/// at a time mixing in each image stream gets to reuse anything.
+///
+/// Clones share the same underlying cache.
+#[derive(Clone)]
+pub struct ChunkCache {
+    shared: Arc<Mutex<CacheState>>,
+}
+
+#[derive(Default)]
+struct CacheState {
+    // Image and compression settings the chunks were made with.
+    key: Vec<usize>,
+
+    // Each chunk's pixel rows, and its compressed data.
+    pixels: Vec<Arc<PixelChunk>>,
+    chunks: Vec<Arc<DeflateChunk>>,
+}
+
+impl ChunkCache {
+    /// Create an empty cache.
+    pub fn new() -> ChunkCache {
+        ChunkCache {
+            shared: Arc::new(Mutex::new(CacheState::default())),
+        }
+    }
+
+    /// Drop the kept chunks, so the next image is compressed from scratch.
+    pub fn clear(&self) {
+        *self.shared.lock().unwrap() = CacheState::default();
+    }
+}
+
+impl Default for ChunkCache {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+/// Where an encode's time went, as enabled with Options::set_stats().
+///
+/// All times are wall-clock. Chunks reused from a ChunkCache count
+/// towards the output bytes only.
+#[derive(Clone, Debug, Default)]
+pub struct Stats {
+    elapsed: Duration,
+    filter_time: Duration,
+    deflate_time: Duration,
+    output_time: Duration,
+    blocked_time: Duration,
+    threads: usize,
+    bytes_in: u64,
+    bytes_filtered: u64,
+    bytes_out: u64,
+    filter_counts: [u64; 5],
+    chunks: Vec<ChunkStats>,
+    chunks_reused: usize,
+}
+
+impl Stats {
+    /// Time since the header was written, up to the last of the
+    /// image data being written if it has been.
+    pub fn elapsed(&self) -> Duration {
+        self.elapsed
+    }
+
+    /// Total time spent in filter jobs.
+    pub fn filter_time(&self) -> Duration {
+        self.filter_time
+    }
+
+    /// Total time spent in deflate jobs.
+    pub fn deflate_time(&self) -> Duration {
+        self.deflate_time
+    }
+
+    /// Time the calling thread spent writing compressed data to the
+    /// output sink.
+    pub fn output_time(&self) -> Duration {
+        self.output_time
+    }
+
+    /// Time the calling thread spent waiting on the worker threads,
+    /// in flush() or when write_image_rows() held back new rows.
+    pub fn blocked_time(&self) -> Duration {
+        self.blocked_time
+    }
+
+    /// Time the thread pool's threads spent on anything but this
+    /// encoder's jobs, over the elapsed time.
+    pub fn idle_time(&self) -> Duration {
+        let capacity = self.elapsed * self.threads as u32;
+        capacity.checked_sub(self.filter_time + self.deflate_time)
+                .unwrap_or(Duration::from_secs(0))
+    }
+
+    /// Number of threads in the pool the jobs ran on.
+    pub fn threads(&self) -> usize {
+        self.threads
+    }
+
+    /// Bytes of pixel data taken in, in the source format.
+    pub fn bytes_in(&self) -> u64 {
+        self.bytes_in
+    }
+
+    /// Bytes of filtered rows passed to the deflate jobs.
+    pub fn bytes_filtered(&self) -> u64 {
+        self.bytes_filtered
+    }
+
+    /// Bytes of compressed image data written out.
+    pub fn bytes_out(&self) -> u64 {
+        self.bytes_out
+    }
+
+    /// Number of rows filtered with each filter type, indexed
+    /// by the Filter value.
+    pub fn filter_counts(&self) -> [u64; 5] {
+        self.filter_counts
+    }
+
+    /// Job timings for each chunk compressed, in output order.
+    pub fn chunks(&self) -> &[ChunkStats] {
+        &self.chunks
+    }
+
+    /// Number of chunks whose compressed data came from a ChunkCache.
+    pub fn chunks_reused(&self) -> usize {
+        self.chunks_reused
+    }
+}
+
+impl Stats {
+    //
+    // Count in a chunk's jobs as its output is written.
+    //
+    fn add_chunk(&mut self, chunk: &DeflateChunk) {
+        let filter = chunk.filter_timing.unwrap_or_default();
+        let deflate = chunk.timing.unwrap_or_default();
+        self.filter_time += filter.duration;
+        self.deflate_time += deflate.duration;
+        self.bytes_filtered += chunk.input_len as u64;
+        for (count, &rows) in self.filter_counts.iter_mut().zip(chunk.filters.iter()) {
+            *count += rows as u64;
+        }
+        self.chunks.push(ChunkStats {
+            index: chunk.index,
+            filter,
+            deflate,
+        });
+    }
+}
+
+/// When and on which pool threads one chunk's jobs ran, with start
+/// times relative to the header being written.
+#[derive(Copy, Clone, Debug, Default)]
+pub struct ChunkStats {
+    index: usize,
+    filter: JobTiming,
+    deflate: JobTiming,
+}
+
+impl ChunkStats {
+    /// Chunk number, counting on through interlaced passes and
+    /// animation frames.
+    pub fn index(&self) -> usize {
+        self.index
+    }
+
+    /// Start of the filter job.
+    pub fn filter_start(&self) -> Duration {
+        self.filter.start
+    }
+
+    /// Length of the filter job.
+    pub fn filter_time(&self) -> Duration {
+        self.filter.duration
+    }
+
+    /// Thread pool index the filter job ran on, or None if it ran
+    /// on the calling thread.
+    pub fn filter_thread(&self) -> Option<usize> {
+        self.filter.thread
+    }
+
+    /// Start of the deflate job.
+    pub fn deflate_start(&self) -> Duration {
+        self.deflate.start
+    }
+
+    /// Length of the deflate job.
+    pub fn deflate_time(&self) -> Duration {
+        self.deflate.duration
+    }
+
+    /// Thread pool index the deflate job ran on, or None if it ran
+    /// on the calling thread.
+    pub fn deflate_thread(&self) -> Option<usize> {
+        self.deflate.thread
+    }
+}
+
+#[derive(Copy, Clone, Debug, Default)]
+struct JobTiming {
+    start: Duration,
+    duration: Duration,
+    thread: Option<usize>,
+}
+
+//
+// Run a job, timing it relative to epoch if collecting stats.
+//
+fn timed<T, F>(epoch: Option<Instant>, func: F) -> (T, Option<JobTiming>)
+    where F: FnOnce() -> T
+{
+    match epoch {
+        None => (func(), None),
+        Some(epoch) => {
+            let start = Instant::now();
+            let result = func();
+            let timing = JobTiming {
+                start: start.duration_since(epoch),
+                duration: start.elapsed(),
+                thread: ::rayon::current_thread_index(),
+            };
+            (result, Some(timing))
+        }
+    }
+}
+
+//
+// Whole-image pixel data handed over with write_image(), which the
+// filter jobs read their rows from directly instead of copying.
+//
+trait ImageData: Send + Sync {
+    fn bytes(&self) -> &[u8];
+}
+
+struct SharedImage<T: ?Sized>(Arc<T>);
+
+impl<T> ImageData for SharedImage<T>
+    where T: AsRef<[u8]> + Send + Sync + ?Sized
+{
+    fn bytes(&self) -> &[u8] {
+        (*self.0).as_ref()
+    }
+}
+
+enum PixelRows {
+    // Rows copied in one at a time via write_image_rows(),
+    // packed back to back in a single allocation.
+    Copied(Vec<u8>),
+
+    // A view of the full image, from the given byte offset
+    // and with the given distance in bytes between the starts
+    // of consecutive rows.
+    Shared(Arc<dyn ImageData>, usize, usize),
+
+    // One Adam7 pass of the full image with the given row stride
+    // and header, pulled out by the filter job as it goes.
+    Interlaced(Arc<dyn ImageData>, usize, Header, usize),
+}
+
 // Accumulates a set of pixels, then gets sent off as input
 // to the deflate jobs.
 struct PixelChunk {
@@ -181,16 +764,30 @@ struct PixelChunk {
     start_row: usize,
     end_row: usize,
     is_start: bool,
-    is_end: bool,
+
+    // Whether the chunk starts or ends the compressed stream. Same as
+    // above, except for the passes of an interlaced image, which are
+    // filtered as separate sub-images but compressed as one.
+    stream_start: bool,
+    stream_end: bool,
 
     stride: usize,
 
-    // Rows of pixel data, each with stride bytes per row
-    rows: Vec<Vec<u8>>,
+    // Pixel data in the header's source format, with stride
+    // bytes per row
+    rows: PixelRows,
+
+    // Where to return the copied row buffer when done.
+    pool: BufferPool,
 }
 
 impl PixelChunk {
-    fn new(header: Header, index: usize, start_row: usize, end_row: usize) -> PixelChunk {
+    fn new(header: Header, index: usize, start_row: usize, end_row: usize, pool: &BufferPool) -> PixelChunk {
+        let rows = PixelRows::Copied(pool.take((end_row - start_row) * header.source_stride()));
+        PixelChunk::with_rows(header, index, start_row, end_row, rows, pool)
+    }
+
+    fn with_rows(header: Header, index: usize, start_row: usize, end_row: usize, rows: PixelRows, pool: &BufferPool) -> PixelChunk {
         assert!(start_row <= end_row);
 
         let height = header.height as usize;
@@ -203,24 +800,50 @@ impl PixelChunk {
             start_row,
             end_row,
             is_start: start_row == 0,
-            is_end: end_row == height,
+            stream_start: start_row == 0,
+            stream_end: end_row == height,
 
-            stride: header.stride(),
+            stride: header.source_stride(),
 
-            rows: Vec::with_capacity(end_row - start_row),
+            rows,
+            pool: pool.clone(),
         }
     }
 
     fn is_full(&self) -> bool {
-        self.rows.len() == (self.end_row - self.start_row)
+        match self.rows {
+            PixelRows::Copied(ref data) => data.len() == (self.end_row - self.start_row) * self.stride,
+            PixelRows::Shared(..) | PixelRows::Interlaced(..) => true,
+        }
     }
 
     fn read_row(&mut self, row: &[u8])
     {
-        let mut row_copy = Vec::with_capacity(self.stride);
-        row_copy.extend_from_slice(row);
+        match self.rows {
+            PixelRows::Copied(ref mut data) => data.extend_from_slice(row),
+            PixelRows::Shared(..) | PixelRows::Interlaced(..) => {
+                panic!("Tried to copy a row into a shared image chunk")
+            },
+        }
+    }
+
+    //
+    // Whether the rows match another image's chunk, to spot them
+    // changing between images.
+    //
+    fn same_rows(&self, other: &PixelChunk) -> bool {
+        self.start_row == other.start_row &&
+            self.end_row == other.end_row &&
+            (self.start_row .. self.end_row).all(|row| {
+                self.get_row(row) == other.get_row(row)
+            })
+    }
 
-        self.rows.push(row_copy);
+    fn pass(&self) -> usize {
+        match self.rows {
+            PixelRows::Interlaced(_, _, _, pass) => pass,
+            _ => 0,
+        }
     }
 
     fn get_row(&self, row: usize) -> &[u8] {
@@ -229,22 +852,143 @@ impl PixelChunk {
         } else if row >= self.end_row {
             panic!("Tried to access row from later chunk: {} >= {}", row, self.end_row);
         } else {
-            &self.rows[row - self.start_row]
+            match self.rows {
+                PixelRows::Copied(ref data) => {
+                    let start = (row - self.start_row) * self.stride;
+                    &data[start .. start + self.stride]
+                },
+                PixelRows::Shared(ref image, offset, row_stride) => {
+                    let start = offset + row * row_stride;
+                    &image.bytes()[start .. start + self.stride]
+                },
+                PixelRows::Interlaced(..) => {
+                    panic!("Tried to access a row of an interlaced pass directly")
+                },
+            }
+        }
+    }
+
+    //
+    // Pull the given rows of an interlaced pass out of the full image,
+    // packed back to back. May start before this chunk's own rows.
+    //
+    fn extract_rows(&self, start_row: usize, end_row: usize) -> Vec<u8> {
+        match self.rows {
+            PixelRows::Interlaced(ref image, row_stride, ref header, pass) => {
+                let len = (end_row - start_row) * self.stride;
+                let mut data = self.pool.take(len);
+                data.resize(len, 0);
+
+                let src_stride = header.source_stride();
+                let format = header.source_format();
+                let mut converted = match format {
+                    SourceFormat::Packed => Vec::new(),
+                    _ => vec![0u8; header.stride()],
+                };
+                let bytes = image.bytes();
+                for (row, dest) in (start_row .. end_row).zip(data.chunks_mut(self.stride)) {
+                    let start = interlace::source_row(pass, row) * row_stride;
+                    let src = &bytes[start .. start + src_stride];
+                    if let SourceFormat::Packed = format {
+                        interlace::extract_row(header, pass, src, dest);
+                    } else {
+                        convert::convert_row(format, src, &mut converted);
+                        interlace::extract_row(header, pass, &converted, dest);
+                    }
+                }
+                data
+            },
+            _ => panic!("Tried to extract rows from a non-interlaced chunk"),
         }
     }
 }
 
+impl Drop for PixelChunk {
+    fn drop(&mut self) {
+        if let PixelRows::Copied(ref mut data) = self.rows {
+            self.pool.give_from(data);
+        }
+    }
+}
+
+//
+// The filter modes and deflate strategies each chunk is compressed
+// with in search mode, keeping whichever comes out smallest.
+//
+struct Search {
+    filters: Vec<Mode<Filter>>,
+    strategies: Vec<Strategy>,
+    backend: Backend,
+    compression_level: CompressionLevel,
+}
+
+impl Search {
+    //
+    // Compressed size of a chunk's filtered data on its own, to pick
+    // a filter mode before the previous chunk's data is settled. Each
+    // is paired with the strategy the encoder would pick for it, so
+    // the usual choice is always among them; the strategy is searched
+    // again later, with the previous chunk's data as a dictionary.
+    //
+    fn trial_size(&self, mode: Mode<Filter>, data: &[u8], pool: &BufferPool) -> io::Result<usize> {
+        let mut options = deflate::Options::new();
+        options.set_window_bits(-15);
+        match self.compression_level {
+            CompressionLevel::Default => {},
+            CompressionLevel::Fast => options.set_level(1),
+            CompressionLevel::High => options.set_level(9),
+        }
+        options.set_strategy(match (&self.strategies[..], mode) {
+            (&[strategy], _) => strategy,
+            (_, Fixed(Filter::None)) => Strategy::Default,
+            _ => Strategy::Filtered,
+        });
+
+        let mut encoder = deflate::compressor(self.backend, options)?;
+        let bound = encoder.bound(data.len())?;
+        *encoder.output() = pool.take(bound);
+        encoder.write(data, Flush::Finish)?;
+        let output = encoder.finish()?;
+        let size = output.len();
+        pool.give(output);
+        Ok(size)
+    }
+}
+
+//
+// Map func over the items, splitting them in halves with rayon::join
+// so idle threads in the pool the job is running on can take them.
+//
+fn par_map<T, R, F>(items: &[T], func: &F) -> Vec<R>
+    where T: Sync, R: Send, F: Fn(&T) -> R + Sync
+{
+    if items.len() <= 1 {
+        return items.iter().map(func).collect();
+    }
+    let (left, right) = items.split_at(items.len() / 2);
+    let (mut results, rest) = ::rayon::join(|| par_map(left, func), || par_map(right, func));
+    results.extend(rest);
+    results
+}
+
 // Takes pixel chunks as input and accumulates filtered output.
 struct FilterChunk {
     index: usize,
     start_row: usize,
     end_row: usize,
-    is_start: bool,
-    is_end: bool,
+    stream_start: bool,
+    stream_end: bool,
 
     stride: usize,
     filter_mode: Mode<Filter>,
 
+    // Filter the first row without looking at the one above,
+    // for the chunk index.
+    standalone: bool,
+
+    // Filter modes to try instead, in search mode.
+    search: Option<Arc<Search>>,
+
     // The input pixels for chunk n-1
     // Needed for its last row only.
     prior_input: Option<Arc<PixelChunk>>,
@@ -254,30 +998,46 @@ struct FilterChunk {
 
     // Filtered output bytes
     data: Vec<u8>,
-}
+
+    // Rows filtered with each filter type, and when the job ran
+    // if collecting stats.
+    filters: [u32; 5],
+    timing: Option<JobTiming>,
+
+    pool: BufferPool,
+}
 
 impl FilterChunk {
     fn new(prior_input: Option<Arc<PixelChunk>>,
            input: Arc<PixelChunk>,
-           filter_mode: Mode<Filter>) -> FilterChunk
+           filter_mode: Mode<Filter>,
+           pool: BufferPool) -> FilterChunk
     {
         // Prepend one byte for the filter selector.
-        let stride = input.stride + 1;
+        let stride = input.header.stride() + 1;
         let nbytes = stride * (input.end_row - input.start_row);
 
+        let mut data = pool.take(nbytes);
+        data.resize(nbytes, 0);
+
         FilterChunk {
             index: input.index,
             start_row: input.start_row,
             end_row: input.end_row,
-            is_start: input.is_start,
-            is_end: input.is_end,
+            stream_start: input.stream_start,
+            stream_end: input.stream_end,
 
             stride,
             filter_mode,
+            standalone: false,
+            search: None,
 
             prior_input,
             input,
-            data: Vec::with_capacity(nbytes),
+            data,
+            filters: [0; 5],
+            timing: None,
+            pool,
         }
     }
 
@@ -293,87 +1053,280 @@ impl FilterChunk {
         }
     }
 
+    //
+    // Convert rows from first to the end of the chunk out of the
+    // source format, taking any before the chunk from the prior one.
+    //
+    fn convert_rows(&self, format: SourceFormat, first: usize) -> Vec<u8> {
+        let pixel_stride = self.stride - 1;
+        let len = (self.end_row - first) * pixel_stride;
+        let mut data = self.pool.take(len);
+        data.resize(len, 0);
+
+        let prior = self.prior_input.as_ref().unwrap_or(&self.input);
+        for (row, dest) in (first .. self.end_row).zip(data.chunks_mut(pixel_stride)) {
+            let src = if row < self.start_row {
+                prior.get_row(row)
+            } else {
+                self.input.get_row(row)
+            };
+            convert::convert_row(format, src, dest);
+        }
+        data
+    }
+
     //
     // Run the filtering, on a background thread.
     //
     fn run(&mut self) -> IoResult {
-        let mut filter = AdaptiveFilter::new(self.input.header, self.filter_mode);
-        let zero = vec![0u8; self.stride - 1];
-        for i in self.start_row .. self.end_row {
-            let prior = if i == self.start_row {
-                match self.prior_input {
-                    Some(ref input) => &input,
-                    None => &self.input, // Won't get used.
+        let pixel_stride = self.stride - 1;
+        let zero = vec![0u8; pixel_stride];
+        let start_row = self.start_row;
+
+        // Interlaced passes aren't laid out as rows in the caller's
+        // image, and other source formats need converting, so gather
+        // this chunk's rows and the one it's filtered against here,
+        // in parallel with the other chunks.
+        let first = if start_row == 0 { 0 } else { start_row - 1 };
+        let extracted = match (&self.input.rows, self.input.header.source_format()) {
+            (&PixelRows::Interlaced(..), _) => Some((first, self.input.extract_rows(first, self.end_row))),
+            (_, SourceFormat::Packed) => None,
+            (_, format) => Some((first, self.convert_rows(format, first))),
+        };
+
+        {
+            let input = &self.input;
+            let prior = self.prior_input.as_ref().unwrap_or(input);
+            let get_row = |row: usize| -> &[u8] {
+                match extracted {
+                    Some((first, ref data)) => {
+                        let start = (row - first) * pixel_stride;
+                        &data[start .. start + pixel_stride]
+                    },
+                    None if row < start_row => prior.get_row(row),
+                    None => input.get_row(row),
                 }
-            } else {
-                &self.input
             };
-            let prev = if i == 0 {
-                &zero
-            } else {
-                prior.get_row(i - 1)
+
+            let standalone = self.standalone;
+            let filter_rows = |mode: Mode<Filter>, data: &mut [u8], filters: &mut [u32; 5]| {
+                let filter = AdaptiveFilter::new(input.header, mode);
+                let rows = start_row .. start_row + data.len() / (pixel_stride + 1);
+                for (i, output) in rows.zip(data.chunks_mut(pixel_stride + 1)) {
+                    let chosen = if i == 0 {
+                        filter.filter_into(&zero, get_row(i), output)
+                    } else if i == start_row && standalone {
+                        filter.filter_standalone_into(&zero, get_row(i), output)
+                    } else {
+                        filter.filter_into(get_row(i - 1), get_row(i), output)
+                    };
+                    filters[chosen as usize] += 1;
+                }
             };
 
-            let row = self.input.get_row(i);
+            match self.search {
+                None => filter_rows(self.filter_mode, &mut self.data, &mut self.filters),
+                Some(ref search) => {
+                    // Filter the chunk every way in parallel, and keep
+                    // whichever compresses smallest on its own.
+                    let pool = &self.pool;
+                    let len = self.data.len();
+                    let trials = par_map(&search.filters, &|&mode| -> io::Result<_> {
+                        let mut data = pool.take(len);
+                        data.resize(len, 0);
+                        let mut filters = [0u32; 5];
+                        filter_rows(mode, &mut data, &mut filters);
+                        let size = search.trial_size(mode, &data, pool)?;
+                        Ok((size, data, filters))
+                    });
 
-            let output = filter.filter(prev, row);
+                    let mut best: Option<(usize, Vec<u8>, [u32; 5])> = None;
+                    for trial in trials {
+                        let trial = trial?;
+                        let better = match best {
+                            Some(ref best) => trial.0 < best.0,
+                            None => true,
+                        };
+                        if !better {
+                            pool.give(trial.1);
+                        } else if let Some((_, data, _)) = best.replace(trial) {
+                            pool.give(data);
+                        }
+                    }
+                    let (_, data, filters) = best.unwrap();
+                    pool.give(mem::replace(&mut self.data, data));
+                    self.filters = filters;
+                },
+            }
+        }
 
-            self.data.write_all(output)?
+        if let Some((_, data)) = extracted {
+            self.pool.give(data);
         }
         Ok(())
     }
 }
 
+impl Drop for FilterChunk {
+    fn drop(&mut self) {
+        self.pool.give_from(&mut self.data);
+    }
+}
+
 // Takes filter chunks as input and accumulates compressed output.
 struct DeflateChunk {
     index: usize,
     is_start: bool,
     is_end: bool,
 
+    // Rows of the image, or pass of an interlaced one, for the
+    // chunk index.
+    pass: usize,
+    start_row: usize,
+    end_row: usize,
+
+    backend: Backend,
     compression_level: CompressionLevel,
     strategy: Strategy,
 
+    // Strategies to try instead in search mode, keeping
+    // the smallest output.
+    strategies: Vec<Strategy>,
+
+    // Bytes of input between early sync flushes, or 0.
+    flush_interval: usize,
+
     // The filtered pixels for chunk n-1
     // Empty on first chunk.
     // Needed for its last row only.
     prior_input: Option<Arc<FilterChunk>>,
 
     // The filtered pixels for chunk n
-    input: Arc<FilterChunk>,
+    // Released once compressed, as the output may be kept
+    // around until the end of the image.
+    input: Option<Arc<FilterChunk>>,
+    input_len: usize,
 
-    // Compressed output bytes
+    // Compressed output bytes, after any pieces emitted early
     data: Vec<u8>,
 
     // Checksum of this chunk
     adler32: u32,
+
+    // PNG chunk checksum of the compressed output
+    crc32: u32,
+
+    // Carried over from the filter job for stats, with this job's
+    // own timing.
+    filters: [u32; 5],
+    filter_timing: Option<JobTiming>,
+    timing: Option<JobTiming>,
+
+    pool: BufferPool,
 }
 
 impl DeflateChunk {
-    fn new(compression_level: CompressionLevel,
+    fn new(backend: Backend,
+           compression_level: CompressionLevel,
            strategy: Strategy,
+           flush_interval: usize,
            prior_input: Option<Arc<FilterChunk>>,
-           input: Arc<FilterChunk>) -> DeflateChunk {
+           input: Arc<FilterChunk>,
+           pool: BufferPool) -> DeflateChunk {
 
         DeflateChunk {
             index: input.index,
-            is_start: input.is_start,
-            is_end: input.is_end,
+            is_start: input.stream_start,
+            is_end: input.stream_end,
+
+            pass: input.input.pass(),
+            start_row: input.start_row,
+            end_row: input.end_row,
 
+            backend,
             compression_level,
             strategy,
+            strategies: Vec::new(),
+            flush_interval,
 
             prior_input,
-            input,
+            input_len: input.data.len(),
+            filters: input.filters,
+            filter_timing: input.timing,
+            input: Some(input),
             data: Vec::new(),
             adler32: deflate::adler32_initial(),
+            crc32: deflate::crc32_initial(),
+            timing: None,
+            pool,
         }
     }
 
-    fn run(&mut self) -> IoResult {
-        // Run the deflate!
-        // Todo: don't create an empty vector earlier, but reuse it sanely.
-        let data = Vec::<u8>::new();
+    //
+    // Compress the chunk. With a flush interval, each piece but the
+    // last is handed to emit with its PNG chunk checksum as soon as
+    // it's flushed; the last one is left in data.
+    //
+    fn run<F>(&mut self, emit: F) -> IoResult
+        where F: FnMut(Vec<u8>, u32)
+    {
+        let prior_input = self.prior_input.take();
+        let input = match self.input.take() {
+            Some(input) => input,
+            None => return Err(other("Deflate chunk already run")),
+        };
+        let prior = prior_input.as_ref().map(|filter| &**filter);
+
+        let data = if self.strategies.len() > 1 {
+            // Compress with each strategy in parallel and keep the
+            // smallest. Nothing is emitted early, as it could turn
+            // out to be the wrong one.
+            let pool = &self.pool;
+            let trials = par_map(&self.strategies, &|&strategy| {
+                self.compress(&input, prior, strategy, |_, _| {})
+            });
+            let mut best: Option<Vec<u8>> = None;
+            for trial in trials {
+                let trial = trial?;
+                let better = match best {
+                    Some(ref best) => trial.len() < best.len(),
+                    None => true,
+                };
+                if !better {
+                    pool.give(trial);
+                } else if let Some(data) = best.replace(trial) {
+                    pool.give(data);
+                }
+            }
+            best.unwrap()
+        } else {
+            self.compress(&input, prior, self.strategy, emit)?
+        };
+
+        // In raw deflate mode we have to calculate the checksum ourselves.
+        self.adler32 = deflate::adler32(1, &input.data);
+
+        // This seems lame to move the vector back, but it's actually cheap.
+        self.data = data;
+
+        // Checksum here on a worker thread rather than
+        // serially over the whole IDAT at the end.
+        self.crc32 = deflate::crc32(self.crc32, &self.data);
+        Ok(())
+    }
 
+    //
+    // Deflate the filtered input with the given strategy, returning
+    // what's left after any pieces handed to emit.
+    //
+    fn compress<F>(&self,
+                   input: &FilterChunk,
+                   prior_input: Option<&FilterChunk>,
+                   strategy: Strategy,
+                   mut emit: F) -> io::Result<Vec<u8>>
+        where F: FnMut(Vec<u8>, u32)
+    {
+        // Run the deflate!
         let mut options = deflate::Options::new();
 
         options.set_window_bits(if self.is_start {
@@ -390,148 +1343,424 @@ impl DeflateChunk {
             CompressionLevel::Fast => options.set_level(1),
             CompressionLevel::High => options.set_level(9),
         }
-        options.set_strategy(self.strategy);
+        options.set_strategy(strategy);
 
-        let mut encoder = Deflate::new(options, data);
+        let mut encoder = deflate::compressor(self.backend, options)?;
 
+        // Size the output buffer up front so it never has to grow.
+        // The bound assumes a single Finish; leave room for a SyncFlush.
+        let bound = encoder.bound(input.data.len())? + 16;
+        *encoder.output() = self.pool.take(bound);
 
-        if let Some(ref filter) = self.prior_input {
+        if let Some(filter) = prior_input {
             let trailer = filter.get_trailer();
             encoder.set_dictionary(trailer)?;
         }
 
-        encoder.write(&self.input.data, if self.is_end {
+        // Pieces are whole rows, so the data for the next ones
+        // lines up with the image for a progressive decoder.
+        let piece = match self.flush_interval {
+            0 => input.data.len(),
+            n => input.stride * cmp::max(n / input.stride, 1),
+        };
+        let len = input.data.len();
+        let mut start = 0;
+        while len - start > piece {
+            let end = start + piece;
+            encoder.write(&input.data[start .. end], Flush::SyncFlush)?;
+
+            let bound = encoder.bound(len - end)? + 16;
+            let part = mem::replace(encoder.output(), self.pool.take(bound));
+            let crc = deflate::crc32(deflate::crc32_initial(), &part);
+            emit(part, crc);
+            start = end;
+        }
+        encoder.write(&input.data[start ..], if self.is_end {
             Flush::Finish
         } else {
             Flush::SyncFlush
         })?;
 
-        // In raw deflate mode we have to calculate the checksum ourselves.
-        self.adler32 = deflate::adler32(1, &self.input.data);
+        encoder.finish()
+    }
+}
 
-        match encoder.finish() {
-            Ok(data) => {
-                // This seems lame to move the vector back, but it's actually cheap.
-                self.data = data;
-                Ok(())
-            },
-            Err(e) => Err(e)
+impl Drop for DeflateChunk {
+    fn drop(&mut self) {
+        self.pool.give_from(&mut self.data);
+    }
+}
+
+//
+// Bounding rectangle of the pixels that differ between two images
+// in the given header's source format, as (x, y, width, height). Comes out
+// as a single pixel if they're the same, as frames can't be empty.
+//
+fn changed_rect(header: &Header, last: &[u8], next: &[u8]) -> (u32, u32, u32, u32) {
+    let stride = header.source_stride();
+    let bpp = stride / header.width as usize;
+
+    let mut top = None;
+    let mut bottom = 0;
+    let mut left = stride;
+    let mut right = 0;
+    for (y, (a, b)) in last.chunks(stride).zip(next.chunks(stride)).enumerate() {
+        if a == b {
+            continue;
         }
+        let first = a.iter().zip(b).position(|(p, q)| p != q).unwrap();
+        let last = a.iter().zip(b).rposition(|(p, q)| p != q).unwrap();
+        top.get_or_insert(y);
+        bottom = y;
+        left = cmp::min(left, first / bpp);
+        right = cmp::max(right, last / bpp);
+    }
+    match top {
+        Some(top) => (left as u32, top as u32, (right - left + 1) as u32, (bottom - top + 1) as u32),
+        None => (0, 0, 1, 1),
     }
 }
 
 //
-// List of completed chunks, which may come in in any order
-// but are returned in original order, in pairs with the
-// prior chunk when available.
+// Fixed-size ring of filtered chunks shared between the encoder and
+// its worker threads, indexed by chunk number modulo the ring size.
 //
-// The prior chunk is passed around because filtering and
-// deflating jobs need the end (last row, or last 32 KiB)
-// of the previous chunk's input as well as their own.
+// The deflate job for chunk n needs the filtered output of chunks
+// n-1 and n, since it continues from the end of the previous one.
+// Whichever of the two filter jobs finishes last spawns it straight
+// from its worker thread, without a round trip through the encoder.
 //
-struct ChunkMap<T> {
-    cursor_in: usize,
-    cursor_out: usize,
-    running: usize,
+// The encoder keeps fewer than len chunks between starting their
+// filter job and writing out their compressed data, so a slot is
+// never reused while its previous occupant may still be read.
+//
+struct FilterSlot {
+    // From Arc::into_raw(), or null when empty.
+    chunk: AtomicPtr<FilterChunk>,
+
+    // Filter jobs left to land before this chunk's deflate job
+    // can start: this one and the previous one.
+    pending: AtomicUsize,
 
-    // todo use a VecDeque for this maybe
-    live_chunks: HashMap<usize, Arc<T>>,
+    // Deflate jobs left to take a reference to this chunk:
+    // this one and the next one.
+    users: AtomicUsize,
+
+    // Which of those deflate jobs to run, as bits: 1 for this
+    // chunk's, 2 for the next one's. Set up by prepare().
+    deflates: AtomicUsize,
+}
+
+struct ChunkRing {
+    slots: Vec<FilterSlot>,
+
+    // Filter and deflate jobs queued and running.
+    running: AtomicUsize,
 }
 
-impl<T> ChunkMap<T> {
-    fn new() -> ChunkMap<T> {
-        ChunkMap {
-            cursor_in: 0,
-            cursor_out: 0,
-            running: 0,
-            live_chunks: HashMap::new(),
+impl ChunkRing {
+    fn new(len: usize) -> ChunkRing {
+        let slots = (0 .. len).map(|_| FilterSlot {
+            chunk: AtomicPtr::new(ptr::null_mut()),
+            pending: AtomicUsize::new(0),
+            users: AtomicUsize::new(0),
+            deflates: AtomicUsize::new(0),
+        }).collect();
+        ChunkRing {
+            slots,
+            running: AtomicUsize::new(0),
         }
     }
 
-    fn in_flight(&self) -> bool {
-        self.cursor_in > self.cursor_out
+    fn len(&self) -> usize {
+        self.slots.len()
+    }
+
+    fn slot(&self, index: usize) -> &FilterSlot {
+        &self.slots[index % self.slots.len()]
     }
 
     fn running_jobs(&self) -> usize {
-        self.running
+        self.running.load(Ordering::SeqCst)
+    }
+
+    //
+    // Called before spawning the filter job for this chunk. It may
+    // land before the next chunk's filter job is spawned, so set up
+    // that one's slot too.
+    //
+    // Chunks at the start of an image or animation frame don't
+    // continue from the one before. With a chunk cache, a chunk may
+    // only be filtered for the next one's deflate job, or the next
+    // one may not need one; it never does after the end of a frame.
+    //
+    fn prepare(&self, index: usize, is_start: bool, deflate: bool, deflate_next: bool) {
+        let slot = self.slot(index);
+        if deflate && is_start {
+            slot.pending.store(1, Ordering::Relaxed);
+        }
+        if deflate_next {
+            self.slot(index + 1).pending.store(2, Ordering::Relaxed);
+        }
+        let deflates = deflate as usize | (deflate_next as usize) << 1;
+        slot.deflates.store(deflates, Ordering::Relaxed);
     }
 
     //
-    // Record that this job is now in-flight
+    // Store a filtered chunk, and return whether the deflate jobs
+    // for it and for the following chunk are ready to spawn.
     //
-    fn advance(&mut self) {
-        self.cursor_in += 1;
-        self.running += 1;
+    fn land(&self, chunk: Arc<FilterChunk>) -> (bool, bool) {
+        let index = chunk.index;
+        let slot = self.slot(index);
+        let deflates = slot.deflates.load(Ordering::Relaxed);
+        let deflate = deflates & 1 != 0;
+        let deflate_next = deflates & 2 != 0;
+
+        slot.users.store(deflate as usize + deflate_next as usize, Ordering::Relaxed);
+        slot.chunk.store(Arc::into_raw(chunk) as *mut FilterChunk, Ordering::Release);
+
+        // Whichever side counts down to 0 has seen both chunks.
+        let ready = deflate &&
+            slot.pending.fetch_sub(1, Ordering::AcqRel) == 1;
+        let next_ready = deflate_next &&
+            self.slot(index + 1).pending.fetch_sub(1, Ordering::AcqRel) == 1;
+        (ready, next_ready)
     }
 
     //
-    // Record that this job has landed and save its data.
+    // Get a reference to a landed chunk for a deflate job, dropping
+    // the ring's own reference once both jobs needing it have theirs.
     //
-    fn land(&mut self, index: usize, chunk: Arc<T>) {
-        if index < self.cursor_out {
-            panic!("Tried to land an expired chunk");
+    fn take(&self, index: usize) -> Arc<FilterChunk> {
+        let slot = self.slot(index);
+        let raw = slot.chunk.load(Ordering::Acquire);
+        let chunk = unsafe {
+            let ring_ref = Arc::from_raw(raw);
+            let chunk = Arc::clone(&ring_ref);
+            mem::forget(ring_ref);
+            chunk
+        };
+        if slot.users.fetch_sub(1, Ordering::AcqRel) == 1 {
+            slot.chunk.store(ptr::null_mut(), Ordering::Relaxed);
+            unsafe {
+                drop(Arc::from_raw(raw));
+            }
         }
-        if index > self.cursor_in {
-            panic!("Tried to land a future chunk");
+        chunk
+    }
+}
+
+impl Drop for ChunkRing {
+    fn drop(&mut self) {
+        // Chunks left over after a failed or abandoned encode.
+        for slot in &self.slots {
+            let raw = slot.chunk.swap(ptr::null_mut(), Ordering::Acquire);
+            if !raw.is_null() {
+                unsafe {
+                    drop(Arc::from_raw(raw));
+                }
+            }
         }
-        self.running -= 1;
-        match self.live_chunks.insert(index, chunk) {
-            None => {},
-            Some(_x) => panic!("Tried to re-append an existing chunk"),
+    }
+}
+
+//
+// State shared with the worker threads for an image.
+//
+struct Pipeline {
+    ring: ChunkRing,
+
+    backend: Backend,
+    compression_level: CompressionLevel,
+    strategy: Strategy,
+    flush_interval: usize,
+    search: Option<Arc<Search>>,
+    chunk_affinity: bool,
+    buffer_pool: BufferPool,
+
+    // Where jobs are queued, if sharing a scheduler.
+    scheduler: Option<scheduler::Client>,
+
+    // Start of the encode, if timing the jobs for stats.
+    epoch: Option<Instant>,
+
+    // Called after each job finishes, once finish_async() has
+    // handed the rest of the encode to the worker threads.
+    notify: Mutex<Option<Arc<dyn Fn() + Send + Sync>>>,
+}
+
+impl Pipeline {
+    //
+    // Queue a job on the scheduler if there is one, and hand whatever
+    // should start running now to spawn.
+    //
+    fn submit<F, S>(&self, job: F, spawn: S)
+        where F: FnOnce() + Send + 'static,
+              S: FnOnce(scheduler::Job)
+    {
+        match self.scheduler {
+            Some(ref client) => {
+                if let Some(runner) = client.submit(Box::new(job)) {
+                    spawn(runner);
+                }
+            },
+            None => spawn(Box::new(job)),
         }
     }
 
-    fn get(&self, index: usize) -> Option<Arc<T>> {
-        match self.live_chunks.get(&index) {
-            Some(item) => Some(Arc::clone(item)),
-            _ => None,
+    fn notify(&self) {
+        let func = self.notify.lock().unwrap().clone();
+        if let Some(func) = func {
+            func();
         }
     }
+}
 
-    fn retire(&mut self, index: usize) {
-        self.live_chunks.remove(&index);
+//
+// Land a filtered chunk on a worker thread, and spawn any deflate
+// jobs it completes the input for. With chunk affinity, its own
+// deflate runs here instead, once the next chunk's is handed off.
+//
+fn filter_done(pipeline: &Arc<Pipeline>, chunk: Arc<FilterChunk>, tx: &Sender<ThreadMessage>) {
+    let index = chunk.index;
+    let (ready, next_ready) = pipeline.ring.land(chunk);
+    if ready && !pipeline.chunk_affinity {
+        spawn_deflate(pipeline, index, tx);
+    }
+    if next_ready {
+        spawn_deflate(pipeline, index + 1, tx);
     }
+    if ready && pipeline.chunk_affinity {
+        deflate_job(pipeline, index, tx)();
+    }
+}
 
-    fn pop_front(&mut self) -> Option<(Option<Arc<T>>, Arc<T>)> {
-        let index = self.cursor_out;
-        let current = self.get(index);
-        if index > 0 {
-            let prev = self.get(index - 1);
-            match (prev, current) {
-                (Some(p), Some(c)) => {
-                    // Next pipeline stage needs the current
-                    // and previous items from this stage.
-                    self.cursor_out += 1;
-                    let prev_chunk = p.clone();
-                    let cur_chunk = c.clone();
+fn spawn_deflate(pipeline: &Arc<Pipeline>, index: usize, tx: &Sender<ThreadMessage>) {
+    pipeline.submit(deflate_job(pipeline, index, tx), |job| {
+        // Goes to the same thread pool as the filter job we're on.
+        ::rayon::spawn(job);
+    });
+}
+
+fn deflate_job(pipeline: &Arc<Pipeline>, index: usize, tx: &Sender<ThreadMessage>) -> impl FnOnce() + Send + 'static {
+    let ring = &pipeline.ring;
+    let current = ring.take(index);
+    let previous = if current.stream_start {
+        None
+    } else {
+        Some(ring.take(index - 1))
+    };
+
+    let mut deflate = DeflateChunk::new(pipeline.backend,
+                                        pipeline.compression_level,
+                                        pipeline.strategy,
+                                        pipeline.flush_interval,
+                                        previous,
+                                        current,
+                                        pipeline.buffer_pool.clone());
+    if let Some(ref search) = pipeline.search {
+        deflate.strategies = search.strategies.clone();
+    }
+    let shared = Arc::clone(pipeline);
+    let tx = tx.clone();
+    ring.running.fetch_add(1, Ordering::SeqCst);
+
+    move || {
+        let (result, timing) = timed(shared.epoch, || {
+            deflate.run(|data, crc| {
+                let _ = tx.send(ThreadMessage::DeflatePart(index, data, crc));
+                shared.notify();
+            })
+        });
+        deflate.timing = timing;
+        let message = match result {
+            Ok(()) => ThreadMessage::DeflateDone(Arc::new(deflate)),
+            Err(e) => ThreadMessage::Error(e),
+        };
+        shared.ring.running.fetch_sub(1, Ordering::SeqCst);
 
-                    // Drop the previous item off the list;
-                    // it'll be kept alive by whatever needs
-                    // it while they run.
-                    self.retire(index - 1);
+        // The encoder may already have been dropped.
+        let _ = tx.send(message);
+        shared.notify();
+    }
+}
 
-                    Some((Some(prev_chunk), cur_chunk))
-                },
-                _ => {
-                    None
-                }
+//
+// Encoder handed over by finish_async(), woken up by its jobs.
+//
+struct FinishTask<W: Write + Send + 'static> {
+    encoder: Mutex<Option<Encoder<'static, W>>>,
+    error: Mutex<Option<io::Error>>,
+    done: Mutex<Option<Box<dyn FnOnce(io::Result<W>) + Send>>>,
+
+    // Wakeups not yet handled; whoever raises it from 0 steps the
+    // encoder until it comes back down, so no wakeup is lost and
+    // only one thread writes output at a time.
+    wakeups: AtomicUsize,
+}
+
+impl<W: Write + Send + 'static> FinishTask<W> {
+    fn wake(&self) {
+        if self.wakeups.fetch_add(1, Ordering::SeqCst) > 0 {
+            return;
+        }
+        loop {
+            let seen = self.wakeups.load(Ordering::SeqCst);
+            self.step();
+            if self.wakeups.fetch_sub(seen, Ordering::SeqCst) == seen {
+                break;
             }
-        } else {
-            match current {
-                Some(c) => {
-                    self.cursor_out += 1;
-                    Some((None, c.clone()))
+        }
+    }
+
+    fn step(&self) {
+        let result = {
+            let mut guard = self.encoder.lock().unwrap();
+            let mut error = self.error.lock().unwrap();
+            let complete = match *guard {
+                Some(ref mut encoder) => {
+                    if error.is_none() {
+                        if let Err(e) = encoder.dispatch(DispatchMode::NonBlocking) {
+                            *error = Some(e);
+                        } else if encoder.chunks_output == encoder.pixel_index
+                               && !encoder.is_finished() {
+                            *error = Some(other("Incomplete image input"));
+                        }
+                    }
+                    match *error {
+                        // Jobs may still be reading the input.
+                        Some(_) => encoder.running_jobs() == 0,
+                        None => encoder.is_finished(),
+                    }
                 },
-                _ => {
-                    None
+                None => false,
+            };
+            if !complete {
+                return;
+            }
+
+            let encoder = guard.take().unwrap();
+            if let Some(ref pipeline) = encoder.pipeline {
+                // Break the cycle back to us.
+                *pipeline.notify.lock().unwrap() = None;
+            }
+            match error.take() {
+                Some(e) => Err(e),
+                None => {
+                    let mut writer = encoder.writer;
+                    writer.write_end().and_then(|_| writer.finish())
                 }
             }
+        };
+        if let Some(done) = self.done.lock().unwrap().take() {
+            done(result);
         }
     }
 }
 
 enum ThreadMessage {
-    FilterDone(Arc<FilterChunk>),
+    DeflatePart(usize, Vec<u8>, u32),
     DeflateDone(Arc<DeflateChunk>),
     Error(io::Error),
 }
@@ -547,6 +1776,103 @@ enum RowStatus {
     Done,
 }
 
+//
+// A chunk between landing its input and writing out its output.
+//
+struct OutputSlot {
+    // Compressed output, once it comes in.
+    chunk: Option<Arc<DeflateChunk>>,
+
+    // Pieces of it flushed early, with their checksums,
+    // waiting for the chunks before them to be written,
+    // and the length of those written so far.
+    parts: Vec<(Vec<u8>, u32)>,
+    early_len: u64,
+
+    // Set on the first chunk of a frame until anything of
+    // it has been written, so its frame control goes first.
+    frame_start: bool,
+
+    // Estimated memory held for it, from chunk_memory().
+    memory: usize,
+
+    // Its output came from a ChunkCache, so took no jobs.
+    reused: bool,
+}
+
+//
+// APNG state, once write_animation_control() has been called.
+//
+struct Animation {
+    num_frames: u32,
+
+    // Frame controls written by the caller so far.
+    frames: u32,
+
+    // Frame controls of frames whose output hasn't started yet, in
+    // order. The default image has None unless it's the first frame.
+    queue: VecDeque<Option<FrameControl>>,
+
+    // Shared by the fcTL and fdAT chunks.
+    sequence: u32,
+
+    // The default image has been written as IDAT, so image data
+    // for the frames after it goes in fdAT chunks.
+    wrote_idat: bool,
+
+    // Input of the last frame written with write_frame_diff().
+    last_frame: Option<Arc<dyn ImageData>>,
+}
+
+impl Animation {
+    fn next_sequence(&mut self) -> u32 {
+        let sequence = self.sequence;
+        self.sequence += 1;
+        sequence
+    }
+}
+
+//
+// Chunks taken from a ChunkCache, and the ones to put back.
+//
+struct Reuse {
+    cache: ChunkCache,
+    key: Vec<usize>,
+
+    // From the last image, or empty if it didn't match.
+    old_pixels: Vec<Arc<PixelChunk>>,
+    old_chunks: Vec<Arc<DeflateChunk>>,
+
+    // For this image, as the chunks land and are written, and whether
+    // each one's rows are the same as the last image's.
+    pixels: Vec<Arc<PixelChunk>>,
+    chunks: Vec<Arc<DeflateChunk>>,
+    unchanged: Vec<bool>,
+
+    // A chunk filtered for this one's deflate job before its rows
+    // came in, so it has to have one.
+    promised: Option<usize>,
+}
+
+impl Reuse {
+    //
+    // A chunk's compressed data depends on its own rows, and on the
+    // filtered rows of the chunk before it priming the dictionary --
+    // which in turn depend on the last row of the chunk before that.
+    //
+    fn needs_deflate(&self, index: usize) -> bool {
+        self.promised == Some(index) ||
+            (index.saturating_sub(2) ..= index).any(|i| !self.unchanged[i])
+    }
+
+    fn store(self) {
+        let mut state = self.cache.shared.lock().unwrap();
+        state.key = self.key;
+        state.pixels = self.pixels;
+        state.chunks = self.chunks;
+    }
+}
+
 /// Parallel PNG encoder state.
 /// Takes an Options struct with initializer data and a Write struct
 /// to send output to.
@@ -554,6 +1880,8 @@ pub struct Encoder<'a, W: Write> {
     writer: Writer<W>,
     options: Options<'a>,
 
+    // As written in IHDR, and for the current frame.
+    image_header: Header,
     header: Header,
 
     wrote_header: bool,
@@ -565,21 +1893,88 @@ pub struct Encoder<'a, W: Write> {
     chunks_total: usize,
     chunks_output: usize,
 
+    // Chunk numbers run on from one animation frame to the next,
+    // as they share the ring, so the current frame's rows are split
+    // from frame_base to chunks_total.
+    frame_base: usize,
+
+    // Set up by write_animation_control().
+    animation: Option<Animation>,
+
+    // From the options, and set up from it by write_header().
+    chunk_cache: Option<ChunkCache>,
+    reuse: Option<Reuse>,
+
+    // Set while flushing, so nothing waits on rows not yet written.
+    flushing: bool,
+
     // Accumulates input rows until enough are ready to fire off a filter job.
-    pixel_accumulator: Arc<PixelChunk>,
+    pixel_accumulator: Option<PixelChunk>,
     pixel_index: usize,
     current_row: u32,
 
-    // Accumulates completed output from pixel input, filter, and deflate jobs.
-    pixel_chunks: ChunkMap<PixelChunk>,
-    filter_chunks: ChunkMap<FilterChunk>,
-    deflate_chunks: ChunkMap<DeflateChunk>,
+    // Collects the whole of an interlaced image's input rows.
+    interlace_rows: Option<Vec<u8>>,
+
+    // The input layout when quantizing or reducing, as given to
+    // write_header(), with its rows collected as they come in, as
+    // the whole image is converted before encoding.
+    input_header: Option<Header>,
+    input_rows: Option<Vec<u8>>,
+
+    // Set while the signature and header wait on the image, to see
+    // what it can be reduced to, or the palette on quantizing it,
+    // with any chunks written meanwhile.
+    header_pending: bool,
+    palette_pending: bool,
+    pending_chunks: Vec<(Vec<u8>, Vec<u8>)>,
+
+    // Completed pixel chunks waiting for a filter job, and the last one
+    // sent off, which the next filter job needs the end of.
+    pixel_queue: VecDeque<Arc<PixelChunk>>,
+    prior_pixels: Option<Arc<PixelChunk>>,
+    filter_index: usize,
+
+    // Shared with the jobs; set up once the header is written.
+    pipeline: Option<Arc<Pipeline>>,
+
+    // Set to send even a single chunk to the thread pool, in a batch.
+    pipelined: bool,
+
+    // Chunks from chunks_output on, up to pixel_index.
+    output_queue: VecDeque<OutputSlot>,
+    chunks_received: usize,
+
+    // Jobs that reported an error instead of landing.
+    failed_jobs: usize,
+
+    // Recycles buffers for the pixel, filter, and deflate chunks.
+    buffer_pool: BufferPool,
+
+    // Job queue on a shared scheduler, until the pipeline takes it.
+    scheduler: Option<scheduler::Client>,
+
+    // Estimated bytes held by chunks between input and output,
+    // for the memory limit.
+    in_flight_bytes: usize,
+    shared_input: bool,
 
     // Accumulates the checksum of all output chunks in turn.
     adler32: u32,
 
-    // Accumulates IDAT output when not using streaming output mode
-    idat_buffer: Vec<u8>,
+    // Collected from the header on, if enabled in the options.
+    stats: Option<Stats>,
+    epoch: Option<Instant>,
+
+    // Accumulates IDAT output when not using streaming output mode,
+    // to be written out in one go without copying it together.
+    idat_chunks: Vec<Arc<DeflateChunk>>,
+    idat_crc32: u32,
+
+    // Built up as the default image's chunks are written, if enabled,
+    // with the length of its compressed stream so far.
+    index: Option<Index>,
+    stream_len: u64,
 
     // For messages from the thread pool.
     tx: Sender<ThreadMessage>,
@@ -593,6 +1988,7 @@ impl<'a, W: Write> Encoder<'a, W> {
         Encoder {
             writer: Writer::new(write),
 
+            image_header: Header::new(),
             header: Header::new(),
             options: *options,
 
@@ -605,17 +2001,60 @@ impl<'a, W: Write> Encoder<'a, W> {
             chunks_total: 0,
             chunks_output: 0,
 
-            // hack, clean this up later
-            pixel_accumulator: Arc::new(PixelChunk::new(Header::new(), 0, 0, 0)),
+            frame_base: 0,
+            animation: None,
+
+            chunk_cache: options.chunk_cache.cloned(),
+            reuse: None,
+            flushing: false,
+
+            pixel_accumulator: None,
             pixel_index: 0,
             current_row: 0,
 
-            pixel_chunks: ChunkMap::new(),
-            filter_chunks: ChunkMap::new(),
-            deflate_chunks: ChunkMap::new(),
+            interlace_rows: None,
+
+            input_header: None,
+            input_rows: None,
+
+            header_pending: false,
+            palette_pending: false,
+            pending_chunks: Vec::new(),
+
+            pixel_queue: VecDeque::new(),
+            prior_pixels: None,
+            filter_index: 0,
+
+            pipeline: None,
+            pipelined: false,
+
+            output_queue: VecDeque::new(),
+            chunks_received: 0,
+
+            failed_jobs: 0,
+
+            buffer_pool: match options.buffer_pool {
+                Some(pool) => pool.clone(),
+                None => BufferPool::new(),
+            },
+
+            scheduler: options.scheduler.map(|s| s.client(options.priority)),
+
+            in_flight_bytes: 0,
+            shared_input: false,
 
             adler32: deflate::adler32_initial(),
-            idat_buffer: Vec::new(),
+            stats: None,
+            epoch: None,
+            idat_chunks: Vec::new(),
+            idat_crc32: deflate::crc32_initial(),
+
+            index: if options.write_index {
+                Some(Index::new(index::PRIMED | index::STANDALONE_ROWS))
+            } else {
+                None
+            },
+            stream_len: 0,
 
             tx,
             rx,
@@ -634,8 +2073,63 @@ impl<'a, W: Write> Encoder<'a, W> {
         }
     }
 
+    /// Same as finish(), but returns immediately instead of waiting
+    /// for the image data to be compressed and written out.
+    ///
+    /// The rest of the encode is driven from the thread pool as jobs
+    /// complete, with output written to the sink from whichever worker
+    /// thread is doing so at the time. Once everything is written, or
+    /// on failure once no job is left running, done is called with the
+    /// result of finish() -- usually on a worker thread, though it may
+    /// be called before finish_async() returns.
+    ///
+    /// Combined with write_image(), which does not wait on the workers
+    /// either, this lets a single thread start many encodes at once.
+    pub fn finish_async<F>(self, done: F)
+        where F: FnOnce(io::Result<W>) + Send + 'static,
+              W: Send + 'static,
+              'a: 'static
+    {
+        let pipeline = match self.pipeline {
+            Some(ref pipeline) => Arc::clone(pipeline),
+            None => {
+                // Nothing runs on the pool for a single chunk.
+                done(if self.wrote_header {
+                    self.finish()
+                } else {
+                    Err(other("Incomplete image input"))
+                });
+                return;
+            }
+        };
+        let task = Arc::new(FinishTask {
+            encoder: Mutex::new(Some(self)),
+            error: Mutex::new(None),
+            done: Mutex::new(Some(Box::new(done))),
+            wakeups: AtomicUsize::new(0),
+        });
+        {
+            let task = Arc::clone(&task);
+            *pipeline.notify.lock().unwrap() = Some(Arc::new(move || task.wake()));
+        }
+
+        // Anything that finished before the callback was installed.
+        task.wake();
+    }
+
     fn running_jobs(&self) -> usize {
-        self.filter_chunks.running_jobs() + self.deflate_chunks.running_jobs()
+        match self.pipeline {
+            Some(ref pipeline) => pipeline.ring.running_jobs(),
+            None => 0,
+        }
+    }
+
+    //
+    // Chunks whose filter job has been started but whose compressed
+    // output has not come back over the channel yet.
+    //
+    fn pending_jobs(&self) -> usize {
+        self.filter_index - self.chunks_received
     }
 
     fn threads(&self) -> usize {
@@ -652,25 +2146,24 @@ impl<'a, W: Write> Encoder<'a, W> {
     }
 
     fn dispatch_func<F>(&self, func: F)
-        where F: Fn(&Sender<ThreadMessage>) + Send + 'static
+        where F: FnOnce(&Sender<ThreadMessage>) + Send + 'static
     {
         let tx = self.tx.clone();
-        match self.options.thread_pool {
-            Some(pool) => {
-                pool.spawn(move || {
-                    func(&tx);
-                });
-            },
-            None => {
-                ::rayon::spawn(move || {
-                    func(&tx);
-                });
+        let thread_pool = self.options.thread_pool;
+        let pipeline = self.pipeline.as_ref().unwrap();
+        pipeline.submit(move || {
+            func(&tx);
+        }, |job| {
+            match thread_pool {
+                Some(pool) => pool.spawn(job),
+                None => ::rayon::spawn(job),
             }
-        }
+        });
     }
 
     fn start_row(&self, index: usize) -> usize {
-        index * self.header.height() as usize / self.chunks_total
+        let frame_chunks = self.chunks_total - self.frame_base;
+        (index - self.frame_base) * self.header.height() as usize / frame_chunks
     }
 
     fn end_row(&self, index: usize) -> usize {
@@ -679,9 +2172,16 @@ impl<'a, W: Write> Encoder<'a, W> {
 
     fn receive(&mut self, blocking: DispatchMode) -> Option<ThreadMessage> {
         match blocking {
-            DispatchMode::Blocking => match self.rx.recv() {
-                Ok(msg) => Some(msg),
-                _ => None,
+            DispatchMode::Blocking => {
+                let start = self.epoch.map(|_| Instant::now());
+                let msg = self.rx.recv();
+                if let (Some(start), Some(ref mut stats)) = (start, self.stats.as_mut()) {
+                    stats.blocked_time += start.elapsed();
+                }
+                match msg {
+                    Ok(msg) => Some(msg),
+                    _ => None,
+                }
             },
             DispatchMode::NonBlocking => match self.rx.try_recv() {
                 Ok(msg) => Some(msg),
@@ -700,6 +2200,61 @@ impl<'a, W: Write> Encoder<'a, W> {
         }
     }
 
+    //
+    // Aim for a few chunks per thread, so that uneven ones even out
+    // and no thread sits idle at the end, within bounds per level.
+    // Below the minimum the restarted match history at each boundary
+    // starts to cost noticeably more than the extra parallelism buys,
+    // even with the previous chunk as a dictionary; past the maximum
+    // there's little ratio left to gain. Higher levels get bigger
+    // chunks, as those callers are paying for ratio.
+    //
+    fn adaptive_chunk_size(&self) -> usize {
+        let (min, max) = match self.options.compression_level {
+            CompressionLevel::Fast    => (8 * 1024, 256 * 1024),
+            CompressionLevel::Default => (16 * 1024, 512 * 1024),
+            CompressionLevel::High    => (32 * 1024, 1024 * 1024),
+        };
+        let bytes = (self.header.stride() + 1) * self.header.height as usize;
+        let target = bytes / (self.threads() * 4);
+        cmp::min(cmp::max(target, min), max)
+    }
+
+    fn flush_interval(&self) -> usize {
+        if self.options.streaming && !self.options.search {
+            self.options.flush_interval
+        } else {
+            0
+        }
+    }
+
+    fn search(&self) -> Option<Arc<Search>> {
+        if !self.options.search {
+            return None;
+        }
+        let filters = match self.options.filter_mode {
+            Fixed(filter) => vec![Fixed(filter)],
+            Adaptive => vec![
+                Adaptive,
+                Fixed(Filter::None),
+                Fixed(Filter::Sub),
+                Fixed(Filter::Up),
+                Fixed(Filter::Average),
+                Fixed(Filter::Paeth),
+            ],
+        };
+        let strategies = match self.options.strategy_mode {
+            Fixed(strategy) => vec![strategy],
+            Adaptive => vec![Strategy::Default, Strategy::Filtered, Strategy::RLE],
+        };
+        Some(Arc::new(Search {
+            filters,
+            strategies,
+            backend: self.options.backend,
+            compression_level: self.options.compression_level,
+        }))
+    }
+
     fn compression_strategy(&self) -> Strategy {
         match self.options.strategy_mode {
             Fixed(s) => s,
@@ -710,18 +2265,63 @@ impl<'a, W: Write> Encoder<'a, W> {
         }
     }
 
+    //
+    // Start the filter job for the next queued pixel chunk.
+    // Its deflate job will be started from the worker threads.
+    //
+    fn spawn_filter(&mut self, current: Arc<PixelChunk>, deflate: bool, deflate_next: bool) {
+        let pipeline = Arc::clone(self.pipeline.as_ref().unwrap());
+        let previous = match self.prior_pixels.replace(Arc::clone(&current)) {
+            // The last frame's rows aren't needed at the top of this one.
+            Some(_) if current.is_start => None,
+            previous => previous,
+        };
+        let filter_mode = self.filter_mode();
+        let standalone = self.options.write_index;
+        let search = pipeline.search.clone();
+        let pool = self.buffer_pool.clone();
+
+        pipeline.ring.prepare(current.index, current.stream_start, deflate, deflate_next);
+        pipeline.ring.running.fetch_add(1, Ordering::SeqCst);
+        self.filter_index += 1;
+
+        self.dispatch_func(move |tx| {
+            let mut filter = FilterChunk::new(previous,
+                                              current,
+                                              filter_mode,
+                                              pool);
+            filter.standalone = standalone;
+            filter.search = search;
+            let (result, timing) = timed(pipeline.epoch, || filter.run());
+            filter.timing = timing;
+            if result.is_ok() {
+                filter_done(&pipeline, Arc::new(filter), tx);
+            }
+            pipeline.ring.running.fetch_sub(1, Ordering::SeqCst);
+            if let Err(e) = result {
+                // The encoder may already have been dropped.
+                let _ = tx.send(ThreadMessage::Error(e));
+            }
+            pipeline.notify();
+        });
+    }
+
     fn dispatch(&mut self, mode: DispatchMode) -> IoResult {
         // See if anything interesting happened on the threads.
         let mut blocking_mode = mode;
-        while self.filter_chunks.in_flight() || self.deflate_chunks.in_flight() {
+        while self.chunks_received < self.filter_index {
             match self.receive(blocking_mode) {
-                Some(ThreadMessage::FilterDone(filter)) => {
-                    self.filter_chunks.land(filter.index, filter);
-                }
+                Some(ThreadMessage::DeflatePart(index, data, crc)) => {
+                    let offset = index - self.chunks_output;
+                    self.output_queue[offset].parts.push((data, crc));
+                },
                 Some(ThreadMessage::DeflateDone(deflate)) => {
-                    self.deflate_chunks.land(deflate.index, deflate);
+                    let offset = deflate.index - self.chunks_output;
+                    self.output_queue[offset].chunk = Some(deflate);
+                    self.chunks_received += 1;
                 },
                 Some(ThreadMessage::Error(e)) => {
+                    self.failed_jobs += 1;
                     return Err(e);
                 }
                 None => {
@@ -734,91 +2334,355 @@ impl<'a, W: Write> Encoder<'a, W> {
             blocking_mode = DispatchMode::NonBlocking;
         }
 
-        // If we have more deflate work to do, dispatch them!
-        while self.running_jobs() < self.max_threads() {
-            match self.filter_chunks.pop_front() {
-                Some((previous, current)) => {
-                    // Prepare to dispatch the deflate job:
-                    let level = self.options.compression_level;
-                    let strategy = self.compression_strategy();
-                    self.deflate_chunks.advance();
-                    self.dispatch_func(move |tx| {
-                        let mut deflate = DeflateChunk::new(level, strategy, previous.clone(), current.clone());
-                        tx.send(match deflate.run() {
-                            Ok(()) => ThreadMessage::DeflateDone(Arc::new(deflate)),
-                            Err(e) => ThreadMessage::Error(e),
-                        }).unwrap();
-                    });
+        // If we have output to run, write it!
+        let output_start = self.epoch.map(|_| Instant::now());
+        loop {
+            // Early pieces of the oldest chunk can go out right away.
+            let parts = match self.output_queue.front_mut() {
+                Some(slot) => {
+                    let parts = mem::replace(&mut slot.parts, Vec::new());
+                    slot.early_len += parts.iter().map(|&(ref data, _)| data.len() as u64).sum::<u64>();
+                    parts
                 },
-                None => {
-                    break;
-                }
+                None => break,
+            };
+            if !parts.is_empty() {
+                self.write_frame_start()?;
             }
-        }
-
-        // If we have more filter work to do, dispatch them!
-        while self.running_jobs() < self.max_threads() {
-            match self.pixel_chunks.pop_front() {
-                Some((previous, current)) => {
-                    // Prepare to dispatch the filter job:
-                    self.filter_chunks.advance();
-                    let filter_mode = self.filter_mode();
-                    self.dispatch_func(move |tx| {
-                        let mut filter = FilterChunk::new(previous.clone(),
-                                                          current.clone(),
-                                                          filter_mode);
-                        tx.send(match filter.run() {
-                            Ok(()) => ThreadMessage::FilterDone(Arc::new(filter)),
-                            Err(e) => ThreadMessage::Error(e),
-                        }).unwrap();
-                    });
-                },
-                None => {
-                    break;
-                }
+            for (data, crc) in parts {
+                self.stream_len += data.len() as u64;
+                self.write_image_data(&[&data], crc)?;
+                self.writer.flush()?;
+                self.buffer_pool.give(data);
             }
-        }
-
-        // If we have output to run, write it!
-        while let Some((_previous, current)) = self.deflate_chunks.pop_front() {
+            if self.output_queue.front().unwrap().chunk.is_none() {
+                break;
+            }
+            self.write_frame_start()?;
+            let slot = self.output_queue.pop_front().unwrap();
+            let current = slot.chunk.unwrap();
             if self.chunks_output >= self.chunks_total {
                 panic!("Got extra output after end of file; should not happen.");
             }
 
             // Combine the checksums!
+            if current.is_start {
+                // Each frame is its own zlib stream.
+                self.adler32 = deflate::adler32_initial();
+            }
             self.adler32 = deflate::adler32_combine(self.adler32,
                                                     current.adler32,
-                                                    current.input.data.len());
+                                                    current.input_len);
+            self.index_chunk(&current, slot.early_len);
 
             // if not streaming, append to an in-memory buffer
             // and output a giant tag later.
             if self.options.streaming {
-                self.writer.write_chunk(b"IDAT", &current.data)?;
+                self.write_image_data(&[&current.data], current.crc32)?;
+                if self.flush_interval() > 0 {
+                    self.writer.flush()?;
+                }
 
                 if current.is_end {
                     let mut chunk = Vec::<u8>::new();
                     if !current.is_start {
                         write_be32(&mut chunk, self.adler32)?;
                     }
-                    self.writer.write_chunk(b"IDAT", &chunk)?;
+                    let crc = deflate::crc32(deflate::crc32_initial(), &chunk);
+                    self.write_image_data(&[&chunk], crc)?;
                 }
             } else {
-                self.idat_buffer.write_all(&current.data)?;
+                self.idat_crc32 = deflate::crc32_combine(self.idat_crc32,
+                                                         current.crc32,
+                                                         current.data.len());
+                self.idat_chunks.push(Arc::clone(&current));
 
                 if current.is_end {
+                    let mut trailer = Vec::<u8>::new();
                     if !current.is_start {
-                        write_be32(&mut self.idat_buffer, self.adler32)?;
+                        write_be32(&mut trailer, self.adler32)?;
+                        self.idat_crc32 = deflate::crc32(self.idat_crc32, &trailer);
+                    }
+                    let mut chunks = mem::replace(&mut self.idat_chunks, Vec::new());
+                    {
+                        let mut parts: Vec<&[u8]> = chunks.iter()
+                                                          .map(|chunk| &chunk.data[..])
+                                                          .collect();
+                        parts.push(&trailer);
+                        let crc = self.idat_crc32;
+                        self.write_image_data(&parts, crc)?;
                     }
-                    self.writer.write_chunk(b"IDAT", &self.idat_buffer)?;
+                    chunks.clear();
+                    self.idat_chunks = chunks;
+                    self.idat_crc32 = deflate::crc32_initial();
                 }
             }
 
+            if current.is_end {
+                self.write_index()?;
+                if let Some(ref mut animation) = self.animation {
+                    animation.wrote_idat = true;
+                }
+            }
+            if let Some(ref mut reuse) = self.reuse {
+                reuse.chunks.push(Arc::clone(&current));
+            }
+            if let Some(ref mut stats) = self.stats {
+                if slot.reused {
+                    stats.chunks_reused += 1;
+                } else {
+                    stats.add_chunk(&current);
+                }
+            }
+
+            self.in_flight_bytes -= slot.memory;
             self.chunks_output += 1;
         }
+        if let (Some(start), Some(ref mut stats)) = (output_start, self.stats.as_mut()) {
+            stats.output_time += start.elapsed();
+        }
+        if self.chunks_output == self.chunks_total {
+            if let Some(reuse) = self.reuse.take() {
+                reuse.store();
+            }
+            if let (Some(epoch), Some(ref mut stats)) = (self.epoch, self.stats.as_mut()) {
+                stats.elapsed = epoch.elapsed();
+            }
+        }
+
+        // Start filter jobs for any pixel chunks that have been waiting,
+        // now that output has made room for them in the ring.
+        match self.pipeline.as_ref().map(|p| p.ring.len() - 1) {
+            Some(window) => {
+                while self.running_jobs() < self.max_threads()
+                    && self.filter_index - self.chunks_output < window {
+                    let plan = match self.pixel_queue.front() {
+                        Some(pixels) => (pixels.index, pixels.stream_end),
+                        None => break,
+                    };
+                    let (deflate, deflate_next) = match self.chunk_plan(plan.0, plan.1) {
+                        Some(plan) => plan,
+                        None => break,
+                    };
+                    let pixels = self.pixel_queue.pop_front().unwrap();
+                    let index = pixels.index;
+                    if deflate || deflate_next {
+                        self.spawn_filter(pixels, deflate, deflate_next);
+                    } else {
+                        self.prior_pixels = Some(pixels);
+                        self.filter_index += 1;
+                    }
+                    if !deflate {
+                        self.reuse_chunk(index);
+                    }
+                }
+            },
+            None => {
+                if let Some(pixels) = self.pixel_queue.pop_front() {
+                    match self.chunk_plan(pixels.index, pixels.stream_end) {
+                        Some((false, _)) => {
+                            self.filter_index += 1;
+                            self.reuse_chunk(pixels.index);
+                        },
+                        _ => self.encode_inline(pixels)?,
+                    }
+                    return self.dispatch(mode);
+                }
+            }
+        }
 
         Ok(())
     }
 
+    //
+    // Whether a chunk needs its deflate job, and filtering for the next
+    // chunk's deflate job, or None if that can't be told until the next
+    // chunk's rows come in. Without a chunk cache, all of them do.
+    //
+    fn chunk_plan(&mut self, index: usize, is_end: bool) -> Option<(bool, bool)> {
+        let flushing = self.flushing;
+        match self.reuse {
+            None => Some((true, !is_end)),
+            Some(ref mut reuse) => {
+                let deflate = reuse.needs_deflate(index);
+                if is_end {
+                    Some((deflate, false))
+                } else if reuse.unchanged.len() > index + 1 {
+                    Some((deflate, reuse.needs_deflate(index + 1)))
+                } else if flushing {
+                    reuse.promised = Some(index + 1);
+                    Some((deflate, true))
+                } else {
+                    None
+                }
+            }
+        }
+    }
+
+    //
+    // Output the last image's compressed data for an unchanged chunk.
+    //
+    fn reuse_chunk(&mut self, index: usize) {
+        let chunk = Arc::clone(&self.reuse.as_ref().unwrap().old_chunks[index]);
+        let slot = &mut self.output_queue[index - self.chunks_output];
+        slot.chunk = Some(chunk);
+        slot.reused = true;
+        self.chunks_received += 1;
+    }
+
+    //
+    // Add an index entry for a chunk of the default image, given the
+    // length of any pieces of it flushed early, already written.
+    //
+    fn index_chunk(&mut self, chunk: &DeflateChunk, early_len: u64) {
+        let wrote_idat = match self.animation {
+            Some(ref animation) => animation.wrote_idat,
+            None => false,
+        };
+        match self.index {
+            Some(ref mut index) if !wrote_idat => index.entries.push(index::Entry {
+                offset: self.stream_len - early_len,
+                pass: chunk.pass as u8,
+                start_row: chunk.start_row as u32,
+                end_row: chunk.end_row as u32,
+                adler32: chunk.adler32,
+            }),
+            _ => {},
+        }
+        self.stream_len += chunk.data.len() as u64;
+    }
+
+    //
+    // Write the index after the default image's data, once.
+    //
+    fn write_index(&mut self) -> IoResult {
+        let wrote_idat = match self.animation {
+            Some(ref animation) => animation.wrote_idat,
+            None => false,
+        };
+        match self.index.take() {
+            Some(index) if !wrote_idat => {
+                let data = index.to_bytes()?;
+                self.writer.write_chunk(index::TAG, &data)
+            },
+            index => {
+                self.index = index;
+                Ok(())
+            }
+        }
+    }
+
+    //
+    // Write the frame control ahead of the first output for the oldest
+    // chunk, if it starts an animation frame.
+    //
+    fn write_frame_start(&mut self) -> IoResult {
+        {
+            let slot = self.output_queue.front_mut().unwrap();
+            if !slot.frame_start {
+                return Ok(());
+            }
+            slot.frame_start = false;
+        }
+        if let Some(ref mut animation) = self.animation {
+            if let Some(Some(frame)) = animation.queue.pop_front() {
+                let sequence = animation.next_sequence();
+                self.writer.write_frame_control(sequence, &frame)?;
+            }
+        }
+        Ok(())
+    }
+
+    //
+    // Write out compressed image data, given the checksum of its parts:
+    // as IDAT for the default image, or as fdAT after a sequence number
+    // for the animation frames following it.
+    //
+    fn write_image_data(&mut self, parts: &[&[u8]], crc: u32) -> IoResult {
+        if let Some(ref mut stats) = self.stats {
+            stats.bytes_out += parts.iter().map(|part| part.len() as u64).sum::<u64>();
+        }
+        let sequence = match self.animation {
+            Some(ref mut animation) if animation.wrote_idat => animation.next_sequence(),
+            _ => return self.writer.write_chunk_parts(b"IDAT", parts, crc),
+        };
+        let mut prefix = Vec::<u8>::new();
+        write_be32(&mut prefix, sequence)?;
+        let len = parts.iter().map(|part| part.len()).sum();
+        let prefix_crc = deflate::crc32(deflate::crc32_initial(), &prefix);
+        let crc = deflate::crc32_combine(prefix_crc, crc, len);
+
+        let mut all: Vec<&[u8]> = vec![&prefix];
+        all.extend_from_slice(parts);
+        self.writer.write_chunk_parts(b"fdAT", &all, crc)
+    }
+
+    //
+    // Filter and compress a single-chunk image right here, since
+    // there's nothing to run in parallel with it.
+    //
+    fn encode_inline(&mut self, pixels: Arc<PixelChunk>) -> IoResult {
+        let mut parts = Vec::new();
+        let result = {
+            let filter_mode = self.filter_mode();
+            let epoch = self.epoch;
+            let backend = self.options.backend;
+            let compression_level = self.options.compression_level;
+            let strategy = self.compression_strategy();
+            let flush_interval = self.flush_interval();
+            let buffer_pool = self.buffer_pool.clone();
+            let search = self.search();
+            let searching = search.is_some();
+            let parts = &mut parts;
+            let run = move || {
+                let mut filter = FilterChunk::new(None,
+                                                  pixels,
+                                                  filter_mode,
+                                                  buffer_pool.clone());
+                filter.search = search.clone();
+                let (result, timing) = timed(epoch, || filter.run());
+                filter.timing = timing;
+                result.and_then(|_| {
+                    let mut deflate = DeflateChunk::new(backend,
+                                                        compression_level,
+                                                        strategy,
+                                                        flush_interval,
+                                                        None,
+                                                        Arc::new(filter),
+                                                        buffer_pool);
+                    if let Some(search) = search {
+                        deflate.strategies = search.strategies.clone();
+                    }
+                    let (result, timing) = timed(epoch, || {
+                        deflate.run(|data, crc| parts.push((data, crc)))
+                    });
+                    deflate.timing = timing;
+                    result.map(|_| deflate)
+                })
+            };
+            // A search splits its tries up with rayon::join, which from
+            // outside a pool would run them on the global one.
+            match self.options.thread_pool {
+                Some(pool) if searching => pool.install(run),
+                _ => run(),
+            }
+        };
+        match result {
+            Ok(deflate) => {
+                self.filter_index += 1;
+                self.chunks_received += 1;
+                let slot = &mut self.output_queue[deflate.index - self.chunks_output];
+                slot.chunk = Some(Arc::new(deflate));
+                slot.parts = parts;
+                Ok(())
+            },
+            Err(e) => {
+                self.failed_jobs += 1;
+                Err(e)
+            }
+        }
+    }
+
     /// Write the PNG signature and header chunk.
     /// Must be done before anything else is output.
     ///
@@ -827,29 +2691,295 @@ impl<'a, W: Write> Encoder<'a, W> {
         if self.wrote_header {
             return Err(invalid_input("Cannot write header a second time."));
         }
+        header.check_source_format()?;
 
-        self.header = *header;
+        let mut header = *header;
+        if self.options.quantize {
+            match (header.color_type, header.depth) {
+                (ColorType::Truecolor, 8) | (ColorType::TruecolorAlpha, 8) => {},
+                _ => return Err(invalid_input("Quantizing requires 8-bit truecolor input.")),
+            }
+            self.input_header = Some(header);
+            self.palette_pending = true;
+            header.set_color(ColorType::IndexedColor, 8)?;
+            header.set_source_format(SourceFormat::Packed)?;
+        }
 
-        let stride = self.header.stride() + 1;
-        let height = self.header.height as usize;
+        if self.options.stats {
+            self.epoch = Some(Instant::now());
+            self.stats = Some(Stats {
+                threads: self.threads(),
+                ..Stats::default()
+            });
+        }
+
+        self.wrote_header = true;
+
+        let reducible = match header.color_type {
+            ColorType::IndexedColor => false,
+            _ => header.depth >= 8,
+        };
+        if self.options.reduce && !self.options.quantize && reducible {
+            self.input_header = Some(header);
+            self.image_header = header;
+            self.header = header;
+            self.header_pending = true;
+            return Ok(());
+        }
+        self.begin(header)
+    }
+
+    //
+    // Set up to encode the image with the given header, and write
+    // it out after the signature.
+    //
+    fn begin(&mut self, header: Header) -> IoResult {
+        self.image_header = header;
+        self.start_frame(header);
+        self.start_reuse();
+
+        // A single chunk is filtered and compressed on this thread
+        // when it comes in, so it needs no pipeline, unless it's
+        // to run alongside others in a batch.
+        if self.chunks_total > 1 || self.pipelined {
+            self.start_pipeline();
+        }
+
+        self.writer.write_signature()?;
+        self.writer.write_header(self.image_header)
+    }
 
-        let chunks = stride * height / self.options.chunk_size;
-        self.chunks_total = if chunks < 1 {
+    //
+    // Give up on reducing the image, for things that depend on its
+    // header being as given, and write out the header as it is.
+    //
+    fn skip_reduce(&mut self) -> IoResult {
+        if self.header_pending {
+            self.header_pending = false;
+            self.input_header = None;
+            let header = self.image_header;
+            self.begin(header)?;
+            self.write_generated_palette(&[], &[])
+        } else {
+            Ok(())
+        }
+    }
+
+    //
+    // Split up the rows of the default image or the next animation
+    // frame into chunks, numbered on from the previous frame's.
+    //
+    fn start_frame(&mut self, header: Header) {
+        self.header = header;
+
+        // Each interlaced pass is split up on its own.
+        let chunks = match header.interlace_method {
+            InterlaceMethod::Standard => self.split_chunks(&header),
+            InterlaceMethod::Adam7 => self.interlace_passes().iter()
+                                          .map(|&(_, ref pass)| self.split_chunks(pass))
+                                          .sum(),
+        };
+        self.frame_base = self.chunks_total;
+        self.chunks_total += chunks;
+
+        self.current_row = 0;
+        self.shared_input = false;
+    }
+
+    //
+    // Number of chunks to split an image or interlaced pass into.
+    //
+    fn split_chunks(&self, header: &Header) -> usize {
+        let stride = header.stride() + 1;
+        let height = header.height as usize;
+
+        let chunk_size = match self.options.chunk_size {
+            Fixed(n) => n,
+            Adaptive => self.adaptive_chunk_size(),
+        };
+        let chunks = stride * height / chunk_size;
+        if chunks < 1 {
             1
         } else {
             chunks
+        }
+    }
+
+    //
+    // Numbers and sub-image headers of the current image's
+    // non-empty Adam7 passes, in order.
+    //
+    fn interlace_passes(&self) -> Vec<(usize, Header)> {
+        (0 .. 7).filter_map(|pass| {
+            interlace::pass_header(&self.header, pass).map(|header| (pass, header))
+        }).collect()
+    }
+
+    //
+    // Take the last image's chunks from the cache, if they were made
+    // the same way as this image's will be.
+    //
+    fn start_reuse(&mut self) {
+        let cache = match self.chunk_cache {
+            Some(ref cache) if self.flush_interval() == 0
+                && self.header.interlace_method == InterlaceMethod::Standard => cache.clone(),
+            _ => return,
+        };
+        let header = self.header;
+        let filter = match self.filter_mode() {
+            Adaptive => 5,
+            Fixed(filter) => filter as usize,
+        };
+        let key = vec![
+            header.width as usize,
+            header.height as usize,
+            header.depth as usize,
+            header.color_type as usize,
+            self.chunks_total,
+            self.options.compression_level as usize,
+            self.compression_strategy() as usize,
+            filter,
+            self.options.backend as usize,
+            header.source_format as usize,
+            self.options.write_index as usize,
+            self.options.search as usize,
+        ];
+
+        let (old_pixels, old_chunks) = {
+            let mut state = cache.shared.lock().unwrap();
+            let state = mem::replace(&mut *state, CacheState::default());
+            if state.key == key {
+                (state.pixels, state.chunks)
+            } else {
+                (Vec::new(), Vec::new())
+            }
         };
+        self.reuse = Some(Reuse {
+            cache,
+            key,
+            old_pixels,
+            old_chunks,
+            pixels: Vec::new(),
+            chunks: Vec::new(),
+            unchanged: Vec::new(),
+            promised: None,
+        });
+    }
 
-        self.pixel_chunks.advance();
-        self.pixel_accumulator = Arc::new(PixelChunk::new(self.header,
-                                                          0, // index
-                                                          self.start_row(0),
-                                                          self.end_row(0)));
+    fn start_pipeline(&mut self) {
+        // Enough ring slots to keep every thread busy while
+        // the oldest chunk waits to be written out.
+        let ring_len = cmp::max(4, 2 * self.max_threads());
+        self.pipeline = Some(Arc::new(Pipeline {
+            ring: ChunkRing::new(ring_len),
+            backend: self.options.backend,
+            compression_level: self.options.compression_level,
+            strategy: self.compression_strategy(),
+            flush_interval: self.flush_interval(),
+            search: self.search(),
+            chunk_affinity: self.options.chunk_affinity,
+            buffer_pool: self.buffer_pool.clone(),
+            scheduler: self.scheduler.take(),
+            epoch: self.epoch,
+            notify: Mutex::new(None),
+        }));
+    }
 
-        self.wrote_header = true;
+    /// Mark the file as an animated PNG with the given number of frames,
+    /// to be shown num_plays times over, or forever if 0.
+    ///
+    /// Must be done after the header and before any image data. Each
+    /// frame then starts with write_frame_control(), followed by its
+    /// image data. The default image shown by decoders without APNG
+    /// support is the first frame if its frame control comes before
+    /// any image data, and otherwise isn't part of the animation.
+    ///
+    /// Frames go through the same worker pipeline one after another,
+    /// so the next one can be filtered while the last is compressed.
+    pub fn write_animation_control(&mut self, num_frames: u32, num_plays: u32) -> IoResult {
+        if !self.wrote_header {
+            return Err(invalid_input("Cannot write animation control before header."));
+        }
+        if self.animation.is_some() {
+            return Err(invalid_input("Cannot write animation control a second time."));
+        }
+        if self.started_image {
+            return Err(invalid_input("Cannot write animation control after image data."));
+        }
+        if num_frames == 0 {
+            return Err(invalid_input("Animation must have at least one frame."));
+        }
+        if self.image_header.interlace_method != InterlaceMethod::Standard {
+            return Err(invalid_input("Animation is not supported with interlacing."));
+        }
+        if self.options.quantize {
+            return Err(invalid_input("Animation is not supported when quantizing."));
+        }
+        self.skip_reduce()?;
+
+        // Chunks are only cached for still images.
+        self.reuse = None;
+
+        let mut queue = VecDeque::new();
+        queue.push_back(None);
+        self.animation = Some(Animation {
+            num_frames,
+            frames: 0,
+            queue,
+            sequence: 0,
+            wrote_idat: false,
+            last_frame: None,
+        });
+        if self.pipeline.is_none() {
+            self.start_pipeline();
+        }
+        self.writer.write_animation_control(num_frames, num_plays)
+    }
 
-        self.writer.write_signature()?;
-        self.writer.write_header(self.header)
+    /// Start the next animation frame, whose image data follows with
+    /// write_image_rows() or write_image(), sized to the frame.
+    ///
+    /// The previous frame's image data must be complete. The first frame,
+    /// if it is also the default image, must cover the whole canvas.
+    pub fn write_frame_control(&mut self, frame: &FrameControl) -> IoResult {
+        self.check_failed()?;
+        let default_image = !self.started_image;
+        let header = match self.animation {
+            None => return Err(invalid_input("Cannot write frame control before animation control.")),
+            Some(ref animation) if animation.frames >= animation.num_frames => {
+                return Err(invalid_input("Cannot write more frames than given in animation control."));
+            },
+            Some(_) => {
+                if !default_image && self.current_row < self.header.height {
+                    return Err(invalid_input("Cannot start a frame before the last one is complete."));
+                }
+                let width = self.image_header.width;
+                let height = self.image_header.height;
+                if frame.x_offset.checked_add(frame.width).map_or(true, |x| x > width)
+                    || frame.y_offset.checked_add(frame.height).map_or(true, |y| y > height) {
+                    return Err(invalid_input("Frame must fit within the image."));
+                }
+                if default_image && (frame.width != width || frame.height != height
+                                     || frame.x_offset != 0 || frame.y_offset != 0) {
+                    return Err(invalid_input("First frame must cover the whole image."));
+                }
+                let mut header = self.image_header;
+                header.set_size(frame.width, frame.height)?;
+                header
+            },
+        };
+
+        if !default_image {
+            self.start_frame(header);
+        }
+        let animation = self.animation.as_mut().unwrap();
+        animation.frames += 1;
+        if default_image {
+            *animation.queue.back_mut().unwrap() = Some(*frame);
+        } else {
+            animation.queue.push_back(Some(*frame));
+        }
+        Ok(())
     }
 
     /// Write an indexed-color palette as a PLTE chunk.
@@ -865,6 +2995,9 @@ impl<'a, W: Write> Encoder<'a, W> {
         if self.wrote_palette {
             return Err(invalid_input("Cannot write palette a second time."));
         }
+        if self.options.quantize {
+            return Err(invalid_input("Cannot write palette when quantizing."));
+        }
         if self.wrote_transparency {
             return Err(invalid_input("Cannot write palette after transparency."));
         }
@@ -877,6 +3010,7 @@ impl<'a, W: Write> Encoder<'a, W> {
         if palette.len() % 3 != 0 {
             return Err(invalid_input("Palette must have an integral number of entries."));
         }
+        self.skip_reduce()?;
 
         self.wrote_palette = true;
         self.palette_length = palette.len() / 3;
@@ -899,6 +3033,9 @@ impl<'a, W: Write> Encoder<'a, W> {
         if self.started_image {
             return Err(invalid_input("Cannot write transparency after image data."));
         }
+        if self.options.quantize {
+            return Err(invalid_input("Cannot write transparency when quantizing."));
+        }
         match self.header.color_type {
             ColorType::Greyscale => {
                 if data.len() != 2 {
@@ -926,6 +3063,7 @@ impl<'a, W: Write> Encoder<'a, W> {
             }
 
         }
+        self.skip_reduce()?;
         self.wrote_transparency = true;
         self.writer.write_chunk(b"tRNS", data)
     }
@@ -936,55 +3074,166 @@ impl<'a, W: Write> Encoder<'a, W> {
     // in the appropriate format for the tag.
     //
     pub fn write_chunk(&mut self, tag: &[u8], data: &[u8]) -> io::Result<()> {
-        self.writer.write_chunk(tag, data)
+        if COLOR_CHUNKS.contains(&tag) {
+            if self.options.quantize {
+                return Err(invalid_input("Cannot write chunks laid out by color type when quantizing."));
+            }
+            self.skip_reduce()?;
+        }
+        if self.header_pending || self.palette_pending {
+            self.pending_chunks.push((tag.to_vec(), data.to_vec()));
+            Ok(())
+        } else {
+            self.writer.write_chunk(tag, data)
+        }
     }
 
-    //
-    // Copy a row's pixel data into buffers for async compression.
-    // Returns immediately after copying.
-    //
-    fn process_row(&mut self, row: &[u8]) -> io::Result<RowStatus>
-    {
-        if self.pixel_index >= self.chunks_total {
-            return Err(other("invalid internal state"));
+    fn check_failed(&self) -> IoResult {
+        if self.failed_jobs > 0 {
+            Err(other("Cannot continue after a failed encoding job."))
+        } else {
+            Ok(())
         }
+    }
+
+    fn check_image_start(&mut self) -> IoResult {
+        self.check_failed()?;
         if !self.wrote_header {
             return Err(invalid_input("Cannot write image data before header."));
         }
         if let ColorType::IndexedColor = self.header.color_type {
-            if !self.wrote_palette {
+            if !self.wrote_palette && self.input_header.is_none() {
                 return Err(invalid_input("Cannot write indexed-color image data before palette."));
             }
         }
+        if self.pixel_index >= self.chunks_total && !self.header_pending {
+            return Err(other("invalid internal state"));
+        }
         if !self.started_image {
             self.started_image = true;
         }
+        Ok(())
+    }
 
-        Arc::get_mut(&mut self.pixel_accumulator).unwrap().read_row(row);
-
-        if self.pixel_accumulator.is_full() {
-            // Move the item off to the completed stack...
-            self.pixel_chunks.land(self.pixel_index, self.pixel_accumulator.clone());
+    //
+    // Hand off a completed pixel chunk to the filter stage.
+    //
+    // In blocking mode, waits for running jobs to finish if there are
+    // too many jobs or too much data in flight.
+    //
+    fn land_pixels(&mut self, pixels: PixelChunk, mode: DispatchMode) -> IoResult {
+        // Queue it up for a filter job...
+        let pixels = Arc::new(pixels);
+        if let Some(ref mut reuse) = self.reuse {
+            let unchanged = match reuse.old_pixels.get(reuse.pixels.len()) {
+                Some(old) => pixels.same_rows(old),
+                None => false,
+            };
+            reuse.unchanged.push(unchanged);
+            reuse.pixels.push(Arc::clone(&pixels));
+        }
+        if let Some(ref mut stats) = self.stats {
+            stats.bytes_in += ((pixels.end_row - pixels.start_row) * pixels.stride) as u64;
+        }
+        let memory = self.chunk_memory(&pixels);
+        self.output_queue.push_back(OutputSlot {
+            chunk: None,
+            parts: Vec::new(),
+            early_len: 0,
+            frame_start: pixels.stream_start,
+            memory,
+            reused: false,
+        });
+        self.pixel_queue.push_back(pixels);
+        self.pixel_index += 1;
+        self.in_flight_bytes += memory;
 
-            // Make a nice new buffer to accumulate data into.
-            self.pixel_index += 1;
-            if self.pixel_index < self.chunks_total {
-                self.pixel_chunks.advance();
-                self.pixel_accumulator = Arc::new(PixelChunk::new(self.header,
-                                                                  self.pixel_index,
-                                                                  self.start_row(self.pixel_index),
-                                                                  self.end_row(self.pixel_index)));
+        // Dispatch any available async tasks and output.
+        if let DispatchMode::Blocking = mode {
+            self.dispatch(DispatchMode::NonBlocking)?;
+            while !self.pixel_queue.is_empty() && self.pending_jobs() > 0 {
+                self.dispatch(DispatchMode::Blocking)?;
             }
-
-            // Dispatch any available async tasks and output.
-            while self.running_jobs() >= self.max_threads() {
+            while self.over_memory_limit() && self.pending_jobs() > 0 {
                 self.dispatch(DispatchMode::Blocking)?;
             }
-            self.dispatch(DispatchMode::NonBlocking)?;
         }
+        self.dispatch(DispatchMode::NonBlocking)
+    }
+
+    //
+    // Estimated pixel and filter buffer memory held by a chunk
+    // from when its input lands until its output is written.
+    //
+    fn chunk_memory(&self, pixels: &PixelChunk) -> usize {
+        let rows = pixels.end_row - pixels.start_row;
+        let filtered = rows * (pixels.header.stride() + 1);
+        if self.shared_input {
+            // Owned by the caller.
+            filtered
+        } else {
+            rows * pixels.stride + filtered
+        }
+    }
+
+    fn over_memory_limit(&self) -> bool {
+        self.options.memory_limit > 0 && self.in_flight_bytes > self.options.memory_limit
+    }
+
+    //
+    // Copy a row's pixel data into buffers for async compression.
+    // Returns immediately after copying.
+    //
+    fn process_row(&mut self, row: &[u8], mode: DispatchMode) -> io::Result<RowStatus>
+    {
+        self.check_image_start()?;
+
+        if let InterlaceMethod::Adam7 = self.header.interlace_method {
+            return self.process_interlaced_row(row);
+        }
+
+        let header = self.header;
+        let pool = &self.buffer_pool;
+        let index = self.pixel_index;
+        let start_row = self.start_row(index);
+        let end_row = self.end_row(index);
+
+        let full = {
+            // Make a nice new buffer to accumulate data into if needed.
+            let pixels = self.pixel_accumulator.get_or_insert_with(|| {
+                PixelChunk::new(header, index, start_row, end_row, pool)
+            });
+            pixels.read_row(row);
+            pixels.is_full()
+        };
+
+        if full {
+            let pixels = self.pixel_accumulator.take().unwrap();
+            self.land_pixels(pixels, mode)?;
+        }
+
+        self.current_row += 1;
+        if self.current_row == self.header.height {
+            Ok(RowStatus::Done)
+        } else {
+            Ok(RowStatus::Continue)
+        }
+    }
+
+    //
+    // Every Adam7 pass takes rows from all over the image, so copy
+    // them all before handing off any chunks.
+    //
+    fn process_interlaced_row(&mut self, row: &[u8]) -> io::Result<RowStatus> {
+        let len = self.header.source_stride() * self.header.height as usize;
+        self.interlace_rows.get_or_insert_with(|| Vec::with_capacity(len))
+                           .extend_from_slice(row);
 
         self.current_row += 1;
         if self.current_row == self.header.height {
+            let image = Arc::new(self.interlace_rows.take().unwrap());
+            let stride = self.header.source_stride();
+            self.land_interlaced(Arc::new(SharedImage(image)), stride)?;
             Ok(RowStatus::Done)
         } else {
             Ok(RowStatus::Continue)
@@ -993,46 +3242,430 @@ impl<'a, W: Write> Encoder<'a, W> {
 
     /// Encode and compress the given image data and write to output.
     /// Input data must be packed in the correct format for the given
-    /// color type and depth, with no padding at the end of rows.
+    /// color type and depth, with no padding at the end of rows, or
+    /// laid out in the header's source format if one is set.
     ///
     /// An integral number of rows must be provided at once.
     ///
     /// If not all of the image rows are provided, multiple calls are
     /// required to finish out the data.
     pub fn write_image_rows(&mut self, buf: &[u8]) -> IoResult {
-        let stride = self.header.stride();
+        let stride = self.input_stride();
         if buf.len() % stride != 0 {
             Err(invalid_input("Buffer must be an integral number of rows"))
+        } else if self.input_header.is_some() {
+            self.collect_rows(buf)
         } else {
             for row in buf.chunks(stride) {
-                self.process_row(& &*row)?;
+                self.process_row(& &*row, DispatchMode::Blocking)?;
             }
             Ok(())
         }
     }
 
+    /// Same as write_image_rows(), but never waits on the worker threads.
+    ///
+    /// If the memory limit set in Options is already exceeded, or every
+    /// thread is busy with chunks still waiting for one, returns an error
+    /// of kind WouldBlock without consuming any input; try again once some
+    /// output has been written. Otherwise all the rows are accepted, which
+    /// may take the encoder over the limit.
+    pub fn try_write_image_rows(&mut self, buf: &[u8]) -> IoResult {
+        let stride = self.input_stride();
+        if buf.len() % stride != 0 {
+            return Err(invalid_input("Buffer must be an integral number of rows"));
+        }
+        if self.input_header.is_some() {
+            return self.collect_rows(buf);
+        }
+        self.check_failed()?;
+        self.dispatch(DispatchMode::NonBlocking)?;
+        if self.over_memory_limit() && self.pending_jobs() > 0 {
+            return Err(io::Error::new(io::ErrorKind::WouldBlock, "Memory limit reached"));
+        }
+        // Where write_image_rows() would wait for a thread to take
+        // the chunks already queued up.
+        if self.running_jobs() >= self.max_threads() && !self.pixel_queue.is_empty() {
+            return Err(io::Error::new(io::ErrorKind::WouldBlock, "All threads busy"));
+        }
+        for row in buf.chunks(stride) {
+            self.process_row(row, DispatchMode::NonBlocking)?;
+        }
+        Ok(())
+    }
+
+    /// Encode and compress a complete image at once, without copying it.
+    ///
+    /// The filter jobs read rows straight out of the given buffer, which
+    /// is kept alive until they're done with it. Input data must be packed
+    /// in the correct format for the given color type and depth, with no
+    /// padding at the end of rows, or laid out in the header's source
+    /// format if one is set, and must contain the whole image.
+    ///
+    /// Returns without waiting on the worker threads; the image is
+    /// compressed as output is flushed or the encoder is finished.
+    ///
+    /// Cannot be combined with write_image_rows() on the same encoder.
+    pub fn write_image<T>(&mut self, image: Arc<T>) -> IoResult
+        where T: AsRef<[u8]> + Send + Sync + ?Sized + 'static
+    {
+        let stride = self.input_stride();
+        self.write_image_strided(image, stride)
+    }
+
+    /// Same as write_image(), but rows start every row_stride bytes
+    /// in the buffer, which may be more than the packed row length,
+    /// as is common for framebuffers. Padding bytes are ignored, and
+    /// the last row need not be padded.
+    pub fn write_image_strided<T>(&mut self, image: Arc<T>, row_stride: usize) -> IoResult
+        where T: AsRef<[u8]> + Send + Sync + ?Sized + 'static
+    {
+        self.check_image_start()?;
+        if self.current_row > 0 {
+            return Err(invalid_input("Cannot mix write_image with write_image_rows."));
+        }
+
+        let stride = self.input_stride();
+        let height = self.header.height as usize;
+        if row_stride < stride {
+            return Err(invalid_input("Row stride cannot be less than the row length"));
+        }
+        let len = row_stride.checked_mul(height - 1)
+                            .and_then(|n| n.checked_add(stride));
+        match len {
+            Some(len) if len <= (*image).as_ref().len() => {},
+            _ => return Err(invalid_input("Buffer is too short for the image")),
+        }
+
+        if self.input_header.is_some() {
+            return self.write_converted(image, row_stride);
+        }
+        let image = Arc::new(SharedImage(image));
+        match self.header.interlace_method {
+            InterlaceMethod::Standard => self.land_shared(image, 0, row_stride),
+            InterlaceMethod::Adam7 => self.land_interlaced(image, row_stride),
+        }
+    }
+
+    //
+    // Packed row length of the input, which differs from the
+    // encoded image's when quantizing or reducing.
+    //
+    fn input_stride(&self) -> usize {
+        self.input_header.unwrap_or(self.header).source_stride()
+    }
+
+    //
+    // The image can't be converted until every row is in, so
+    // collect them all, as for interlacing.
+    //
+    fn collect_rows(&mut self, buf: &[u8]) -> IoResult {
+        self.check_image_start()?;
+        let header = self.input_header.unwrap();
+        let stride = header.source_stride();
+        if self.current_row as usize + buf.len() / stride > header.height as usize {
+            return Err(invalid_input("Too many rows for the image"));
+        }
+
+        let len = stride * header.height as usize;
+        self.input_rows.get_or_insert_with(|| Vec::with_capacity(len))
+                       .extend_from_slice(buf);
+        self.current_row += (buf.len() / stride) as u32;
+        if self.current_row == header.height {
+            let image = Arc::new(self.input_rows.take().unwrap());
+            self.write_converted(image, stride)
+        } else {
+            Ok(())
+        }
+    }
+
+    //
+    // Quantize or reduce the whole image, writing out the header if it
+    // was waiting and any palette made up for it, and send the result
+    // through the pipeline as if it had been given to write_image().
+    //
+    fn write_converted<T>(&mut self, image: Arc<T>, row_stride: usize) -> IoResult
+        where T: AsRef<[u8]> + Send + Sync + ?Sized + 'static
+    {
+        let input = self.input_header.unwrap();
+        let pool = self.options.thread_pool;
+        let (image, row_stride): (Arc<dyn ImageData>, usize) = if self.header_pending {
+            self.header_pending = false;
+            // An ICC profile is laid out for color or for grey.
+            let icc = self.pending_chunks.iter().any(|&(ref tag, _)| &tag[..] == b"iCCP");
+            match reduce::reduce(&input, Arc::clone(&image), row_stride, icc, pool) {
+                Some(reduced) => {
+                    self.begin(reduced.header)?;
+                    self.write_generated_palette(&reduced.palette, &reduced.transparency)?;
+                    let stride = reduced.header.stride();
+                    (Arc::new(SharedImage(Arc::new(reduced.data))), stride)
+                },
+                None => {
+                    self.begin(input)?;
+                    self.write_generated_palette(&[], &[])?;
+                    (Arc::new(SharedImage(image)), row_stride)
+                },
+            }
+        } else {
+            let quantized = quantize::quantize(&input, image, row_stride, self.options.dither, pool)?;
+            self.write_generated_palette(&quantized.palette, &quantized.transparency)?;
+            let width = self.header.width as usize;
+            (Arc::new(SharedImage(Arc::new(quantized.indices))), width)
+        };
+
+        match self.header.interlace_method {
+            InterlaceMethod::Standard => self.land_shared(image, 0, row_stride),
+            InterlaceMethod::Adam7 => self.land_interlaced(image, row_stride),
+        }
+    }
+
+    //
+    // Write out the palette made up for the image, if any, with the
+    // chunks held back for it placed around it as the spec orders them.
+    //
+    fn write_generated_palette(&mut self, palette: &[u8], transparency: &[u8]) -> IoResult {
+        self.palette_pending = false;
+        let (before, after): (Vec<_>, Vec<_>) = mem::replace(&mut self.pending_chunks, Vec::new())
+            .into_iter()
+            .partition(|&(ref tag, _)| BEFORE_PALETTE_CHUNKS.contains(&&tag[..]));
+        for (tag, data) in before {
+            self.writer.write_chunk(&tag, &data)?;
+        }
+        if !palette.is_empty() {
+            self.writer.write_chunk(b"PLTE", palette)?;
+            self.wrote_palette = true;
+            self.palette_length = palette.len() / 3;
+            if !transparency.is_empty() {
+                self.writer.write_chunk(b"tRNS", transparency)?;
+                self.wrote_transparency = true;
+            }
+        }
+        for (tag, data) in after {
+            self.writer.write_chunk(&tag, &data)?;
+        }
+        Ok(())
+    }
+
+    /// Write the next animation frame from an image of the whole canvas,
+    /// packed as for write_image(), encoding only the rectangle in which
+    /// it differs from the last frame written this way.
+    ///
+    /// The size and offset of the given frame control are replaced with
+    /// that rectangle; the first frame written this way covers the whole
+    /// canvas. As the rest is left as the last frame had it, the frame
+    /// before should use DisposeOp::None, and this one BlendOp::Source
+    /// if it has transparency.
+    ///
+    /// Requires a bit depth of at least 8. Keeps a reference to the
+    /// image, to compare the next frame against.
+    pub fn write_frame_diff<T>(&mut self, frame: &FrameControl, image: Arc<T>) -> IoResult
+        where T: AsRef<[u8]> + Send + Sync + ?Sized + 'static
+    {
+        let header = self.image_header;
+        if header.depth < 8 {
+            return Err(invalid_input("Frame differencing requires a bit depth of at least 8."));
+        }
+        let stride = header.source_stride();
+        let len = stride * header.height as usize;
+        if (*image).as_ref().len() < len {
+            return Err(invalid_input("Buffer is too short for the image"));
+        }
+        let last = match self.animation {
+            Some(ref animation) => animation.last_frame.clone(),
+            None => return Err(invalid_input("Cannot write frame control before animation control.")),
+        };
+
+        let image: Arc<dyn ImageData> = Arc::new(SharedImage(image));
+        let (x, y, width, height) = match last {
+            Some(ref last) => changed_rect(&header, &last.bytes()[.. len], &image.bytes()[.. len]),
+            None => (0, 0, header.width, header.height),
+        };
+        let mut frame = *frame;
+        frame.set_offset(x, y)?;
+        frame.set_size(width, height)?;
+        self.write_frame_control(&frame)?;
+
+        self.check_image_start()?;
+        let offset = y as usize * stride + x as usize * (stride / header.width as usize);
+        self.land_shared(Arc::clone(&image), offset, stride)?;
+        self.animation.as_mut().unwrap().last_frame = Some(image);
+        Ok(())
+    }
+
+    //
+    // Queue up all of the current frame's chunks to read straight
+    // from the given image.
+    //
+    fn land_shared(&mut self, image: Arc<dyn ImageData>, offset: usize, row_stride: usize) -> IoResult {
+        self.shared_input = true;
+        while self.pixel_index < self.chunks_total {
+            let index = self.pixel_index;
+            let rows = PixelRows::Shared(Arc::clone(&image), offset, row_stride);
+            let pixels = PixelChunk::with_rows(self.header,
+                                               index,
+                                               self.start_row(index),
+                                               self.end_row(index),
+                                               rows,
+                                               &self.buffer_pool);
+            // Nothing is copied, and the chunk ring limits how many
+            // get filtered at once, so just queue them all up.
+            self.land_pixels(pixels, DispatchMode::NonBlocking)?;
+        }
+
+        self.current_row = self.header.height;
+        Ok(())
+    }
+
+    //
+    // Queue up the chunks of each interlaced pass in turn, to pull
+    // their pixels from the given full image as they're filtered.
+    // The passes make up a single compressed stream.
+    //
+    fn land_interlaced(&mut self, image: Arc<dyn ImageData>, row_stride: usize) -> IoResult {
+        self.shared_input = true;
+        let header = self.header;
+        let passes = self.interlace_passes();
+        for (n, &(pass, sub)) in passes.iter().enumerate() {
+            let chunks = self.split_chunks(&sub);
+            let height = sub.height as usize;
+            for i in 0 .. chunks {
+                let rows = PixelRows::Interlaced(Arc::clone(&image), row_stride, header, pass);
+                let mut pixels = PixelChunk::with_rows(sub,
+                                                       self.pixel_index,
+                                                       i * height / chunks,
+                                                       (i + 1) * height / chunks,
+                                                       rows,
+                                                       &self.buffer_pool);
+                pixels.stream_start = self.pixel_index == self.frame_base;
+                pixels.stream_end = n == passes.len() - 1 && i == chunks - 1;
+                self.land_pixels(pixels, DispatchMode::NonBlocking)?;
+            }
+        }
+
+        self.current_row = header.height;
+        Ok(())
+    }
+
+    //
+    // Block until no filter or deflate jobs are running, discarding
+    // their results. Used when abandoning an encoder partway through,
+    // so no worker is left reading caller-owned image data.
+    //
+    #[cfg(feature="capi")]
+    pub(crate) fn wait_for_jobs(&mut self) {
+        // Deflate jobs are started from the workers, so don't try to
+        // count them; drop our sender and wait for every job's clone
+        // of it to go away instead.
+        let (tx, _) = mpsc::channel();
+        drop(mem::replace(&mut self.tx, tx));
+        while self.rx.recv().is_ok() {}
+    }
+
     /// Return completion progress as a fraction of 1.0
     ///
     /// Currently progress is measured in chunks, so small files may
     /// not report values between 0.0 and 1.0.
     pub fn progress(&self) -> f64 {
+        if self.chunks_total == 0 {
+            return 0.0;
+        }
         self.chunks_output as f64 / self.chunks_total as f64
     }
 
     /// Return finished-ness state.
     /// Is it finished? Yeah or no.
+    ///
+    /// Animations are finished once all of their frames are written.
     pub fn is_finished(&self) -> bool {
-        self.chunks_output == self.chunks_total
+        let frames_done = match self.animation {
+            Some(ref animation) => animation.frames == animation.num_frames,
+            None => true,
+        };
+        frames_done && !self.header_pending && self.chunks_output == self.chunks_total
+    }
+
+    /// Timings and counts for the encode so far, if enabled with
+    /// Options::set_stats(). Call after flush() for the whole image,
+    /// as finish() consumes the encoder.
+    pub fn stats(&self) -> Option<Stats> {
+        let mut stats = self.stats.clone()?;
+        if self.chunks_output < self.chunks_total {
+            stats.elapsed = self.epoch.unwrap().elapsed();
+        }
+        Some(stats)
     }
 
     /// Flush all currently in-progress data to output
     /// Warning: this may block.
     pub fn flush(&mut self) -> IoResult {
-        while self.chunks_output < self.pixel_index {
-            // Dispatch any available async tasks and output.
-            self.dispatch(DispatchMode::Blocking)?;
+        self.check_failed()?;
+        self.flushing = true;
+        let result = (|| -> IoResult {
+            while self.chunks_output < self.pixel_index {
+                // Dispatch any available async tasks and output.
+                self.dispatch(DispatchMode::Blocking)?;
+            }
+            Ok(())
+        })();
+        self.flushing = false;
+        result
+    }
+}
+
+/// One of the images for encode_batch(), with rows starting every
+/// row_stride bytes as for Encoder::write_image_strided(), and the
+/// palette and transparency to write before it, if any.
+pub struct BatchImage<T: ?Sized> {
+    pub header: Header,
+    pub image: Arc<T>,
+    pub row_stride: usize,
+    pub palette: Option<Vec<u8>>,
+    pub transparency: Option<Vec<u8>>,
+}
+
+/// Encode a batch of images with the same options, running the jobs
+/// of several at once on the thread pool, and call done with each
+/// image's index and PNG data, or error, in order as they finish.
+///
+/// Each image is a job graph of its own as with Encoder, but even
+/// those small enough for a single chunk are compressed on the pool,
+/// so a batch of small images keeps all of its threads busy where
+/// encoding them one after another would use only one. Images are
+/// started ahead of the one being written out, a few per thread.
+pub fn encode_batch<T, F>(images: &[BatchImage<T>], options: &Options, mut done: F)
+    where T: AsRef<[u8]> + Send + Sync + ?Sized + 'static,
+          F: FnMut(usize, io::Result<Vec<u8>>)
+{
+    let threads = match options.thread_pool {
+        Some(pool) => pool.current_num_threads(),
+        None => ::rayon::current_num_threads(),
+    };
+    let ahead = cmp::max(4, threads * 4);
+
+    let start = |batch: &BatchImage<T>| -> io::Result<Encoder<Vec<u8>>> {
+        let mut encoder = Encoder::new(Vec::new(), options);
+        encoder.pipelined = true;
+        encoder.write_header(&batch.header)?;
+        if let Some(ref palette) = batch.palette {
+            encoder.write_palette(palette)?;
         }
-        Ok(())
+        if let Some(ref transparency) = batch.transparency {
+            encoder.write_transparency(transparency)?;
+        }
+        encoder.write_image_strided(Arc::clone(&batch.image), batch.row_stride)?;
+        Ok(encoder)
+    };
+
+    let mut running: VecDeque<(usize, io::Result<Encoder<Vec<u8>>>)> = VecDeque::with_capacity(ahead);
+    for (index, batch) in images.iter().enumerate() {
+        if running.len() == ahead {
+            let (index, encoder) = running.pop_front().unwrap();
+            done(index, encoder.and_then(|encoder| encoder.finish()));
+        }
+        running.push_back((index, start(batch)));
+    }
+    for (index, encoder) in running {
+        done(index, encoder.and_then(|encoder| encoder.finish()));
     }
 }
 
@@ -1042,9 +3675,16 @@ mod tests {
     use super::super::ColorType;
     use super::Encoder;
     use super::Options;
+    use super::ChunkCache;
     use super::IoResult;
+    use super::Scheduler;
+    use super::super::FrameControl;
+    use super::super::InterlaceMethod;
+    use super::super::Mode::{Adaptive, Fixed};
 
     use std::io;
+    use std::sync::Arc;
+    use std::sync::mpsc;
 
     fn test_encoder<F>(width: u32, height: u32, func: F)
         where F: Fn(&mut Encoder<Vec<u8>>, &[u8]) -> IoResult
@@ -1108,4 +3748,799 @@ mod tests {
             Ok(())
         });
     }
+
+    fn encode_rgb<F>(width: u32, height: u32, func: F) -> io::Result<Vec<u8>>
+        where F: Fn(&mut Encoder<Vec<u8>>) -> IoResult
+    {
+        let writer = Vec::<u8>::new();
+        let mut options = Options::new();
+        options.set_chunk_size(32768)?;
+        let mut encoder = Encoder::new(writer, &options);
+
+        let mut header = Header::new();
+        header.set_size(width, height)?;
+        header.set_color(ColorType::Truecolor, 8)?;
+        encoder.write_header(&header)?;
+
+        func(&mut encoder)?;
+        encoder.finish()
+    }
+
+    #[test]
+    fn test_image() {
+        let (width, height) = (640usize, 480usize);
+        let padded = width * 3 + 7;
+        let mut data = vec![0u8; padded * height];
+        for y in 0 .. height {
+            for x in 0 .. width * 3 {
+                data[y * padded + x] = ((x * 7 + y * 3) % 251) as u8;
+            }
+        }
+
+        let rows = encode_rgb(width as u32, height as u32, |encoder| {
+            for row in data.chunks(padded) {
+                encoder.write_image_rows(&row[0 .. width * 3])?;
+            }
+            Ok(())
+        }).unwrap();
+
+        let shared = Arc::new(data.clone());
+        let image = encode_rgb(width as u32, height as u32, |encoder| {
+            encoder.write_image_strided(shared.clone(), padded)
+        }).unwrap();
+        assert_eq!(rows, image);
+
+        // Too short for the given stride.
+        let short = Arc::new(vec![0u8; padded * (height - 1)]);
+        let result = encode_rgb(width as u32, height as u32, |encoder| {
+            encoder.write_image_strided(short.clone(), padded)
+        });
+        assert!(result.is_err());
+    }
+
+    #[test]
+    fn test_source_formats() {
+        use super::super::SourceFormat;
+        use super::super::convert::convert_row;
+
+        let (width, height) = (300usize, 200usize);
+        let formats = [
+            (SourceFormat::Bgra, ColorType::TruecolorAlpha, 8),
+            (SourceFormat::Bgrx, ColorType::Truecolor, 8),
+            (SourceFormat::PremultipliedRgba, ColorType::TruecolorAlpha, 8),
+            (SourceFormat::PremultipliedBgra, ColorType::TruecolorAlpha, 8),
+            (SourceFormat::NativeEndian16, ColorType::TruecolorAlpha, 16),
+            (SourceFormat::NativeEndian16, ColorType::Greyscale, 16),
+        ];
+        for &(format, color_type, depth) in &formats {
+            let mut header = Header::new();
+            header.set_size(width as u32, height as u32).unwrap();
+            header.set_color(color_type, depth).unwrap();
+            let stride = header.stride();
+            let encode = |header: &Header, func: &dyn Fn(&mut Encoder<Vec<u8>>) -> IoResult| {
+                let mut options = Options::new();
+                options.set_chunk_size(32768).unwrap();
+                let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+                encoder.write_header(header).unwrap();
+                func(&mut encoder).unwrap();
+                encoder.finish().unwrap()
+            };
+
+            // The same image converted up front and given packed.
+            let mut source = header;
+            source.set_source_format(format).unwrap();
+            let source_stride = source.source_stride();
+            let data: Vec<u8> = (0 .. source_stride * height).map(|i| ((i * 7) % 251) as u8).collect();
+            let mut packed = vec![0u8; stride * height];
+            for (src, dest) in data.chunks(source_stride).zip(packed.chunks_mut(stride)) {
+                convert_row(format, src, dest);
+            }
+            let expected = encode(&header, &|encoder| encoder.write_image_rows(&packed));
+
+            let rows = encode(&source, &|encoder| encoder.write_image_rows(&data));
+            assert!(rows == expected);
+
+            let padded = source_stride + 5;
+            let mut strided = vec![0u8; padded * height];
+            for (src, dest) in data.chunks(source_stride).zip(strided.chunks_mut(padded)) {
+                dest[.. source_stride].copy_from_slice(src);
+            }
+            let strided = Arc::new(strided);
+            let image = encode(&source, &|encoder| {
+                encoder.write_image_strided(Arc::clone(&strided), padded)
+            });
+            assert!(image == expected);
+        }
+    }
+
+    #[test]
+    fn test_memory_limit() {
+        let (width, height) = (640usize, 480usize);
+        let data = vec![128u8; width * 3 * height];
+
+        let writer = Vec::<u8>::new();
+        let mut options = Options::new();
+        options.set_chunk_size(32768).unwrap();
+        options.set_memory_limit(100000).unwrap();
+        let mut encoder = Encoder::new(writer, &options);
+
+        let mut header = Header::new();
+        header.set_size(width as u32, height as u32).unwrap();
+        header.set_color(ColorType::Truecolor, 8).unwrap();
+        encoder.write_header(&header).unwrap();
+
+        // Copied pixels and filtered rows of one chunk.
+        let rows = encoder.end_row(0) - encoder.start_row(0);
+        let chunk_memory = rows * (width * 3) + rows * (width * 3 + 1);
+
+        for row in data.chunks(width * 3 * 16) {
+            encoder.write_image_rows(row).unwrap();
+            assert!(encoder.in_flight_bytes <= 100000 + chunk_memory);
+        }
+        encoder.finish().unwrap();
+    }
+
+    #[test]
+    fn test_interlaced() {
+        let (width, height) = (333usize, 211usize);
+        let data: Vec<u8> = (0 .. width * 3 * height).map(|i| (i % 251) as u8).collect();
+        let data = Arc::new(data);
+
+        let encode = |whole: bool| -> io::Result<Vec<u8>> {
+            let mut options = Options::new();
+            options.set_chunk_size(32768)?;
+            let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+
+            let mut header = Header::new();
+            header.set_size(width as u32, height as u32)?;
+            header.set_color(ColorType::Truecolor, 8)?;
+            header.set_interlace_method(InterlaceMethod::Adam7)?;
+            encoder.write_header(&header)?;
+
+            // Seven passes, the last few in more than one chunk.
+            assert!(encoder.chunks_total > 7);
+            if whole {
+                encoder.write_image(Arc::clone(&data))?;
+            } else {
+                for row in data.chunks(width * 3 * 10) {
+                    encoder.write_image_rows(row)?;
+                }
+            }
+            encoder.finish()
+        };
+        let rows = encode(false).unwrap();
+        let image = encode(true).unwrap();
+        assert_eq!(rows[28], 1, "expected Adam7 in IHDR");
+        assert!(rows == image, "expected the same output from rows and whole image");
+    }
+
+    #[test]
+    fn test_flush_interval() {
+        let count_idat = |png: &[u8]| {
+            let mut count = 0;
+            let mut i = 8;
+            while i < png.len() {
+                let len = ((png[i] as usize) << 24) | ((png[i + 1] as usize) << 16) |
+                          ((png[i + 2] as usize) << 8) | (png[i + 3] as usize);
+                if &png[i + 4 .. i + 8] == b"IDAT" {
+                    count += 1;
+                }
+                i += len + 12;
+            }
+            count
+        };
+        let (width, height) = (640usize, 480usize);
+        let data = Arc::new(vec![99u8; width * 3 * height]);
+        let mut counts = Vec::new();
+        for &interval in &[0, 8192] {
+            let mut options = Options::new();
+            options.set_chunk_size(262144).unwrap();
+            options.set_streaming(true).unwrap();
+            options.set_flush_interval(interval).unwrap();
+            let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+
+            let mut header = Header::new();
+            header.set_size(width as u32, height as u32).unwrap();
+            header.set_color(ColorType::Truecolor, 8).unwrap();
+            encoder.write_header(&header).unwrap();
+            encoder.write_image(data.clone()).unwrap();
+            counts.push(count_idat(&encoder.finish().unwrap()));
+        }
+        // Three chunks plus the adler32, then one per 4 rows.
+        assert_eq!(counts[0], 4);
+        assert_eq!(counts[1], height / 4 + 1);
+    }
+
+    #[test]
+    fn test_adaptive_chunks() {
+        // Chunk sizes depend on the thread count, so fix it.
+        let thread_pool = ::rayon::ThreadPoolBuilder::new().num_threads(4).build().unwrap();
+        let mut options = Options::new();
+        options.set_thread_pool(&thread_pool).unwrap();
+        options.set_chunk_size_mode(Adaptive).unwrap();
+        assert!(options.set_chunk_size_mode(Fixed(1024)).is_err());
+
+        // Small images still get split up...
+        let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+        let mut header = Header::new();
+        header.set_size(200, 100).unwrap();
+        header.set_color(ColorType::Truecolor, 8).unwrap();
+        encoder.write_header(&header).unwrap();
+        assert!(encoder.chunks_total > 1);
+        let row = vec![1u8; 200 * 3];
+        for _ in 0 .. 100 {
+            encoder.write_image_rows(&row).unwrap();
+        }
+        encoder.finish().unwrap();
+
+        // ...and big ones not too finely.
+        let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+        header.set_size(4000, 4000).unwrap();
+        encoder.write_header(&header).unwrap();
+        assert_eq!(encoder.chunks_total, (4000 * 3 + 1) * 4000 / (512 * 1024));
+    }
+
+    #[test]
+    fn test_try_write_rows() {
+        let (width, height) = (640usize, 480usize);
+        let data: Vec<u8> = (0 .. width * 3 * height).map(|i| ((i * 7) % 251) as u8).collect();
+        let expected = encode_rgb(width as u32, height as u32, |encoder| {
+            encoder.write_image_rows(&data)
+        }).unwrap();
+
+        // Handing rows over faster than one thread takes them has
+        // to be turned away until it catches up.
+        let thread_pool = ::rayon::ThreadPoolBuilder::new().num_threads(1).build().unwrap();
+        let mut options = Options::new();
+        options.set_thread_pool(&thread_pool).unwrap();
+        options.set_chunk_size(32768).unwrap();
+        let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+        let mut header = Header::new();
+        header.set_size(width as u32, height as u32).unwrap();
+        header.set_color(ColorType::Truecolor, 8).unwrap();
+        encoder.write_header(&header).unwrap();
+        for rows in data.chunks(width * 3 * 10) {
+            loop {
+                match encoder.try_write_image_rows(rows) {
+                    Ok(()) => break,
+                    Err(ref e) if e.kind() == io::ErrorKind::WouldBlock => {},
+                    Err(e) => panic!("{}", e),
+                }
+            }
+        }
+        assert!(encoder.finish().unwrap() == expected);
+    }
+
+    #[test]
+    fn test_finish_async() {
+        let (width, height) = (640usize, 480usize);
+        let mut data = vec![0u8; width * 3 * height];
+        for (i, byte) in data.iter_mut().enumerate() {
+            *byte = ((i * 7) % 251) as u8;
+        }
+        let data = Arc::new(data);
+
+        let expected = encode_rgb(width as u32, height as u32, |encoder| {
+            encoder.write_image(data.clone())
+        }).unwrap();
+
+        let (tx, rx) = mpsc::channel();
+        for _ in 0 .. 4 {
+            let mut options = Options::new();
+            options.set_chunk_size(32768).unwrap();
+            let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+
+            let mut header = Header::new();
+            header.set_size(width as u32, height as u32).unwrap();
+            header.set_color(ColorType::Truecolor, 8).unwrap();
+            encoder.write_header(&header).unwrap();
+            encoder.write_image(data.clone()).unwrap();
+
+            let tx = tx.clone();
+            encoder.finish_async(move |result| {
+                tx.send(result).unwrap();
+            });
+        }
+        for _ in 0 .. 4 {
+            assert_eq!(rx.recv().unwrap().unwrap(), expected);
+        }
+
+        // Missing image data.
+        let options = Options::new();
+        let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+        let mut header = Header::new();
+        header.set_size(16, 16).unwrap();
+        encoder.write_header(&header).unwrap();
+        let tx = tx.clone();
+        encoder.finish_async(move |result| {
+            tx.send(result).unwrap();
+        });
+        assert!(rx.recv().unwrap().is_err());
+    }
+
+    #[test]
+    fn test_scheduler() {
+        let (width, height) = (640usize, 480usize);
+        let data = Arc::new(vec![77u8; width * 3 * height]);
+        let expected = encode_rgb(width as u32, height as u32, |encoder| {
+            encoder.write_image(data.clone())
+        }).unwrap();
+
+        let scheduler = Scheduler::with_limit(2);
+        let mut encoders = Vec::new();
+        for priority in 1 .. 4 {
+            let mut options = Options::new();
+            options.set_chunk_size(32768).unwrap();
+            options.set_scheduler(&scheduler).unwrap();
+            options.set_priority(priority).unwrap();
+            let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+
+            let mut header = Header::new();
+            header.set_size(width as u32, height as u32).unwrap();
+            header.set_color(ColorType::Truecolor, 8).unwrap();
+            encoder.write_header(&header).unwrap();
+            encoder.write_image(data.clone()).unwrap();
+            encoders.push(encoder);
+        }
+        for encoder in encoders {
+            assert_eq!(encoder.finish().unwrap(), expected);
+        }
+    }
+
+    #[test]
+    fn test_animation() {
+        let chunk_tags = |png: &[u8]| {
+            let mut tags = Vec::new();
+            let mut i = 8;
+            while i < png.len() {
+                let len = ((png[i] as usize) << 24) | ((png[i + 1] as usize) << 16) |
+                          ((png[i + 2] as usize) << 8) | (png[i + 3] as usize);
+                let mut tag = png[i + 4 .. i + 8].to_vec();
+                if &tag[..] == b"fcTL" || &tag[..] == b"fdAT" {
+                    // Followed by the sequence number's low byte.
+                    tag.push(png[i + 11]);
+                }
+                tags.push(tag);
+                i += len + 12;
+            }
+            tags
+        };
+        let (width, height) = (256usize, 256usize);
+        let mut options = Options::new();
+        options.set_chunk_size(65536).unwrap();
+        let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+
+        let mut header = Header::new();
+        header.set_size(width as u32, height as u32).unwrap();
+        header.set_color(ColorType::Truecolor, 8).unwrap();
+        encoder.write_header(&header).unwrap();
+        encoder.write_animation_control(3, 0).unwrap();
+
+        let mut frame = FrameControl::new();
+        frame.set_size(width as u32, height as u32).unwrap();
+        let mut data = vec![0u8; width * 3 * height];
+        encoder.write_frame_diff(&frame, Arc::new(data.clone())).unwrap();
+        assert!(encoder.write_frame_control(&frame).is_ok());
+        encoder.write_image_rows(&data).unwrap();
+
+        // Only touches the second row.
+        data[width * 3 + 6] = 1;
+        encoder.write_frame_diff(&frame, Arc::new(data)).unwrap();
+        assert!(encoder.write_frame_control(&frame).is_err());
+
+        let tags = chunk_tags(&encoder.finish().unwrap());
+        let expected: Vec<&[u8]> = vec![b"IHDR", b"acTL", b"fcTL\x00", b"IDAT",
+                                        b"fcTL\x01", b"fdAT\x02", b"fcTL\x03", b"fdAT\x04", b"IEND"];
+        assert_eq!(tags, expected);
+    }
+
+    #[test]
+    fn test_chunk_cache() {
+        let (width, height) = (256usize, 256usize);
+        let cache = ChunkCache::new();
+        let mut plain = Options::new();
+        plain.set_chunk_size(32768).unwrap();
+        let mut cached = plain;
+        cached.set_chunk_cache(&cache).unwrap();
+
+        cached.set_stats(true).unwrap();
+
+        let encode = |options: &Options, data: &Vec<u8>| -> (Vec<u8>, usize) {
+            let mut encoder = Encoder::new(Vec::<u8>::new(), options);
+            let mut header = Header::new();
+            header.set_size(width as u32, height as u32).unwrap();
+            header.set_color(ColorType::Truecolor, 8).unwrap();
+            encoder.write_header(&header).unwrap();
+            encoder.write_image_rows(data).unwrap();
+            encoder.flush().unwrap();
+            let reused = encoder.stats().map_or(0, |stats| stats.chunks_reused());
+            (encoder.finish().unwrap(), reused)
+        };
+        // 256 rows of 769 filtered bytes make 6 chunks of up to 43 rows.
+        // A change means compressing its own chunk and the two after it
+        // again, and an unchanged image reuses all of them.
+        let mut data: Vec<u8> = (0 .. width * 3 * height).map(|i| (i % 251) as u8).collect();
+        for &(row, value, reused) in &[(0, 0, 0), (100, 1, 3), (100, 1, 6), (255, 2, 5)] {
+            data[row * width * 3] = value;
+            let (output, chunks_reused) = encode(&cached, &data);
+            assert!(output == encode(&plain, &data).0);
+            assert_eq!(chunks_reused, reused);
+        }
+    }
+
+    #[test]
+    fn test_stats() {
+        let (width, height) = (256usize, 256usize);
+        let data: Vec<u8> = (0 .. width * 3 * height).map(|i| (i % 251) as u8).collect();
+        let mut options = Options::new();
+        options.set_chunk_size(32768).unwrap();
+        options.set_stats(true).unwrap();
+
+        let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+        let mut header = Header::new();
+        header.set_size(width as u32, height as u32).unwrap();
+        header.set_color(ColorType::Truecolor, 8).unwrap();
+        encoder.write_header(&header).unwrap();
+        encoder.write_image_rows(&data).unwrap();
+        encoder.flush().unwrap();
+
+        let stats = encoder.stats().unwrap();
+        let output = encoder.finish().unwrap();
+        assert_eq!(stats.bytes_in(), data.len() as u64);
+        assert_eq!(stats.bytes_filtered(), (height * (width * 3 + 1)) as u64);
+        assert!(stats.bytes_out() > 0 && stats.bytes_out() < output.len() as u64);
+        assert_eq!(stats.filter_counts().iter().sum::<u64>(), height as u64);
+        assert!(stats.chunks().len() > 1);
+        for (i, chunk) in stats.chunks().iter().enumerate() {
+            assert_eq!(chunk.index(), i);
+            assert!(chunk.filter_start() + chunk.filter_time() <= chunk.deflate_start());
+        }
+        assert!(stats.deflate_time() <= stats.elapsed() * stats.threads() as u32);
+    }
+
+    #[test]
+    fn test_quantize() {
+        use std::io::Cursor;
+        use super::super::decoder::{Decoder, Options as DecoderOptions};
+
+        // Few enough colors to keep exactly, some translucent.
+        let (width, height) = (300usize, 200usize);
+        let colors = [[200u8, 10, 10, 255], [10, 200, 10, 64], [10, 10, 200, 255], [0, 0, 0, 0]];
+        let mut data = Vec::with_capacity(width * height * 4);
+        for y in 0 .. height {
+            for x in 0 .. width {
+                data.extend_from_slice(&colors[(x / 7 + y / 5) % 4]);
+            }
+        }
+        let mut options = Options::new();
+        options.set_chunk_size(32768).unwrap();
+        options.set_quantize(true).unwrap();
+
+        for &interlace in &[InterlaceMethod::Standard, InterlaceMethod::Adam7] {
+            let mut header = Header::new();
+            header.set_size(width as u32, height as u32).unwrap();
+            header.set_color(ColorType::TruecolorAlpha, 8).unwrap();
+            header.set_interlace_method(interlace).unwrap();
+
+            let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+            encoder.write_header(&header).unwrap();
+            assert!(encoder.write_palette(&[0u8; 3]).is_err());
+            assert!(encoder.write_chunk(b"bKGD", &[0, 0, 0, 0, 0, 0]).is_err());
+            encoder.write_chunk(b"tEXt", b"Comment\0few").unwrap();
+            encoder.write_chunk(b"gAMA", &[0, 0, 0xb1, 0x8f]).unwrap();
+            encoder.write_image_rows(&data[.. data.len() / 2]).unwrap();
+            encoder.write_image_rows(&data[data.len() / 2 ..]).unwrap();
+            let output = encoder.finish().unwrap();
+
+            // Held back until the palette, with gAMA still ahead of it.
+            let mut tags = Vec::new();
+            let mut pos = 8;
+            while pos < output.len() {
+                let len = super::super::utils::read_be32(&output[pos ..]) as usize;
+                tags.push(output[pos + 4 .. pos + 8].to_vec());
+                pos += len + 12;
+            }
+            assert_eq!(&tags[.. 5], &[b"IHDR".to_vec(), b"gAMA".to_vec(), b"PLTE".to_vec(),
+                                      b"tRNS".to_vec(), b"tEXt".to_vec()]);
+
+            let mut decoder = Decoder::new(Cursor::new(output), &DecoderOptions::new());
+            let decoded = decoder.read_header().unwrap();
+            assert_eq!(decoded.depth(), 8);
+            if let ColorType::IndexedColor = decoded.color_type() {} else {
+                assert!(false, "expected indexed color");
+            }
+            let indices = decoder.read_image().unwrap();
+            let palette = decoder.palette().unwrap().to_vec();
+            let transparency = decoder.transparency().unwrap().to_vec();
+            assert_eq!(palette.len(), 4 * 3);
+            assert_eq!(transparency.len(), 2);
+            for (pixel, &index) in data.chunks(4).zip(indices.iter()) {
+                let i = index as usize;
+                assert_eq!(&palette[i * 3 .. i * 3 + 3], &pixel[.. 3]);
+                assert_eq!(transparency.get(i).cloned().unwrap_or(255), pixel[3]);
+            }
+        }
+    }
+
+    #[test]
+    fn test_search() {
+        use std::io::Cursor;
+        use super::super::decoder::{Decoder, Options as DecoderOptions};
+
+        // Smooth gradients, which some filters suit better than others.
+        let (width, height) = (256usize, 256usize);
+        let mut data = Vec::with_capacity(width * height * 3);
+        for y in 0 .. height {
+            for x in 0 .. width {
+                data.extend_from_slice(&[x as u8, (x + y / 16) as u8, (y / 4) as u8]);
+            }
+        }
+        let mut header = Header::new();
+        header.set_size(width as u32, height as u32).unwrap();
+        header.set_color(ColorType::Truecolor, 8).unwrap();
+
+        let encode = |chunk_size: usize, search: bool| {
+            let mut options = Options::new();
+            options.set_chunk_size(chunk_size).unwrap();
+            options.set_search(search).unwrap();
+            let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+            encoder.write_header(&header).unwrap();
+            encoder.write_image_rows(&data).unwrap();
+            encoder.finish().unwrap()
+        };
+        // In one chunk, the usual filter and strategy are among those
+        // searched, so it can only get smaller.
+        let size = data.len() + height;
+        assert!(encode(size, true).len() <= encode(size, false).len());
+
+        for &chunk_size in &[size, 32768] {
+            let output = encode(chunk_size, true);
+            let mut decoder = Decoder::new(Cursor::new(output), &DecoderOptions::new());
+            decoder.read_header().unwrap();
+            assert_eq!(decoder.read_image().unwrap(), data);
+        }
+    }
+
+    #[test]
+    fn test_chunk_affinity() {
+        // Deflating on the filter's thread changes where, not what.
+        let (width, height) = (640usize, 480usize);
+        let data: Vec<u8> = (0 .. width * height * 3).map(|n| (n % 251 ^ n / 1920) as u8).collect();
+        let mut header = Header::new();
+        header.set_size(width as u32, height as u32).unwrap();
+        header.set_color(ColorType::Truecolor, 8).unwrap();
+
+        let encode = |chunk_affinity: bool| {
+            let mut options = Options::new();
+            options.set_chunk_size(32768).unwrap();
+            options.set_chunk_affinity(chunk_affinity).unwrap();
+            let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+            encoder.write_header(&header).unwrap();
+            encoder.write_image_rows(&data).unwrap();
+            encoder.finish().unwrap()
+        };
+        assert_eq!(encode(true), encode(false));
+    }
+
+    #[test]
+    fn test_batch() {
+        use super::{encode_batch, BatchImage};
+
+        // Mostly small images of a single chunk, and a larger one,
+        // some of them with padded rows.
+        let mut options = Options::new();
+        options.set_chunk_size(32768).unwrap();
+        let batch: Vec<BatchImage<Vec<u8>>> = (0 .. 20).map(|i| {
+            let (width, height) = if i == 7 { (400, 300) } else { (16 + i * 5, 10 + i * 3) };
+            let row_stride = width * 3 + (i % 3) * 4;
+            let mut header = Header::new();
+            header.set_size(width as u32, height as u32).unwrap();
+            header.set_color(ColorType::Truecolor, 8).unwrap();
+            let image = (0 .. row_stride * height).map(|n| (n * (i + 1) / 7) as u8).collect();
+            BatchImage {
+                header,
+                image: Arc::new(image),
+                row_stride,
+                palette: None,
+                transparency: None,
+            }
+        }).collect();
+
+        let mut outputs = Vec::new();
+        encode_batch(&batch, &options, |index, result| {
+            outputs.push((index, result.unwrap()));
+        });
+
+        // The same as encoding them one by one.
+        assert_eq!(outputs.len(), batch.len());
+        for (i, (&(index, ref output), image)) in outputs.iter().zip(&batch).enumerate() {
+            assert_eq!(index, i);
+            let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+            encoder.write_header(&image.header).unwrap();
+            encoder.write_image_strided(Arc::clone(&image.image), image.row_stride).unwrap();
+            assert_eq!(output, &encoder.finish().unwrap());
+        }
+    }
+
+    #[test]
+    fn test_reduce() {
+        use std::io::Cursor;
+        use super::super::decoder::{Decoder, Options as DecoderOptions};
+
+        // Opaque grey in RGBA, which should come out as plain greyscale.
+        let (width, height) = (320usize, 240usize);
+        let mut data = Vec::with_capacity(width * height * 4);
+        for y in 0 .. height {
+            for x in 0 .. width {
+                let v = ((x * 3 + y) % 251) as u8;
+                data.extend_from_slice(&[v, v, v, 255]);
+            }
+        }
+        let mut options = Options::new();
+        options.set_chunk_size(32768).unwrap();
+        options.set_reduce(true).unwrap();
+
+        let mut header = Header::new();
+        header.set_size(width as u32, height as u32).unwrap();
+        header.set_color(ColorType::TruecolorAlpha, 8).unwrap();
+
+        let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+        encoder.write_header(&header).unwrap();
+        encoder.write_chunk(b"tEXt", b"Comment\0grey").unwrap();
+
+        // Rejected calls leave it waiting to reduce.
+        assert!(encoder.write_palette(&[0u8; 4]).is_err());
+        assert!(encoder.write_transparency(&[0, 1]).is_err());
+        encoder.write_image_rows(&data[.. width * 4 * 100]).unwrap();
+        assert_eq!(encoder.is_finished(), false);
+        encoder.write_image_rows(&data[width * 4 * 100 ..]).unwrap();
+        let output = encoder.finish().unwrap();
+
+        // The text follows the header, written along with the image.
+        assert_eq!(&output[12 .. 16], b"IHDR");
+        assert_eq!(&output[37 .. 41], b"tEXt");
+
+        let mut decoder = Decoder::new(Cursor::new(output), &DecoderOptions::new());
+        let decoded = decoder.read_header().unwrap();
+        assert_eq!(decoded.depth(), 8);
+        if let ColorType::Greyscale = decoded.color_type() {} else {
+            assert!(false, "expected greyscale");
+        }
+        let grey = decoder.read_image().unwrap();
+        assert_eq!(grey.len(), width * height);
+        for (pixel, &v) in data.chunks(4).zip(grey.iter()) {
+            assert_eq!(pixel[0], v);
+        }
+
+        // An ICC profile for color keeps it out of greyscale, though
+        // it can still take a palette.
+        let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+        encoder.write_header(&header).unwrap();
+        encoder.write_chunk(b"iCCP", b"rgb\0\0").unwrap();
+        encoder.write_image(Arc::new(data.clone())).unwrap();
+        let output = encoder.finish().unwrap();
+        assert_eq!(output[25], ColorType::IndexedColor as u8);
+
+        // Transparency depends on the color type, so stops it.
+        header.set_color(ColorType::Truecolor, 8).unwrap();
+        let rgb: Vec<u8> = data.chunks(4).flat_map(|pixel| pixel[.. 3].to_vec()).collect();
+        let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+        encoder.write_header(&header).unwrap();
+        encoder.write_transparency(&[0, 1, 0, 1, 0, 1]).unwrap();
+        encoder.write_image(Arc::new(rgb.clone())).unwrap();
+        let output = encoder.finish().unwrap();
+        assert_eq!(output[25], ColorType::Truecolor as u8);
+
+        // As does a background color, which comes out after the header.
+        let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+        encoder.write_header(&header).unwrap();
+        encoder.write_chunk(b"tEXt", b"Comment\0grey").unwrap();
+        encoder.write_chunk(b"bKGD", &[0, 1, 0, 1, 0, 1]).unwrap();
+        encoder.write_image(Arc::new(rgb)).unwrap();
+        let output = encoder.finish().unwrap();
+        assert_eq!(output[25], ColorType::Truecolor as u8);
+        assert_eq!(&output[37 .. 41], b"tEXt");
+        assert_eq!(&output[37 + 12 + 12 .. 37 + 12 + 16], b"bKGD");
+    }
+
+    //
+    // Somewhat photo-like RGB test image: smooth gradients with
+    // a little noise, so it neither compresses to nothing nor
+    // looks like random data.
+    //
+    fn bench_image(width: usize, height: usize) -> Vec<u8> {
+        let mut seed = 4242u32;
+        let mut data = Vec::with_capacity(width * height * 3);
+        for y in 0 .. height {
+            for x in 0 .. width {
+                seed = seed.wrapping_mul(1103515245).wrapping_add(12345);
+                let noise = (seed >> 28) as usize;
+                data.push(((x + noise) * 255 / width) as u8);
+                data.push(((y + noise) * 255 / height) as u8);
+                data.push(((x + y) / 8 % 256) as u8);
+            }
+        }
+        data
+    }
+
+    //
+    // Microbenchmarks for the checksums and a single chunk's deflate
+    // job under each backend, level, and strategy, then whole encodes
+    // at each chunk size and thread count. Run as described at
+    // utils::bench().
+    //
+    #[test]
+    #[ignore]
+    fn bench_stages() {
+        use super::{PixelChunk, PixelRows, FilterChunk, DeflateChunk};
+        use super::super::{CompressionLevel, Strategy};
+        use super::super::deflate;
+        use super::super::deflate::Backend;
+        use super::super::filter::Filter;
+        use super::super::pool::BufferPool;
+        use super::super::utils::bench;
+
+        let data = bench_image(1920, 1080);
+        bench("crc32", data.len(), || {
+            assert!(deflate::crc32(deflate::crc32_initial(), &data) != 0);
+        });
+        bench("adler32", data.len(), || {
+            assert!(deflate::adler32(deflate::adler32_initial(), &data) != 0);
+        });
+
+        // About one default-sized chunk's worth of rows.
+        let mut header = Header::new();
+        header.set_size(1920, 45).unwrap();
+        header.set_color(ColorType::Truecolor, 8).unwrap();
+        let pool = BufferPool::new();
+        let rows = PixelRows::Copied(data[.. header.stride() * 45].to_vec());
+        let pixels = PixelChunk::with_rows(header, 0, 0, 45, rows, &pool);
+        let mut filter = FilterChunk::new(None, Arc::new(pixels), Fixed(Filter::Paeth), pool.clone());
+        filter.run().unwrap();
+        let filter = Arc::new(filter);
+
+        let levels = [("fast", CompressionLevel::Fast), ("default", CompressionLevel::Default),
+                      ("high", CompressionLevel::High)];
+        let strategies = [("default", Strategy::Default), ("filtered", Strategy::Filtered),
+                          ("huffman", Strategy::HuffmanOnly), ("rle", Strategy::RLE),
+                          ("fixed", Strategy::Fixed)];
+        let backends = [("zlib", Backend::Zlib), ("miniz", Backend::Miniz)];
+        for &(backend_name, backend) in backends.iter().filter(|b| b.1.is_available()) {
+            for &(level_name, level) in levels.iter() {
+                for &(strategy_name, strategy) in strategies.iter() {
+                    let name = format!("deflate_chunk/{}/{}/{}", backend_name, level_name, strategy_name);
+                    bench(&name, filter.data.len(), || {
+                        let mut deflate = DeflateChunk::new(backend, level, strategy, 0, None,
+                                                            Arc::clone(&filter), pool.clone());
+                        deflate.run(|_, _| {}).unwrap();
+                    });
+                }
+            }
+        }
+
+        let image = Arc::new(data);
+        let max_threads = ::rayon::current_num_threads();
+        let mut counts = vec![1, 2, 4, 8];
+        counts.retain(|&n| n < max_threads);
+        counts.push(max_threads);
+        for &threads in counts.iter() {
+            let thread_pool = ::rayon::ThreadPoolBuilder::new().num_threads(threads).build().unwrap();
+            let chunk_sizes = [("32k", Fixed(32768)), ("256k", Fixed(256 * 1024)),
+                               ("1m", Fixed(1024 * 1024)), ("auto", Adaptive)];
+            for &(chunk_name, chunk_size) in chunk_sizes.iter() {
+                let mut options = Options::new();
+                options.set_thread_pool(&thread_pool).unwrap();
+                options.set_chunk_size_mode(chunk_size).unwrap();
+                bench(&format!("encode/threads{}/chunk_{}", threads, chunk_name), image.len(), || {
+                    let mut encoder = Encoder::new(Vec::<u8>::new(), &options);
+                    let mut header = Header::new();
+                    header.set_size(1920, 1080).unwrap();
+                    header.set_color(ColorType::Truecolor, 8).unwrap();
+                    encoder.write_header(&header).unwrap();
+                    encoder.write_image(Arc::clone(&image)).unwrap();
+                    encoder.finish().unwrap();
+                });
+            }
+        }
+    }
 }
@@ -34,7 +34,7 @@ use super::Header;
 use super::Mode;
 use super::Mode::{Adaptive, Fixed};
 
-use super::utils::invalid_input;
+use super::utils::{invalid_data, invalid_input, IoResult};
 
 #[repr(u8)]
 #[derive(Copy, Clone)]
@@ -135,12 +135,15 @@ fn filter_none(_bpp: usize, _prev: &[u8], src: &[u8], dest: &mut [u8]) {
 //
 // https://www.w3.org/TR/PNG/#9Filter-types
 //
+#[inline(always)]
+fn sub_delta(val: u8, left: u8, _above: u8, _upper_left: u8) -> u8 {
+    val.wrapping_sub(left)
+}
+
 fn filter_sub(bpp: usize, prev: &[u8], src: &[u8], dest: &mut [u8]) {
     dest[0] = Filter::Sub as u8;
 
-    filter_iter_specialized(bpp, &prev, &src, &mut dest[1 ..], |val, left, _above, _upper_left| -> u8 {
-        val.wrapping_sub(left)
-    })
+    filter_iter_specialized(bpp, &prev, &src, &mut dest[1 ..], sub_delta)
 }
 
 //
@@ -150,13 +153,16 @@ fn filter_sub(bpp: usize, prev: &[u8], src: &[u8], dest: &mut [u8]) {
 //
 // https://www.w3.org/TR/PNG/#9Filter-types
 //
+#[inline(always)]
+fn up_delta(val: u8, _left: u8, above: u8, _upper_left: u8) -> u8 {
+    val.wrapping_sub(above)
+}
+
 fn filter_up(bpp: usize, prev: &[u8], src: &[u8], dest: &mut [u8]) {
     // Does not need specialization.
     dest[0] = Filter::Up as u8;
 
-    filter_iter_specialized(bpp, &prev, &src, &mut dest[1 ..], |val, _left, above, _upper_left| -> u8 {
-        val.wrapping_sub(above)
-    })
+    filter_iter_specialized(bpp, &prev, &src, &mut dest[1 ..], up_delta)
 }
 
 //
@@ -165,13 +171,16 @@ fn filter_up(bpp: usize, prev: &[u8], src: &[u8], dest: &mut [u8]) {
 //
 // https://www.w3.org/TR/PNG/#9Filter-type-3-Average
 //
+#[inline(always)]
+fn average_delta(val: u8, left: u8, above: u8, _upper_left: u8) -> u8 {
+    let avg = ((i16::from(left) + i16::from(above)) / 2) as u8;
+    val.wrapping_sub(avg)
+}
+
 fn filter_average(bpp: usize, prev: &[u8], src: &[u8], dest: &mut [u8]) {
     dest[0] = Filter::Average as u8;
 
-    filter_iter_specialized(bpp, &prev, &src, &mut dest[1 ..], |val, left, above, _upper_left| -> u8 {
-        let avg = ((i16::from(left) + i16::from(above)) / 2) as u8;
-        val.wrapping_sub(avg)
-    })
+    filter_iter_specialized(bpp, &prev, &src, &mut dest[1 ..], average_delta)
 }
 
 //
@@ -210,12 +219,445 @@ fn paeth_predictor(left: u8, above: u8, upper_left: u8) -> u8 {
 //
 // https://www.w3.org/TR/PNG/#9Filter-type-4-Paeth
 //
+#[inline(always)]
+fn paeth_delta(val: u8, left: u8, above: u8, upper_left: u8) -> u8 {
+    val.wrapping_sub(paeth_predictor(left, above, upper_left))
+}
+
 fn filter_paeth(bpp: usize, prev: &[u8], src: &[u8], dest: &mut [u8]) {
     dest[0] = Filter::Paeth as u8;
 
-    filter_iter_specialized(bpp, &prev, &src, &mut dest[1 ..], |val, left, above, upper_left| -> u8 {
-        val.wrapping_sub(paeth_predictor(left, above, upper_left))
-    })
+    filter_iter_specialized(bpp, &prev, &src, &mut dest[1 ..], paeth_delta)
+}
+
+//
+// Explicit SIMD filter kernels.
+//
+// Unlike unfiltering on decode, filtering has no serial dependency:
+// the left and upper-left neighbors come from the unfiltered source
+// rows, never from the output. So every filter type, including Paeth,
+// can process a whole vector of bytes at once, using unaligned loads
+// offset by bpp for the left neighbors.
+//
+// Each instruction set module below provides load/store and predictor
+// primitives; this macro expands them into a full row loop. The first
+// pixel (which has no left neighbor) and any tail shorter than a vector
+// go through the same scalar delta functions as the generic path.
+//
+// This is a macro rather than a function taking closures so that the
+// vector code gets compiled inside the #[target_feature] function.
+//
+#[cfg(any(target_arch = "x86", target_arch = "x86_64", target_arch = "aarch64"))]
+macro_rules! filter_iter_simd {
+    ($bpp:expr, $lanes:expr, $prev:ident, $src:ident, $out:ident,
+     |$val:ident, $left:ident, $above:ident, $upper_left:ident| $vector:expr,
+     $scalar:expr) => {{
+        let bpp = $bpp;
+        let len = $out.len();
+        assert!($prev.len() == len && $src.len() == len && len >= bpp);
+
+        for i in 0 .. bpp {
+            $out[i] = $scalar($src[i], 0, $prev[i], 0);
+        }
+
+        let mut i = bpp;
+        while i + $lanes <= len {
+            let $val = load($src, i);
+            let $left = load($src, i - bpp);
+            let $above = load($prev, i);
+            let $upper_left = load($prev, i - bpp);
+            store($out, i, $vector);
+            i += $lanes;
+        }
+
+        while i < len {
+            $out[i] = $scalar($src[i], $src[i - bpp], $prev[i], $prev[i - bpp]);
+            i += 1;
+        }
+    }};
+}
+
+//
+// Same as filter_iter_specialized, but for the unsafe SIMD kernels.
+//
+#[cfg(any(target_arch = "x86", target_arch = "x86_64", target_arch = "aarch64"))]
+macro_rules! simd_specialized {
+    ($func:ident, $bpp:expr, $($arg:expr),*) => {
+        match $bpp {
+            1 => $func::<U1>($($arg),*),
+            2 => $func::<U2>($($arg),*),
+            3 => $func::<U3>($($arg),*),
+            4 => $func::<U4>($($arg),*),
+            6 => $func::<U6>($($arg),*),
+            8 => $func::<U8>($($arg),*),
+            _ => panic!("Invalid bpp, should never happen."),
+        }
+    };
+}
+
+//
+// Generates the public per-filter entry points for a SIMD module,
+// matching the signatures of the scalar filter_* functions, plus
+// the fused complexity estimate used by the adaptive filter.
+//
+#[cfg(any(target_arch = "x86", target_arch = "x86_64", target_arch = "aarch64"))]
+macro_rules! simd_filters {
+    ($feature:tt, $vsub:ident) => {
+        #[target_feature(enable = $feature)]
+        unsafe fn filter_sub_generic<BPP: Unsigned>(prev: &[u8], src: &[u8], out: &mut [u8]) {
+            filter_iter_simd!(BPP::USIZE, LANES, prev, src, out,
+                              |val, left, _above, _upper_left| $vsub(val, left),
+                              sub_delta)
+        }
+
+        #[target_feature(enable = $feature)]
+        unsafe fn filter_up_generic<BPP: Unsigned>(prev: &[u8], src: &[u8], out: &mut [u8]) {
+            filter_iter_simd!(BPP::USIZE, LANES, prev, src, out,
+                              |val, _left, above, _upper_left| $vsub(val, above),
+                              up_delta)
+        }
+
+        #[target_feature(enable = $feature)]
+        unsafe fn filter_average_generic<BPP: Unsigned>(prev: &[u8], src: &[u8], out: &mut [u8]) {
+            filter_iter_simd!(BPP::USIZE, LANES, prev, src, out,
+                              |val, left, above, _upper_left| $vsub(val, average(left, above)),
+                              average_delta)
+        }
+
+        #[target_feature(enable = $feature)]
+        unsafe fn filter_paeth_generic<BPP: Unsigned>(prev: &[u8], src: &[u8], out: &mut [u8]) {
+            filter_iter_simd!(BPP::USIZE, LANES, prev, src, out,
+                              |val, left, above, upper_left| $vsub(val, paeth(left, above, upper_left)),
+                              paeth_delta)
+        }
+
+        #[target_feature(enable = $feature)]
+        unsafe fn estimate_complexity_generic<BPP: Unsigned>(prev: &[u8], src: &[u8]) -> Complexity {
+            let bpp = BPP::USIZE;
+            let len = src.len();
+            assert!(prev.len() == len && len >= bpp);
+
+            let mut sums = [0u64; 4];
+            for i in 0 .. bpp {
+                estimate_pixel(&mut sums, src[i], 0, prev[i], 0);
+            }
+
+            let mut sum_sub = zero_sum();
+            let mut sum_up = zero_sum();
+            let mut sum_average = zero_sum();
+            let mut sum_paeth = zero_sum();
+            let mut i = bpp;
+            while i + LANES <= len {
+                let val = load(src, i);
+                let left = load(src, i - bpp);
+                let above = load(prev, i);
+                let upper_left = load(prev, i - bpp);
+                sum_sub = accumulate(sum_sub, $vsub(val, left));
+                sum_up = accumulate(sum_up, $vsub(val, above));
+                sum_average = accumulate(sum_average, $vsub(val, average(left, above)));
+                sum_paeth = accumulate(sum_paeth, $vsub(val, paeth(left, above, upper_left)));
+                i += LANES;
+            }
+
+            while i < len {
+                estimate_pixel(&mut sums, src[i], src[i - bpp], prev[i], prev[i - bpp]);
+                i += 1;
+            }
+
+            Complexity::from_sums([sums[0] + total(sum_sub),
+                                   sums[1] + total(sum_up),
+                                   sums[2] + total(sum_average),
+                                   sums[3] + total(sum_paeth)])
+        }
+
+        #[target_feature(enable = $feature)]
+        pub unsafe fn estimate_complexity(bpp: usize, prev: &[u8], src: &[u8]) -> Complexity {
+            simd_specialized!(estimate_complexity_generic, bpp, prev, src)
+        }
+
+        #[target_feature(enable = $feature)]
+        pub unsafe fn filter_sub(bpp: usize, prev: &[u8], src: &[u8], dest: &mut [u8]) {
+            dest[0] = Filter::Sub as u8;
+            simd_specialized!(filter_sub_generic, bpp, prev, src, &mut dest[1 ..])
+        }
+
+        #[target_feature(enable = $feature)]
+        pub unsafe fn filter_up(bpp: usize, prev: &[u8], src: &[u8], dest: &mut [u8]) {
+            dest[0] = Filter::Up as u8;
+            simd_specialized!(filter_up_generic, bpp, prev, src, &mut dest[1 ..])
+        }
+
+        #[target_feature(enable = $feature)]
+        pub unsafe fn filter_average(bpp: usize, prev: &[u8], src: &[u8], dest: &mut [u8]) {
+            dest[0] = Filter::Average as u8;
+            simd_specialized!(filter_average_generic, bpp, prev, src, &mut dest[1 ..])
+        }
+
+        #[target_feature(enable = $feature)]
+        pub unsafe fn filter_paeth(bpp: usize, prev: &[u8], src: &[u8], dest: &mut [u8]) {
+            dest[0] = Filter::Paeth as u8;
+            simd_specialized!(filter_paeth_generic, bpp, prev, src, &mut dest[1 ..])
+        }
+    };
+}
+
+//
+// SSE4.1 kernels, 16 bytes at a time.
+//
+// Paeth widens to 16 bits to compute the distances, using the
+// identities p - a = b - c, p - b = a - c, p - c = a + b - 2c.
+//
+#[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+mod sse41 {
+    #[cfg(target_arch = "x86")]
+    use std::arch::x86::*;
+    #[cfg(target_arch = "x86_64")]
+    use std::arch::x86_64::*;
+
+    use typenum::Unsigned;
+    use typenum::consts::*;
+
+    use super::Filter;
+    use super::{sub_delta, up_delta, average_delta, paeth_delta};
+    use super::{Complexity, estimate_pixel};
+
+    const LANES: usize = 16;
+
+    #[inline]
+    #[target_feature(enable = "sse4.1")]
+    unsafe fn load(data: &[u8], i: usize) -> __m128i {
+        _mm_loadu_si128(data.as_ptr().add(i) as *const __m128i)
+    }
+
+    #[inline]
+    #[target_feature(enable = "sse4.1")]
+    unsafe fn store(data: &mut [u8], i: usize, val: __m128i) {
+        _mm_storeu_si128(data.as_mut_ptr().add(i) as *mut __m128i, val)
+    }
+
+    #[inline]
+    #[target_feature(enable = "sse4.1")]
+    unsafe fn average(left: __m128i, above: __m128i) -> __m128i {
+        // pavgb rounds up; knock off the carry to get floor((a + b) / 2).
+        let round = _mm_and_si128(_mm_xor_si128(left, above), _mm_set1_epi8(1));
+        _mm_sub_epi8(_mm_avg_epu8(left, above), round)
+    }
+
+    #[inline]
+    #[target_feature(enable = "sse4.1")]
+    unsafe fn paeth_16(a: __m128i, b: __m128i, c: __m128i) -> __m128i {
+        let pa = _mm_abs_epi16(_mm_sub_epi16(b, c));
+        let pb = _mm_abs_epi16(_mm_sub_epi16(a, c));
+        let pc = _mm_abs_epi16(_mm_sub_epi16(_mm_add_epi16(a, b), _mm_add_epi16(c, c)));
+        let not_a = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+        let use_c = _mm_cmpgt_epi16(pb, pc);
+        _mm_blendv_epi8(a, _mm_blendv_epi8(b, c, use_c), not_a)
+    }
+
+    #[inline]
+    #[target_feature(enable = "sse4.1")]
+    unsafe fn paeth(left: __m128i, above: __m128i, upper_left: __m128i) -> __m128i {
+        let zero = _mm_setzero_si128();
+        let lo = paeth_16(_mm_unpacklo_epi8(left, zero),
+                          _mm_unpacklo_epi8(above, zero),
+                          _mm_unpacklo_epi8(upper_left, zero));
+        let hi = paeth_16(_mm_unpackhi_epi8(left, zero),
+                          _mm_unpackhi_epi8(above, zero),
+                          _mm_unpackhi_epi8(upper_left, zero));
+        _mm_packus_epi16(lo, hi)
+    }
+
+    #[inline]
+    #[target_feature(enable = "sse4.1")]
+    unsafe fn zero_sum() -> __m128i {
+        _mm_setzero_si128()
+    }
+
+    #[inline]
+    #[target_feature(enable = "sse4.1")]
+    unsafe fn accumulate(sum: __m128i, delta: __m128i) -> __m128i {
+        // Absolute value as signed bytes, summed into two 64-bit lanes.
+        _mm_add_epi64(sum, _mm_sad_epu8(_mm_abs_epi8(delta), _mm_setzero_si128()))
+    }
+
+    #[inline]
+    #[target_feature(enable = "sse4.1")]
+    unsafe fn total(sum: __m128i) -> u64 {
+        let mut lanes = [0u64; 2];
+        _mm_storeu_si128(lanes.as_mut_ptr() as *mut __m128i, sum);
+        lanes[0] + lanes[1]
+    }
+
+    simd_filters!("sse4.1", _mm_sub_epi8);
+}
+
+//
+// AVX2 kernels, 32 bytes at a time.
+//
+// The unpack and pack instructions work within 128-bit lanes, so
+// widening with unpacklo/hi and narrowing with packus round-trips
+// the byte order without any cross-lane shuffles.
+//
+#[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+mod avx2 {
+    #[cfg(target_arch = "x86")]
+    use std::arch::x86::*;
+    #[cfg(target_arch = "x86_64")]
+    use std::arch::x86_64::*;
+
+    use typenum::Unsigned;
+    use typenum::consts::*;
+
+    use super::Filter;
+    use super::{sub_delta, up_delta, average_delta, paeth_delta};
+    use super::{Complexity, estimate_pixel};
+
+    const LANES: usize = 32;
+
+    #[inline]
+    #[target_feature(enable = "avx2")]
+    unsafe fn load(data: &[u8], i: usize) -> __m256i {
+        _mm256_loadu_si256(data.as_ptr().add(i) as *const __m256i)
+    }
+
+    #[inline]
+    #[target_feature(enable = "avx2")]
+    unsafe fn store(data: &mut [u8], i: usize, val: __m256i) {
+        _mm256_storeu_si256(data.as_mut_ptr().add(i) as *mut __m256i, val)
+    }
+
+    #[inline]
+    #[target_feature(enable = "avx2")]
+    unsafe fn average(left: __m256i, above: __m256i) -> __m256i {
+        let round = _mm256_and_si256(_mm256_xor_si256(left, above), _mm256_set1_epi8(1));
+        _mm256_sub_epi8(_mm256_avg_epu8(left, above), round)
+    }
+
+    #[inline]
+    #[target_feature(enable = "avx2")]
+    unsafe fn paeth_16(a: __m256i, b: __m256i, c: __m256i) -> __m256i {
+        let pa = _mm256_abs_epi16(_mm256_sub_epi16(b, c));
+        let pb = _mm256_abs_epi16(_mm256_sub_epi16(a, c));
+        let pc = _mm256_abs_epi16(_mm256_sub_epi16(_mm256_add_epi16(a, b), _mm256_add_epi16(c, c)));
+        let not_a = _mm256_or_si256(_mm256_cmpgt_epi16(pa, pb), _mm256_cmpgt_epi16(pa, pc));
+        let use_c = _mm256_cmpgt_epi16(pb, pc);
+        _mm256_blendv_epi8(a, _mm256_blendv_epi8(b, c, use_c), not_a)
+    }
+
+    #[inline]
+    #[target_feature(enable = "avx2")]
+    unsafe fn paeth(left: __m256i, above: __m256i, upper_left: __m256i) -> __m256i {
+        let zero = _mm256_setzero_si256();
+        let lo = paeth_16(_mm256_unpacklo_epi8(left, zero),
+                          _mm256_unpacklo_epi8(above, zero),
+                          _mm256_unpacklo_epi8(upper_left, zero));
+        let hi = paeth_16(_mm256_unpackhi_epi8(left, zero),
+                          _mm256_unpackhi_epi8(above, zero),
+                          _mm256_unpackhi_epi8(upper_left, zero));
+        _mm256_packus_epi16(lo, hi)
+    }
+
+    #[inline]
+    #[target_feature(enable = "avx2")]
+    unsafe fn zero_sum() -> __m256i {
+        _mm256_setzero_si256()
+    }
+
+    #[inline]
+    #[target_feature(enable = "avx2")]
+    unsafe fn accumulate(sum: __m256i, delta: __m256i) -> __m256i {
+        _mm256_add_epi64(sum, _mm256_sad_epu8(_mm256_abs_epi8(delta), _mm256_setzero_si256()))
+    }
+
+    #[inline]
+    #[target_feature(enable = "avx2")]
+    unsafe fn total(sum: __m256i) -> u64 {
+        let mut lanes = [0u64; 4];
+        _mm256_storeu_si256(lanes.as_mut_ptr() as *mut __m256i, sum);
+        lanes[0] + lanes[1] + lanes[2] + lanes[3]
+    }
+
+    simd_filters!("avx2", _mm256_sub_epi8);
+}
+
+//
+// NEON kernels for arm64, 16 bytes at a time.
+//
+// NEON is a baseline feature on aarch64 so these are used unconditionally.
+// Halving add gives the floor average directly, and the widening absolute
+// difference ops give the Paeth distances without sign juggling.
+//
+#[cfg(target_arch = "aarch64")]
+mod neon {
+    use std::arch::aarch64::*;
+
+    use typenum::Unsigned;
+    use typenum::consts::*;
+
+    use super::Filter;
+    use super::{sub_delta, up_delta, average_delta, paeth_delta};
+    use super::{Complexity, estimate_pixel};
+
+    const LANES: usize = 16;
+
+    #[inline]
+    #[target_feature(enable = "neon")]
+    unsafe fn load(data: &[u8], i: usize) -> uint8x16_t {
+        vld1q_u8(data.as_ptr().add(i))
+    }
+
+    #[inline]
+    #[target_feature(enable = "neon")]
+    unsafe fn store(data: &mut [u8], i: usize, val: uint8x16_t) {
+        vst1q_u8(data.as_mut_ptr().add(i), val)
+    }
+
+    #[inline]
+    #[target_feature(enable = "neon")]
+    unsafe fn average(left: uint8x16_t, above: uint8x16_t) -> uint8x16_t {
+        vhaddq_u8(left, above)
+    }
+
+    #[inline]
+    #[target_feature(enable = "neon")]
+    unsafe fn paeth(a: uint8x16_t, b: uint8x16_t, c: uint8x16_t) -> uint8x16_t {
+        let pa_lo = vabdl_u8(vget_low_u8(b), vget_low_u8(c));
+        let pa_hi = vabdl_high_u8(b, c);
+        let pb_lo = vabdl_u8(vget_low_u8(a), vget_low_u8(c));
+        let pb_hi = vabdl_high_u8(a, c);
+        let pc_lo = vabdq_u16(vaddl_u8(vget_low_u8(a), vget_low_u8(b)),
+                              vshll_n_u8::<1>(vget_low_u8(c)));
+        let pc_hi = vabdq_u16(vaddl_high_u8(a, b),
+                              vshll_high_n_u8::<1>(c));
+
+        let not_a = vcombine_u8(vmovn_u16(vorrq_u16(vcgtq_u16(pa_lo, pb_lo), vcgtq_u16(pa_lo, pc_lo))),
+                                vmovn_u16(vorrq_u16(vcgtq_u16(pa_hi, pb_hi), vcgtq_u16(pa_hi, pc_hi))));
+        let use_c = vcombine_u8(vmovn_u16(vcgtq_u16(pb_lo, pc_lo)),
+                                vmovn_u16(vcgtq_u16(pb_hi, pc_hi)));
+        vbslq_u8(not_a, vbslq_u8(use_c, c, b), a)
+    }
+
+    #[inline]
+    #[target_feature(enable = "neon")]
+    unsafe fn zero_sum() -> uint64x2_t {
+        vdupq_n_u64(0)
+    }
+
+    #[inline]
+    #[target_feature(enable = "neon")]
+    unsafe fn accumulate(sum: uint64x2_t, delta: uint8x16_t) -> uint64x2_t {
+        // Absolute value as signed bytes, pairwise widened into two 64-bit lanes.
+        let abs = vreinterpretq_u8_s8(vabsq_s8(vreinterpretq_s8_u8(delta)));
+        vpadalq_u32(sum, vpaddlq_u16(vpaddlq_u8(abs)))
+    }
+
+    #[inline]
+    #[target_feature(enable = "neon")]
+    unsafe fn total(sum: uint64x2_t) -> u64 {
+        vaddvq_u64(sum)
+    }
+
+    simd_filters!("neon", vsubq_u8);
 }
 
 
@@ -226,6 +668,7 @@ fn filter_paeth(bpp: usize, prev: &[u8], src: &[u8], dest: &mut [u8]) {
 // Note this doesn't produce useful results on the "none" filter,
 // as it's expecting, well, a filter delta. :D
 //
+#[inline(always)]
 fn filter_complexity_delta(val: u8) -> u32 {
     i32::abs(i32::from(val as i8)) as u32
 }
@@ -239,136 +682,187 @@ fn complexity_max() -> u32 {
 }
 
 //
-// Any row with this number of bytes needs to check for overflow
-// of the complexity heuristic.
+// Accumulating up to this many bytes at a time in 32 bits can't
+// overflow, so the inner loops don't need to check.
 //
-fn complexity_big_row(len: usize) -> bool {
-    len >= (1 << 24)
-}
+const COMPLEXITY_BLOCK: usize = 1 << 24;
 
 //
-// Complexity/compressibility heuristic recommended by the PNG spec
-// and used in libpng as well.
-//
-// Note this doesn't produce useful results on the "none" filter
+// Complexity/compressibility heuristic values for each of the
+// predicting filters on a single row, as recommended by the PNG
+// spec and used in libpng as well.
 //
-// libpng tries to do this inline with the filter with a clever
-// early return if "too complex", but I find that's slower on large
-// files than just running the whole filter.
-//
-fn estimate_complexity(data: &[u8]) -> u32 {
-    let mut sum = 0u32;
+struct Complexity {
+    sub: u32,
+    up: u32,
+    average: u32,
+    paeth: u32,
+}
 
+impl Complexity {
     //
-    // Very long rows could overflow the 32-bit complexity heuristic's
-    // accumulator, but it doesn't trigger until tens of millions
-    // of bytes per row. :)
+    // Very long rows could overflow the 32-bit heuristic, but it
+    // doesn't trigger until tens of millions of bytes per row. :)
+    // Clamp like the old early-return check did.
     //
-    // The check slows down the inner loop on more realistic sizes
-    // (say, ~31k bytes for a 7680 wide RGBA image) so we skip it.
-    //
-    if complexity_big_row(data.len()) {
-        for iter in data.iter() {
-            sum += filter_complexity_delta(*iter);
-            if sum > complexity_max() {
-                return complexity_max();
-            }
-        }
-    } else {
-        for iter in data.iter() {
-            sum += filter_complexity_delta(*iter);
+    fn from_sums(sums: [u64; 4]) -> Complexity {
+        let clamp = |sum: u64| cmp::min(sum, u64::from(complexity_max())) as u32;
+        Complexity {
+            sub: clamp(sums[0]),
+            up: clamp(sums[1]),
+            average: clamp(sums[2]),
+            paeth: clamp(sums[3]),
         }
     }
 
-    sum
+    //
+    // Pick the filter with the lowest estimate, breaking ties
+    // in favor of Paeth, Average, Up, and Sub in that order.
+    //
+    fn best(&self) -> Filter {
+        let min = cmp::min(cmp::min(self.sub, self.up),
+                           cmp::min(self.average, self.paeth));
+        if min == self.paeth {
+            Filter::Paeth
+        } else if min == self.average {
+            Filter::Average
+        } else if min == self.up {
+            Filter::Up
+        } else {
+            Filter::Sub
+        }
+    }
 }
 
 //
-// Holds a target row that can be filtered
-// Can be reused.
+// Add a single byte's deltas for each filter to the running sums,
+// for the edges of rows in the fused estimators.
 //
-struct Filterator {
-    filter: Filter,
-    bpp: usize,
-    data: Vec<u8>,
-    complexity: u32,
+#[inline(always)]
+fn estimate_pixel(sums: &mut [u64; 4], val: u8, left: u8, above: u8, upper_left: u8) {
+    sums[0] += u64::from(filter_complexity_delta(sub_delta(val, left, above, upper_left)));
+    sums[1] += u64::from(filter_complexity_delta(up_delta(val, left, above, upper_left)));
+    sums[2] += u64::from(filter_complexity_delta(average_delta(val, left, above, upper_left)));
+    sums[3] += u64::from(filter_complexity_delta(paeth_delta(val, left, above, upper_left)));
 }
 
-impl Filterator {
-    fn new(filter: Filter, bpp: usize, stride: usize) -> Filterator {
-        Filterator {
-            filter,
-            bpp,
-            data: vec![0u8; stride + 1],
-            complexity: 0,
-        }
+//
+// Fused complexity estimate for all four predicting filters in a
+// single pass over the source rows. Nothing is written out; the
+// adaptive filter runs only the winning filter into its output
+// afterwards, instead of filtering four times and re-reading
+// each result to measure it.
+//
+// libpng tries to do this inline with the filter with a clever
+// early return if "too complex", but I find that's slower on large
+// files than just running the whole filter.
+//
+#[inline(always)]
+fn estimate_complexity_generic<BPP: Unsigned>(prev: &[u8], src: &[u8]) -> Complexity {
+    let bpp = BPP::USIZE;
+    let len = src.len();
+
+    let mut sums = [0u64; 4];
+    for (cur, up) in izip!(&src[0 .. bpp], &prev[0 .. bpp]) {
+        estimate_pixel(&mut sums, *cur, 0, *up, 0);
     }
 
-    #[inline(always)]
-    fn do_filter(&mut self, prev: &[u8], src: &[u8]) -> &[u8] {
-        match self.filter {
-            Filter::None    => filter_none(self.bpp, prev, src, &mut self.data),
-            Filter::Sub     => filter_sub(self.bpp, prev, src, &mut self.data),
-            Filter::Up      => filter_up(self.bpp, prev, src, &mut self.data),
-            Filter::Average => filter_average(self.bpp, prev, src, &mut self.data),
-            Filter::Paeth   => filter_paeth(self.bpp, prev, src, &mut self.data),
+    let mut start = bpp;
+    while start < len {
+        let end = cmp::min(len, start + COMPLEXITY_BLOCK);
+        let mut sub = 0u32;
+        let mut up = 0u32;
+        let mut average = 0u32;
+        let mut paeth = 0u32;
+        for (cur, left, above, upper_left) in
+            izip!(&src[start .. end],
+                  &src[start - bpp .. end - bpp],
+                  &prev[start .. end],
+                  &prev[start - bpp .. end - bpp]) {
+            sub += filter_complexity_delta(sub_delta(*cur, *left, *above, *upper_left));
+            up += filter_complexity_delta(up_delta(*cur, *left, *above, *upper_left));
+            average += filter_complexity_delta(average_delta(*cur, *left, *above, *upper_left));
+            paeth += filter_complexity_delta(paeth_delta(*cur, *left, *above, *upper_left));
         }
-        self.complexity = estimate_complexity(&self.data[1..]);
-        &self.data
+        sums[0] += u64::from(sub);
+        sums[1] += u64::from(up);
+        sums[2] += u64::from(average);
+        sums[3] += u64::from(paeth);
+        start = end;
     }
 
-    #[cfg(target_arch = "x86")]
-    #[target_feature(enable = "sse2")]
-    unsafe fn do_filter_sse2(&mut self, prev: &[u8], src: &[u8]) -> &[u8] {
-        self.do_filter(prev, src)
-    }
+    Complexity::from_sums(sums)
+}
 
-    #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
-    #[target_feature(enable = "sse4.1")]
-    unsafe fn do_filter_sse41(&mut self, prev: &[u8], src: &[u8]) -> &[u8] {
-        self.do_filter(prev, src)
+fn estimate_complexity(bpp: usize, prev: &[u8], src: &[u8]) -> Complexity {
+    match bpp {
+        1 => estimate_complexity_generic::<U1>(prev, src),
+        2 => estimate_complexity_generic::<U2>(prev, src),
+        3 => estimate_complexity_generic::<U3>(prev, src),
+        4 => estimate_complexity_generic::<U4>(prev, src),
+        6 => estimate_complexity_generic::<U6>(prev, src),
+        8 => estimate_complexity_generic::<U8>(prev, src),
+        _ => panic!("Invalid bpp, should never happen."),
     }
+}
 
-    #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
-    #[target_feature(enable = "sse4.2")]
-    unsafe fn do_filter_sse42(&mut self, prev: &[u8], src: &[u8]) -> &[u8] {
-        self.do_filter(prev, src)
+#[inline(always)]
+fn filter_generic(filter: Filter, bpp: usize, prev: &[u8], src: &[u8], dest: &mut [u8]) {
+    match filter {
+        Filter::None    => filter_none(bpp, prev, src, dest),
+        Filter::Sub     => filter_sub(bpp, prev, src, dest),
+        Filter::Up      => filter_up(bpp, prev, src, dest),
+        Filter::Average => filter_average(bpp, prev, src, dest),
+        Filter::Paeth   => filter_paeth(bpp, prev, src, dest),
     }
+}
 
-    #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
-    #[target_feature(enable = "avx")]
-    unsafe fn do_filter_avx(&mut self, prev: &[u8], src: &[u8]) -> &[u8] {
-        self.do_filter(prev, src)
-    }
+//
+// On 32-bit x86 without SSE4.1, at least let the compiler
+// autovectorize the generic code with SSE2 when present.
+//
+#[cfg(target_arch = "x86")]
+#[target_feature(enable = "sse2")]
+unsafe fn filter_sse2(filter: Filter, bpp: usize, prev: &[u8], src: &[u8], dest: &mut [u8]) {
+    filter_generic(filter, bpp, prev, src, dest)
+}
+
+#[cfg(target_arch = "x86")]
+#[target_feature(enable = "sse2")]
+unsafe fn estimate_complexity_sse2(bpp: usize, prev: &[u8], src: &[u8]) -> Complexity {
+    estimate_complexity(bpp, prev, src)
+}
 
+//
+// Which implementation of the filter kernels to use.
+// Detected once per filter instance rather than on every row.
+//
+#[derive(Copy, Clone)]
+enum Kernels {
+    Generic,
+    #[cfg(target_arch = "x86")]
+    Sse2,
     #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
-    #[target_feature(enable = "avx2")]
-    unsafe fn do_filter_avx2(&mut self, prev: &[u8], src: &[u8]) -> &[u8] {
-        self.do_filter(prev, src)
-    }
+    Sse41,
+    #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+    Avx2,
+    #[cfg(target_arch = "aarch64")]
+    Neon,
+}
 
-    fn filter(&mut self, prev: &[u8], src: &[u8]) -> &[u8] {
+impl Kernels {
+    fn detect() -> Kernels {
+        //
+        // AVX and SSE4.2 don't add anything useful over SSE4.1
+        // for the byte-wise integer ops the kernels use.
+        //
         #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
         {
             if is_x86_feature_detected!("avx2") {
-                return unsafe {
-                    self.do_filter_avx2(prev, src)
-                };
-            }
-            if is_x86_feature_detected!("avx") {
-                return unsafe {
-                    self.do_filter_avx(prev, src)
-                };
-            }
-            if is_x86_feature_detected!("sse4.2") {
-                return unsafe {
-                    self.do_filter_sse42(prev, src)
-                };
+                return Kernels::Avx2;
             }
             if is_x86_feature_detected!("sse4.1") {
-                return unsafe {
-                    self.do_filter_sse41(prev, src)
-                };
+                return Kernels::Sse41;
             }
         }
         #[cfg(target_arch = "x86")]
@@ -376,47 +870,98 @@ impl Filterator {
             // SSE2 is guaranteed on x86_64
             // but may not be present on x86
             if is_x86_feature_detected!("sse2") {
-                return unsafe {
-                    self.do_filter_sse2(prev, src)
-                };
+                return Kernels::Sse2;
+            }
+        }
+        #[cfg(target_arch = "aarch64")]
+        {
+            // NEON is part of the aarch64 baseline.
+            if cfg!(target_feature = "neon") {
+                return Kernels::Neon;
             }
         }
-        self.do_filter(prev, src)
+        Kernels::Generic
     }
 
-    fn get_data(&self) -> &[u8] {
-        &self.data
+    fn filter(self, filter: Filter, bpp: usize, prev: &[u8], src: &[u8], dest: &mut [u8]) {
+        match self {
+            Kernels::Generic => filter_generic(filter, bpp, prev, src, dest),
+            #[cfg(target_arch = "x86")]
+            Kernels::Sse2 => unsafe {
+                filter_sse2(filter, bpp, prev, src, dest)
+            },
+            #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+            Kernels::Sse41 => unsafe {
+                match filter {
+                    Filter::None    => filter_none(bpp, prev, src, dest),
+                    Filter::Sub     => sse41::filter_sub(bpp, prev, src, dest),
+                    Filter::Up      => sse41::filter_up(bpp, prev, src, dest),
+                    Filter::Average => sse41::filter_average(bpp, prev, src, dest),
+                    Filter::Paeth   => sse41::filter_paeth(bpp, prev, src, dest),
+                }
+            },
+            #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+            Kernels::Avx2 => unsafe {
+                match filter {
+                    Filter::None    => filter_none(bpp, prev, src, dest),
+                    Filter::Sub     => avx2::filter_sub(bpp, prev, src, dest),
+                    Filter::Up      => avx2::filter_up(bpp, prev, src, dest),
+                    Filter::Average => avx2::filter_average(bpp, prev, src, dest),
+                    Filter::Paeth   => avx2::filter_paeth(bpp, prev, src, dest),
+                }
+            },
+            #[cfg(target_arch = "aarch64")]
+            Kernels::Neon => unsafe {
+                match filter {
+                    Filter::None    => filter_none(bpp, prev, src, dest),
+                    Filter::Sub     => neon::filter_sub(bpp, prev, src, dest),
+                    Filter::Up      => neon::filter_up(bpp, prev, src, dest),
+                    Filter::Average => neon::filter_average(bpp, prev, src, dest),
+                    Filter::Paeth   => neon::filter_paeth(bpp, prev, src, dest),
+                }
+            },
+        }
     }
 
-    fn get_complexity(&self) -> u32 {
-        self.complexity
+    fn estimate_complexity(self, bpp: usize, prev: &[u8], src: &[u8]) -> Complexity {
+        match self {
+            Kernels::Generic => estimate_complexity(bpp, prev, src),
+            #[cfg(target_arch = "x86")]
+            Kernels::Sse2 => unsafe {
+                estimate_complexity_sse2(bpp, prev, src)
+            },
+            #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+            Kernels::Sse41 => unsafe {
+                sse41::estimate_complexity(bpp, prev, src)
+            },
+            #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+            Kernels::Avx2 => unsafe {
+                avx2::estimate_complexity(bpp, prev, src)
+            },
+            #[cfg(target_arch = "aarch64")]
+            Kernels::Neon => unsafe {
+                neon::estimate_complexity(bpp, prev, src)
+            },
+        }
     }
 }
 
 pub struct AdaptiveFilter {
     mode: Mode<Filter>,
-    filter_none: Filterator,
-    filter_up: Filterator,
-    filter_sub: Filterator,
-    filter_average: Filterator,
-    filter_paeth: Filterator,
+    bpp: usize,
+    kernels: Kernels,
 }
 
 impl AdaptiveFilter {
     pub fn new(header: Header, mode: Mode<Filter>) -> AdaptiveFilter {
-        let stride = header.stride();
-        let bpp = header.bytes_per_pixel();
         AdaptiveFilter {
             mode,
-            filter_none:    Filterator::new(Filter::None,    bpp, stride),
-            filter_up:      Filterator::new(Filter::Up,      bpp, stride),
-            filter_sub:     Filterator::new(Filter::Sub,     bpp, stride),
-            filter_average: Filterator::new(Filter::Average, bpp, stride),
-            filter_paeth:   Filterator::new(Filter::Paeth,   bpp, stride),
+            bpp: header.bytes_per_pixel(),
+            kernels: Kernels::detect(),
         }
     }
 
-    fn filter_adaptive(&mut self, prev: &[u8], src: &[u8]) -> &[u8] {
+    fn filter_adaptive(&self, prev: &[u8], src: &[u8], dest: &mut [u8]) -> Filter {
         //
         // Note the "none" filter is often good for things like
         // line-art diagrams and screenshots that have lots of
@@ -429,40 +974,103 @@ impl AdaptiveFilter {
         // Compression could be improved for some files if a heuristic
         // can be devised to check if the none filter will work well.
         //
+        let complexity = self.kernels.estimate_complexity(self.bpp, prev, src);
+        let filter = complexity.best();
+        self.kernels.filter(filter, self.bpp, prev, src, dest);
+        filter
+    }
 
-        self.filter_sub.filter(prev, src);
-        let mut min = self.filter_sub.get_complexity();
-
-        self.filter_up.filter(prev, src);
-        min = cmp::min(min, self.filter_up.get_complexity());
-
-        self.filter_average.filter(prev, src);
-        min = cmp::min(min, self.filter_average.get_complexity());
+    //
+    // Filter a row straight into the caller's output buffer,
+    // which must be one byte longer than the row for the
+    // filter type tag. Returns the filter used.
+    //
+    pub fn filter_into(&self, prev: &[u8], src: &[u8], dest: &mut [u8]) -> Filter {
+        match self.mode {
+            Fixed(filter) => {
+                self.kernels.filter(filter, self.bpp, prev, src, dest);
+                filter
+            },
+            Adaptive => self.filter_adaptive(prev, src, dest),
+        }
+    }
 
-        self.filter_paeth.filter(prev, src);
-        min = cmp::min(min, self.filter_paeth.get_complexity());
+    //
+    // Same as filter_into(), but with only the filters that don't look
+    // at the row above, so it can be unfiltered without decoding the
+    // rows before it. Given a row of zeros, "up" works out the same as
+    // "none" and "paeth" as "sub".
+    //
+    pub fn filter_standalone_into(&self, zero: &[u8], src: &[u8], dest: &mut [u8]) -> Filter {
+        let filter = match self.mode {
+            Fixed(Filter::None) | Fixed(Filter::Up) => Filter::None,
+            Fixed(_) => Filter::Sub,
+            Adaptive => {
+                let complexity = self.kernels.estimate_complexity(self.bpp, zero, src);
+                if complexity.up < complexity.sub {
+                    Filter::None
+                } else {
+                    Filter::Sub
+                }
+            }
+        };
+        self.kernels.filter(filter, self.bpp, zero, src, dest);
+        filter
+    }
 
-        if min == self.filter_paeth.get_complexity() {
-            self.filter_paeth.get_data()
-        } else if min == self.filter_average.get_complexity() {
-            self.filter_average.get_data()
-        } else if min == self.filter_up.get_complexity() {
-            self.filter_up.get_data()
-        } else /*if min == self.filter_sub.get_complexity() */ {
-            self.filter_sub.get_data()
-        }
+    #[cfg(test)]
+    pub fn filter(&self, prev: &[u8], src: &[u8]) -> Vec<u8> {
+        let mut data = vec![0u8; src.len() + 1];
+        self.filter_into(prev, src, &mut data);
+        data
     }
+}
 
-    pub fn filter(&mut self, prev: &[u8], src: &[u8]) -> &[u8] {
-        match self.mode {
-            Fixed(Filter::None)    => self.filter_none.filter(prev, src),
-            Fixed(Filter::Sub)     => self.filter_sub.filter(prev, src),
-            Fixed(Filter::Up)      => self.filter_up.filter(prev, src),
-            Fixed(Filter::Average) => self.filter_average.filter(prev, src),
-            Fixed(Filter::Paeth)   => self.filter_paeth.filter(prev, src),
-            Adaptive               => self.filter_adaptive(prev, src),
-        }
+//
+// Undo a row's filter when decoding, given its filter type byte and
+// the unfiltered row above, or zeros for the first row. Each byte
+// depends on the one a pixel to its left, so there's not much for
+// the compiler to vectorize except for the "up" filter.
+//
+// https://www.w3.org/TR/PNG/#9Filters
+//
+pub fn unfilter(filter: u8, bpp: usize, prev: &[u8], src: &[u8], dest: &mut [u8]) -> IoResult {
+    let len = dest.len();
+    let first = cmp::min(bpp, len);
+    match filter {
+        0 => dest.copy_from_slice(src),
+        1 => {
+            dest[.. first].copy_from_slice(&src[.. first]);
+            for i in first .. len {
+                dest[i] = src[i].wrapping_add(dest[i - bpp]);
+            }
+        },
+        2 => {
+            for ((out, &val), &above) in dest.iter_mut().zip(src).zip(prev) {
+                *out = val.wrapping_add(above);
+            }
+        },
+        3 => {
+            for i in 0 .. first {
+                dest[i] = src[i].wrapping_add(prev[i] >> 1);
+            }
+            for i in first .. len {
+                let average = (u16::from(dest[i - bpp]) + u16::from(prev[i])) >> 1;
+                dest[i] = src[i].wrapping_add(average as u8);
+            }
+        },
+        4 => {
+            for i in 0 .. first {
+                dest[i] = src[i].wrapping_add(prev[i]);
+            }
+            for i in first .. len {
+                let predictor = paeth_predictor(dest[i - bpp], prev[i], prev[i - bpp]);
+                dest[i] = src[i].wrapping_add(predictor);
+            }
+        },
+        _ => return Err(invalid_data("Invalid filter type")),
     }
+    Ok(())
 }
 
 #[cfg(test)]
@@ -477,7 +1085,7 @@ mod tests {
         let mut header = Header::new();
         header.set_size(1024, 768).unwrap();
         header.set_color(ColorType::Truecolor, 8).unwrap();
-        let mut filter = AdaptiveFilter::new(header, Mode::Adaptive);
+        let filter = AdaptiveFilter::new(header, Mode::Adaptive);
 
         let prev = vec![0u8; header.stride()];
         let row = vec![0u8; header.stride()];
@@ -490,11 +1098,178 @@ mod tests {
         let mut header = Header::new();
         header.set_size(1024, 768).unwrap();
         header.set_color(ColorType::Truecolor, 16).unwrap();
-        let mut filter = AdaptiveFilter::new(header, Mode::Adaptive);
+        let filter = AdaptiveFilter::new(header, Mode::Adaptive);
 
         let prev = vec![0u8; header.stride()];
         let row = vec![0u8; header.stride()];
         let filtered_data = filter.filter(&prev, &row);
         assert_eq!(filtered_data.len(), header.stride() + 1);
     }
+
+    //
+    // Pseudo-random rows with lengths that aren't multiples of the
+    // vector size, checked against the scalar filters for every bpp.
+    //
+    #[cfg(any(target_arch = "x86", target_arch = "x86_64", target_arch = "aarch64"))]
+    fn check_simd<F, G>(scalar: F, simd: G)
+        where F: Fn(usize, &[u8], &[u8], &mut [u8]),
+              G: Fn(usize, &[u8], &[u8], &mut [u8])
+    {
+        let mut seed = 12345u32;
+        let mut rand = || {
+            seed = seed.wrapping_mul(1103515245).wrapping_add(12345);
+            (seed >> 16) as u8
+        };
+        for &bpp in &[1, 2, 3, 4, 6, 8] {
+            for &len in &[8, 15, 16, 17, 31, 32, 33, 63, 100, 1025] {
+                if len < bpp {
+                    continue;
+                }
+                let prev: Vec<u8> = (0 .. len).map(|_| rand()).collect();
+                let src: Vec<u8> = (0 .. len).map(|_| rand()).collect();
+                let mut expected = vec![0u8; len + 1];
+                let mut actual = vec![0u8; len + 1];
+                scalar(bpp, &prev, &src, &mut expected);
+                simd(bpp, &prev, &src, &mut actual);
+                assert_eq!(expected, actual, "bpp {} len {}", bpp, len);
+            }
+        }
+    }
+
+    #[test]
+    #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+    fn simd_matches_scalar_x86() {
+        use super::{filter_sub, filter_up, filter_average, filter_paeth};
+        use super::{sse41, avx2};
+
+        if is_x86_feature_detected!("sse4.1") {
+            check_simd(filter_sub, |b, p, s, d| unsafe { sse41::filter_sub(b, p, s, d) });
+            check_simd(filter_up, |b, p, s, d| unsafe { sse41::filter_up(b, p, s, d) });
+            check_simd(filter_average, |b, p, s, d| unsafe { sse41::filter_average(b, p, s, d) });
+            check_simd(filter_paeth, |b, p, s, d| unsafe { sse41::filter_paeth(b, p, s, d) });
+        }
+        if is_x86_feature_detected!("avx2") {
+            check_simd(filter_sub, |b, p, s, d| unsafe { avx2::filter_sub(b, p, s, d) });
+            check_simd(filter_up, |b, p, s, d| unsafe { avx2::filter_up(b, p, s, d) });
+            check_simd(filter_average, |b, p, s, d| unsafe { avx2::filter_average(b, p, s, d) });
+            check_simd(filter_paeth, |b, p, s, d| unsafe { avx2::filter_paeth(b, p, s, d) });
+        }
+    }
+
+    #[test]
+    #[cfg(target_arch = "aarch64")]
+    fn simd_matches_scalar_neon() {
+        use super::{filter_sub, filter_up, filter_average, filter_paeth};
+        use super::neon;
+
+        check_simd(filter_sub, |b, p, s, d| unsafe { neon::filter_sub(b, p, s, d) });
+        check_simd(filter_up, |b, p, s, d| unsafe { neon::filter_up(b, p, s, d) });
+        check_simd(filter_average, |b, p, s, d| unsafe { neon::filter_average(b, p, s, d) });
+        check_simd(filter_paeth, |b, p, s, d| unsafe { neon::filter_paeth(b, p, s, d) });
+    }
+
+    #[test]
+    fn unfilter_works() {
+        use super::{Filter, filter_generic, unfilter};
+
+        let mut seed = 9876u32;
+        let mut rand = || {
+            seed = seed.wrapping_mul(1103515245).wrapping_add(12345);
+            (seed >> 16) as u8
+        };
+        let filters = [Filter::None, Filter::Sub, Filter::Up, Filter::Average, Filter::Paeth];
+        for &bpp in &[1usize, 2, 3, 4, 6, 8] {
+            let prev: Vec<u8> = (0 .. 101).map(|_| rand()).collect();
+            let src: Vec<u8> = (0 .. 101).map(|_| rand()).collect();
+            for &filter in &filters {
+                let mut filtered = vec![0u8; src.len() + 1];
+                filter_generic(filter, bpp, &prev, &src, &mut filtered);
+                let mut dest = vec![0u8; src.len()];
+                unfilter(filtered[0], bpp, &prev, &filtered[1 ..], &mut dest).unwrap();
+                assert!(dest == src, "bpp {} filter {}", bpp, filter as u8);
+            }
+        }
+        let mut dest = [0u8; 4];
+        assert!(unfilter(5, 1, &[0; 4], &[0; 4], &mut dest).is_err());
+    }
+
+    //
+    // The fused estimators must agree with filtering each row and
+    // summing up the output, as the adaptive filter used to.
+    //
+    #[test]
+    fn fused_complexity_matches() {
+        use super::{Kernels, Filter, filter_generic, filter_complexity_delta};
+
+        let mut seed = 54321u32;
+        let mut rand = || {
+            seed = seed.wrapping_mul(1103515245).wrapping_add(12345);
+            (seed >> 16) as u8 & 0x3f
+        };
+        let kernels = [Kernels::Generic, Kernels::detect()];
+        for &bpp in &[1, 2, 3, 4, 6, 8] {
+            for &len in &[8, 17, 33, 100, 1025] {
+                let prev: Vec<u8> = (0 .. len).map(|_| rand()).collect();
+                let src: Vec<u8> = (0 .. len).map(|_| rand()).collect();
+                let sum = |filter| -> u32 {
+                    let mut out = vec![0u8; len + 1];
+                    filter_generic(filter, bpp, &prev, &src, &mut out);
+                    out[1 ..].iter().map(|x| filter_complexity_delta(*x)).sum()
+                };
+                for k in kernels.iter() {
+                    let complexity = k.estimate_complexity(bpp, &prev, &src);
+                    assert_eq!(complexity.sub, sum(Filter::Sub));
+                    assert_eq!(complexity.up, sum(Filter::Up));
+                    assert_eq!(complexity.average, sum(Filter::Average));
+                    assert_eq!(complexity.paeth, sum(Filter::Paeth));
+                }
+            }
+        }
+    }
+
+    //
+    // Microbenchmarks for each kernel at each pixel size, on a row
+    // as wide as a dual-4K RGBA screenshot's, with the scalar kernels
+    // for comparison. Run as described at utils::bench().
+    //
+    #[test]
+    #[ignore]
+    fn bench_filters() {
+        use super::{Kernels, Filter};
+        use super::super::utils::bench;
+
+        let len = 7680 * 4;
+        let mut seed = 777u32;
+        let mut rand = || {
+            seed = seed.wrapping_mul(1103515245).wrapping_add(12345);
+            (seed >> 16) as u8
+        };
+        let prev: Vec<u8> = (0 .. len).map(|_| rand()).collect();
+        let src: Vec<u8> = (0 .. len).map(|_| rand()).collect();
+        let mut dest = vec![0u8; len + 1];
+
+        let filters = [("none", Filter::None), ("sub", Filter::Sub), ("up", Filter::Up),
+                       ("average", Filter::Average), ("paeth", Filter::Paeth)];
+        let kernels = [("generic", Kernels::Generic), ("detected", Kernels::detect())];
+        for &(kernel_name, kernels) in kernels.iter() {
+            for &bpp in &[1, 2, 3, 4, 6, 8] {
+                for &(filter_name, filter) in filters.iter() {
+                    bench(&format!("filter_{}/{}/bpp{}", filter_name, kernel_name, bpp), len, || {
+                        kernels.filter(filter, bpp, &prev, &src, &mut dest);
+                    });
+                }
+                bench(&format!("estimate_complexity/{}/bpp{}", kernel_name, bpp), len, || {
+                    let complexity = kernels.estimate_complexity(bpp, &prev, &src);
+                    dest[0] = complexity.best() as u8;
+                });
+            }
+        }
+
+        let mut header = Header::new();
+        header.set_size(7680, 1).unwrap();
+        let filter = AdaptiveFilter::new(header, Mode::Adaptive);
+        bench("filter_adaptive/detected/bpp4", len, || {
+            filter.filter_into(&prev, &src, &mut dest);
+        });
+    }
 }
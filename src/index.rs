@@ -0,0 +1,159 @@
+//
+// mtpng - a multithreaded parallel PNG encoder in Rust
+// index.rs - chunk index for parallel and partial decoding
+//
+// Copyright (c) 2018 Brion Vibber
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+use std::io;
+
+use super::utils::*;
+
+//
+// Private ancillary chunk, not safe to copy as it describes the
+// image data's layout, written after the default image's data:
+//
+//   1 byte   version, 1
+//   1 byte   flags, from below
+//   4 bytes  number of entries
+//
+// followed by an entry for each compressed chunk in stream order:
+//
+//   8 bytes  offset of its compressed data in the zlib stream, or
+//            in other words the IDAT chunk data run together
+//   1 byte   Adam7 pass number from 0, or 0 if not interlaced
+//   4 bytes  first row within the pass (or image)
+//   4 bytes  row after its last
+//   4 bytes  Adler-32 of its filtered rows
+//
+// Each chunk's data ends with a sync flush onto a byte boundary,
+// except for the last, which ends the deflate stream.
+//
+pub const TAG: &[u8; 4] = b"mtIX";
+
+const VERSION: u8 = 1;
+const ENTRY_LEN: usize = 21;
+
+// Chunks after the first were compressed with the last 32 KiB of
+// filtered data before them as a preset dictionary, so references
+// back into it can only be resolved once that has been inflated.
+pub const PRIMED: u8 = 1;
+
+// The first row of each chunk uses the "none" or "sub" filter, so
+// can be unfiltered without the chunk before it.
+pub const STANDALONE_ROWS: u8 = 2;
+
+#[derive(Copy, Clone, PartialEq, Eq, Debug)]
+pub struct Entry {
+    pub offset: u64,
+    pub pass: u8,
+    pub start_row: u32,
+    pub end_row: u32,
+    pub adler32: u32,
+}
+
+#[derive(Clone, PartialEq, Eq, Debug)]
+pub struct Index {
+    pub flags: u8,
+    pub entries: Vec<Entry>,
+}
+
+impl Index {
+    pub fn new(flags: u8) -> Index {
+        Index {
+            flags,
+            entries: Vec::new(),
+        }
+    }
+
+    pub fn to_bytes(&self) -> io::Result<Vec<u8>> {
+        let mut data = Vec::<u8>::with_capacity(6 + self.entries.len() * ENTRY_LEN);
+        write_byte(&mut data, VERSION)?;
+        write_byte(&mut data, self.flags)?;
+        write_be32(&mut data, self.entries.len() as u32)?;
+        for entry in &self.entries {
+            write_be32(&mut data, (entry.offset >> 32) as u32)?;
+            write_be32(&mut data, entry.offset as u32)?;
+            write_byte(&mut data, entry.pass)?;
+            write_be32(&mut data, entry.start_row)?;
+            write_be32(&mut data, entry.end_row)?;
+            write_be32(&mut data, entry.adler32)?;
+        }
+        Ok(data)
+    }
+
+    pub fn parse(data: &[u8]) -> io::Result<Index> {
+        if data.len() < 6 || data[0] != VERSION {
+            return Err(invalid_data("Unknown index version"));
+        }
+        let count = read_be32(&data[2 .. 6]) as usize;
+        match count.checked_mul(ENTRY_LEN) {
+            Some(len) if len == data.len() - 6 => {},
+            _ => return Err(invalid_data("Invalid index length")),
+        }
+        let entries = data[6 ..].chunks(ENTRY_LEN).map(|bytes| {
+            Entry {
+                offset: (read_be32(&bytes[0 .. 4]) as u64) << 32 | read_be32(&bytes[4 .. 8]) as u64,
+                pass: bytes[8],
+                start_row: read_be32(&bytes[9 .. 13]),
+                end_row: read_be32(&bytes[13 .. 17]),
+                adler32: read_be32(&bytes[17 .. 21]),
+            }
+        }).collect();
+        Ok(Index {
+            flags: data[1],
+            entries,
+        })
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{Entry, Index, PRIMED, STANDALONE_ROWS};
+
+    #[test]
+    fn round_trip() {
+        let mut index = Index::new(PRIMED | STANDALONE_ROWS);
+        index.entries.push(Entry {
+            offset: 0,
+            pass: 0,
+            start_row: 0,
+            end_row: 17,
+            adler32: 0x12345678,
+        });
+        index.entries.push(Entry {
+            offset: 0x1_0000_0002,
+            pass: 6,
+            start_row: 17,
+            end_row: 40,
+            adler32: 0xfedcba98,
+        });
+        let data = index.to_bytes().unwrap();
+        assert_eq!(data.len(), 6 + 2 * 21);
+        assert_eq!(Index::parse(&data).unwrap(), index);
+        assert!(Index::parse(&data[.. 30]).is_err());
+
+        // A count whose length would overflow on 32-bit.
+        let mut huge = data.clone();
+        huge[2 .. 6].copy_from_slice(&[0xff, 0xff, 0xff, 0xff]);
+        assert!(Index::parse(&huge).is_err());
+    }
+}
@@ -0,0 +1,561 @@
+//
+// mtpng - a multithreaded parallel PNG encoder in Rust
+// inflate.rs - inflate of stream segments without their window
+//
+// Copyright (c) 2018 Brion Vibber
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+//
+// mtpng's encoder ends each chunk's compressed data with a sync flush,
+// so the next chunk's deflate blocks start on a byte boundary -- but
+// primes its window with the end of the chunk before, so its matches
+// can reach back into data that isn't known until that chunk has been
+// inflated too.
+//
+// To inflate the chunks in parallel anyway, each segment of the stream
+// is decoded here to 16-bit symbols: bytes as themselves, and bytes
+// copied from before the segment's start as markers for their position
+// in the 32 KiB window. Once the segments before have been inflated,
+// resolve() swaps the markers for the real bytes.
+//
+// https://www.w3.org/TR/PNG/#10Compression
+// https://tools.ietf.org/html/rfc1951
+//
+
+use std::cmp;
+use std::io;
+
+use super::utils::*;
+
+const WINDOW: usize = 32768;
+
+// Symbols from MARKER up stand for window bytes.
+const MARKER: u16 = 256;
+
+const LENGTH_BASE: [u16; 29] = [
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+];
+const LENGTH_EXTRA: [u8; 29] = [
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+];
+const DISTANCE_BASE: [u16; 30] = [
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577,
+];
+const DISTANCE_EXTRA: [u8; 30] = [
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+];
+
+// Order the code length code lengths are sent in.
+const CODE_LENGTH_ORDER: [usize; 19] = [
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15,
+];
+
+//
+// Deflate packs bits from the least significant end of each byte.
+// Reads past the end of the input come back as zeros, and are
+// caught by checking overrun() afterwards.
+//
+struct BitReader<'a> {
+    data: &'a [u8],
+    pos: usize,
+    buf: u64,
+    count: u32,
+}
+
+impl<'a> BitReader<'a> {
+    fn new(data: &'a [u8]) -> BitReader<'a> {
+        BitReader {
+            data,
+            pos: 0,
+            buf: 0,
+            count: 0,
+        }
+    }
+
+    //
+    // Top the buffer up to at least 56 bits. With a whole word to
+    // spare, load it in one go; the bits past the bytes counted are
+    // the same ones the next refill ORs in.
+    //
+    #[inline(always)]
+    fn refill(&mut self) {
+        if self.pos + 8 <= self.data.len() {
+            let mut word = [0u8; 8];
+            word.copy_from_slice(&self.data[self.pos .. self.pos + 8]);
+            self.buf |= u64::from_le_bytes(word) << self.count;
+            self.pos += (63 - self.count as usize) >> 3;
+            self.count |= 56;
+        } else {
+            while self.count < 56 {
+                let byte = self.data.get(self.pos).cloned().unwrap_or(0);
+                self.buf |= (byte as u64) << self.count;
+                self.pos += 1;
+                self.count += 8;
+            }
+        }
+    }
+
+    #[inline(always)]
+    fn peek(&self, bits: u32) -> u32 {
+        (self.buf & ((1u64 << bits) - 1)) as u32
+    }
+
+    #[inline(always)]
+    fn consume(&mut self, bits: u32) {
+        self.buf >>= bits;
+        self.count -= bits;
+    }
+
+    #[inline(always)]
+    fn bits(&mut self, bits: u32) -> u32 {
+        if self.count < bits {
+            self.refill();
+        }
+        let value = self.peek(bits);
+        self.consume(bits);
+        value
+    }
+
+    // Bits taken so far.
+    fn position(&self) -> usize {
+        self.pos * 8 - self.count as usize
+    }
+
+    fn overrun(&self) -> bool {
+        self.position() > self.data.len() * 8
+    }
+
+    //
+    // Skip to the next byte boundary, and drop what's buffered so the
+    // bytes from there can be taken directly.
+    //
+    fn align(&mut self) -> usize {
+        let pos = (self.position() + 7) / 8;
+        self.pos = pos;
+        self.buf = 0;
+        self.count = 0;
+        pos
+    }
+}
+
+//
+// Canonical Huffman code, looked up with as many bits as its longest
+// code. Entries hold the symbol and code length; length 0 marks bit
+// patterns that no code covers.
+//
+struct Huffman {
+    table: Vec<u16>,
+    bits: u32,
+}
+
+impl Huffman {
+    fn new(lengths: &[u8]) -> io::Result<Huffman> {
+        let mut counts = [0u16; 16];
+        for &len in lengths {
+            counts[len as usize] += 1;
+        }
+        counts[0] = 0;
+
+        // Over-subscribed codes are invalid; incomplete ones are
+        // allowed, eg a single distance code.
+        let mut left = 1i32;
+        for len in 1 .. 16 {
+            left = (left << 1) - counts[len] as i32;
+            if left < 0 {
+                return Err(invalid_data("Over-subscribed Huffman code"));
+            }
+        }
+
+        let bits = (1 .. 16).rev().find(|&len| counts[len] > 0).unwrap_or(0) as u32;
+        let mut next = [0u16; 16];
+        let mut code = 0u16;
+        for len in 1 .. 16 {
+            code = (code + counts[len - 1]) << 1;
+            next[len] = code;
+        }
+
+        let size = 1usize << bits;
+        let mut table = vec![0u16; size];
+        for (symbol, &len) in lengths.iter().enumerate() {
+            if len == 0 {
+                continue;
+            }
+            let len = len as u32;
+            let code = next[len as usize];
+            next[len as usize] += 1;
+            let reversed = (code.reverse_bits() >> (16 - len)) as usize;
+            let entry = (symbol as u16) << 4 | len as u16;
+            let mut i = reversed;
+            while i < size {
+                table[i] = entry;
+                i += 1 << len;
+            }
+        }
+        Ok(Huffman {
+            table,
+            bits,
+        })
+    }
+
+    // Assumes the reader holds at least 15 bits.
+    #[inline(always)]
+    fn decode(&self, reader: &mut BitReader) -> io::Result<usize> {
+        let entry = self.table[reader.peek(self.bits) as usize];
+        let len = (entry & 15) as u32;
+        if len == 0 {
+            return Err(invalid_data("Invalid Huffman code"));
+        }
+        reader.consume(len);
+        Ok((entry >> 4) as usize)
+    }
+}
+
+//
+// A segment's output, with markers in place of window bytes.
+//
+pub struct Segment {
+    pub data: Vec<u16>,
+
+    // Ended with the stream's final block, and if so the offset after
+    // it in the input, where the zlib checksum follows.
+    pub is_final: bool,
+    pub end: usize,
+}
+
+//
+// Inflate raw deflate blocks from the start of data, which must end
+// either on a block boundary at the end of the input or with the final
+// block. Matches reaching back before the start come out as markers
+// unless has_window is false, when they're an error.
+//
+// Fails as soon as the output would pass limit bytes, so a small run
+// of highly compressed data can't take up more than was expected.
+//
+pub fn inflate_segment(data: &[u8], has_window: bool, limit: usize) -> io::Result<Segment> {
+    let mut reader = BitReader::new(data);
+    let mut out = Vec::<u16>::with_capacity(cmp::min(data.len() * 4, limit));
+    loop {
+        let is_final = reader.bits(1) == 1;
+        match reader.bits(2) {
+            0 => stored_block(&mut reader, &mut out, limit)?,
+            1 => {
+                let (lengths, distances) = fixed_lengths();
+                let literals = Huffman::new(&lengths)?;
+                let distances = Huffman::new(&distances)?;
+                huffman_block(&mut reader, &mut out, &literals, &distances, has_window, limit)?;
+            },
+            2 => {
+                let (literals, distances) = dynamic_codes(&mut reader)?;
+                huffman_block(&mut reader, &mut out, &literals, &distances, has_window, limit)?;
+            },
+            _ => return Err(invalid_data("Invalid deflate block type")),
+        }
+        if reader.overrun() {
+            return Err(invalid_data("Truncated deflate stream"));
+        }
+        let position = reader.position();
+        if is_final {
+            return Ok(Segment {
+                data: out,
+                is_final: true,
+                end: (position + 7) / 8,
+            });
+        }
+        if position == data.len() * 8 {
+            return Ok(Segment {
+                data: out,
+                is_final: false,
+                end: data.len(),
+            });
+        }
+    }
+}
+
+fn too_long() -> io::Error {
+    invalid_data("Deflate segment longer than expected")
+}
+
+fn stored_block(reader: &mut BitReader, out: &mut Vec<u16>, limit: usize) -> IoResult {
+    let pos = reader.align();
+    let data = reader.data;
+    if pos + 4 > data.len() {
+        return Err(invalid_data("Truncated stored block"));
+    }
+    let len = data[pos] as usize | (data[pos + 1] as usize) << 8;
+    let nlen = data[pos + 2] as usize | (data[pos + 3] as usize) << 8;
+    if len != !nlen & 0xffff {
+        return Err(invalid_data("Invalid stored block length"));
+    }
+    let start = pos + 4;
+    if start + len > data.len() {
+        return Err(invalid_data("Truncated stored block"));
+    }
+    if out.len() + len > limit {
+        return Err(too_long());
+    }
+    out.extend(data[start .. start + len].iter().map(|&byte| byte as u16));
+    reader.pos = start + len;
+    Ok(())
+}
+
+fn fixed_lengths() -> ([u8; 288], [u8; 30]) {
+    let mut lengths = [8u8; 288];
+    for len in lengths[144 .. 256].iter_mut() {
+        *len = 9;
+    }
+    for len in lengths[256 .. 280].iter_mut() {
+        *len = 7;
+    }
+    (lengths, [5u8; 30])
+}
+
+fn dynamic_codes(reader: &mut BitReader) -> io::Result<(Huffman, Huffman)> {
+    let literal_count = reader.bits(5) as usize + 257;
+    let distance_count = reader.bits(5) as usize + 1;
+    let code_length_count = reader.bits(4) as usize + 4;
+    if literal_count > 286 || distance_count > 30 {
+        return Err(invalid_data("Too many Huffman codes"));
+    }
+
+    let mut code_lengths = [0u8; 19];
+    for &i in &CODE_LENGTH_ORDER[.. code_length_count] {
+        code_lengths[i] = reader.bits(3) as u8;
+    }
+    let code_length_code = Huffman::new(&code_lengths)?;
+
+    let total = literal_count + distance_count;
+    let mut lengths = [0u8; 286 + 30];
+    let mut i = 0;
+    while i < total {
+        reader.refill();
+        let (value, repeat) = match code_length_code.decode(reader)? {
+            len @ 0 ..= 15 => (len as u8, 1),
+            16 => {
+                if i == 0 {
+                    return Err(invalid_data("Repeated length with no previous"));
+                }
+                (lengths[i - 1], 3 + reader.bits(2) as usize)
+            },
+            17 => (0, 3 + reader.bits(3) as usize),
+            _ => (0, 11 + reader.bits(7) as usize),
+        };
+        if i + repeat > total {
+            return Err(invalid_data("Too many code lengths"));
+        }
+        for len in lengths[i .. i + repeat].iter_mut() {
+            *len = value;
+        }
+        i += repeat;
+        if reader.overrun() {
+            return Err(invalid_data("Truncated deflate stream"));
+        }
+    }
+    if lengths[256] == 0 {
+        return Err(invalid_data("Missing end of block code"));
+    }
+    let literals = Huffman::new(&lengths[.. literal_count])?;
+    let distances = Huffman::new(&lengths[literal_count .. total])?;
+    Ok((literals, distances))
+}
+
+fn huffman_block(reader: &mut BitReader,
+                 out: &mut Vec<u16>,
+                 literals: &Huffman,
+                 distances: &Huffman,
+                 has_window: bool,
+                 limit: usize) -> IoResult
+{
+    loop {
+        // Enough for the longest code, extra bits, distance
+        // code, and distance extra bits in one go.
+        reader.refill();
+        if reader.overrun() {
+            return Err(invalid_data("Truncated deflate stream"));
+        }
+        let symbol = literals.decode(reader)?;
+        if symbol < 256 {
+            if out.len() >= limit {
+                return Err(too_long());
+            }
+            out.push(symbol as u16);
+            continue;
+        }
+        if symbol == 256 {
+            return Ok(());
+        }
+        let index = symbol - 257;
+        if index >= 29 {
+            return Err(invalid_data("Invalid length code"));
+        }
+        let extra = LENGTH_EXTRA[index] as u32;
+        let len = LENGTH_BASE[index] as usize + reader.peek(extra) as usize;
+        reader.consume(extra);
+
+        let index = distances.decode(reader)?;
+        if index >= 30 {
+            return Err(invalid_data("Invalid distance code"));
+        }
+        let extra = DISTANCE_EXTRA[index] as u32;
+        let distance = DISTANCE_BASE[index] as usize + reader.peek(extra) as usize;
+        reader.consume(extra);
+
+        let pos = out.len();
+        if pos + len > limit {
+            return Err(too_long());
+        }
+        if distance <= pos {
+            // Overlapping copies repeat the bytes just written,
+            // so this has to go one at a time.
+            let start = pos - distance;
+            for i in start .. start + len {
+                let value = out[i];
+                out.push(value);
+            }
+        } else if has_window {
+            for i in pos .. pos + len {
+                let value = if i >= distance {
+                    out[i - distance]
+                } else {
+                    MARKER + (WINDOW - (distance - i)) as u16
+                };
+                out.push(value);
+            }
+        } else {
+            return Err(invalid_data("Distance reaches before start of stream"));
+        }
+    }
+}
+
+//
+// Swap a segment's markers for the bytes they stand for, given all
+// the output before it, and append the result.
+//
+pub fn resolve(segment: &[u16], output: &mut Vec<u8>) -> IoResult {
+    let window_start = output.len().saturating_sub(WINDOW);
+    let missing = WINDOW - (output.len() - window_start);
+    let base = output.len();
+    output.reserve(segment.len());
+    for i in 0 .. segment.len() {
+        let value = segment[i];
+        let byte = if value < MARKER {
+            value as u8
+        } else {
+            let index = (value - MARKER) as usize;
+            if index < missing {
+                return Err(invalid_data("Distance reaches before start of stream"));
+            }
+            output[window_start + index - missing]
+        };
+        output.push(byte);
+    }
+    debug_assert_eq!(output.len(), base + segment.len());
+    Ok(())
+}
+
+// Stands in for bytes resolve_partial() couldn't fill in.
+pub const UNKNOWN: u16 = MARKER;
+
+//
+// Like resolve(), but for output that starts partway through the
+// stream, keeping it as symbols: bytes from the window before the
+// start come out as UNKNOWN, for the caller to check for.
+//
+pub fn resolve_partial(segment: &[u16], output: &mut Vec<u16>) {
+    let window_start = output.len().saturating_sub(WINDOW);
+    let missing = WINDOW - (output.len() - window_start);
+    output.reserve(segment.len());
+    for &value in segment {
+        let symbol = if value < MARKER {
+            value
+        } else {
+            let index = (value - MARKER) as usize;
+            if index < missing {
+                UNKNOWN
+            } else {
+                output[window_start + index - missing]
+            }
+        };
+        output.push(symbol);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::super::deflate;
+    use super::super::deflate::Flush;
+    use super::{inflate_segment, resolve, resolve_partial, UNKNOWN};
+
+    #[test]
+    fn segments_work() {
+        // Repetitive enough to have plenty of matches reaching back
+        // over the flush points, with a stored block in there too.
+        let mut data = Vec::<u8>::new();
+        for i in 0 .. 200000u32 {
+            data.push((i % 97 + i / 5000) as u8);
+        }
+
+        let mut options = deflate::Options::new();
+        options.set_window_bits(-15);
+        let mut encoder = deflate::Deflate::new(options, Vec::<u8>::new());
+        let mut splits = Vec::new();
+        for (i, piece) in data.chunks(50000).enumerate() {
+            let flush = if i == 3 { Flush::Finish } else { Flush::SyncFlush };
+            encoder.write(piece, flush).unwrap();
+            splits.push(encoder.get_mut().len());
+        }
+        let compressed = encoder.finish().unwrap();
+
+        let mut output = Vec::new();
+        let mut start = 0;
+        for (i, &end) in splits.iter().enumerate() {
+            let segment = inflate_segment(&compressed[start .. end], i > 0, usize::max_value()).unwrap();
+            assert_eq!(segment.is_final, i == 3);
+            resolve(&segment.data, &mut output).unwrap();
+            start = end;
+        }
+        assert!(output == data, "expected the original data back");
+
+        // Starting partway, whatever can be filled in matches.
+        let mut partial = Vec::new();
+        let mut start = splits[1];
+        for &end in &splits[2 ..] {
+            let segment = inflate_segment(&compressed[start .. end], true, usize::max_value()).unwrap();
+            resolve_partial(&segment.data, &mut partial);
+            start = end;
+        }
+        assert_eq!(partial.len(), 100000);
+        assert!(partial.iter().zip(&data[100000 ..]).all(|(&symbol, &byte)| {
+            symbol == UNKNOWN || symbol == byte as u16
+        }));
+
+        // Without the window, the later segments can't be decoded.
+        assert!(inflate_segment(&compressed[splits[0] .. splits[1]], false, usize::max_value()).is_err());
+
+        // Nor can one give more than it's allowed.
+        assert!(inflate_segment(&compressed[.. splits[0]], false, 50000).is_ok());
+        assert!(inflate_segment(&compressed[.. splits[0]], false, 49999).is_err());
+    }
+}
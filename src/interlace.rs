@@ -0,0 +1,199 @@
+//
+// mtpng - a multithreaded parallel PNG encoder in Rust
+// interlace.rs - Adam7 pass geometry and pixel extraction
+//
+// Copyright (c) 2018 Brion Vibber
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+use typenum::Unsigned;
+use typenum::consts::*;
+
+use super::Header;
+use super::InterlaceMethod;
+use super::SourceFormat;
+
+//
+// Starting column and row, then column and row spacing, of the
+// pixels in each of the seven passes.
+//
+// https://www.w3.org/TR/PNG/#8Interlace
+//
+const ADAM7: [(usize, usize, usize, usize); 7] = [
+    (0, 0, 8, 8),
+    (4, 0, 8, 8),
+    (0, 4, 4, 8),
+    (2, 0, 4, 4),
+    (0, 2, 2, 4),
+    (1, 0, 2, 2),
+    (0, 1, 1, 2),
+];
+
+fn pass_count(size: usize, start: usize, step: usize) -> usize {
+    if size > start {
+        (size - start + step - 1) / step
+    } else {
+        0
+    }
+}
+
+//
+// Header for one pass's sub-image, or None if it has no pixels,
+// in which case it's left out of the data stream entirely. Passes
+// are extracted from converted rows, so they come out packed.
+//
+pub fn pass_header(header: &Header, pass: usize) -> Option<Header> {
+    let (x0, y0, dx, dy) = ADAM7[pass];
+    let width = pass_count(header.width as usize, x0, dx);
+    let height = pass_count(header.height as usize, y0, dy);
+    if width == 0 || height == 0 {
+        return None;
+    }
+    let mut sub = *header;
+    sub.width = width as u32;
+    sub.height = height as u32;
+    sub.interlace_method = InterlaceMethod::Standard;
+    sub.source_format = SourceFormat::Packed;
+    Some(sub)
+}
+
+//
+// Row of the full image that a pass's row comes from.
+//
+pub fn source_row(pass: usize, row: usize) -> usize {
+    let (_, y0, _, dy) = ADAM7[pass];
+    y0 + row * dy
+}
+
+//
+// Pull a pass's pixels out of a full-image row into dest, which
+// holds one row of the pass's sub-image.
+//
+pub fn extract_row(header: &Header, pass: usize, src: &[u8], dest: &mut [u8]) {
+    let (x0, _, dx, _) = ADAM7[pass];
+    if header.depth >= 8 {
+        let bpp = header.bytes_per_pixel();
+
+        // As with the filters, a constant pixel size lets the
+        // compiler turn the copies into plain loads and stores.
+        match bpp {
+            1 => extract_generic::<U1>(x0, dx, src, dest),
+            2 => extract_generic::<U2>(x0, dx, src, dest),
+            3 => extract_generic::<U3>(x0, dx, src, dest),
+            4 => extract_generic::<U4>(x0, dx, src, dest),
+            6 => extract_generic::<U6>(x0, dx, src, dest),
+            8 => extract_generic::<U8>(x0, dx, src, dest),
+            _ => panic!("Invalid bpp, should never happen."),
+        }
+    } else {
+        let width = pass_count(header.width as usize, x0, dx);
+        extract_bits(header.depth as usize, width, x0, dx, src, dest);
+    }
+}
+
+//
+// The reverse, for decoding: spread a pass's row out into its
+// places in a full-image row.
+//
+pub fn insert_row(header: &Header, pass: usize, src: &[u8], dest: &mut [u8]) {
+    let (x0, _, dx, _) = ADAM7[pass];
+    if header.depth >= 8 {
+        let bpp = header.bytes_per_pixel();
+        let step = dx * bpp;
+        for (pixel, out) in src.chunks(bpp).zip(dest[x0 * bpp ..].chunks_mut(step)) {
+            out[0 .. bpp].copy_from_slice(pixel);
+        }
+    } else {
+        let depth = header.depth as usize;
+        let per_byte = 8 / depth;
+        let mask = (1u16 << depth) as u8 - 1;
+        let width = pass_count(header.width as usize, x0, dx);
+        for x in 0 .. width {
+            let value = (src[x / per_byte] >> (8 - depth * (x % per_byte + 1))) & mask;
+            let to = x0 + x * dx;
+            let shift = 8 - depth * (to % per_byte + 1);
+            let byte = &mut dest[to / per_byte];
+            *byte = (*byte & !(mask << shift)) | value << shift;
+        }
+    }
+}
+
+#[inline(always)]
+fn extract_generic<BPP: Unsigned>(x0: usize, dx: usize, src: &[u8], dest: &mut [u8]) {
+    let bpp = BPP::USIZE;
+    let step = dx * bpp;
+    for (out, pixel) in dest.chunks_mut(bpp).zip(src[x0 * bpp ..].chunks(step)) {
+        out.copy_from_slice(&pixel[0 .. bpp]);
+    }
+}
+
+//
+// Sub-byte depths go a pixel at a time, left to right from the
+// most significant bits. Padding bits at the end are left as 0.
+//
+fn extract_bits(depth: usize, width: usize, x0: usize, dx: usize, src: &[u8], dest: &mut [u8]) {
+    let per_byte = 8 / depth;
+    let mask = (1u16 << depth) as u8 - 1;
+    for byte in dest.iter_mut() {
+        *byte = 0;
+    }
+    for x in 0 .. width {
+        let from = x0 + x * dx;
+        let shift = 8 - depth * (from % per_byte + 1);
+        let value = (src[from / per_byte] >> shift) & mask;
+        dest[x / per_byte] |= value << (8 - depth * (x % per_byte + 1));
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::super::Header;
+    use super::super::ColorType;
+    use super::{pass_header, extract_row, insert_row};
+
+    #[test]
+    fn passes_work() {
+        let mut header = Header::new();
+        header.set_size(10, 3).unwrap();
+        header.set_color(ColorType::Greyscale, 8).unwrap();
+        let sizes: Vec<Option<(u32, u32)>> = (0 .. 7).map(|pass| {
+            pass_header(&header, pass).map(|sub| (sub.width(), sub.height()))
+        }).collect();
+        assert_eq!(sizes, vec![Some((2, 1)), Some((1, 1)), None, Some((2, 1)),
+                               Some((5, 1)), Some((5, 2)), Some((10, 1))]);
+
+        let row: Vec<u8> = (0 .. 10).collect();
+        let mut out = vec![0u8; 5];
+        extract_row(&header, 5, &row, &mut out);
+        assert_eq!(out, vec![1, 3, 5, 7, 9]);
+
+        header.set_color(ColorType::Greyscale, 2).unwrap();
+        let row = [0b00_01_10_11, 0b00_01_10_11, 0b01_10_00_00];
+        let mut out = [0u8; 2];
+        extract_row(&header, 4, &row, &mut out);
+        assert_eq!(out, [0b00_10_00_10, 0b01_00_00_00]);
+
+        let mut back = row;
+        back[0] = 0;
+        back[2] = 0;
+        insert_row(&header, 4, &out, &mut back);
+        assert_eq!(back, [0b00_00_10_00, 0b00_01_10_11, 0b01_00_00_00]);
+    }
+}
@@ -26,11 +26,13 @@
 //! mtpng - a multithreaded parallel PNG encoder in Rust
 
 extern crate rayon;
-extern crate crc;
 extern crate libz_sys;
 #[macro_use] extern crate itertools;
 extern crate typenum;
 
+#[cfg(feature="miniz_oxide")]
+extern crate miniz_oxide;
+
 #[cfg(feature="capi")]
 extern crate libc;
 #[cfg(feature="capi")]
@@ -38,12 +40,29 @@ pub mod capi;
 
 mod deflate;
 mod filter;
+mod index;
+mod interlace;
+mod convert;
+pub mod decoder;
 pub mod encoder;
+mod inflate;
+mod pool;
+mod quantize;
+mod reader;
+mod reduce;
+mod scheduler;
+mod topology;
 mod utils;
 mod writer;
 
 pub type Strategy = deflate::Strategy;
+pub type Backend = deflate::Backend;
 pub type Filter = filter::Filter;
+pub type BufferPool = pool::BufferPool;
+pub type Scheduler = scheduler::Scheduler;
+pub type Cores = topology::Cores;
+
+pub use topology::thread_pool;
 
 use std::convert::TryFrom;
 use std::io;
@@ -148,9 +167,7 @@ pub enum FilterMethod {
 }
 
 /// PNG header interlace method representation.
-///
-/// Currently only Standard is supported; Adam7 interlacing will throw an error if used.
-#[derive(Copy, Clone)]
+#[derive(Copy, Clone, PartialEq, Eq, Debug)]
 #[repr(u8)]
 pub enum InterlaceMethod {
     /// No interlacing.
@@ -159,10 +176,70 @@ pub enum InterlaceMethod {
     Standard = 0,
     /// Adam7 interlacing.
     ///
-    /// Not yet supported.
+    /// Pixels are sent in seven passes of increasing detail, so a
+    /// partially loaded image can be shown at low resolution. Each
+    /// pass is filtered and compressed as its own sub-image, which
+    /// usually makes the file somewhat larger.
     Adam7 = 1,
 }
 
+impl TryFrom<u8> for InterlaceMethod {
+    type Error = io::Error;
+
+    /// Validate and produce an InterlaceMethod from one of the PNG header constants.
+    ///
+    /// Will return an error on invalid input.
+    fn try_from(val: u8) -> Result<Self, Self::Error> {
+        match val {
+            0 => Ok(InterlaceMethod::Standard),
+            1 => Ok(InterlaceMethod::Adam7),
+            _ => Err(invalid_input("Invalid interlace method")),
+        }
+    }
+}
+
+/// Layout of the input pixel data, when it isn't packed the way the
+/// PNG stores it. Converted rows are produced inside the filter jobs,
+/// so conversion runs in parallel with no extra pass over the image.
+#[derive(Copy, Clone, PartialEq, Eq, Debug)]
+#[repr(u8)]
+pub enum SourceFormat {
+    /// Packed as for the header's color type and depth.
+    Packed = 0,
+    /// 8-bit blue, green, red, alpha, for a TruecolorAlpha image.
+    Bgra = 1,
+    /// 8-bit blue, green, red, and an ignored byte, for a Truecolor image.
+    Bgrx = 2,
+    /// 8-bit red, green, blue, and alpha with the colors premultiplied
+    /// by alpha, for a TruecolorAlpha image.
+    PremultipliedRgba = 3,
+    /// 8-bit blue, green, red, and alpha with the colors premultiplied
+    /// by alpha, for a TruecolorAlpha image.
+    PremultipliedBgra = 4,
+    /// 16-bit samples in the host's byte order instead of big-endian,
+    /// for any color type at depth 16.
+    NativeEndian16 = 5,
+}
+
+impl TryFrom<u8> for SourceFormat {
+    type Error = io::Error;
+
+    /// Validate and produce a SourceFormat from its numeric value.
+    ///
+    /// Will return an error on invalid input.
+    fn try_from(val: u8) -> Result<Self, Self::Error> {
+        match val {
+            0 => Ok(SourceFormat::Packed),
+            1 => Ok(SourceFormat::Bgra),
+            2 => Ok(SourceFormat::Bgrx),
+            3 => Ok(SourceFormat::PremultipliedRgba),
+            4 => Ok(SourceFormat::PremultipliedBgra),
+            5 => Ok(SourceFormat::NativeEndian16),
+            _ => Err(invalid_input("Invalid source format")),
+        }
+    }
+}
+
 /// PNG header representation.
 ///
 /// You must create one of these with image metadata when encoding,
@@ -176,6 +253,7 @@ pub struct Header {
     compression_method: CompressionMethod,
     filter_method: FilterMethod,
     interlace_method: InterlaceMethod,
+    source_format: SourceFormat,
 }
 
 impl Header {
@@ -193,6 +271,7 @@ impl Header {
             compression_method: CompressionMethod::Deflate,
             filter_method: FilterMethod::Standard,
             interlace_method: InterlaceMethod::Standard,
+            source_format: SourceFormat::Packed,
         }
     }
 
@@ -231,6 +310,11 @@ impl Header {
         self.interlace_method
     }
 
+    /// Get the layout of the input pixel data.
+    pub fn source_format(&self) -> SourceFormat {
+        self.source_format
+    }
+
     /// Calculate the bytes per pixel, for PNG filtering purposes.
     ///
     /// If the bit depth is < 8, this will clamp at 1.
@@ -255,7 +339,7 @@ impl Header {
 
         // And round up to nearest byte.
         let stride_bytes = stride_bits >> 3;
-        let remainder = stride_bits & 3;
+        let remainder = stride_bits & 7;
         if remainder > 0 {
             stride_bytes + 1
         } else {
@@ -263,6 +347,15 @@ impl Header {
         }
     }
 
+    /// Calculate the stride in bytes of input rows in the source format,
+    /// which is the same as stride() unless the format adds padding.
+    pub fn source_stride(&self) -> usize {
+        match self.source_format {
+            SourceFormat::Bgrx => (self.width as usize).checked_mul(4).unwrap(),
+            _ => self.stride(),
+        }
+    }
+
     /// Set the pixel dimensions of the image.
     ///
     /// Returns error if width or height are 0.
@@ -316,16 +409,41 @@ impl Header {
     }
 
     /// Set the interlace method.
-    ///
-    /// Currently only Standard is supported; requesting Adam7 will return an error.
     pub fn set_interlace_method(&mut self, interlace_method: InterlaceMethod) -> io::Result<()> {
-        match interlace_method {
-            InterlaceMethod::Standard => {},
-            InterlaceMethod::Adam7 => return Err(invalid_input("Adam7 interlacing not yet")),
-        }
         self.interlace_method = interlace_method;
         Ok(())
     }
+
+    /// Set the layout of the input pixel data, if it isn't packed as
+    /// for the color type and depth. All image data given to the encoder
+    /// is then expected in this format.
+    ///
+    /// The format must suit the color type and depth, which is checked
+    /// when the header is written.
+    pub fn set_source_format(&mut self, source_format: SourceFormat) -> io::Result<()> {
+        self.source_format = source_format;
+        Ok(())
+    }
+
+    //
+    // Check the source format against the color type and depth.
+    //
+    pub(crate) fn check_source_format(&self) -> io::Result<()> {
+        let valid = match (self.source_format, self.color_type, self.depth) {
+            (SourceFormat::Packed, _, _) => true,
+            (SourceFormat::Bgra, ColorType::TruecolorAlpha, 8) => true,
+            (SourceFormat::Bgrx, ColorType::Truecolor, 8) => true,
+            (SourceFormat::PremultipliedRgba, ColorType::TruecolorAlpha, 8) => true,
+            (SourceFormat::PremultipliedBgra, ColorType::TruecolorAlpha, 8) => true,
+            (SourceFormat::NativeEndian16, _, 16) => true,
+            _ => false,
+        };
+        if valid {
+            Ok(())
+        } else {
+            Err(invalid_input("Source format does not match the color type and depth"))
+        }
+    }
 }
 
 impl Default for Header {
@@ -334,6 +452,181 @@ impl Default for Header {
     }
 }
 
+/// APNG frame disposal operations, applied to the frame's region
+/// of the canvas before the next frame is rendered.
+#[derive(Copy, Clone, PartialEq, Eq, Debug)]
+#[repr(u8)]
+pub enum DisposeOp {
+    /// Leave the canvas as it is.
+    None = 0,
+    /// Clear the region to transparent black.
+    Background = 1,
+    /// Revert the region to what it was before this frame.
+    Previous = 2,
+}
+
+impl TryFrom<u8> for DisposeOp {
+    type Error = io::Error;
+
+    /// Validate and convert u8 to DisposeOp.
+    ///
+    /// Will return an error on invalid input.
+    fn try_from(val: u8) -> Result<Self, Self::Error> {
+        match val {
+            0 => Ok(DisposeOp::None),
+            1 => Ok(DisposeOp::Background),
+            2 => Ok(DisposeOp::Previous),
+            _ => Err(invalid_input("Invalid dispose op")),
+        }
+    }
+}
+
+/// APNG frame blending operations.
+#[derive(Copy, Clone, PartialEq, Eq, Debug)]
+#[repr(u8)]
+pub enum BlendOp {
+    /// Replace the region with the frame's pixels, including alpha.
+    Source = 0,
+    /// Alpha-composite the frame over the region.
+    Over = 1,
+}
+
+impl TryFrom<u8> for BlendOp {
+    type Error = io::Error;
+
+    /// Validate and convert u8 to BlendOp.
+    ///
+    /// Will return an error on invalid input.
+    fn try_from(val: u8) -> Result<Self, Self::Error> {
+        match val {
+            0 => Ok(BlendOp::Source),
+            1 => Ok(BlendOp::Over),
+            _ => Err(invalid_input("Invalid blend op")),
+        }
+    }
+}
+
+/// APNG frame control representation.
+///
+/// Describes the region of the canvas an animation frame covers,
+/// how long it is shown, and how it combines with the frames around it.
+/// See [the APNG specification](https://wiki.mozilla.org/APNG_Specification#.60fcTL.60:_The_Frame_Control_Chunk).
+#[derive(Copy, Clone)]
+pub struct FrameControl {
+    width: u32,
+    height: u32,
+    x_offset: u32,
+    y_offset: u32,
+    delay_num: u16,
+    delay_den: u16,
+    dispose_op: DisposeOp,
+    blend_op: BlendOp,
+}
+
+impl FrameControl {
+    /// Create a new FrameControl struct with default settings.
+    ///
+    /// This will be 1x1 pixels at the top left, shown for 1/100 second,
+    /// replacing its region and leaving it for the next frame.
+    /// You can mutate the state using the set_* methods.
+    pub fn new() -> FrameControl {
+        FrameControl {
+            width: 1,
+            height: 1,
+            x_offset: 0,
+            y_offset: 0,
+            delay_num: 1,
+            delay_den: 100,
+            dispose_op: DisposeOp::None,
+            blend_op: BlendOp::Source,
+        }
+    }
+
+    /// Get the pixel width of the frame.
+    pub fn width(&self) -> u32 {
+        self.width
+    }
+
+    /// Get the pixel height of the frame.
+    pub fn height(&self) -> u32 {
+        self.height
+    }
+
+    /// Get the horizontal position of the frame on the canvas.
+    pub fn x_offset(&self) -> u32 {
+        self.x_offset
+    }
+
+    /// Get the vertical position of the frame on the canvas.
+    pub fn y_offset(&self) -> u32 {
+        self.y_offset
+    }
+
+    /// Get the frame delay as a (numerator, denominator) fraction of a second.
+    pub fn delay(&self) -> (u16, u16) {
+        (self.delay_num, self.delay_den)
+    }
+
+    /// Get the disposal operation for the frame.
+    pub fn dispose_op(&self) -> DisposeOp {
+        self.dispose_op
+    }
+
+    /// Get the blending operation for the frame.
+    pub fn blend_op(&self) -> BlendOp {
+        self.blend_op
+    }
+
+    /// Set the pixel dimensions of the frame.
+    ///
+    /// Returns error if width or height are 0.
+    pub fn set_size(&mut self, width: u32, height: u32) -> io::Result<()> {
+        if width == 0 {
+            Err(invalid_input("width cannot be 0"))
+        } else if height == 0 {
+            Err(invalid_input("height cannot be 0"))
+        } else {
+            self.width = width;
+            self.height = height;
+            Ok(())
+        }
+    }
+
+    /// Set the position of the frame's top left corner on the canvas.
+    pub fn set_offset(&mut self, x_offset: u32, y_offset: u32) -> io::Result<()> {
+        self.x_offset = x_offset;
+        self.y_offset = y_offset;
+        Ok(())
+    }
+
+    /// Set how long the frame is shown, as a fraction of a second.
+    ///
+    /// A denominator of 0 is treated as 100 by decoders.
+    pub fn set_delay(&mut self, delay_num: u16, delay_den: u16) -> io::Result<()> {
+        self.delay_num = delay_num;
+        self.delay_den = delay_den;
+        Ok(())
+    }
+
+    /// Set the disposal operation.
+    pub fn set_dispose_op(&mut self, dispose_op: DisposeOp) -> io::Result<()> {
+        self.dispose_op = dispose_op;
+        Ok(())
+    }
+
+    /// Set the blending operation.
+    pub fn set_blend_op(&mut self, blend_op: BlendOp) -> io::Result<()> {
+        self.blend_op = blend_op;
+        Ok(())
+    }
+}
+
+impl Default for FrameControl {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
 /// Representation of deflate compression level.
 #[derive(Copy, Clone)]
 pub enum CompressionLevel {
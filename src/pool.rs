@@ -0,0 +1,153 @@
+//
+// mtpng - a multithreaded parallel PNG encoder in Rust
+// pool.rs - recycling of the large byte buffers used by encoding jobs
+//
+// Copyright (c) 2018 Brion Vibber
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+use std::mem;
+
+use std::sync::Arc;
+use std::sync::Mutex;
+
+struct Shared {
+    // Maximum total capacity in bytes of buffers held for reuse,
+    // or 0 for no limit.
+    limit: usize,
+
+    // Buffers waiting for reuse, and their total capacity.
+    buffers: Vec<Vec<u8>>,
+    retained: usize,
+}
+
+/// Pool of reusable byte buffers for pixel, filter, and deflate data.
+///
+/// Each encoder recycles its own buffers from chunk to chunk; creating
+/// one pool and passing it via Options::set_buffer_pool() lets many
+/// encoders reuse each other's buffers too, which avoids most
+/// allocations when encoding a lot of similarly-sized images.
+///
+/// Clones share the same underlying pool.
+#[derive(Clone)]
+pub struct BufferPool {
+    shared: Arc<Mutex<Shared>>,
+}
+
+impl BufferPool {
+    /// Create a new buffer pool that holds onto any number of
+    /// returned buffers until it's dropped.
+    pub fn new() -> BufferPool {
+        BufferPool::with_limit(0)
+    }
+
+    /// Create a new buffer pool that holds onto at most limit bytes
+    /// of capacity in idle buffers, freeing any returned past that.
+    ///
+    /// A limit of 0 means no limit.
+    pub fn with_limit(limit: usize) -> BufferPool {
+        BufferPool {
+            shared: Arc::new(Mutex::new(Shared {
+                limit,
+                buffers: Vec::new(),
+                retained: 0,
+            })),
+        }
+    }
+
+    //
+    // Take an empty buffer with at least the given capacity.
+    //
+    pub(crate) fn take(&self, capacity: usize) -> Vec<u8> {
+        let recycled = {
+            let mut shared = self.shared.lock().unwrap();
+            let fit = shared.buffers.iter().position(|buf| buf.capacity() >= capacity);
+            match fit.or_else(|| shared.buffers.len().checked_sub(1)) {
+                Some(i) => {
+                    let buf = shared.buffers.swap_remove(i);
+                    shared.retained -= buf.capacity();
+                    Some(buf)
+                },
+                None => None,
+            }
+        };
+        match recycled {
+            Some(mut buf) => {
+                // Too-small buffers get grown rather than stranded.
+                buf.reserve(capacity);
+                buf
+            },
+            None => Vec::with_capacity(capacity),
+        }
+    }
+
+    //
+    // Return a buffer for reuse.
+    //
+    pub(crate) fn give(&self, mut buf: Vec<u8>) {
+        let capacity = buf.capacity();
+        if capacity == 0 {
+            return;
+        }
+        buf.clear();
+
+        let mut shared = self.shared.lock().unwrap();
+        if shared.limit > 0 && shared.retained + capacity > shared.limit {
+            return;
+        }
+        shared.retained += capacity;
+        shared.buffers.push(buf);
+    }
+
+    //
+    // Return the buffer in the given slot, leaving it empty.
+    //
+    pub(crate) fn give_from(&self, slot: &mut Vec<u8>) {
+        self.give(mem::replace(slot, Vec::new()));
+    }
+}
+
+impl Default for BufferPool {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::BufferPool;
+
+    #[test]
+    fn reuse() {
+        let pool = BufferPool::new();
+        let mut buf = pool.take(1000);
+        buf.push(1);
+        let ptr = buf.as_ptr();
+        pool.give(buf);
+
+        let again = pool.take(500);
+        assert_eq!(again.len(), 0);
+        assert_eq!(again.as_ptr(), ptr);
+
+        let limited = BufferPool::with_limit(100);
+        limited.give(Vec::with_capacity(1000));
+        assert_eq!(limited.shared.lock().unwrap().buffers.len(), 0);
+    }
+}
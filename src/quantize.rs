@@ -0,0 +1,488 @@
+//
+// mtpng - a multithreaded parallel PNG encoder in Rust
+// quantize.rs - palette building and remapping for indexed-color output
+//
+// Copyright (c) 2018 Brion Vibber
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+use rayon::ThreadPool;
+
+use std::cmp;
+use std::collections::HashMap;
+use std::io;
+use std::sync::Arc;
+
+use super::ColorType;
+use super::Header;
+
+use super::utils::*;
+
+//
+// Each job works on about this many bytes of input rows. The blocks
+// don't depend on the thread count, so neither does the output.
+//
+const BLOCK_SIZE: usize = 64 * 1024;
+
+// Rounds of k-means refinement after the median cut.
+const REFINE_PASSES: usize = 3;
+
+// Histogram bins keep 5 bits of each channel.
+const BIN_SHIFT: u32 = 3;
+
+pub struct Quantized {
+    // PLTE and tRNS chunk data; the latter is empty if every
+    // color is opaque, and otherwise stops at the last that isn't.
+    pub palette: Vec<u8>,
+    pub transparency: Vec<u8>,
+
+    // One index byte per pixel, packed rows.
+    pub indices: Vec<u8>,
+}
+
+//
+// Reduce an 8-bit truecolor image, with or without alpha and laid
+// out as described by the header, to at most 256 colors.
+//
+// If there are no more than that already, they make up the palette
+// and are mapped exactly. Otherwise histograms of the row blocks are
+// collected in parallel and merged for a median cut, refined with a
+// few rounds of k-means over the histogram, and the blocks mapped to
+// the nearest colors in parallel. With dithering, error diffusion
+// restarts at the top of each block.
+//
+pub fn quantize<T>(header: &Header, image: Arc<T>, row_stride: usize, dither: bool,
+                   pool: Option<&ThreadPool>) -> io::Result<Quantized>
+    where T: AsRef<[u8]> + Send + Sync + ?Sized + 'static
+{
+    match (header.color_type, header.depth) {
+        (ColorType::Truecolor, 8) | (ColorType::TruecolorAlpha, 8) => {},
+        _ => return Err(invalid_input("Quantizing requires 8-bit truecolor input.")),
+    }
+    let source = Arc::new(RowSource {
+        header: *header,
+        image,
+        row_stride,
+    });
+
+    let (colors, exact) = match exact_colors(&source, pool) {
+        Some(colors) => (colors, true),
+        None => {
+            let mut colors = build_palette(&source, pool);
+            sort_palette(&mut colors);
+            (colors, false)
+        },
+    };
+    let indices = remap(&source, &colors, dither && !exact, exact, pool);
+
+    let (palette, transparency) = palette_chunks(&colors);
+    Ok(Quantized {
+        palette,
+        transparency,
+        indices,
+    })
+}
+
+//
+// Call func with each row of the block in turn, unpacked to
+// one RGBA color per pixel.
+//
+fn each_row<T, F>(source: &RowSource<T>, start_row: usize, end_row: usize, mut func: F)
+    where T: AsRef<[u8]> + Send + Sync + ?Sized + 'static,
+          F: FnMut(usize, &[u32])
+{
+    let channels = source.header.color_type.channels();
+    let mut row = vec![0u32; source.header.width as usize];
+    source.each_row(start_row, end_row, |y, packed| {
+        for (color, pixel) in row.iter_mut().zip(packed.chunks(channels)) {
+            let a = if channels == 4 { pixel[3] } else { 255 };
+            *color = rgba(pixel[0], pixel[1], pixel[2], a);
+        }
+        func(y, &row);
+    });
+}
+
+fn rgba(r: u8, g: u8, b: u8, a: u8) -> u32 {
+    (r as u32) << 24 | (g as u32) << 16 | (b as u32) << 8 | a as u32
+}
+
+fn channel(color: u32, n: usize) -> u8 {
+    (color >> (24 - 8 * n)) as u8
+}
+
+fn distance(a: u32, b: u32) -> u32 {
+    (0 .. 4).map(|n| {
+        let d = channel(a, n) as i32 - channel(b, n) as i32;
+        (d * d) as u32
+    }).sum()
+}
+
+//
+// The image's colors, if there are few enough to use as they are.
+// Each block gives up as soon as it has too many on its own.
+//
+fn exact_colors<T>(source: &Arc<RowSource<T>>, pool: Option<&ThreadPool>) -> Option<Vec<u32>>
+    where T: AsRef<[u8]> + Send + Sync + ?Sized + 'static
+{
+    let found = source.map_blocks(BLOCK_SIZE, pool, |source, start, end| {
+        let mut colors = ColorSet::new();
+        each_row(source, start, end, |_, row| {
+            if colors.is_over() {
+                return;
+            }
+            for &color in row {
+                colors.insert(color);
+            }
+        });
+        colors
+    });
+
+    let mut found = found.into_iter();
+    let mut colors = found.next().unwrap();
+    for block in found {
+        colors.merge(block);
+    }
+    colors.palette()
+}
+
+//
+// Pixel count and channel sums of the colors falling into a
+// histogram bin, or into a palette entry's cluster.
+//
+#[derive(Copy, Clone, Default)]
+struct Bin {
+    count: u64,
+    sums: [u64; 4],
+}
+
+impl Bin {
+    fn add(&mut self, color: u32, count: u64) {
+        self.count += count;
+        for n in 0 .. 4 {
+            self.sums[n] += channel(color, n) as u64 * count;
+        }
+    }
+
+    fn merge(&mut self, other: &Bin) {
+        self.count += other.count;
+        for n in 0 .. 4 {
+            self.sums[n] += other.sums[n];
+        }
+    }
+
+    fn mean(&self) -> u32 {
+        let c = |n: usize| ((self.sums[n] + self.count / 2) / self.count) as u8;
+        rgba(c(0), c(1), c(2), c(3))
+    }
+}
+
+fn bin_key(color: u32) -> u32 {
+    let mask = 0xffu32 >> BIN_SHIFT << BIN_SHIFT;
+    color & (mask << 24 | mask << 16 | mask << 8 | mask)
+}
+
+//
+// Median cut over the merged histograms of the blocks, then
+// k-means over the bins to pull the colors towards the clusters.
+//
+fn build_palette<T>(source: &Arc<RowSource<T>>, pool: Option<&ThreadPool>) -> Vec<u32>
+    where T: AsRef<[u8]> + Send + Sync + ?Sized + 'static
+{
+    let histograms = source.map_blocks(BLOCK_SIZE, pool, |source, start, end| {
+        let mut bins = HashMap::<u32, Bin>::new();
+        each_row(source, start, end, |_, row| {
+            for &color in row {
+                bins.entry(bin_key(color)).or_insert_with(Bin::default).add(color, 1);
+            }
+        });
+        bins
+    });
+
+    let mut merged = HashMap::<u32, Bin>::new();
+    for bins in histograms {
+        for (key, bin) in bins {
+            merged.entry(key).or_insert_with(Bin::default).merge(&bin);
+        }
+    }
+    // Sort so the cut doesn't depend on hash order.
+    let mut bins: Vec<(u32, Bin)> = merged.into_iter()
+                                          .map(|(_, bin)| (bin.mean(), bin))
+                                          .collect();
+    bins.sort_by_key(|&(color, _)| color);
+
+    let mut palette = median_cut(&mut bins);
+    let bins = Arc::new(bins);
+    for _ in 0 .. REFINE_PASSES {
+        palette = refine(&bins, palette, pool);
+    }
+    palette.sort();
+    palette.dedup();
+    palette
+}
+
+//
+// Split the box of bins with the widest spread, weighted by pixel
+// count, at the median along its widest channel, until there are
+// enough boxes; the palette is their mean colors.
+//
+fn median_cut(bins: &mut [(u32, Bin)]) -> Vec<u32> {
+    let spread = |bins: &[(u32, Bin)]| -> (u64, usize) {
+        let count: u64 = bins.iter().map(|&(_, ref bin)| bin.count).sum();
+        (0 .. 4).map(|n| {
+            let min = bins.iter().map(|&(color, _)| channel(color, n)).min().unwrap();
+            let max = bins.iter().map(|&(color, _)| channel(color, n)).max().unwrap();
+            ((max - min) as u64 * count, n)
+        }).max().unwrap()
+    };
+
+    let mut boxes = vec![(0, bins.len())];
+    while boxes.len() < PALETTE_COLORS {
+        let (score, n, channel_n) = boxes.iter().enumerate().map(|(n, &(start, end))| {
+            let (score, channel_n) = spread(&bins[start .. end]);
+            (score, n, channel_n)
+        }).max_by_key(|&(score, n, _)| (score, cmp::Reverse(n))).unwrap();
+        if score == 0 {
+            break;
+        }
+
+        let (start, end) = boxes[n];
+        let slice = &mut bins[start .. end];
+        slice.sort_by_key(|&(color, _)| (channel(color, channel_n), color));
+        let total: u64 = slice.iter().map(|&(_, ref bin)| bin.count).sum();
+        let mut count = 0;
+        let mut split = 1;
+        for (i, &(_, ref bin)) in slice.iter().enumerate() {
+            count += bin.count;
+            if count * 2 >= total {
+                split = cmp::max(1, cmp::min(i + 1, slice.len() - 1));
+                break;
+            }
+        }
+        boxes[n] = (start, start + split);
+        boxes.push((start + split, end));
+    }
+
+    boxes.iter().map(|&(start, end)| {
+        let mut sum = Bin::default();
+        for &(_, ref bin) in &bins[start .. end] {
+            sum.merge(bin);
+        }
+        sum.mean()
+    }).collect()
+}
+
+//
+// One k-means round: assign each bin to its nearest palette color in
+// parallel, and move the colors to the means of their clusters.
+//
+fn refine(bins: &Arc<Vec<(u32, Bin)>>, palette: Vec<u32>, pool: Option<&ThreadPool>) -> Vec<u32> {
+    const BINS_PER_JOB: usize = 4096;
+
+    let palette = Arc::new(palette);
+    let blocks = row_blocks(bins.len(), 1, BINS_PER_JOB);
+    let results = {
+        let bins = Arc::clone(bins);
+        let palette = Arc::clone(&palette);
+        map_blocks(&blocks, pool, move |start, end| {
+            let mut clusters = vec![Bin::default(); palette.len()];
+            for &(color, ref bin) in &bins[start .. end] {
+                clusters[nearest(&palette, color)].merge(bin);
+            }
+            clusters
+        })
+    };
+    let mut clusters = vec![Bin::default(); palette.len()];
+    for result in results {
+        for (sum, cluster) in clusters.iter_mut().zip(result.iter()) {
+            sum.merge(cluster);
+        }
+    }
+
+    // Sums are order independent, so this is too.
+    palette.iter().zip(clusters.iter()).map(|(&color, cluster)| {
+        if cluster.count == 0 {
+            color
+        } else {
+            cluster.mean()
+        }
+    }).collect()
+}
+
+fn nearest(palette: &[u32], color: u32) -> usize {
+    let mut best = 0;
+    let mut best_distance = u32::max_value();
+    for (i, &entry) in palette.iter().enumerate() {
+        let d = distance(entry, color);
+        if d < best_distance {
+            best = i;
+            best_distance = d;
+            if d == 0 {
+                break;
+            }
+        }
+    }
+    best
+}
+
+//
+// Map each block's pixels to palette indices in parallel, diffusing
+// the error Floyd-Steinberg style within each block if dithering.
+//
+fn remap<T>(source: &Arc<RowSource<T>>, palette: &[u32], dither: bool, exact: bool,
+            pool: Option<&ThreadPool>) -> Vec<u8>
+    where T: AsRef<[u8]> + Send + Sync + ?Sized + 'static
+{
+    let palette = Arc::new(palette.to_vec());
+    let width = source.header.width as usize;
+    let blocks = {
+        let palette = Arc::clone(&palette);
+        source.map_blocks(BLOCK_SIZE, pool, move |source, start, end| {
+            let mut out = Vec::with_capacity((end - start) * width);
+            let mut cache = HashMap::<u32, u8>::new();
+            if exact {
+                for (i, &color) in palette.iter().enumerate() {
+                    cache.insert(color, i as u8);
+                }
+            }
+            let mut lookup = |color: u32| -> u8 {
+                *cache.entry(color).or_insert_with(|| nearest(&palette, color) as u8)
+            };
+
+            if !dither {
+                each_row(source, start, end, |_, row| {
+                    out.extend(row.iter().map(|&color| lookup(color)));
+                });
+                return out;
+            }
+
+            // Errors in sixteenths, with a pixel of padding either side.
+            let mut errors = vec![[0i32; 4]; width + 2];
+            let mut next = vec![[0i32; 4]; width + 2];
+            each_row(source, start, end, |_, row| {
+                for (x, &color) in row.iter().enumerate() {
+                    let mut wanted = [0u8; 4];
+                    for n in 0 .. 4 {
+                        let value = channel(color, n) as i32 + errors[x + 1][n] / 16;
+                        wanted[n] = cmp::max(0, cmp::min(255, value)) as u8;
+                    }
+                    let wanted = rgba(wanted[0], wanted[1], wanted[2], wanted[3]);
+                    let index = lookup(wanted);
+                    out.push(index);
+
+                    let got = palette[index as usize];
+                    for n in 0 .. 4 {
+                        let error = channel(wanted, n) as i32 - channel(got, n) as i32;
+                        errors[x + 2][n] += error * 7;
+                        next[x][n] += error * 3;
+                        next[x + 1][n] += error * 5;
+                        next[x + 2][n] += error;
+                    }
+                }
+                errors.copy_from_slice(&next);
+                for error in next.iter_mut() {
+                    *error = [0; 4];
+                }
+            });
+            out
+        })
+    };
+
+    let mut indices = Vec::with_capacity(width * source.header.height as usize);
+    for block in blocks {
+        indices.extend_from_slice(&block);
+    }
+    indices
+}
+
+#[cfg(test)]
+mod tests {
+    use std::sync::Arc;
+
+    use super::super::ColorType;
+    use super::super::Header;
+    use super::super::SourceFormat;
+    use super::quantize;
+
+    fn header(width: u32, height: u32, color_type: ColorType) -> Header {
+        let mut header = Header::new();
+        header.set_size(width, height).unwrap();
+        header.set_color(color_type, 8).unwrap();
+        header
+    }
+
+    #[test]
+    fn exact_palette() {
+        // Four colors, two of them translucent, in BGRA order.
+        let colors = [[0u8, 0, 255, 255], [0, 255, 0, 128], [255, 0, 0, 255], [9, 9, 9, 0]];
+        let mut data = Vec::new();
+        for i in 0 .. 64 * 48 {
+            data.extend_from_slice(&colors[(i * 7 / 5) % 4]);
+        }
+        let mut header = header(64, 48, ColorType::TruecolorAlpha);
+        header.set_source_format(SourceFormat::Bgra).unwrap();
+
+        let result = quantize(&header, Arc::new(data.clone()), 64 * 4, false, None).unwrap();
+        assert_eq!(result.palette.len(), 4 * 3);
+        assert_eq!(result.transparency.len(), 2);
+        for (pixel, &index) in data.chunks(4).zip(result.indices.iter()) {
+            let entry = &result.palette[index as usize * 3 .. index as usize * 3 + 3];
+            assert_eq!(entry, &[pixel[2], pixel[1], pixel[0]]);
+            let alpha = result.transparency.get(index as usize).cloned().unwrap_or(255);
+            assert_eq!(alpha, pixel[3]);
+        }
+    }
+
+    #[test]
+    fn reduced_palette() {
+        // A smooth gradient with far too many colors, padded rows.
+        let (width, height, stride) = (300, 200, 904);
+        let mut data = vec![0u8; stride * height];
+        for y in 0 .. height {
+            for x in 0 .. width {
+                let pixel = &mut data[y * stride + x * 3 ..];
+                pixel[0] = (x * 255 / width) as u8;
+                pixel[1] = (y * 255 / height) as u8;
+                pixel[2] = ((x + y) * 255 / (width + height)) as u8;
+            }
+        }
+        let header = header(width as u32, height as u32, ColorType::Truecolor);
+
+        for &dither in &[false, true] {
+            let result = quantize(&header, Arc::new(data.clone()), stride, dither, None).unwrap();
+            let entries = result.palette.len() / 3;
+            assert!(entries > 200 && entries <= 256, "got {} colors", entries);
+            assert!(result.transparency.is_empty());
+            assert_eq!(result.indices.len(), width * height);
+
+            let mut error = 0u64;
+            for y in 0 .. height {
+                for x in 0 .. width {
+                    let index = result.indices[y * width + x] as usize;
+                    for n in 0 .. 3 {
+                        let d = data[y * stride + x * 3 + n] as i64 - result.palette[index * 3 + n] as i64;
+                        error += (d * d) as u64;
+                    }
+                }
+            }
+            let mse = error as f64 / (width * height * 3) as f64;
+            assert!(mse < 40.0, "mean squared error {} with dither {}", mse, dither);
+        }
+    }
+}
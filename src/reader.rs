@@ -0,0 +1,168 @@
+//
+// mtpng - a multithreaded parallel PNG encoder in Rust
+// reader.rs - low-level PNG chunk reader
+//
+// Copyright (c) 2018 Brion Vibber
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+use std::convert::TryFrom;
+use std::io;
+use std::io::Read;
+
+use super::ColorType;
+use super::Header;
+use super::InterlaceMethod;
+
+use super::deflate;
+
+use super::utils::*;
+
+pub struct Reader<R: Read> {
+    input: R,
+}
+
+impl<R: Read> Reader<R> {
+    //
+    // Creates a new PNG chunk stream reader.
+    // Consumes the input Read object, but will
+    // give it back to you via Reader::finish().
+    //
+    pub fn new(input: R) -> Reader<R> {
+        Reader {
+            input,
+        }
+    }
+
+    pub fn finish(self) -> R {
+        self.input
+    }
+
+    //
+    // Check for the PNG file signature at the start of the stream.
+    // https://www.w3.org/TR/PNG/#5PNG-file-signature
+    //
+    pub fn read_signature(&mut self) -> IoResult {
+        let mut bytes = [0u8; 8];
+        self.input.read_exact(&mut bytes)?;
+        if bytes == [137u8, 80, 78, 71, 13, 10, 26, 10] {
+            Ok(())
+        } else {
+            Err(invalid_data("Not a PNG file"))
+        }
+    }
+
+    //
+    // Read the next chunk's tag and data, checking its CRC.
+    //
+    // https://www.w3.org/TR/PNG/#5DataRep
+    //
+    pub fn read_chunk(&mut self) -> io::Result<([u8; 4], Vec<u8>)> {
+        let mut bytes = [0u8; 8];
+        self.input.read_exact(&mut bytes)?;
+        let len = read_be32(&bytes[0 .. 4]);
+        if len > 0x7fff_ffff {
+            return Err(invalid_data("Chunk length out of range"));
+        }
+        let mut tag = [0u8; 4];
+        tag.copy_from_slice(&bytes[4 .. 8]);
+
+        // Read through take() so a bogus length runs into the
+        // end of the file instead of allocating it all up front.
+        let mut data = Vec::new();
+        (&mut self.input).take(len as u64).read_to_end(&mut data)?;
+        if data.len() != len as usize {
+            return Err(invalid_data("Truncated chunk"));
+        }
+
+        self.input.read_exact(&mut bytes[0 .. 4])?;
+        let tag_crc = deflate::crc32(deflate::crc32_initial(), &tag);
+        if read_be32(&bytes[0 .. 4]) != deflate::crc32(tag_crc, &data) {
+            return Err(invalid_data("Chunk CRC mismatch"));
+        }
+        Ok((tag, data))
+    }
+}
+
+//
+// Parse an IHDR chunk's data.
+// https://www.w3.org/TR/PNG/#11IHDR
+//
+pub fn parse_header(data: &[u8]) -> io::Result<Header> {
+    if data.len() != 13 {
+        return Err(invalid_data("Invalid IHDR length"));
+    }
+    if data[10] != 0 || data[11] != 0 {
+        return Err(invalid_data("Unknown compression or filter method"));
+    }
+    let mut header = Header::new();
+    header.set_size(read_be32(&data[0 .. 4]), read_be32(&data[4 .. 8]))?;
+    header.set_color(ColorType::try_from(data[9])?, data[8])?;
+    header.set_interlace_method(InterlaceMethod::try_from(data[12])?)?;
+    Ok(header)
+}
+
+//
+// Chunks whose tag starts with a lowercase letter can be skipped
+// if not understood; others are needed to render the image.
+//
+pub fn is_critical(tag: &[u8; 4]) -> bool {
+    tag[0] & 0x20 == 0
+}
+
+#[cfg(test)]
+mod tests {
+    use std::io::Cursor;
+
+    use super::super::writer::Writer;
+    use super::super::Header;
+    use super::super::ColorType;
+    use super::{Reader, parse_header};
+
+    #[test]
+    fn chunks_work() {
+        let mut header = Header::new();
+        header.set_size(7, 3).unwrap();
+        header.set_color(ColorType::GreyscaleAlpha, 16).unwrap();
+
+        let mut writer = Writer::new(Vec::<u8>::new());
+        writer.write_signature().unwrap();
+        writer.write_header(header).unwrap();
+        writer.write_chunk(b"tEXt", b"hello").unwrap();
+        let mut file = writer.finish().unwrap();
+
+        let mut reader = Reader::new(Cursor::new(file.clone()));
+        reader.read_signature().unwrap();
+        let (tag, data) = reader.read_chunk().unwrap();
+        assert_eq!(&tag, b"IHDR");
+        let parsed = parse_header(&data).unwrap();
+        assert_eq!((parsed.width(), parsed.height(), parsed.depth()), (7, 3, 16));
+        let (tag, data) = reader.read_chunk().unwrap();
+        assert_eq!((&tag, &data[..]), (b"tEXt", &b"hello"[..]));
+
+        // Flip a bit in the text.
+        let len = file.len();
+        file[len - 6] ^= 1;
+        let mut reader = Reader::new(Cursor::new(file));
+        reader.read_signature().unwrap();
+        reader.read_chunk().unwrap();
+        assert!(reader.read_chunk().is_err(), "expected CRC failure");
+    }
+}
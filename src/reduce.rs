@@ -0,0 +1,440 @@
+//
+// mtpng - a multithreaded parallel PNG encoder in Rust
+// reduce.rs - lossless color type and bit depth reduction
+//
+// Copyright (c) 2018 Brion Vibber
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+use rayon::ThreadPool;
+
+use std::sync::Arc;
+
+use super::ColorType;
+use super::Header;
+use super::SourceFormat;
+
+use super::utils::*;
+
+// Each job scans or converts about this many bytes of input rows.
+const BLOCK_SIZE: usize = 64 * 1024;
+
+pub struct Reduced {
+    // Packed in the new color type and depth.
+    pub header: Header,
+    pub data: Vec<u8>,
+
+    // PLTE and tRNS chunk data, if reduced to indexed color;
+    // tRNS stops at the last translucent entry.
+    pub palette: Vec<u8>,
+    pub transparency: Vec<u8>,
+}
+
+//
+// What a block of rows needs kept, merged over the whole image.
+//
+struct Scan {
+    // Every alpha sample is at its maximum.
+    opaque: bool,
+
+    // Every pixel has equal red, green, and blue.
+    grey: bool,
+
+    // Every 16-bit sample has the same high and low bytes, so
+    // is exactly its 8-bit value scaled up.
+    repeated: bool,
+
+    // Bit set of the 8-bit grey levels seen.
+    levels: [u64; 4],
+
+    // Up to 256 distinct 8-bit RGBA colors.
+    colors: ColorSet,
+}
+
+impl Scan {
+    fn merge(&mut self, other: Scan) {
+        self.opaque &= other.opaque;
+        self.grey &= other.grey;
+        self.repeated &= other.repeated;
+        for (bits, other_bits) in self.levels.iter_mut().zip(other.levels.iter()) {
+            *bits |= *other_bits;
+        }
+        self.colors.merge(other.colors);
+    }
+}
+
+//
+// Call func with each row of the block in turn, unpacked to
+// RGBA samples at the input depth.
+//
+fn each_row<T, F>(source: &RowSource<T>, start_row: usize, end_row: usize, mut func: F)
+    where T: AsRef<[u8]> + Send + Sync + ?Sized + 'static,
+          F: FnMut(&[[u16; 4]])
+{
+    let header = &source.header;
+    let width = header.width as usize;
+    let channels = header.color_type.channels();
+    let wide = header.depth == 16;
+    let max = if wide { 0xffff } else { 0xff };
+
+    let mut row = vec![[0u16; 4]; width];
+    source.each_row(start_row, end_row, |_, packed| {
+        for (x, pixel) in row.iter_mut().enumerate() {
+            let mut sample = [max; 4];
+            for n in 0 .. channels {
+                sample[n] = if wide {
+                    let i = (x * channels + n) * 2;
+                    (packed[i] as u16) << 8 | packed[i + 1] as u16
+                } else {
+                    packed[x * channels + n] as u16
+                };
+            }
+            *pixel = match channels {
+                1 => [sample[0], sample[0], sample[0], max],
+                2 => [sample[0], sample[0], sample[0], sample[1]],
+                3 => [sample[0], sample[1], sample[2], max],
+                _ => sample,
+            };
+        }
+        func(&row);
+    });
+}
+
+//
+// Check in parallel over blocks of rows whether the image could be
+// stored losslessly in fewer bits per pixel, by dropping an opaque
+// alpha channel, storing equal red, green, and blue as grey, halving
+// 16-bit samples that repeat their high byte, or using a palette of
+// up to 256 colors, and if so convert it in parallel.
+//
+// With keep_color_space, color stays color and grey stays grey,
+// for an ICC profile that only fits one or the other.
+//
+// Returns None if it's already as small as it can be, or is indexed
+// or has less than 8 bits per sample already.
+//
+pub fn reduce<T>(header: &Header, image: Arc<T>, row_stride: usize,
+                 keep_color_space: bool, pool: Option<&ThreadPool>) -> Option<Reduced>
+    where T: AsRef<[u8]> + Send + Sync + ?Sized + 'static
+{
+    if header.depth < 8 {
+        return None;
+    }
+    if let ColorType::IndexedColor = header.color_type {
+        return None;
+    }
+
+    let source = Arc::new(RowSource {
+        header: *header,
+        image,
+        row_stride,
+    });
+
+    let scans = source.map_blocks(BLOCK_SIZE, pool, scan);
+    let mut scans = scans.into_iter();
+    let mut scan = scans.next().unwrap();
+    for other in scans {
+        scan.merge(other);
+    }
+
+    let target = Target::choose(header, scan, keep_color_space);
+    if target.header.color_type as u8 == header.color_type as u8
+        && target.header.depth == header.depth {
+        return None;
+    }
+
+    let target = Arc::new(target);
+    let converted = {
+        let target = Arc::clone(&target);
+        source.map_blocks(BLOCK_SIZE, pool, move |source, start, end| {
+            target.convert(source, start, end)
+        })
+    };
+    let mut data = Vec::with_capacity(target.header.stride() * header.height as usize);
+    for block in converted {
+        data.extend_from_slice(&block);
+    }
+
+    let (palette, transparency) = palette_chunks(&target.palette);
+    Some(Reduced {
+        header: target.header,
+        data,
+        palette,
+        transparency,
+    })
+}
+
+fn scan<T>(source: &RowSource<T>, start_row: usize, end_row: usize) -> Scan
+    where T: AsRef<[u8]> + Send + Sync + ?Sized + 'static
+{
+    let wide = source.header.depth == 16;
+    let shift = if wide { 8 } else { 0 };
+    let max = if wide { 0xffff } else { 0xff };
+    let mut scan = Scan {
+        opaque: true,
+        grey: true,
+        repeated: wide,
+        levels: [0; 4],
+        colors: ColorSet::new(),
+    };
+    each_row(source, start_row, end_row, |row| {
+        for pixel in row {
+            scan.opaque &= pixel[3] == max;
+            scan.grey &= pixel[0] == pixel[1] && pixel[1] == pixel[2];
+            if wide {
+                scan.repeated &= pixel.iter().all(|&v| v >> 8 == v & 0xff);
+            }
+            let level = (pixel[0] >> shift) as usize;
+            scan.levels[level >> 6] |= 1 << (level & 63);
+
+            scan.colors.insert(rgba8(pixel, shift));
+        }
+    });
+    scan
+}
+
+fn rgba8(pixel: &[u16; 4], shift: u32) -> u32 {
+    ((pixel[0] >> shift) as u32) << 24 |
+    ((pixel[1] >> shift) as u32) << 16 |
+    ((pixel[2] >> shift) as u32) << 8 |
+    (pixel[3] >> shift) as u32
+}
+
+struct Target {
+    header: Header,
+
+    // Drop the low byte of 16-bit samples.
+    shift: u32,
+
+    // For indexed color, sorted translucent first, and the
+    // colors in order with their indexes for lookup.
+    palette: Vec<u32>,
+    lookup: Vec<(u32, u8)>,
+}
+
+impl Target {
+    fn choose(header: &Header, scan: Scan, keep_color_space: bool) -> Target {
+        let wide = header.depth == 16 && !scan.repeated;
+        let alpha = !scan.opaque;
+        let was_grey = match header.color_type {
+            ColorType::Greyscale | ColorType::GreyscaleAlpha => true,
+            _ => false,
+        };
+        let grey = if keep_color_space { was_grey } else { scan.grey };
+
+        // Greyscale levels that are all multiples of 255 / (2^n - 1)
+        // fit in n bits exactly.
+        let grey_depth = if wide {
+            16
+        } else {
+            let fits = |depth: u32| {
+                let step = 255 / ((1 << depth) - 1);
+                (0 .. 256).all(|level| {
+                    scan.levels[level >> 6] & 1 << (level & 63) == 0 || level % step == 0
+                })
+            };
+            [1, 2, 4].iter().cloned().find(|&depth| !alpha && fits(depth)).unwrap_or(8)
+        };
+        let (color_type, depth) = match (grey, alpha) {
+            (true, false) => (ColorType::Greyscale, grey_depth),
+            (true, true) => (ColorType::GreyscaleAlpha, if wide { 16 } else { 8 }),
+            (false, false) => (ColorType::Truecolor, if wide { 16 } else { 8 }),
+            (false, true) => (ColorType::TruecolorAlpha, if wide { 16 } else { 8 }),
+        };
+
+        // A palette is always color.
+        let mut palette = match scan.colors.palette() {
+            Some(palette) if !wide && !(keep_color_space && was_grey) => palette,
+            _ => Vec::new(),
+        };
+        let index_depth = match palette.len() {
+            0 => None,
+            1 ..= 2 => Some(1),
+            3 ..= 4 => Some(2),
+            5 ..= 16 => Some(4),
+            _ => Some(8),
+        };
+        let bits = color_type.channels() as u32 * depth as u32;
+        let (color_type, depth) = match index_depth {
+            Some(index_depth) if index_depth < bits => (ColorType::IndexedColor, index_depth as u8),
+            _ => {
+                palette.clear();
+                (color_type, depth as u8)
+            },
+        };
+        let mut lookup: Vec<(u32, u8)> = palette.iter().enumerate()
+                                                .map(|(i, &color)| (color, i as u8))
+                                                .collect();
+        lookup.sort();
+
+        let mut reduced = *header;
+        reduced.set_color(color_type, depth).unwrap();
+        reduced.set_source_format(SourceFormat::Packed).unwrap();
+        Target {
+            header: reduced,
+            shift: if header.depth == 16 && !wide { 8 } else { 0 },
+            palette,
+            lookup,
+        }
+    }
+
+    fn convert<T>(&self, source: &RowSource<T>, start_row: usize, end_row: usize) -> Vec<u8>
+        where T: AsRef<[u8]> + Send + Sync + ?Sized + 'static
+    {
+        let header = &self.header;
+        let stride = header.stride();
+        let depth = header.depth as usize;
+        let shift = self.shift;
+        let mut out = Vec::with_capacity((end_row - start_row) * stride);
+        each_row(source, start_row, end_row, |row| {
+            let start = out.len();
+            out.resize(start + stride, 0);
+            let dest = &mut out[start ..];
+            match header.color_type {
+                ColorType::IndexedColor => {
+                    for (x, pixel) in row.iter().enumerate() {
+                        let color = rgba8(pixel, shift);
+                        let i = self.lookup.binary_search_by_key(&color, |&(c, _)| c).unwrap();
+                        pack(dest, x, depth, self.lookup[i].1);
+                    }
+                },
+                ColorType::Greyscale if depth < 8 => {
+                    let step = 255 / ((1 << depth) - 1);
+                    for (x, pixel) in row.iter().enumerate() {
+                        pack(dest, x, depth, (pixel[0] as usize / step) as u8);
+                    }
+                },
+                color_type => {
+                    let channels = color_type.channels();
+                    let samples: &[usize] = match channels {
+                        1 => &[0],
+                        2 => &[0, 3],
+                        3 => &[0, 1, 2],
+                        _ => &[0, 1, 2, 3],
+                    };
+                    let mut i = 0;
+                    for pixel in row {
+                        for &n in samples {
+                            let value = pixel[n] >> shift;
+                            if depth == 16 {
+                                dest[i] = (value >> 8) as u8;
+                                dest[i + 1] = value as u8;
+                                i += 2;
+                            } else {
+                                dest[i] = value as u8;
+                                i += 1;
+                            }
+                        }
+                    }
+                },
+            }
+        });
+        out
+    }
+}
+
+//
+// Set the x'th value of depth bits in a row, most significant first.
+//
+fn pack(row: &mut [u8], x: usize, depth: usize, value: u8) {
+    let bit = x * depth;
+    row[bit / 8] |= value << (8 - depth - bit % 8);
+}
+
+#[cfg(test)]
+mod tests {
+    use std::sync::Arc;
+
+    use super::super::ColorType;
+    use super::super::Header;
+    use super::reduce;
+
+    fn header(width: u32, height: u32, color_type: ColorType, depth: u8) -> Header {
+        let mut header = Header::new();
+        header.set_size(width, height).unwrap();
+        header.set_color(color_type, depth).unwrap();
+        header
+    }
+
+    #[test]
+    fn opaque_grey() {
+        // Opaque RGBA with multiples of 17 on the diagonal is 4-bit grey.
+        let (width, height) = (33, 20);
+        let mut data = Vec::new();
+        for y in 0 .. height {
+            for x in 0 .. width {
+                let v = ((x + y) % 16 * 17) as u8;
+                data.extend_from_slice(&[v, v, v, 255]);
+            }
+        }
+        let header = header(width as u32, height as u32, ColorType::TruecolorAlpha, 8);
+        let reduced = reduce(&header, Arc::new(data.clone()), width * 4, false, None).unwrap();
+        assert_eq!(reduced.header.stride(), 17);
+        assert_eq!(reduced.header.depth(), 4);
+        if let ColorType::Greyscale = reduced.header.color_type() {} else {
+            assert!(false, "expected greyscale");
+        }
+        assert_eq!(reduced.data.len(), 17 * height);
+        assert_eq!(&reduced.data[.. 3], &[0x01, 0x23, 0x45]);
+        assert_eq!(&reduced.data[17 .. 20], &[0x12, 0x34, 0x56]);
+
+        // Keeping it in color space, its 16 colors make a palette instead.
+        let reduced = reduce(&header, Arc::new(data), width * 4, true, None).unwrap();
+        assert_eq!(reduced.header.depth(), 4);
+        if let ColorType::IndexedColor = reduced.header.color_type() {} else {
+            assert!(false, "expected indexed color");
+        }
+    }
+
+    #[test]
+    fn few_colors() {
+        // Three 16-bit colors, one translucent, fit a 2-bit palette.
+        let colors = [[0x1111u16, 0x2222, 0x3333, 0xffff],
+                      [0xaaaa, 0xbbbb, 0xcccc, 0x8080],
+                      [0, 0, 0, 0xffff]];
+        let (width, height) = (10, 4);
+        let mut data = Vec::new();
+        for i in 0 .. width * height {
+            for &sample in &colors[i % 3] {
+                data.push((sample >> 8) as u8);
+                data.push(sample as u8);
+            }
+        }
+        let header = header(width as u32, height as u32, ColorType::TruecolorAlpha, 16);
+        let reduced = reduce(&header, Arc::new(data.clone()), width * 8, false, None).unwrap();
+        assert_eq!(reduced.header.depth(), 2);
+        if let ColorType::IndexedColor = reduced.header.color_type() {} else {
+            assert!(false, "expected indexed color");
+        }
+        assert_eq!(reduced.palette, vec![0xaa, 0xbb, 0xcc, 0, 0, 0, 0x11, 0x22, 0x33]);
+        assert_eq!(reduced.transparency, vec![0x80]);
+        assert_eq!(&reduced.data[.. 3], &[0b10000110, 0b00011000, 0b01100000]);
+
+        // A fourth color still fits.
+        let mut data = data;
+        data[6 .. 8].copy_from_slice(&[0xfe, 0xfe]);
+        let reduced = reduce(&header, Arc::new(data.clone()), width * 8, false, None).unwrap();
+        assert_eq!(reduced.header.depth(), 2);
+
+        // Once a low byte differs from its high byte, nothing can be done.
+        data[7] = 0;
+        assert!(reduce(&header, Arc::new(data), width * 8, false, None).is_none());
+    }
+}
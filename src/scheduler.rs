@@ -0,0 +1,245 @@
+//
+// mtpng - a multithreaded parallel PNG encoder in Rust
+// scheduler.rs - fair sharing of a thread pool between encoders
+//
+// Copyright (c) 2018 Brion Vibber
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+use std::cmp;
+
+use std::collections::BTreeMap;
+use std::collections::VecDeque;
+
+use std::sync::Arc;
+use std::sync::Mutex;
+
+pub(crate) type Job = Box<dyn FnOnce() + Send>;
+
+// Virtual time taken by one job at priority 1.
+const JOB_COST: u64 = 1 << 20;
+
+struct Queue {
+    priority: u32,
+
+    // Virtual time at which this encoder's next job may start.
+    start_time: u64,
+
+    jobs: VecDeque<Job>,
+}
+
+struct Shared {
+    // Maximum number of jobs running at once across all encoders.
+    limit: usize,
+    running: usize,
+
+    // Start time of the most recently started job.
+    virtual_time: u64,
+
+    // Per-encoder job queues, keyed in order of creation.
+    queues: BTreeMap<usize, Queue>,
+    next_id: usize,
+}
+
+impl Shared {
+    //
+    // Pick the queued job with the earliest virtual start time.
+    // Each job an encoder starts pushes its next one back by
+    // JOB_COST / priority, so encoders with work waiting share the
+    // running slots in proportion to their priorities.
+    //
+    fn next_job(&mut self) -> Option<Job> {
+        let mut best: Option<(usize, u64)> = None;
+        for (&id, queue) in self.queues.iter() {
+            if queue.jobs.is_empty() {
+                continue;
+            }
+            match best {
+                Some((_, time)) if time <= queue.start_time => {},
+                _ => best = Some((id, queue.start_time)),
+            }
+        }
+        let (id, time) = best?;
+        let queue = self.queues.get_mut(&id).unwrap();
+        queue.start_time += JOB_COST / queue.priority as u64;
+        self.virtual_time = time;
+        queue.jobs.pop_front()
+    }
+}
+
+/// Scheduler dividing a thread pool between encoders.
+///
+/// Each encoder normally queues its jobs straight onto the thread
+/// pool, so one large image can fill the queue and hold up smaller
+/// ones started after it. Encoders given the same scheduler via
+/// Options::set_scheduler() instead queue their jobs here, and share
+/// a fixed budget of running jobs according to their priorities.
+///
+/// Encoders sharing a scheduler should use the same thread pool.
+///
+/// Clones share the same underlying scheduler.
+#[derive(Clone)]
+pub struct Scheduler {
+    shared: Arc<Mutex<Shared>>,
+}
+
+impl Scheduler {
+    /// Create a new scheduler that keeps as many jobs running at
+    /// once as there are threads in the global thread pool, plus
+    /// a couple to keep them busy.
+    pub fn new() -> Scheduler {
+        Scheduler::with_limit(::rayon::current_num_threads() + 2)
+    }
+
+    /// Create a new scheduler that keeps at most limit jobs running
+    /// at once. Usually a little more than the number of threads in
+    /// the thread pool the encoders run on.
+    pub fn with_limit(limit: usize) -> Scheduler {
+        Scheduler {
+            shared: Arc::new(Mutex::new(Shared {
+                limit: cmp::max(limit, 1),
+                running: 0,
+                virtual_time: 0,
+                queues: BTreeMap::new(),
+                next_id: 0,
+            })),
+        }
+    }
+
+    //
+    // Set up a job queue for an encoder.
+    //
+    pub(crate) fn client(&self, priority: u32) -> Client {
+        let mut shared = self.shared.lock().unwrap();
+        let id = shared.next_id;
+        shared.next_id += 1;
+        shared.queues.insert(id, Queue {
+            priority,
+            start_time: 0,
+            jobs: VecDeque::new(),
+        });
+        Client {
+            shared: Arc::clone(&self.shared),
+            id,
+        }
+    }
+}
+
+impl Default for Scheduler {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+//
+// An encoder's job queue on a scheduler.
+//
+pub(crate) struct Client {
+    shared: Arc<Mutex<Shared>>,
+    id: usize,
+}
+
+impl Client {
+    //
+    // Queue a job to run. If the scheduler is under its limit, returns
+    // a job for the caller to spawn on the thread pool, which will run
+    // queued jobs from any encoder until there are none left.
+    //
+    pub(crate) fn submit(&self, job: Job) -> Option<Job> {
+        let mut shared = self.shared.lock().unwrap();
+        let virtual_time = shared.virtual_time;
+        {
+            let queue = shared.queues.get_mut(&self.id).unwrap();
+            if queue.jobs.is_empty() {
+                // Time spent idle doesn't earn a burst later.
+                queue.start_time = cmp::max(queue.start_time, virtual_time);
+            }
+            queue.jobs.push_back(job);
+        }
+        if shared.running < shared.limit {
+            shared.running += 1;
+            let shared = Arc::clone(&self.shared);
+            Some(Box::new(move || run(&shared)))
+        } else {
+            None
+        }
+    }
+}
+
+impl Drop for Client {
+    fn drop(&mut self) {
+        // Queued jobs hold on to their encoder's client, so this
+        // one's queue is empty by now.
+        self.shared.lock().unwrap().queues.remove(&self.id);
+    }
+}
+
+fn run(shared: &Arc<Mutex<Shared>>) {
+    loop {
+        let job = {
+            let mut shared = shared.lock().unwrap();
+            match shared.next_job() {
+                Some(job) => job,
+                None => {
+                    shared.running -= 1;
+                    return;
+                }
+            }
+        };
+        job();
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::Scheduler;
+
+    use std::sync::{Arc, Mutex};
+
+    #[test]
+    fn priorities() {
+        let scheduler = Scheduler::with_limit(1);
+        let low = scheduler.client(1);
+        let high = scheduler.client(3);
+        let order = Arc::new(Mutex::new(Vec::new()));
+
+        // Hold the only running slot while queueing everything up.
+        let (gate_tx, gate_rx) = ::std::sync::mpsc::channel::<()>();
+        let runner = low.submit(Box::new(move || {
+            gate_rx.recv().unwrap();
+        })).unwrap();
+        for i in 0 .. 8 {
+            for &(client, name) in &[(&low, 'l'), (&high, 'h')] {
+                let order = Arc::clone(&order);
+                let runner = client.submit(Box::new(move || {
+                    order.lock().unwrap().push((name, i));
+                }));
+                assert!(runner.is_none());
+            }
+        }
+        gate_tx.send(()).unwrap();
+        runner();
+
+        let order = order.lock().unwrap();
+        let first: String = order.iter().take(8).map(|&(name, _)| name).collect();
+        assert!(first.matches('h').count() >= 6);
+        assert_eq!(order.len(), 16);
+    }
+}
@@ -0,0 +1,254 @@
+//
+// mtpng - a multithreaded parallel PNG encoder in Rust
+// topology.rs - thread pools placed on physical or big cores
+//
+// Copyright (c) 2018 Brion Vibber
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+
+use rayon::{ThreadPool, ThreadPoolBuilder};
+
+use std::convert::TryFrom;
+use std::fs;
+use std::io;
+use std::mem;
+
+use super::utils::*;
+
+/// Which processors a thread pool from thread_pool() runs on.
+#[derive(Copy, Clone, PartialEq, Eq, Debug)]
+#[repr(u8)]
+pub enum Cores {
+    /// Every logical processor, as rayon uses by default.
+    All = 0,
+    /// One worker per physical core, leaving out extra hyperthreads,
+    /// which add little to filtering and deflate.
+    Physical = 1,
+    /// One worker per physical core of the fastest kind only, on
+    /// big.LITTLE and other designs mixing large and small cores.
+    Big = 2,
+}
+
+impl TryFrom<u8> for Cores {
+    type Error = io::Error;
+
+    fn try_from(val: u8) -> Result<Self, Self::Error> {
+        match val {
+            0 => Ok(Cores::All),
+            1 => Ok(Cores::Physical),
+            2 => Ok(Cores::Big),
+            _ => Err(invalid_input("Invalid cores mode")),
+        }
+    }
+}
+
+//
+// A logical processor, as listed under /sys/devices/system/cpu.
+// The capacity is relative speed, or maximum clock if the kernel
+// doesn't give that, and 0 if neither.
+//
+#[derive(Copy, Clone)]
+struct Cpu {
+    id: usize,
+    node: usize,
+    package: usize,
+    core: usize,
+    capacity: u64,
+}
+
+const SYSFS: &str = "/sys/devices/system/cpu";
+
+fn read_number(path: &str) -> Option<u64> {
+    fs::read_to_string(path).ok()?.trim().parse().ok()
+}
+
+//
+// Parse a kernel CPU list such as "0-3,8-11".
+//
+fn parse_list(list: &str) -> Option<Vec<usize>> {
+    let mut ids = Vec::new();
+    for range in list.trim().split(',').filter(|range| !range.is_empty()) {
+        let mut ends = range.splitn(2, '-');
+        let first = ends.next()?.parse::<usize>().ok()?;
+        let last = match ends.next() {
+            Some(last) => last.parse::<usize>().ok()?,
+            None => first,
+        };
+        ids.extend(first ..= last);
+    }
+    Some(ids)
+}
+
+fn node_of(id: usize) -> usize {
+    let entries = match fs::read_dir(format!("{}/cpu{}", SYSFS, id)) {
+        Ok(entries) => entries,
+        Err(_) => return 0,
+    };
+    entries.filter_map(|entry| {
+        let name = entry.ok()?.file_name().into_string().ok()?;
+        if name.starts_with("node") {
+            name[4 ..].parse().ok()
+        } else {
+            None
+        }
+    }).next().unwrap_or(0)
+}
+
+//
+// The online processors this process may run on, if the system
+// describes them. A cpuset or taskset can leave out some of the host's.
+//
+fn online_cpus() -> Option<Vec<Cpu>> {
+    let mut ids = parse_list(&fs::read_to_string(format!("{}/online", SYSFS)).ok()?)?;
+    if let Some(allowed) = allowed_cpus() {
+        ids.retain(|id| allowed.contains(id));
+    }
+    ids.into_iter().map(|id| {
+        let base = format!("{}/cpu{}", SYSFS, id);
+        let capacity = read_number(&format!("{}/cpu_capacity", base))
+            .or_else(|| read_number(&format!("{}/cpufreq/cpuinfo_max_freq", base)))
+            .unwrap_or(0);
+        Some(Cpu {
+            id,
+            node: node_of(id),
+            package: read_number(&format!("{}/topology/physical_package_id", base))? as usize,
+            core: read_number(&format!("{}/topology/core_id", base))? as usize,
+            capacity,
+        })
+    }).collect()
+}
+
+//
+// The processors to put a worker on for the given cores, one per
+// physical core, ordered so that neighbouring workers share a NUMA
+// node and package.
+//
+fn select(cpus: &[Cpu], cores: Cores) -> Vec<usize> {
+    let mut chosen: Vec<Cpu> = Vec::new();
+    for cpu in cpus {
+        let sibling = chosen.iter().any(|other| {
+            other.package == cpu.package && other.core == cpu.core
+        });
+        if cores == Cores::All || !sibling {
+            chosen.push(*cpu);
+        }
+    }
+    if cores == Cores::Big {
+        let fastest = chosen.iter().map(|cpu| cpu.capacity).max().unwrap_or(0);
+        chosen.retain(|cpu| cpu.capacity == fastest);
+    }
+    chosen.sort_by_key(|cpu| (cpu.node, cpu.package, cpu.core, cpu.id));
+    chosen.into_iter().map(|cpu| cpu.id).collect()
+}
+
+#[cfg(target_os = "linux")]
+extern "C" {
+    fn sched_getaffinity(pid: i32, size: usize, mask: *mut u64) -> i32;
+    fn sched_setaffinity(pid: i32, size: usize, mask: *const u64) -> i32;
+}
+
+#[cfg(target_os = "linux")]
+fn allowed_cpus() -> Option<Vec<usize>> {
+    let mut mask = [0u64; 16];
+    let ret = unsafe {
+        sched_getaffinity(0, mem::size_of_val(&mask), mask.as_mut_ptr())
+    };
+    if ret != 0 {
+        return None;
+    }
+    Some((0 .. mask.len() * 64).filter(|&cpu| mask[cpu / 64] & 1 << (cpu % 64) != 0).collect())
+}
+
+#[cfg(not(target_os = "linux"))]
+fn allowed_cpus() -> Option<Vec<usize>> {
+    None
+}
+
+#[cfg(target_os = "linux")]
+fn pin(cpu: usize) {
+    let mut mask = [0u64; 16];
+    if cpu < mask.len() * 64 {
+        mask[cpu / 64] |= 1 << (cpu % 64);
+        // Best effort; the thread runs wherever it was if refused.
+        unsafe {
+            sched_setaffinity(0, mem::size_of_val(&mask), mask.as_ptr());
+        }
+    }
+}
+
+#[cfg(not(target_os = "linux"))]
+fn pin(_cpu: usize) {}
+
+/// Create a thread pool with a worker for each of the given cores,
+/// or threads workers spread over them in turn if not 0. Workers are
+/// pinned to their processors, with neighbouring ones on the same
+/// NUMA node, so a chunk's data stays near the worker using it. Only
+/// processors the process is allowed to run on are used.
+///
+/// The processor topology is read from Linux's sysfs. Elsewhere, or
+/// if it can't be read, this builds an unpinned pool with a worker per
+/// logical processor, or threads workers, as ThreadPoolBuilder does.
+pub fn thread_pool(threads: usize, cores: Cores) -> io::Result<ThreadPool> {
+    let placed = online_cpus().map(|cpus| select(&cpus, cores))
+                              .filter(|placed| !placed.is_empty());
+    let builder = match placed {
+        Some(placed) => {
+            let count = if threads == 0 { placed.len() } else { threads };
+            ThreadPoolBuilder::new().num_threads(count).start_handler(move |index| {
+                pin(placed[index % placed.len()]);
+            })
+        },
+        None => ThreadPoolBuilder::new().num_threads(threads),
+    };
+    builder.build().map_err(|err| other(&err.to_string()))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{parse_list, select, Cores, Cpu};
+
+    #[test]
+    fn cpu_lists() {
+        assert_eq!(parse_list("0\n").unwrap(), vec![0]);
+        assert_eq!(parse_list("0-3,8-9,12").unwrap(), vec![0, 1, 2, 3, 8, 9, 12]);
+        assert!(parse_list("0-x").is_none());
+    }
+
+    #[test]
+    fn select_cores() {
+        // Two nodes of two cores with hyperthreads, listed with the
+        // siblings last as Linux does, and a slow core on node 0.
+        let cpu = |id, node, core, capacity| Cpu {
+            id,
+            node,
+            package: node,
+            core,
+            capacity,
+        };
+        let cpus = [
+            cpu(0, 0, 0, 1024), cpu(1, 1, 0, 1024), cpu(2, 0, 1, 1024), cpu(3, 1, 1, 1024),
+            cpu(4, 0, 0, 1024), cpu(5, 1, 0, 1024), cpu(6, 0, 1, 1024), cpu(7, 1, 1, 1024),
+            cpu(8, 0, 2, 400),
+        ];
+        assert_eq!(select(&cpus, Cores::All), vec![0, 4, 2, 6, 8, 1, 5, 3, 7]);
+        assert_eq!(select(&cpus, Cores::Physical), vec![0, 2, 8, 1, 3]);
+        assert_eq!(select(&cpus, Cores::Big), vec![0, 2, 1, 3]);
+    }
+}
@@ -23,8 +23,18 @@
 // THE SOFTWARE.
 //
 
+use ::rayon::ThreadPool;
+
+use ::std::cmp;
+use ::std::collections::HashSet;
 use ::std::io;
 use ::std::io::{Error, ErrorKind, Write};
+use ::std::sync::Arc;
+use ::std::sync::mpsc;
+
+use super::Header;
+
+use super::convert;
 
 pub type IoResult = io::Result<()>;
 
@@ -38,6 +48,18 @@ pub fn other(payload: &str) -> Error
     Error::new(ErrorKind::Other, payload)
 }
 
+pub fn invalid_data(payload: &str) -> Error
+{
+    Error::new(ErrorKind::InvalidData, payload)
+}
+
+pub fn read_be32(bytes: &[u8]) -> u32 {
+    (bytes[0] as u32) << 24 |
+    (bytes[1] as u32) << 16 |
+    (bytes[2] as u32) << 8 |
+    (bytes[3] as u32)
+}
+
 pub fn write_be32<W: Write>(w: &mut W, val: u32) -> IoResult {
     let bytes = [
         (val >> 24 & 0xff) as u8,
@@ -48,7 +70,228 @@ pub fn write_be32<W: Write>(w: &mut W, val: u32) -> IoResult {
     w.write_all(&bytes)
 }
 
+pub fn write_be16<W: Write>(w: &mut W, val: u16) -> IoResult {
+    let bytes = [
+        (val >> 8 & 0xff) as u8,
+        (val & 0xff) as u8,
+    ];
+    w.write_all(&bytes)
+}
+
 pub fn write_byte<W: Write>(w: &mut W, val: u8) -> IoResult {
     let bytes = [val];
     w.write_all(&bytes)
 }
+
+pub fn spawn<F>(pool: Option<&ThreadPool>, job: F)
+    where F: FnOnce() + Send + 'static
+{
+    match pool {
+        Some(pool) => pool.spawn(job),
+        None => ::rayon::spawn(job),
+    }
+}
+
+//
+// Split an image's rows into blocks of about block_size bytes each,
+// for whole-image passes run in parallel. The blocks depend only on
+// the image, not the thread count.
+//
+pub fn row_blocks(height: usize, stride: usize, block_size: usize) -> Vec<(usize, usize)> {
+    let rows = cmp::max(1, block_size / stride);
+    (0 .. (height + rows - 1) / rows).map(|block| {
+        (block * rows, cmp::min(height, (block + 1) * rows))
+    }).collect()
+}
+
+//
+// Run func on each of the row ranges in parallel, returning
+// the results in order.
+//
+pub fn map_blocks<R, F>(blocks: &[(usize, usize)], pool: Option<&ThreadPool>, func: F) -> Vec<R>
+    where R: Send + 'static,
+          F: Fn(usize, usize) -> R + Send + Sync + 'static
+{
+    let func = Arc::new(func);
+    let (tx, rx) = mpsc::channel();
+    for (n, &(start, end)) in blocks.iter().enumerate() {
+        let func = Arc::clone(&func);
+        let tx = tx.clone();
+        spawn(pool, move || {
+            let _ = tx.send((n, func(start, end)));
+        });
+    }
+    let mut results: Vec<Option<R>> = blocks.iter().map(|_| None).collect();
+    for _ in 0 .. blocks.len() {
+        let (n, result) = rx.recv().unwrap();
+        results[n] = Some(result);
+    }
+    results.into_iter().map(|result| result.unwrap()).collect()
+}
+
+//
+// A whole image as given to write_image() or collected from its
+// rows, for the passes over it in blocks to quantize or reduce it.
+//
+pub struct RowSource<T: ?Sized> {
+    pub header: Header,
+    pub image: Arc<T>,
+    pub row_stride: usize,
+}
+
+impl<T> RowSource<T>
+    where T: AsRef<[u8]> + Send + Sync + ?Sized + 'static
+{
+    //
+    // Call func with each row of the block in turn, converted
+    // from the source format to packed samples.
+    //
+    pub fn each_row<F>(&self, start_row: usize, end_row: usize, mut func: F)
+        where F: FnMut(usize, &[u8])
+    {
+        let bytes = (*self.image).as_ref();
+        let stride = self.header.source_stride();
+        let mut packed = vec![0u8; self.header.stride()];
+        for y in start_row .. end_row {
+            let src = &bytes[y * self.row_stride .. y * self.row_stride + stride];
+            convert::convert_row(self.header.source_format, src, &mut packed);
+            func(y, &packed);
+        }
+    }
+
+    //
+    // Run func on blocks of about block_size bytes of rows in
+    // parallel, returning the results in order.
+    //
+    pub fn map_blocks<R, F>(self: &Arc<Self>, block_size: usize, pool: Option<&ThreadPool>,
+                            func: F) -> Vec<R>
+        where R: Send + 'static,
+              F: Fn(&RowSource<T>, usize, usize) -> R + Send + Sync + 'static
+    {
+        let header = &self.header;
+        let blocks = row_blocks(header.height as usize, header.source_stride(), block_size);
+        let source = Arc::clone(self);
+        map_blocks(&blocks, pool, move |start, end| func(&source, start, end))
+    }
+}
+
+//
+// The distinct 8-bit RGBA colors of an image, counted until there
+// are more than fit a palette, after which it stops keeping them.
+// Runs of a color are only looked up once.
+//
+pub struct ColorSet {
+    colors: Option<HashSet<u32>>,
+    last: Option<u32>,
+}
+
+pub const PALETTE_COLORS: usize = 256;
+
+impl ColorSet {
+    pub fn new() -> ColorSet {
+        ColorSet {
+            colors: Some(HashSet::new()),
+            last: None,
+        }
+    }
+
+    pub fn insert(&mut self, color: u32) {
+        if self.last == Some(color) {
+            return;
+        }
+        self.last = Some(color);
+        let over = match self.colors {
+            Some(ref mut colors) => {
+                colors.insert(color);
+                colors.len() > PALETTE_COLORS
+            },
+            None => false,
+        };
+        if over {
+            self.colors = None;
+        }
+    }
+
+    pub fn is_over(&self) -> bool {
+        self.colors.is_none()
+    }
+
+    pub fn merge(&mut self, other: ColorSet) {
+        self.colors = match (self.colors.take(), other.colors) {
+            (Some(mut colors), Some(other_colors)) => {
+                colors.extend(other_colors);
+                if colors.len() > PALETTE_COLORS {
+                    None
+                } else {
+                    Some(colors)
+                }
+            },
+            _ => None,
+        };
+    }
+
+    //
+    // The colors, if they fit, in palette order: translucent
+    // first, to keep tRNS short, and sorted so the palette doesn't
+    // depend on hash order.
+    //
+    pub fn palette(&self) -> Option<Vec<u32>> {
+        self.colors.as_ref().map(|colors| {
+            let mut palette: Vec<u32> = colors.iter().cloned().collect();
+            sort_palette(&mut palette);
+            palette
+        })
+    }
+}
+
+pub fn sort_palette(palette: &mut [u32]) {
+    palette.sort_by_key(|&color| (color as u8 == 255, color));
+}
+
+//
+// PLTE and tRNS chunk data for a palette of RGBA colors sorted
+// translucent first; tRNS is empty if they're all opaque.
+//
+pub fn palette_chunks(palette: &[u32]) -> (Vec<u8>, Vec<u8>) {
+    let mut plte = Vec::with_capacity(palette.len() * 3);
+    let mut trns = Vec::new();
+    for &color in palette {
+        plte.push((color >> 24) as u8);
+        plte.push((color >> 16) as u8);
+        plte.push((color >> 8) as u8);
+        if color as u8 != 255 {
+            trns.push(color as u8);
+        }
+    }
+    (plte, trns)
+}
+
+//
+// Run a benchmark body for at least a tenth of a second, doubling
+// the iteration count until it gets there, and print the time per
+// iteration as a line of JSON to collect for regression reports.
+// Used by the ignored bench_* tests:
+//
+//   cargo test --release -- --ignored --nocapture --test-threads=1 bench_
+//
+#[cfg(test)]
+pub fn bench<F: FnMut()>(name: &str, bytes: usize, mut func: F) {
+    use std::time::Instant;
+
+    func();
+    let mut iters = 1u64;
+    loop {
+        let start = Instant::now();
+        for _ in 0 .. iters {
+            func();
+        }
+        let elapsed = start.elapsed();
+        if elapsed.as_millis() >= 100 {
+            let ns = elapsed.as_nanos() as f64 / iters as f64;
+            println!("{{\"bench\":\"{}\",\"bytes\":{},\"iters\":{},\"ns_per_iter\":{:.0},\"mb_per_s\":{:.1}}}",
+                     name, bytes, iters, ns, bytes as f64 * 1000.0 / ns);
+            return;
+        }
+        iters *= 2;
+    }
+}
@@ -23,14 +23,14 @@
 // THE SOFTWARE.
 //
 
-use crc::crc32;
-use crc::Hasher32;
-
 use std::io;
-use std::io::Write;
+use std::io::{Error, ErrorKind, IoSlice, Write};
 
+use super::FrameControl;
 use super::Header;
 
+use super::deflate;
+
 use super::utils::*;
 
 pub struct Writer<W: Write> {
@@ -94,26 +94,86 @@ impl<W: Write> Writer<W> {
     // https://www.w3.org/TR/PNG/#5CRC-algorithm
     //
     pub fn write_chunk(&mut self, tag: &[u8], data: &[u8]) -> IoResult {
+        let data_crc = deflate::crc32(deflate::crc32_initial(), data);
+        self.write_chunk_with_crc(tag, data, data_crc)
+    }
+
+    //
+    // Write a chunk whose data checksum was already calculated,
+    // eg in pieces on the worker threads.
+    //
+    pub fn write_chunk_with_crc(&mut self, tag: &[u8], data: &[u8], data_crc: u32) -> IoResult {
+        self.write_chunk_parts(tag, &[data], data_crc)
+    }
+
+    //
+    // Write a chunk whose data is split over several buffers,
+    // without first copying them together, given the checksum
+    // of all the data.
+    //
+    pub fn write_chunk_parts(&mut self, tag: &[u8], parts: &[&[u8]], data_crc: u32) -> IoResult {
         if tag.len() != 4 {
             return Err(invalid_input("Chunk tags must be 4 bytes"));
         }
-        if data.len() > u32::max_value() as usize {
+        let len = parts.iter().fold(0usize, |sum, part| sum.saturating_add(part.len()));
+        if len > u32::max_value() as usize {
             return Err(invalid_input("Data chunks cannot exceed 4 GiB - 1 byte"));
         }
 
         // CRC covers both tag and data.
-        let mut digest = crc32::Digest::new(crc32::IEEE);
-        digest.write(tag);
-        digest.write(data);
-        let checksum = digest.sum32();
+        let tag_crc = deflate::crc32(deflate::crc32_initial(), tag);
+        let checksum = deflate::crc32_combine(tag_crc, data_crc, len);
 
         // Write data...
-        self.write_be32(data.len() as u32)?;
+        self.write_be32(len as u32)?;
         self.write_bytes(tag)?;
-        self.write_bytes(data)?;
+        self.write_parts(parts)?;
         self.write_be32(checksum)
     }
 
+    //
+    // Like write_all() over a list of buffers, using vectored writes
+    // where the output supports them.
+    //
+    fn write_parts(&mut self, parts: &[&[u8]]) -> IoResult {
+        // Built once, with the first unwritten slice cut down in place
+        // after a partial write, so outputs that take a buffer at a
+        // time aren't quadratic in the number of parts.
+        let mut slices: Vec<IoSlice> = parts.iter().map(|part| IoSlice::new(part)).collect();
+        let mut index = 0;
+        let mut offset = 0;
+        loop {
+            // Skip anything already written, and empty parts.
+            while index < parts.len() && offset == parts[index].len() {
+                index += 1;
+                offset = 0;
+            }
+            if index == parts.len() {
+                return Ok(());
+            }
+
+            let mut written = match self.output.write_vectored(&slices[index ..]) {
+                Ok(0) => return Err(Error::new(ErrorKind::WriteZero, "failed to write whole buffer")),
+                Ok(n) => n,
+                Err(ref e) if e.kind() == ErrorKind::Interrupted => continue,
+                Err(e) => return Err(e),
+            };
+
+            while written > 0 {
+                let remaining = parts[index].len() - offset;
+                if written >= remaining {
+                    written -= remaining;
+                    index += 1;
+                    offset = 0;
+                } else {
+                    offset += written;
+                    written = 0;
+                    slices[index] = IoSlice::new(&parts[index][offset ..]);
+                }
+            }
+        }
+    }
+
     //
     // IHDR - first chunk in the file.
     // https://www.w3.org/TR/PNG/#11IHDR
@@ -131,6 +191,37 @@ impl<W: Write> Writer<W> {
         self.write_chunk(b"IHDR", &data)
     }
 
+    //
+    // acTL - marks an animated PNG, before any image data.
+    // https://wiki.mozilla.org/APNG_Specification#.60acTL.60:_The_Animation_Control_Chunk
+    //
+    pub fn write_animation_control(&mut self, num_frames: u32, num_plays: u32) -> IoResult {
+        let mut data = Vec::<u8>::new();
+        write_be32(&mut data, num_frames)?;
+        write_be32(&mut data, num_plays)?;
+
+        self.write_chunk(b"acTL", &data)
+    }
+
+    //
+    // fcTL - starts each animation frame.
+    // https://wiki.mozilla.org/APNG_Specification#.60fcTL.60:_The_Frame_Control_Chunk
+    //
+    pub fn write_frame_control(&mut self, sequence: u32, frame: &FrameControl) -> IoResult {
+        let mut data = Vec::<u8>::new();
+        write_be32(&mut data, sequence)?;
+        write_be32(&mut data, frame.width)?;
+        write_be32(&mut data, frame.height)?;
+        write_be32(&mut data, frame.x_offset)?;
+        write_be32(&mut data, frame.y_offset)?;
+        write_be16(&mut data, frame.delay_num)?;
+        write_be16(&mut data, frame.delay_den)?;
+        write_byte(&mut data, frame.dispose_op as u8)?;
+        write_byte(&mut data, frame.blend_op as u8)?;
+
+        self.write_chunk(b"fcTL", &data)
+    }
+
     //
     // IEND - last chunk in the file.
     // https://www.w3.org/TR/PNG/#11IEND
@@ -226,4 +317,58 @@ mod tests {
             assert_eq!(output[20..24], b"\xa3\x0a\x15\xe3"[..], "expected crc32");
         })
     }
+
+    #[test]
+    fn frame_control_works() {
+        let mut frame = ::FrameControl::new();
+        frame.set_size(3, 2).unwrap();
+        test_writer(|writer| {
+            writer.write_frame_control(1, &frame)
+        }, |output| {
+            assert_eq!(output[0..4], b"\x00\x00\x00\x1a"[..], "expected length 26");
+            assert_eq!(output[4..8], b"fcTL"[..], "expected fcTL");
+            assert_eq!(output[8..16], b"\x00\x00\x00\x01\x00\x00\x00\x03"[..], "expected sequence and width");
+            assert_eq!(output.len(), 38);
+        })
+    }
+
+    #[test]
+    fn parts_work() {
+        let one_pixel = b"\x08\x99\x63\x60\x60\x60\x00\x00\x00\x04\x00\x01";
+        let parts: [&[u8]; 4] = [&one_pixel[0 .. 5], &[], &one_pixel[5 .. 11], &one_pixel[11 ..]];
+        let crc = ::deflate::crc32(::deflate::crc32_initial(), one_pixel);
+        test_writer(|writer| {
+            writer.write_chunk_parts(b"IDAT", &parts, crc)
+        }, |output| {
+            assert_eq!(output[0..4], b"\x00\x00\x00\x0c"[..], "expected length 12");
+            assert_eq!(output[8..20], one_pixel[..], "expected data payload");
+            assert_eq!(output[20..24], b"\xa3\x0a\x15\xe3"[..], "expected crc32");
+        })
+    }
+
+    #[test]
+    fn partial_parts_work() {
+        // Takes a few bytes of one buffer at a time, as the default
+        // write_vectored() does for outputs without their own.
+        struct Trickle(Vec<u8>);
+        impl io::Write for Trickle {
+            fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+                let len = ::std::cmp::min(buf.len(), 3);
+                self.0.extend_from_slice(&buf[.. len]);
+                Ok(len)
+            }
+            fn flush(&mut self) -> io::Result<()> {
+                Ok(())
+            }
+        }
+
+        let data: Vec<u8> = (0 .. 200u32).map(|i| i as u8).collect();
+        let parts: Vec<&[u8]> = data.chunks(7).collect();
+        let crc = ::deflate::crc32(::deflate::crc32_initial(), &data);
+        let mut writer = Writer::new(Trickle(Vec::new()));
+        writer.write_chunk_parts(b"IDAT", &parts, crc).unwrap();
+        let output = writer.finish().unwrap().0;
+        assert_eq!(output.len(), 200 + 12);
+        assert_eq!(&output[8 .. 208], &data[..]);
+    }
 }